@@ -0,0 +1,356 @@
+#include "activity.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+GST_DEBUG_CATEGORY_EXTERN (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define BLOCK_SIZE 8
+#define INITIAL_SAMPLE_CAPACITY 4096
+
+// Reduce BLOCK_SIZE rows of a plane to one row of block means.
+typedef void (*ReduceFunc) (const guint8 * plane, gint stride, gint blocks, guint8 * means);
+// Sum of absolute differences of two rows of block means.
+typedef guint64 (*SadFunc) (const guint8 * a, const guint8 * b, gint n);
+
+typedef struct {
+  const gchar * name;
+  ReduceFunc reduce;
+  SadFunc sad;
+} Kernels;
+
+struct _ActivityMeter {
+  const Kernels * kernels;
+  gint blocks_x;
+  gint blocks_y;
+  guint8 * means;
+  guint8 * previous;
+  gboolean have_previous;
+};
+
+struct _ActivityIndex {
+  GMutex lock;
+  GstClockTime max_time;
+
+  // Circular array of samples in PTS order; samples[head] is the oldest.
+  ActivitySample * samples;
+  guint capacity;
+  guint head;
+  guint length;
+};
+
+#define SAMPLE_AT(index, i) (&(index)->samples[((index)->head + (i)) % (index)->capacity])
+
+static void reduce_c (const guint8 * plane, gint stride, gint blocks, guint8 * means)
+{
+  gint b, x, y;
+
+  for (b = 0; b < blocks; b++) {
+    guint sum = 0;
+
+    for (y = 0; y < BLOCK_SIZE; y++)
+      for (x = 0; x < BLOCK_SIZE; x++)
+        sum += plane[y * stride + b * BLOCK_SIZE + x];
+    means[b] = sum / (BLOCK_SIZE * BLOCK_SIZE);
+  }
+}
+
+static guint64 sad_c (const guint8 * a, const guint8 * b, gint n)
+{
+  guint64 sad = 0;
+  gint i;
+
+  for (i = 0; i < n; i++)
+    sad += ABS ((gint) a[i] - (gint) b[i]);
+
+  return sad;
+}
+
+static const Kernels kernels_c = { "c", reduce_c, sad_c };
+
+#ifdef HAVE_X86
+
+// psadbw against zero sums each 8-byte half of a register: one block's row.
+__attribute__ ((target ("sse2")))
+static void reduce_sse2 (const guint8 * plane, gint stride, gint blocks, guint8 * means)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  gint b, y;
+
+  for (b = 0; b + 2 <= blocks; b += 2) {
+    __m128i acc = zero;
+
+    for (y = 0; y < BLOCK_SIZE; y++)
+      acc = _mm_add_epi64 (acc, _mm_sad_epu8 (
+              _mm_loadu_si128 ((const __m128i *) (plane + y * stride + b * BLOCK_SIZE)), zero));
+
+    means[b] = _mm_cvtsi128_si32 (acc) / (BLOCK_SIZE * BLOCK_SIZE);
+    means[b + 1] = _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8)) / (BLOCK_SIZE * BLOCK_SIZE);
+  }
+
+  if (b < blocks)
+    reduce_c (plane + b * BLOCK_SIZE, stride, blocks - b, means + b);
+}
+
+__attribute__ ((target ("sse2")))
+static guint64 sad_sse2 (const guint8 * a, const guint8 * b, gint n)
+{
+  __m128i acc = _mm_setzero_si128 ();
+  gint i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    acc = _mm_add_epi64 (acc, _mm_sad_epu8 (_mm_loadu_si128 ((const __m128i *) (a + i)),
+            _mm_loadu_si128 ((const __m128i *) (b + i))));
+
+  return (guint64) _mm_cvtsi128_si32 (acc) + _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8)) +
+      sad_c (a + i, b + i, n - i);
+}
+
+static const Kernels kernels_sse2 = { "sse2", reduce_sse2, sad_sse2 };
+
+__attribute__ ((target ("avx2")))
+static void reduce_avx2 (const guint8 * plane, gint stride, gint blocks, guint8 * means)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  guint64 sums[4];
+  gint b, y, i;
+
+  for (b = 0; b + 4 <= blocks; b += 4) {
+    __m256i acc = zero;
+
+    for (y = 0; y < BLOCK_SIZE; y++)
+      acc = _mm256_add_epi64 (acc, _mm256_sad_epu8 (
+              _mm256_loadu_si256 ((const __m256i *) (plane + y * stride + b * BLOCK_SIZE)), zero));
+
+    _mm256_storeu_si256 ((__m256i *) sums, acc);
+    for (i = 0; i < 4; i++)
+      means[b + i] = sums[i] / (BLOCK_SIZE * BLOCK_SIZE);
+  }
+
+  if (b < blocks)
+    reduce_sse2 (plane + b * BLOCK_SIZE, stride, blocks - b, means + b);
+}
+
+__attribute__ ((target ("avx2")))
+static guint64 sad_avx2 (const guint8 * a, const guint8 * b, gint n)
+{
+  __m256i acc = _mm256_setzero_si256 ();
+  guint64 sums[4];
+  gint i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+    acc = _mm256_add_epi64 (acc, _mm256_sad_epu8 (_mm256_loadu_si256 ((const __m256i *) (a + i)),
+            _mm256_loadu_si256 ((const __m256i *) (b + i))));
+
+  _mm256_storeu_si256 ((__m256i *) sums, acc);
+  return sums[0] + sums[1] + sums[2] + sums[3] + sad_sse2 (a + i, b + i, n - i);
+}
+
+static const Kernels kernels_avx2 = { "avx2", reduce_avx2, sad_avx2 };
+
+#endif
+
+// The best kernels this CPU runs; CAMSRC_ACTIVITY_KERNEL=c|sse2|avx2 picks
+// one instead (no further than the CPU goes), for comparing them.
+static const Kernels * get_kernels (void)
+{
+  static const Kernels * kernels;
+  static gsize initialized;
+
+  if (g_once_init_enter (&initialized)) {
+    const gchar * forced = g_getenv ("CAMSRC_ACTIVITY_KERNEL");
+
+    kernels = &kernels_c;
+#ifdef HAVE_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse2") && !(forced && !strcmp (forced, "c")))
+      kernels = &kernels_sse2;
+    if (__builtin_cpu_supports ("avx2") && !(forced && strcmp (forced, "avx2")))
+      kernels = &kernels_avx2;
+#endif
+    GST_INFO ("Activity kernels: %s", kernels->name);
+    g_once_init_leave (&initialized, 1);
+  }
+
+  return kernels;
+}
+
+const gchar * activity_get_kernel_name (void)
+{
+  return get_kernels ()->name;
+}
+
+ActivityMeter * activity_meter_new (void)
+{
+  ActivityMeter * meter = g_new0 (ActivityMeter, 1);
+
+  meter->kernels = get_kernels ();
+  return meter;
+}
+
+void activity_meter_free (ActivityMeter * meter)
+{
+  g_free (meter->means);
+  g_free (meter->previous);
+  g_free (meter);
+}
+
+// Score one frame against the last.  The first frame (or the first after a
+// size change) has nothing to compare with, and scores 0.  Edge pixels that
+// don't fill a block are left out.
+gfloat activity_meter_measure (ActivityMeter * meter, const guint8 * luma,
+    gint width, gint height, gint stride)
+{
+  gint blocks_x = width / BLOCK_SIZE, blocks_y = height / BLOCK_SIZE, y;
+  guint8 * swap;
+  guint64 sad;
+
+  if (blocks_x <= 0 || blocks_y <= 0)
+    return 0;
+
+  if (blocks_x != meter->blocks_x || blocks_y != meter->blocks_y) {
+    meter->blocks_x = blocks_x;
+    meter->blocks_y = blocks_y;
+    meter->means = g_renew (guint8, meter->means, blocks_x * blocks_y);
+    meter->previous = g_renew (guint8, meter->previous, blocks_x * blocks_y);
+    meter->have_previous = FALSE;
+  }
+
+  for (y = 0; y < blocks_y; y++)
+    meter->kernels->reduce (luma + (gsize) y * BLOCK_SIZE * stride, stride, blocks_x,
+        meter->means + y * blocks_x);
+
+  sad = meter->have_previous ?
+    meter->kernels->sad (meter->means, meter->previous, blocks_x * blocks_y) : 0;
+
+  swap = meter->previous;
+  meter->previous = meter->means;
+  meter->means = swap;
+  meter->have_previous = TRUE;
+
+  return (gfloat) sad / (blocks_x * blocks_y);
+}
+
+ActivityIndex * activity_index_new (GstClockTime max_time)
+{
+  ActivityIndex * index = g_new0 (ActivityIndex, 1);
+
+  g_mutex_init (&index->lock);
+  index->max_time = max_time;
+  index->capacity = INITIAL_SAMPLE_CAPACITY;
+  index->samples = g_new (ActivitySample, index->capacity);
+
+  return index;
+}
+
+void activity_index_free (ActivityIndex * index)
+{
+  g_free (index->samples);
+  g_mutex_clear (&index->lock);
+  g_free (index);
+}
+
+static void grow_samples (ActivityIndex * index)
+{
+  guint i, capacity = index->capacity * 2;
+  ActivitySample * samples = g_new (ActivitySample, capacity);
+
+  for (i = 0; i < index->length; i++)
+    samples[i] = *SAMPLE_AT (index, i);
+
+  g_free (index->samples);
+  index->samples = samples;
+  index->capacity = capacity;
+  index->head = 0;
+}
+
+// Samples must arrive in PTS order; anything older than max_time behind the
+// newest is dropped.
+void activity_index_push (ActivityIndex * index, GstClockTime pts, gfloat score)
+{
+  g_mutex_lock (&index->lock);
+
+  if (index->length && pts <= SAMPLE_AT (index, index->length - 1)->pts) {
+    g_mutex_unlock (&index->lock);
+    return;
+  }
+
+  if (index->length == index->capacity)
+    grow_samples (index);
+
+  *SAMPLE_AT (index, index->length) = (ActivitySample) { pts, score };
+  index->length++;
+
+  while (index->max_time && index->length > 1 &&
+      pts - SAMPLE_AT (index, 0)->pts > index->max_time) {
+    index->head = (index->head + 1) % index->capacity;
+    index->length--;
+  }
+
+  g_mutex_unlock (&index->lock);
+}
+
+// The first sample at or after pts.
+static guint find_sample (ActivityIndex * index, GstClockTime pts)
+{
+  guint lo = 0, hi = index->length, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (SAMPLE_AT (index, mid)->pts < pts)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static gint compare_scores (gconstpointer a, gconstpointer b)
+{
+  const ActivitySample * sa = a, * sb = b;
+
+  return sa->score > sb->score ? -1 : sa->score < sb->score;
+}
+
+// Fill peaks with up to max_peaks of the highest-scoring samples in
+// [start, end), highest first, at least min_gap apart so that one burst of
+// motion doesn't take every slot.  Returns how many were found.
+guint activity_index_get_peaks (ActivityIndex * index, GstClockTime start, GstClockTime end,
+    guint max_peaks, GstClockTime min_gap, ActivitySample * peaks)
+{
+  ActivitySample * candidates;
+  guint first, n, found = 0, i, j;
+
+  g_mutex_lock (&index->lock);
+
+  first = find_sample (index, start);
+  n = find_sample (index, end) - first;
+  candidates = g_new (ActivitySample, MAX (n, 1));
+  for (i = 0; i < n; i++)
+    candidates[i] = *SAMPLE_AT (index, first + i);
+
+  g_mutex_unlock (&index->lock);
+
+  qsort (candidates, n, sizeof(ActivitySample), compare_scores);
+
+  for (i = 0; i < n && found < max_peaks && candidates[i].score > 0; i++) {
+    for (j = 0; j < found; j++) {
+      GstClockTime a = candidates[i].pts, b = peaks[j].pts;
+
+      if ((a > b ? a - b : b - a) < min_gap)
+        break;
+    }
+    if (j == found)
+      peaks[found++] = candidates[i];
+  }
+
+  g_free (candidates);
+  return found;
+}
@@ -0,0 +1,45 @@
+/*
+ * Activity: a cheap per-frame measure of how much the picture is changing.
+ *
+ * An ActivityMeter reduces each luma plane to the means of its 8x8 blocks
+ * and scores the frame by the mean absolute difference between those and
+ * the previous frame's, from 0 (still) to 255.  Averaging blocks first keeps
+ * sensor noise from looking like motion, and leaves the comparison itself
+ * with 1/64th of the pixels.  Both steps run on SSE2 or AVX2 where the CPU
+ * has them (picked once, at runtime), with a plain C fallback.
+ *
+ * An ActivityIndex keeps scores for a bounded window of time, like the
+ * replay ring keeps footage, and finds the highest peaks in a range.  It is
+ * safe to call from any thread; a meter belongs to the one thread feeding
+ * it frames.
+ */
+
+#ifndef __ACTIVITY_H__
+#define __ACTIVITY_H__
+
+#include <gst/gst.h>
+
+typedef struct _ActivityMeter ActivityMeter;
+
+ActivityMeter * activity_meter_new (void);
+void activity_meter_free (ActivityMeter * meter);
+gfloat activity_meter_measure (ActivityMeter * meter, const guint8 * luma,
+    gint width, gint height, gint stride);
+
+const gchar * activity_get_kernel_name (void);
+
+typedef struct {
+  GstClockTime pts;
+  gfloat score;
+} ActivitySample;
+
+typedef struct _ActivityIndex ActivityIndex;
+
+ActivityIndex * activity_index_new (GstClockTime max_time);
+void activity_index_free (ActivityIndex * index);
+
+void activity_index_push (ActivityIndex * index, GstClockTime pts, gfloat score);
+guint activity_index_get_peaks (ActivityIndex * index, GstClockTime start, GstClockTime end,
+    guint max_peaks, GstClockTime min_gap, ActivitySample * peaks);
+
+#endif /* __ACTIVITY_H__ */
@@ -0,0 +1,115 @@
+/*
+ * Time the activity meter on frames the size camsrc captures.
+ *
+ * Renders a few seconds of moving test pattern at 1080p and 2160p, then
+ * scores every frame against the last, repeatedly, and prints one JSON line
+ * per size with the kernels in use and the time per frame.  Set
+ * CAMSRC_ACTIVITY_KERNEL=c or sse2 to time the slower kernels.
+ *
+ *   make bench && ./activity-bench [--iterations N]
+ */
+
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <glib.h>
+
+#include "activity.h"
+
+GST_DEBUG_CATEGORY (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define SOURCE_FRAMES 90      // 3s at 30 fps
+
+static const struct { gint width, height; } sizes[] = { { 1920, 1080 }, { 3840, 2160 } };
+
+// SOURCE_FRAMES of the bouncing ball, as copies we can keep hold of.
+static GPtrArray * render_frames (gint width, gint height, GstVideoInfo * info)
+{
+  GPtrArray * frames = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+  GstElement * pipeline;
+  GstElement * sink;
+  GstSample * sample;
+  GError * error = NULL;
+  gchar * description;
+
+  description = g_strdup_printf ("videotestsrc is-live=false pattern=ball num-buffers=%d ! "
+      "video/x-raw,width=%d,height=%d,framerate=30/1,format=I420 ! appsink name=sink sync=false",
+      SOURCE_FRAMES, width, height);
+  pipeline = gst_parse_launch (description, &error);
+  g_free (description);
+  if (!pipeline)
+    g_error ("couldn't build source pipeline: %s", error->message);
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  while ((sample = gst_app_sink_pull_sample (GST_APP_SINK (sink)))) {
+    gst_video_info_from_caps (info, gst_sample_get_caps (sample));
+    g_ptr_array_add (frames, gst_buffer_ref (gst_sample_get_buffer (sample)));
+    gst_sample_unref (sample);
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (pipeline);
+
+  return frames;
+}
+
+int main (int argc, char * argv[])
+{
+  gint iterations = 20;
+  GOptionEntry entries[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Passes over the frames (default 20)", "N" },
+    { NULL }
+  };
+  GOptionContext * context;
+  GError * error = NULL;
+  guint s, i;
+  gint n;
+
+  gst_init (&argc, &argv);
+  GST_DEBUG_CATEGORY_INIT (camsrc, "camsrc", 0, "camera source");
+
+  context = g_option_context_new ("- time the activity meter");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    g_error ("%s", error->message);
+  g_option_context_free (context);
+
+  for (s = 0; s < G_N_ELEMENTS (sizes); s++) {
+    GstVideoInfo info;
+    GPtrArray * frames = render_frames (sizes[s].width, sizes[s].height, &info);
+    ActivityMeter * meter = activity_meter_new ();
+    gdouble total_score = 0;
+    gint64 begin, elapsed;
+    guint measured = 0;
+
+    begin = g_get_monotonic_time ();
+    for (n = 0; n < iterations; n++) {
+      for (i = 0; i < frames->len; i++) {
+        GstVideoFrame frame;
+
+        if (!gst_video_frame_map (&frame, &info, g_ptr_array_index (frames, i), GST_MAP_READ))
+          g_error ("couldn't map frame");
+        total_score += activity_meter_measure (meter, GST_VIDEO_FRAME_PLANE_DATA (&frame, 0),
+            GST_VIDEO_FRAME_COMP_WIDTH (&frame, 0), GST_VIDEO_FRAME_COMP_HEIGHT (&frame, 0),
+            GST_VIDEO_FRAME_PLANE_STRIDE (&frame, 0));
+        gst_video_frame_unmap (&frame);
+        measured++;
+      }
+    }
+    elapsed = g_get_monotonic_time () - begin;
+
+    g_print ("{ \"width\": %d, \"height\": %d, \"kernels\": \"%s\", \"frames\": %u, "
+        "\"us-per-frame\": %.1f, \"mean-score\": %.3f }\n",
+        sizes[s].width, sizes[s].height, activity_get_kernel_name (), measured,
+        (gdouble) elapsed / MAX (measured, 1), total_score / MAX (measured, 1));
+
+    activity_meter_free (meter);
+    g_ptr_array_free (frames, TRUE);
+  }
+
+  return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * How many cameras one host can encode in real time.
+ *
+ * For each capture size and x264 preset, runs N live test-pattern cameras
+ * through the encoder settings camsrc uses (a second of queue in front of
+ * x264enc, a GOP a second) and counts the frames each encoder gets out over
+ * the measurement window.  N doubles until some camera can't hold its frame
+ * rate (its queue overflows and drops frames), then bisection narrows it
+ * down; one JSON line per size and preset gives the most cameras that kept
+ * up.  With --pin, each camera's threads get an equal share of the CPUs, as
+ * camsrc's --cpu-sets would give them.
+ *
+ *   make bench && ./capacity-bench --sizes 1920x1080@30,3840x2160@60 --presets 1,3
+ */
+
+#define _GNU_SOURCE
+
+#include <gst/gst.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+GST_DEBUG_CATEGORY (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define KEEP_UP 0.95              // share of the frame rate a camera must encode
+#define REFERENCE_BITRATE 5000    // kbit/s at 1080p30, scaled by pixel rate
+
+typedef struct {
+  gint width;
+  gint height;
+  gint fps;
+} Size;
+
+typedef struct {
+  GstElement * pipeline;
+  cpu_set_t cpus;
+  gint frames;
+} Camera;
+
+typedef struct {
+  // Options
+  gint bitrate;
+  gint threads;
+  gboolean sliced_threads;
+  gint lookahead;
+  gboolean pin;
+  gint warmup;
+  gint duration;
+  gint max_cameras;
+} Bench;
+
+static GstBusSyncReply pin_thread_cb (GstBus * bus, GstMessage * message, gpointer data)
+{
+  Camera * camera = data;
+  GstStreamStatusType type;
+  GstElement * owner;
+
+  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_STREAM_STATUS) {
+    gst_message_parse_stream_status (message, &type, &owner);
+    if (type == GST_STREAM_STATUS_TYPE_ENTER)
+      pthread_setaffinity_np (pthread_self (), sizeof(cpu_set_t), &camera->cpus);
+  }
+
+  return GST_BUS_PASS;
+}
+
+static GstPadProbeReturn count_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  Camera * camera = data;
+
+  g_atomic_int_inc (&camera->frames);
+  return GST_PAD_PROBE_OK;
+}
+
+static void start_camera (Bench * bench, Camera * camera, const Size * size, gint preset,
+    guint index, guint n)
+{
+  GstElement * sink;
+  GstPad * pad;
+  GError * error = NULL;
+  GString * encoder;
+  gchar * description;
+  gint bitrate = bench->bitrate ? bench->bitrate :
+    (gint) gst_util_uint64_scale (REFERENCE_BITRATE,
+        (guint64) size->width * size->height * size->fps, 1920 * 1080 * 30);
+  guint cpus = g_get_num_processors (), cpu;
+
+  encoder = g_string_new (NULL);
+  g_string_append_printf (encoder, "x264enc speed-preset=%d key-int-max=%d bitrate=%d "
+      "threads=%d sliced-threads=%s", preset, size->fps, bitrate, bench->threads,
+      bench->sliced_threads ? "true" : "false");
+  if (bench->lookahead >= 0)
+    g_string_append_printf (encoder, " rc-lookahead=%d", bench->lookahead);
+
+  description = g_strdup_printf ("videotestsrc is-live=true pattern=ball ! "
+      "video/x-raw,format=I420,width=%d,height=%d,framerate=%d/1 ! "
+      "queue max-size-time=1000000000 max-size-bytes=0 max-size-buffers=0 leaky=downstream ! "
+      "%s ! fakesink name=sink sync=false",
+      size->width, size->height, size->fps, encoder->str);
+  g_string_free (encoder, TRUE);
+
+  camera->pipeline = gst_parse_launch (description, &error);
+  g_free (description);
+  if (!camera->pipeline)
+    g_error ("couldn't build camera pipeline: %s", error->message);
+
+  // An equal slice of the CPUs each, wrapping round if there are more cameras
+  if (bench->pin) {
+    GstBus * bus = gst_pipeline_get_bus (GST_PIPELINE (camera->pipeline));
+    guint first = index * cpus / n, last = MAX ((index + 1) * cpus / n, first + 1);
+
+    CPU_ZERO (&camera->cpus);
+    for (cpu = first; cpu < last; cpu++)
+      CPU_SET (cpu % cpus, &camera->cpus);
+    gst_bus_set_sync_handler (bus, pin_thread_cb, camera, NULL);
+    gst_object_unref (bus);
+  }
+
+  sink = gst_bin_get_by_name (GST_BIN (camera->pipeline), "sink");
+  pad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, count_cb, camera, NULL);
+  gst_object_unref (pad);
+  gst_object_unref (sink);
+
+  camera->frames = 0;
+  gst_element_set_state (camera->pipeline, GST_STATE_PLAYING);
+}
+
+// Run n cameras and return whether every one of them kept up; the slowest
+// one's encoded frame rate goes to min_fps.
+static gboolean try_cameras (Bench * bench, const Size * size, gint preset, guint n,
+    gdouble * min_fps)
+{
+  Camera * cameras = g_new0 (Camera, n);
+  gint * start = g_new0 (gint, n);
+  gint64 began;
+  gdouble elapsed;
+  guint i;
+
+  for (i = 0; i < n; i++)
+    start_camera (bench, &cameras[i], size, preset, i, n);
+
+  g_usleep ((gulong) bench->warmup * G_USEC_PER_SEC);
+  for (i = 0; i < n; i++)
+    start[i] = g_atomic_int_get (&cameras[i].frames);
+  began = g_get_monotonic_time ();
+  g_usleep ((gulong) bench->duration * G_USEC_PER_SEC);
+  elapsed = (gdouble) (g_get_monotonic_time () - began) / G_USEC_PER_SEC;
+
+  *min_fps = G_MAXDOUBLE;
+  for (i = 0; i < n; i++) {
+    gdouble fps = (g_atomic_int_get (&cameras[i].frames) - start[i]) / elapsed;
+
+    *min_fps = MIN (*min_fps, fps);
+    gst_element_set_state (cameras[i].pipeline, GST_STATE_NULL);
+    gst_object_unref (cameras[i].pipeline);
+  }
+
+  g_free (start);
+  g_free (cameras);
+
+  g_printerr ("%dx%d@%d preset %d: %u cameras, slowest at %.2f fps\n", size->width, size->height,
+      size->fps, preset, n, *min_fps);
+  return *min_fps >= size->fps * KEEP_UP;
+}
+
+// The most cameras that keep up: double until one doesn't, then bisect.
+static guint find_capacity (Bench * bench, const Size * size, gint preset, gdouble * fps_at_max)
+{
+  guint good = 0, bad = 0, n;
+  gdouble fps;
+
+  *fps_at_max = 0;
+
+  for (n = 1; n <= (guint) bench->max_cameras; n *= 2) {
+    if (!try_cameras (bench, size, preset, n, &fps)) {
+      bad = n;
+      break;
+    }
+    good = n;
+    *fps_at_max = fps;
+  }
+  if (!bad)
+    bad = bench->max_cameras + 1;
+
+  while (bad - good > 1) {
+    n = good + (bad - good) / 2;
+    if (try_cameras (bench, size, preset, n, &fps)) {
+      good = n;
+      *fps_at_max = fps;
+    } else {
+      bad = n;
+    }
+  }
+
+  return good;
+}
+
+static GArray * parse_sizes (const gchar * str)
+{
+  GArray * sizes = g_array_new (FALSE, FALSE, sizeof(Size));
+  gchar ** items = g_strsplit (str, ",", -1);
+  guint i;
+
+  for (i = 0; items[i]; i++) {
+    Size size;
+
+    if (sscanf (items[i], "%dx%d@%d", &size.width, &size.height, &size.fps) != 3 ||
+        size.width <= 0 || size.height <= 0 || size.fps <= 0)
+      g_error ("invalid size '%s' (want WIDTHxHEIGHT@FPS)", items[i]);
+    g_array_append_val (sizes, size);
+  }
+
+  g_strfreev (items);
+  return sizes;
+}
+
+int main (int argc, char * argv[])
+{
+  Bench bench = {
+    .bitrate = 0,
+    .threads = 0,
+    .sliced_threads = FALSE,
+    .lookahead = -1,
+    .pin = FALSE,
+    .warmup = 3,
+    .duration = 10,
+    .max_cameras = 64,
+  };
+  gchar * sizes_str = NULL, * presets_str = NULL;
+  GOptionEntry entries[] = {
+    { "sizes", 0, 0, G_OPTION_ARG_STRING, &sizes_str, "Capture sizes to try (default 1280x720@30,1920x1080@30,1920x1080@60,3840x2160@30,3840x2160@60)", "LIST" },
+    { "presets", 0, 0, G_OPTION_ARG_STRING, &presets_str, "x264 speed presets to try (default 1,2,3)", "LIST" },
+    { "bitrate", 0, 0, G_OPTION_ARG_INT, &bench.bitrate, "Encoder bitrate (default 5000 at 1080p30, scaled by pixel rate)", "KBPS" },
+    { "encoder-threads", 0, 0, G_OPTION_ARG_INT, &bench.threads, "Threads per encoder (default 0, automatic)", "COUNT" },
+    { "sliced-threads", 0, 0, G_OPTION_ARG_NONE, &bench.sliced_threads, "Thread x264 by slices" },
+    { "lookahead", 0, 0, G_OPTION_ARG_INT, &bench.lookahead, "x264 rate control lookahead (default x264's)", "FRAMES" },
+    { "pin", 0, 0, G_OPTION_ARG_NONE, &bench.pin, "Pin each camera to an equal share of the CPUs" },
+    { "warmup", 0, 0, G_OPTION_ARG_INT, &bench.warmup, "Seconds to run before counting (default 3)", "SECONDS" },
+    { "duration", 0, 0, G_OPTION_ARG_INT, &bench.duration, "Seconds to count frames for (default 10)", "SECONDS" },
+    { "max-cameras", 0, 0, G_OPTION_ARG_INT, &bench.max_cameras, "Most cameras to try (default 64)", "COUNT" },
+    { NULL }
+  };
+  GOptionContext * context;
+  GError * error = NULL;
+  GArray * sizes;
+  gchar ** presets;
+  guint i, j;
+
+  gst_init (&argc, &argv);
+  GST_DEBUG_CATEGORY_INIT (camsrc, "camsrc", 0, "camera source");
+
+  context = g_option_context_new ("- find how many cameras this host can encode");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    g_error ("%s", error->message);
+  g_option_context_free (context);
+
+  sizes = parse_sizes (sizes_str ? sizes_str :
+      "1280x720@30,1920x1080@30,1920x1080@60,3840x2160@30,3840x2160@60");
+  presets = g_strsplit (presets_str ? presets_str : "1,2,3", ",", -1);
+  bench.warmup = MAX (bench.warmup, 1);
+  bench.duration = MAX (bench.duration, 1);
+  bench.max_cameras = MAX (bench.max_cameras, 1);
+
+  for (i = 0; i < sizes->len; i++) {
+    Size * size = &g_array_index (sizes, Size, i);
+
+    for (j = 0; presets[j]; j++) {
+      gint preset = atoi (presets[j]);
+      gdouble fps;
+      guint cameras = find_capacity (&bench, size, preset, &fps);
+
+      g_print ("{ \"width\": %d, \"height\": %d, \"fps\": %d, \"preset\": %d, "
+          "\"encoder-threads\": %d, \"sliced-threads\": %s, \"pinned\": %s, \"cpus\": %u, "
+          "\"cameras\": %u, \"slowest-fps\": %.2f }\n",
+          size->width, size->height, size->fps, preset, bench.threads,
+          bench.sliced_threads ? "true" : "false", bench.pin ? "true" : "false",
+          g_get_num_processors (), cameras, fps);
+    }
+  }
+
+  g_strfreev (presets);
+  g_array_free (sizes, TRUE);
+  g_free (sizes_str);
+  g_free (presets_str);
+
+  return 0;
+}
@@ -0,0 +1,555 @@
+/*
+ * Load test for the replay server.
+ *
+ * Starts camsrc on the test pattern (device -1), lets the ring fill, then
+ * fires replay requests at a fixed rate with a bounded number in flight,
+ * picking window lengths and relative or absolute starts at random.  While
+ * it runs, it prints one JSON line per second with camsrc's CPU and RSS.
+ * At the end it prints a summary line with request latency percentiles,
+ * how far clip durations land from the requested window, and frames the
+ * capture dropped (from the `stats` command).
+ *
+ *   make load-test
+ *   ./load-bench --rate 4 --concurrency 8 --windows 2,10,30 --duration 60
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+typedef struct {
+  // Options
+  gchar * camsrc;
+  gint port;
+  gdouble rate;
+  gint concurrency;
+  gint duration;
+  gint warmup;
+  gint lag;
+  gdouble absolute;
+  gchar * windows;
+  gchar * replay_options;
+  gchar * dir;
+  gboolean simulate;
+
+  GMainLoop * loop;
+  GPid pid;
+  GArray * window_ms;
+  GRand * rand;
+  gint64 start_time;
+  gboolean firing;
+  guint next_clip;
+  guint in_flight;
+  guint sent;
+  guint completed;
+  guint failed;
+  guint skipped;
+  GArray * latencies;
+  GArray * duration_errors;
+  guint64 bytes;
+  guint64 frames_dropped_before;
+  guint64 last_cpu_ticks;
+  gint64 last_sample_time;
+  gdouble cpu_percent_max;
+  guint64 rss_kb_max;
+} Bench;
+
+typedef struct {
+  Bench * bench;
+  guint window_ms;
+  gint64 sent_time;
+  gchar * path;
+  GSocketConnection * connection;
+  GDataInputStream * input;
+} Shot;
+
+static GSocketConnection * connect_to_camsrc (Bench * bench, GError ** error)
+{
+  GSocketClient * client = g_socket_client_new ();
+  GSocketConnection * connection =
+    g_socket_client_connect_to_host (client, "127.0.0.1", bench->port, NULL, error);
+
+  g_object_unref (client);
+  return connection;
+}
+
+// Send one command and wait for the first line of the answer.
+static gchar * command (Bench * bench, const gchar * line)
+{
+  GSocketConnection * connection = connect_to_camsrc (bench, NULL);
+  GDataInputStream * input;
+  gchar * answer;
+
+  if (!connection)
+    return NULL;
+
+  g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (connection)),
+      line, strlen (line), NULL, NULL, NULL);
+  input = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+  answer = g_data_input_stream_read_line (input, NULL, NULL, NULL);
+
+  g_object_unref (input);
+  g_object_unref (connection);
+  return answer;
+}
+
+// Sum of every "frames-dropped" in a stats answer (one per camera).
+static guint64 frames_dropped (Bench * bench)
+{
+  gchar * stats = command (bench, "stats\n");
+  const gchar * key = "\"frames-dropped\": ";
+  guint64 total = 0;
+  gchar * p;
+
+  for (p = stats; p && (p = strstr (p, key)); p += strlen (key))
+    total += g_ascii_strtoull (p + strlen (key), NULL, 10);
+
+  g_free (stats);
+  return total;
+}
+
+// camsrc's own clock; the virtual one when it's simulating.
+static gint64 clock_ms (Bench * bench)
+{
+  gchar * stats = command (bench, "stats\n");
+  const gchar * key = "\"clock-ms\": ";
+  gchar * p = stats ? strstr (stats, key) : NULL;
+  gint64 now = p ? g_ascii_strtoll (p + strlen (key), NULL, 10) : g_get_real_time () / 1000;
+
+  g_free (stats);
+  return now;
+}
+
+static guint32 read_u32 (const guint8 * p)
+{
+  return (guint32) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static guint64 read_u64 (const guint8 * p)
+{
+  return (guint64) read_u32 (p) << 32 | read_u32 (p + 4);
+}
+
+// Movie duration from moov/mvhd, or a negative value if there isn't one.
+static gdouble mp4_duration_ms (const gchar * path)
+{
+  FILE * file = fopen (path, "rb");
+  guint8 header[16], mvhd[32];
+  off_t offset = 0, end = -1;
+  gdouble duration = -1;
+
+  if (!file)
+    return -1;
+
+  while (fseeko (file, offset, SEEK_SET) == 0 && fread (header, 1, 8, file) == 8) {
+    guint64 size = read_u32 (header);
+    guint header_size = 8;
+
+    if (size == 1) {
+      if (fread (header + 8, 1, 8, file) != 8)
+        break;
+      size = read_u64 (header + 8);
+      header_size = 16;
+    }
+
+    if (!memcmp (header + 4, "moov", 4)) {
+      // Look inside the moov instead of skipping it
+      end = offset + size;
+      offset += header_size;
+      continue;
+    }
+
+    if (!memcmp (header + 4, "mvhd", 4)) {
+      if (fread (mvhd, 1, sizeof(mvhd), file) == sizeof(mvhd)) {
+        if (mvhd[0] == 1)
+          duration = read_u64 (mvhd + 24) * 1000.0 / read_u32 (mvhd + 20);
+        else
+          duration = read_u32 (mvhd + 16) * 1000.0 / read_u32 (mvhd + 12);
+      }
+      break;
+    }
+
+    if (size < header_size || (end >= 0 && offset + (off_t) size >= end))
+      break;
+    offset += size;
+  }
+
+  fclose (file);
+  return duration;
+}
+
+static void shot_free (Shot * shot)
+{
+  if (shot->input)
+    g_object_unref (shot->input);
+  if (shot->connection)
+    g_object_unref (shot->connection);
+  g_free (shot->path);
+  g_free (shot);
+}
+
+static void shot_done (Shot * shot)
+{
+  Bench * bench = shot->bench;
+
+  shot_free (shot);
+  bench->in_flight--;
+
+  if (!bench->firing && !bench->in_flight)
+    g_main_loop_quit (bench->loop);
+}
+
+static void response_cb (GObject * source, GAsyncResult * result, gpointer data)
+{
+  Shot * shot = data;
+  Bench * bench = shot->bench;
+  gchar * line = g_data_input_stream_read_line_finish (shot->input, result, NULL, NULL);
+  gdouble latency = (g_get_monotonic_time () - shot->sent_time) / 1000.0;
+  struct stat stat_buf;
+
+  if (line && strstr (line, "\"status\": 200") && g_stat (shot->path, &stat_buf) == 0) {
+    gdouble duration = mp4_duration_ms (shot->path);
+
+    bench->completed++;
+    bench->bytes += stat_buf.st_size;
+    g_array_append_val (bench->latencies, latency);
+    if (duration >= 0) {
+      gdouble error = ABS (duration - shot->window_ms);
+      g_array_append_val (bench->duration_errors, error);
+    }
+  } else {
+    bench->failed++;
+    g_printerr ("replay of %ums failed: %s\n", shot->window_ms, line ? line : "no answer");
+  }
+
+  g_unlink (shot->path);
+  g_free (line);
+  shot_done (shot);
+}
+
+static gboolean fire_cb (gpointer data)
+{
+  Bench * bench = data;
+  Shot * shot;
+  GError * error = NULL;
+  gchar * line;
+  gint64 start;
+
+  if (!bench->firing)
+    return G_SOURCE_REMOVE;
+
+  if (bench->in_flight >= (guint) bench->concurrency) {
+    bench->skipped++;
+    return G_SOURCE_CONTINUE;
+  }
+
+  shot = g_new0 (Shot, 1);
+  shot->bench = bench;
+  shot->window_ms = g_array_index (bench->window_ms, guint,
+      g_rand_int_range (bench->rand, 0, bench->window_ms->len));
+  shot->path = g_strdup_printf ("%s/load-bench-%d-%u.mp4", bench->dir, getpid (), bench->next_clip++);
+
+  // Windows end `lag` ms ago, so most of them are already in the ring
+  if (g_rand_double (bench->rand) < bench->absolute)
+    start = (bench->simulate ? clock_ms (bench) : g_get_real_time () / 1000) -
+      shot->window_ms - bench->lag;
+  else
+    start = -(gint64) (shot->window_ms + bench->lag);
+
+  shot->connection = connect_to_camsrc (bench, &error);
+  if (!shot->connection) {
+    g_printerr ("couldn't connect: %s\n", error->message);
+    g_error_free (error);
+    bench->failed++;
+    shot_free (shot);
+    return G_SOURCE_CONTINUE;
+  }
+
+  line = g_strdup_printf ("replay %" G_GINT64_FORMAT " %u %s %s\n",
+      start, shot->window_ms, bench->replay_options, shot->path);
+  shot->sent_time = g_get_monotonic_time ();
+  g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (shot->connection)),
+      line, strlen (line), NULL, NULL, NULL);
+  g_free (line);
+
+  shot->input = g_data_input_stream_new (
+      g_io_stream_get_input_stream (G_IO_STREAM (shot->connection)));
+  g_data_input_stream_read_line_async (shot->input, G_PRIORITY_DEFAULT, NULL, response_cb, shot);
+
+  bench->in_flight++;
+  bench->sent++;
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean stop_cb (gpointer data)
+{
+  Bench * bench = data;
+
+  bench->firing = FALSE;
+  if (!bench->in_flight)
+    g_main_loop_quit (bench->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean start_cb (gpointer data)
+{
+  Bench * bench = data;
+
+  bench->frames_dropped_before = frames_dropped (bench);
+  bench->firing = TRUE;
+  g_timeout_add (MAX (1000 / bench->rate, 1), fire_cb, bench);
+  g_timeout_add_seconds (bench->duration, stop_cb, bench);
+
+  return G_SOURCE_REMOVE;
+}
+
+// CPU (user + system) ticks and resident set of camsrc, from /proc.
+static gboolean read_proc (GPid pid, guint64 * cpu_ticks, guint64 * rss_kb)
+{
+  gchar path[64];
+  gchar * contents, * p;
+  gulong utime, stime;
+
+  g_snprintf (path, sizeof(path), "/proc/%d/stat", pid);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
+
+  // Fields 14 and 15, counting from the state after the command name
+  p = strrchr (contents, ')');
+  if (!p || sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+        &utime, &stime) != 2) {
+    g_free (contents);
+    return FALSE;
+  }
+  *cpu_ticks = utime + stime;
+  g_free (contents);
+
+  g_snprintf (path, sizeof(path), "/proc/%d/status", pid);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
+  p = strstr (contents, "VmRSS:");
+  *rss_kb = p ? g_ascii_strtoull (p + 6, NULL, 10) : 0;
+  g_free (contents);
+
+  return TRUE;
+}
+
+static gboolean sample_cb (gpointer data)
+{
+  Bench * bench = data;
+  gint64 now = g_get_monotonic_time ();
+  guint64 cpu_ticks, rss_kb;
+  gdouble cpu_percent = 0;
+
+  if (!read_proc (bench->pid, &cpu_ticks, &rss_kb))
+    return G_SOURCE_CONTINUE;
+
+  if (bench->last_sample_time)
+    cpu_percent = (cpu_ticks - bench->last_cpu_ticks) * 100.0 / sysconf (_SC_CLK_TCK) /
+      ((now - bench->last_sample_time) / 1e6);
+  bench->last_cpu_ticks = cpu_ticks;
+  bench->last_sample_time = now;
+  bench->cpu_percent_max = MAX (bench->cpu_percent_max, cpu_percent);
+  bench->rss_kb_max = MAX (bench->rss_kb_max, rss_kb);
+
+  g_print ("{ \"type\": \"sample\", \"t-s\": %.1f, \"phase\": \"%s\", \"cpu-percent\": %.1f, "
+      "\"rss-kb\": %" G_GUINT64_FORMAT ", \"in-flight\": %u }\n",
+      (now - bench->start_time) / 1e6, bench->firing ? "load" : bench->sent ? "drain" : "warmup",
+      cpu_percent, rss_kb, bench->in_flight);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static int compare_doubles (gconstpointer a, gconstpointer b)
+{
+  gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static gdouble percentile (GArray * values, gdouble q)
+{
+  if (!values->len)
+    return 0;
+  return g_array_index (values, gdouble, (guint) (q * (values->len - 1) + 0.5));
+}
+
+static GArray * parse_windows (const gchar * str)
+{
+  GArray * windows = g_array_new (FALSE, FALSE, sizeof(guint));
+  gchar ** items = g_strsplit (str, ",", -1);
+  guint i;
+
+  for (i = 0; items[i]; i++) {
+    guint ms = atof (items[i]) * 1000;
+
+    if (!ms)
+      g_error ("invalid window '%s' (want seconds)", items[i]);
+    g_array_append_val (windows, ms);
+  }
+
+  g_strfreev (items);
+  return windows;
+}
+
+static gboolean spawn_camsrc (Bench * bench, gint max_replays)
+{
+  gchar port[16], replays[16];
+  gchar * argv[] = { bench->camsrc, "--devices", "-1", "--port", port,
+    "--max-replays", replays, bench->simulate ? "--simulate" : NULL, NULL };
+  GError * error = NULL;
+  gint i;
+
+  g_snprintf (port, sizeof(port), "%d", bench->port);
+  g_snprintf (replays, sizeof(replays), "%d", max_replays);
+
+  if (!g_spawn_async (NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+        &bench->pid, &error)) {
+    g_printerr ("couldn't start %s: %s\n", bench->camsrc, error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  // Wait for the control port to come up
+  for (i = 0; i < 100; i++) {
+    GSocketConnection * connection = connect_to_camsrc (bench, NULL);
+
+    if (connection) {
+      g_object_unref (connection);
+      return TRUE;
+    }
+    g_usleep (100 * 1000);
+  }
+
+  g_printerr ("camsrc didn't open port %d\n", bench->port);
+  kill (bench->pid, SIGTERM);
+  return FALSE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  Bench bench_data = {
+    .port = 2100,
+    .rate = 2,
+    .concurrency = 8,
+    .duration = 60,
+    .warmup = -1,
+    .lag = 1000,
+    .absolute = 0.5,
+  };
+  Bench * bench = &bench_data;
+  GOptionContext * option_context;
+  GError * error = NULL;
+  gint max_replays = 0;
+  guint max_window = 0, i;
+  guint64 dropped;
+  gdouble error_mean = 0;
+  gchar * answer;
+
+  GOptionEntry option_entries[] = {
+    { "camsrc", 0, 0, G_OPTION_ARG_FILENAME, &bench->camsrc, "camsrc binary (default ./camsrc)", "PATH" },
+    { "port", 'p', 0, G_OPTION_ARG_INT, &bench->port, "Port to run camsrc on (default 2100)", "PORT" },
+    { "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &bench->rate, "Replay requests per second (default 2)", "RATE" },
+    { "concurrency", 'c', 0, G_OPTION_ARG_INT, &bench->concurrency, "Most requests in flight; more are skipped (default 8)", "COUNT" },
+    { "max-replays", 'm', 0, G_OPTION_ARG_INT, &max_replays, "camsrc --max-replays (default --concurrency)", "COUNT" },
+    { "duration", 't', 0, G_OPTION_ARG_INT, &bench->duration, "Seconds to fire requests for (default 60)", "SECONDS" },
+    { "warmup", 'w', 0, G_OPTION_ARG_INT, &bench->warmup, "Seconds to let the ring fill first (default longest window + lag + 2)", "SECONDS" },
+    { "windows", 0, 0, G_OPTION_ARG_STRING, &bench->windows, "Window lengths to pick from (default 2,10,30)", "SECONDS,..." },
+    { "lag", 'l', 0, G_OPTION_ARG_INT, &bench->lag, "How long ago windows end (default 1000)", "MS" },
+    { "absolute", 'a', 0, G_OPTION_ARG_DOUBLE, &bench->absolute, "Share of requests with absolute starts (default 0.5)", "RATIO" },
+    { "replay-options", 'o', 0, G_OPTION_ARG_STRING, &bench->replay_options, "Options for every replay, e.g. --exact-start", "OPTIONS" },
+    { "dir", 'd', 0, G_OPTION_ARG_FILENAME, &bench->dir, "Where camsrc writes clips (default /tmp)", "DIR" },
+    { "simulate", 0, 0, G_OPTION_ARG_NONE, &bench->simulate, "Run camsrc on its virtual clock, faster than real time" },
+    { NULL }
+  };
+
+  option_context = g_option_context_new ("- load test the replay server");
+  g_option_context_add_main_entries (option_context, option_entries, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error))
+    g_error ("%s", error->message);
+  g_option_context_free (option_context);
+
+  if (!bench->camsrc)
+    bench->camsrc = g_strdup ("./camsrc");
+  if (!bench->windows)
+    bench->windows = g_strdup ("2,10,30");
+  if (!bench->replay_options)
+    bench->replay_options = g_strdup ("");
+  if (!bench->dir)
+    bench->dir = g_strdup (g_get_tmp_dir ());
+  bench->rate = MAX (bench->rate, 0.01);
+  bench->concurrency = MAX (bench->concurrency, 1);
+
+  bench->window_ms = parse_windows (bench->windows);
+  for (i = 0; i < bench->window_ms->len; i++)
+    max_window = MAX (max_window, g_array_index (bench->window_ms, guint, i));
+  if (bench->warmup < 0)
+    bench->warmup = (max_window + bench->lag) / 1000 + 2;
+
+  // Clips from camsrc land wherever it is told; both run on this host
+  signal (SIGPIPE, SIG_IGN);
+  if (!spawn_camsrc (bench, max_replays > 0 ? max_replays : bench->concurrency))
+    return 1;
+
+  bench->loop = g_main_loop_new (NULL, FALSE);
+  bench->rand = g_rand_new ();
+  bench->latencies = g_array_new (FALSE, FALSE, sizeof(gdouble));
+  bench->duration_errors = g_array_new (FALSE, FALSE, sizeof(gdouble));
+  bench->start_time = g_get_monotonic_time ();
+
+  g_timeout_add_seconds (bench->warmup, start_cb, bench);
+  g_timeout_add_seconds (1, sample_cb, bench);
+  g_main_loop_run (bench->loop);
+
+  dropped = frames_dropped (bench);
+  dropped = dropped > bench->frames_dropped_before ? dropped - bench->frames_dropped_before : 0;
+
+  g_array_sort (bench->latencies, compare_doubles);
+  g_array_sort (bench->duration_errors, compare_doubles);
+  for (i = 0; i < bench->duration_errors->len; i++)
+    error_mean += g_array_index (bench->duration_errors, gdouble, i) / bench->duration_errors->len;
+
+  g_print ("{ \"type\": \"summary\", \"simulated\": %s, \"rate\": %.2f, \"concurrency\": %d, \"windows-s\": \"%s\", "
+      "\"absolute\": %.2f, \"replay-options\": \"%s\", \"duration-s\": %d, "
+      "\"sent\": %u, \"completed\": %u, \"failed\": %u, \"skipped\": %u, "
+      "\"latency-ms-p50\": %.2f, \"latency-ms-p95\": %.2f, \"latency-ms-p99\": %.2f, "
+      "\"duration-error-ms-mean\": %.2f, \"duration-error-ms-p95\": %.2f, \"duration-error-ms-max\": %.2f, "
+      "\"bytes\": %" G_GUINT64_FORMAT ", \"frames-dropped\": %" G_GUINT64_FORMAT ", "
+      "\"cpu-percent-max\": %.1f, \"rss-kb-max\": %" G_GUINT64_FORMAT " }\n",
+      bench->simulate ? "true" : "false", bench->rate, bench->concurrency, bench->windows, bench->absolute, bench->replay_options,
+      bench->duration, bench->sent, bench->completed, bench->failed, bench->skipped,
+      percentile (bench->latencies, 0.50), percentile (bench->latencies, 0.95),
+      percentile (bench->latencies, 0.99), error_mean,
+      percentile (bench->duration_errors, 0.95), percentile (bench->duration_errors, 1.0),
+      bench->bytes, dropped,
+      bench->cpu_percent_max, bench->rss_kb_max);
+
+  // "shutdown" answers nothing; the connection just closes
+  answer = command (bench, "shutdown\n");
+  g_free (answer);
+  waitpid (bench->pid, NULL, 0);
+  g_spawn_close_pid (bench->pid);
+
+  g_array_free (bench->latencies, TRUE);
+  g_array_free (bench->duration_errors, TRUE);
+  g_array_free (bench->window_ms, TRUE);
+  g_rand_free (bench->rand);
+  g_main_loop_unref (bench->loop);
+  g_free (bench->camsrc);
+  g_free (bench->windows);
+  g_free (bench->replay_options);
+  g_free (bench->dir);
+
+  return 0;
+}
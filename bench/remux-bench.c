@@ -0,0 +1,265 @@
+/*
+ * Compare the built-in MP4 writer against the appsrc ! mp4mux ! filesink
+ * pipeline camsrc used to build for every replay.
+ *
+ * Encodes a minute or so of test pattern into a ReplayRing the same way
+ * camsrc does, then exports 2s, 10s and 60s windows through both paths and
+ * prints one JSON line per (path, window) with wall-clock latency and CPU
+ * time per clip.
+ *
+ *   make bench && ./remux-bench [--iterations N] [--dir DIR]
+ */
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "replay-ring.h"
+#include "mp4-writer.h"
+
+GST_DEBUG_CATEGORY (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define SOURCE_FRAMES "1950"      // 65s at 30 fps
+
+static const guint windows[] = { 2, 10, 60 };
+
+typedef gboolean (*ExportFunc) (ReplayRing * ring, guint64 first, GstClockTime end,
+    const gchar * path);
+
+// Fill the ring with SOURCE_FRAMES of 1080p30 H.264, as fast as x264 will go.
+static ReplayRing * fill_ring (void)
+{
+  ReplayRing * ring = replay_ring_new (0, 0);
+  GstElement * pipeline;
+  GstElement * sink;
+  GstSample * sample;
+  GError * error = NULL;
+
+  pipeline = gst_parse_launch (
+      "videotestsrc is-live=false pattern=ball num-buffers=" SOURCE_FRAMES " ! "
+      "video/x-raw,width=1920,height=1080,framerate=30/1,format=I420 ! "
+      "x264enc key-int-max=30 speed-preset=ultrafast bitrate=5000 ! "
+      "video/x-h264,stream-format=avc,alignment=au ! appsink name=sink sync=false",
+      &error);
+  if (!pipeline)
+    g_error ("couldn't build source pipeline: %s", error->message);
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  while ((sample = gst_app_sink_pull_sample (GST_APP_SINK (sink)))) {
+    GstCaps * caps = gst_sample_get_caps (sample);
+
+    if (caps)
+      replay_ring_set_caps (ring, caps);
+    replay_ring_push (ring, gst_buffer_ref (gst_sample_get_buffer (sample)));
+    gst_sample_unref (sample);
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (pipeline);
+
+  return ring;
+}
+
+static gboolean export_native (ReplayRing * ring, guint64 first, GstClockTime end,
+    const gchar * path)
+{
+  GError * error = NULL;
+  GstCaps * caps = replay_ring_get_caps (ring);
+  gint fd = g_open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  Mp4Writer * writer = mp4_writer_new (fd, caps, &error);
+  ReplayUnit unit;
+  guint64 seq;
+  gboolean ok = writer != NULL;
+
+  gst_caps_unref (caps);
+
+  for (seq = first; ok && replay_ring_get (ring, seq, &unit) == REPLAY_RING_OK; seq++) {
+    if (unit.pts >= end) {
+      replay_ring_unit_clear (&unit);
+      break;
+    }
+    ok = mp4_writer_add (writer, &unit, &error);
+    replay_ring_unit_clear (&unit);
+  }
+
+  ok = ok && mp4_writer_finish (writer, &error);
+  if (!ok) {
+    g_printerr ("native export failed: %s\n", error->message);
+    g_error_free (error);
+  }
+
+  if (writer)
+    mp4_writer_free (writer);
+  close (fd);
+
+  return ok;
+}
+
+static gboolean export_gst (ReplayRing * ring, guint64 first, GstClockTime end,
+    const gchar * path)
+{
+  GstElement * bin = gst_pipeline_new ("replay"),
+             * src = gst_element_factory_make ("appsrc", "src"),
+             * mux = gst_element_factory_make ("mp4mux", "mux"),
+             * sink = gst_element_factory_make ("filesink", "sink");
+  GstCaps * caps = replay_ring_get_caps (ring);
+  GstClockTime base = GST_CLOCK_TIME_NONE;
+  GstBus * bus;
+  GstMessage * msg;
+  ReplayUnit unit;
+  guint64 seq;
+  gboolean ok;
+
+  g_object_set (src, "caps", caps, "format", GST_FORMAT_TIME, "max-bytes", (guint64) 0, NULL);
+  g_object_set (sink, "location", path, NULL);
+  gst_caps_unref (caps);
+
+  gst_bin_add_many (GST_BIN (bin), src, mux, sink, NULL);
+  gst_element_link_many (src, mux, sink, NULL);
+  gst_element_set_state (bin, GST_STATE_PLAYING);
+
+  for (seq = first; replay_ring_get (ring, seq, &unit) == REPLAY_RING_OK; seq++) {
+    GstBuffer * buffer;
+
+    if (unit.pts >= end) {
+      replay_ring_unit_clear (&unit);
+      break;
+    }
+
+    if (!GST_CLOCK_TIME_IS_VALID (base))
+      base = MIN (unit.pts, unit.dts);
+
+    buffer = gst_buffer_copy (unit.buffer);
+    GST_BUFFER_PTS (buffer) = unit.pts - base;
+    GST_BUFFER_DTS (buffer) = unit.dts - base;
+    gst_app_src_push_buffer (GST_APP_SRC (src), buffer);
+    replay_ring_unit_clear (&unit);
+  }
+  gst_app_src_end_of_stream (GST_APP_SRC (src));
+
+  bus = gst_pipeline_get_bus (GST_PIPELINE (bin));
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  ok = GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS;
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+
+  gst_element_set_state (bin, GST_STATE_NULL);
+  gst_object_unref (bin);
+
+  return ok;
+}
+
+static gdouble cpu_seconds (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+    usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int compare_doubles (gconstpointer a, gconstpointer b)
+{
+  gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void run (const gchar * name, ExportFunc export, ReplayRing * ring,
+    guint64 first, GstClockTime start, guint window, guint iterations, const gchar * dir)
+{
+  gdouble * latencies = g_new (gdouble, iterations);
+  gdouble cpu = 0;
+  gchar * path;
+  struct stat stat_buf;
+  guint i;
+
+  path = g_strdup_printf ("%s/remux-bench-%s-%us.mp4", dir, name, window);
+
+  for (i = 0; i < iterations; i++) {
+    gint64 wall = g_get_monotonic_time ();
+    gdouble cpu_start = cpu_seconds ();
+
+    if (!export (ring, first, start + window * GST_SECOND, path))
+      g_error ("%s export of %us failed", name, window);
+
+    latencies[i] = (g_get_monotonic_time () - wall) / 1000.0;
+    cpu += cpu_seconds () - cpu_start;
+  }
+
+  qsort (latencies, iterations, sizeof(gdouble), compare_doubles);
+  g_stat (path, &stat_buf);
+
+  g_print ("{ \"path\": \"%s\", \"window-s\": %u, \"iterations\": %u, \"bytes\": %ld, "
+      "\"latency-ms-p50\": %.2f, \"latency-ms-max\": %.2f, \"cpu-ms-per-clip\": %.2f }\n",
+      name, window, iterations, (glong) stat_buf.st_size,
+      latencies[iterations / 2], latencies[iterations - 1], cpu * 1000 / iterations);
+
+  g_unlink (path);
+  g_free (path);
+  g_free (latencies);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext * option_context;
+  GError * error = NULL;
+  gint iterations = 20;
+  gchar * dir = NULL;
+  ReplayRing * ring;
+  ReplayUnit unit;
+  GstClockTime start;
+  guint64 first;
+  guint i;
+
+  GOptionEntry option_entries[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Clips per path and window (default 20)", "N" },
+    { "dir", 'd', 0, G_OPTION_ARG_FILENAME, &dir, "Where to write clips (default /tmp)", "DIR" },
+    { NULL }
+  };
+
+  gst_init (&argc, &argv);
+  GST_DEBUG_CATEGORY_INIT (camsrc, "camsrc", 0, "camera source");
+
+  option_context = g_option_context_new ("- benchmark clip export paths");
+  g_option_context_add_main_entries (option_context, option_entries, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error))
+    g_error ("%s", error->message);
+  g_option_context_free (option_context);
+
+  iterations = MAX (iterations, 1);
+  if (!dir)
+    dir = g_strdup (g_get_tmp_dir ());
+
+  ring = fill_ring ();
+
+  // Every window starts at the very first keyframe
+  if (!replay_ring_find_keyframe (ring, 0, &first) ||
+      replay_ring_get (ring, first, &unit) != REPLAY_RING_OK)
+    g_error ("source produced no keyframes");
+  start = unit.pts;
+  replay_ring_unit_clear (&unit);
+
+  for (i = 0; i < G_N_ELEMENTS (windows); i++) {
+    run ("native", export_native, ring, first, start, windows[i], iterations, dir);
+    run ("gst-mux", export_gst, ring, first, start, windows[i], iterations, dir);
+  }
+
+  replay_ring_free (ring);
+  g_free (dir);
+
+  return 0;
+}
@@ -1,47 +1,270 @@
 /*
  * Things to do:
- * * protect against multiple overlapping requests
- * * on startup, choose a camera
- * * adjust start time to account for keyframes
  * * record last PTS seen and use that as a lower bound for acceptable request start-time
  * */
 
+#define _GNU_SOURCE
+
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 #include <gio/gio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "replay-ring.h"
+#include "mp4-writer.h"
+#include "metrics.h"
+#include "mark-index.h"
+#include "activity.h"
+#include "snapshot.h"
+#include "hls.h"
+#include "journal.h"
+#include <json-glib/json-glib.h>
 
 #define PORT 2000
 #define DEVICE_NUMBER_TEST -1
-#define GST_QUEUE_LEAK_DOWNSTREAM 2
-#define DECKLINK_MODE_1080_30_P 9
 #define X264_SPEED_PRESET_DEFAULT 3
 #define VERBOSE_DEFAULT FALSE
 #define BITRATE_DEFAULT 5000
+#define CAPTURE_DEFAULT "1920x1080@30"
+#define CAPTURE_MAX_WIDTH 3840
+#define CAPTURE_MAX_HEIGHT 2160
+#define CAPTURE_MAX_FPS 120
+#define CAPTURE_MAX_PIXEL_RATE (3840 * 2160 * 60)   // so 120 fps tops out at 1080p
+#define RETENTION_TIME_DEFAULT (5 * 60)
+#define SPILL_SIZE_DEFAULT 4096
+#define SEGMENT_SIZE_DEFAULT 64
+#define MEMORY_TIME_DEFAULT 30
+#define MEMORY_BYTES_DEFAULT 512
+#define MEGABYTE (1024 * 1024)
+#define FRAGMENT_DURATION_MS 1000   // one GOP at key-int-max 30, 30 fps
+#define MAX_REPLAYS_DEFAULT 8
+#define MAX_CAMERAS 64
+#define CLOCK_MAPPING_INTERVAL 1      // seconds
+#define CLOCK_MAPPING_TOLERANCE GST_MSECOND
+#define CLOCK_MAPPINGS_MAX 64
+#define RENDITION_NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_"
+#define JOB_ID_CHARS RENDITION_NAME_CHARS ".:"
+#define JOB_ID_SIZE 64
+#define ADMISSION_QUEUE_MS 500      // encoder backlog that holds new jobs back
+#define ADMISSION_RETRY_MS 200
+#define BATCH_CLIPS_MAX 256
+#define MARKS_MAX 1024
+#define MARK_ROLL_DEFAULT_MS 5000
+#define MAX_PINNED_DEFAULT 1024     // MB
+#define MATERIALIZE_RETRY_MS 500
+#define ACTIVITY_PEAKS_DEFAULT 5
+#define ACTIVITY_PEAKS_MAX 100
+#define ACTIVITY_PEAK_GAP GST_SECOND
+#define SNAPSHOT_THREADS_DEFAULT 4
+#define SNAPSHOT_CACHE_DEFAULT 256  // MB
+#define THUMBNAILS_MAX 100
+#define THUMBNAIL_WIDTH_DEFAULT 320
+#define ENCODER_QUEUE_MS 1000       // raw video a rendition may buffer before capture blocks
+#define FRAME_POOL_SLACK 4          // frames in flight beyond the encoder queues
+#define ENCODER_CONTROL_MS 500      // how often encoder backlogs are checked
+#define ENCODER_PRESSURE_MS 250     // a growing backlog past this lowers the bitrate
+#define ENCODER_CALM_MS 50          // and one below this for long enough raises it again
+#define ENCODER_CALM_TICKS 10
+#define ENCODER_BITRATE_STEP 10     // percent of the configured bitrate per change
+#define MIN_BITRATE_DEFAULT 50      // percent
+#define HLS_PART_MS_DEFAULT 334     // ten frames at 30 fps, three parts to a GOP
+#define HLS_THREADS 256             // blocking playlist and part requests each hold one
+
+typedef struct _App App;
+
+// The wall clock at one moment, against the stream clock buffers carry.
+typedef struct {
+  GstClockTime wall;
+  GstClockTime stream;
+} ClockMapping;
 
+typedef struct _Camera Camera;
+
+// One encoding of a camera's input (full quality, a proxy...) and the ring
+// it records into.
 typedef struct {
-  GMainLoop  *loop;
+  Camera * camera;
+  gchar * name;
+  gint width;
+  gint height;
+  gint bitrate;
+  GstElement *queue;
+  GstElement *encoder;
+  ReplayRing *ring;
+  HlsPublisher *hls;
+  Journal *journal;
+  // Encoder control, from the main loop only
+  GstClockTime last_queue_level;
+  guint calm_ticks;
+  // Guarded by the app's metrics_lock
+  guint64 frames_encoded;
+  guint64 bytes_encoded;
+  Histogram encode_latency;
+  Histogram ring_latency;
+  GstClockTime fps_window_start;
+  guint fps_frames;
+  gdouble fps;
+  gdouble current_bitrate;
+  guint64 bitrate_changes;
+} Rendition;
+
+// One capture pipeline, teed into each of its renditions.
+struct _Camera {
+  App * app;
+  guint index;
+  gint device_number;
   GstElement *pipeline;
-  GstElement *queue2;
+  GPtrArray *renditions;
+  guint bus_watch_id;
+  // Scored on the streaming thread, looked up from the main loop
+  ActivityMeter *activity_meter;
+  ActivityIndex *activity;
+  GstVideoInfo video_info;
+  gboolean have_video_info;
+  // Every streaming thread of the camera's pipelines runs on these
+  cpu_set_t cpus;
+  gboolean pinned;
+  // Capture path, from the source's streaming thread
+  gboolean passthrough;
+  GstElement * videorate;       // borrowed from the pipeline; NULL if passthrough
+  GstMemory *source_memory;     // compared against, never touched
+  GstBufferPool *frame_pool;
+  // Guarded by the app's metrics_lock
+  guint64 frames_captured;
+  guint64 frames_dropped;
+  GstClockTime last_capture;
+  Histogram convert_latency;
+  guint64 raw_bytes_copied;
+  guint64 rate_duplicated;      // as of the last stats, to warn about new ones
+  gdouble activity_score;
+  guint64 activity_frames;
+  GstClockTime activity_time;
+};
+
+struct _App {
+  GMainLoop  *loop;
+  GPtrArray *cameras;
+  gint pump_scheduled;
+  GList *requests;
+  // Only the main loop changes it, atomically, since metrics reads it too
+  guint active_replays;
+  guint max_replays;
+  guint next_request_id;
+  GstClock * clock;
+  GArray * clock_mappings;
+  gboolean simulate;
+  GstClockTime simulation_epoch;
+  gint min_bitrate;
+  // Jobs waiting for admission, highest priority first
+  GList *queue;
+  const gchar *admission_hold;
+  guint admission_timer_id;
+  guint64 max_export_rate;
+  guint64 export_bytes;
+  guint64 export_bytes_sampled;
+  gint64 export_rate_time;
+  gdouble export_rate;
+  // Counters and histograms are updated from streaming threads and read
+  // from the metrics server's, so all of them live under this lock.
+  GMutex metrics_lock;
+  guint64 replays_completed;
+  guint64 replays_failed;
+  Histogram request_latency;
+  Histogram first_byte_latency;
+  Histogram mux_latency;
+  guint64 hls_requests;
+  guint64 hls_bytes;
+  // Marks by name.  The pump pins footage for the ones still waiting on it;
+  // queued materializations are written out when no replays are running.
+  GHashTable *marks;
+  GList *pinning;
+  GQueue *materialize_queue;
+  guint materialize_id;
+  MarkIndex *mark_index;
+  guint64 pinned_bytes;
+  guint64 max_pinned_bytes;
+  // Stills are decoded on the pool's threads, through the shared cache
+  SnapshotCache *snapshot_cache;
+  GThreadPool *snapshot_pool;
+  guint64 snapshots_taken;
+};
+
+typedef struct _Request Request;
+
+// One per client connection; a replay gets its own output pipeline so any
+// number of them can read the ring at once.  A replay of several cameras
+// becomes one child request per camera, answering over the parent's
+// connection.  A connection speaking JSON lines is a session instead, and
+// each job it submits is a child request (which may have children of its
+// own), tagged with the client's id.  A batch's clips are its children too,
+// fed from the batch's single pass over the ring rather than pumped alone.
+struct _Request {
+  App * app;
+  Camera * camera;
+  guint rendition_index;
+  Rendition * rendition;
+  Request * parent;
+  guint children;
+  guint id;
+  GSocketConnection * connection;
+  guint socket_watcher_id;
   GstElement *bin;
-  GstPad * blockpad;
-  GstPad * srcpad;
-  gulong blockpad_probe_id;
-  gulong srcpad_probe_id;
+  GstElement *appsrc;
+  guint bin_watch_id;
+  gboolean replay_active;
+  gboolean replay_started;
+  guint64 replay_cursor;
+  GstClockTime replay_base;
   GstClockTime clock_start;
   GstClockTime clock_end;
   GstClockTime clock_desired_duration;
-  GSocketConnection * connection;
-  guint socket_watcher_id;
+  gint64 received_time;
   gchar file_location[1024];
-} App;
+  gboolean inline_delivery;
+  gboolean fragmented;
+  gboolean in_memory;
+  gboolean gst_mux;
+  gboolean exact_start;
+  gboolean smart_render;
+  gint slow_motion_fps;
+  guint64 stretch_n;
+  guint64 stretch_d;
+  guint64 camera_set;
+  GPtrArray *batch;
+  gboolean session;
+  GList *jobs;
+  gchar job_id[JOB_ID_SIZE];
+  gint priority;
+  gboolean queued;
+  GstElement *head;
+  GstElement *head_src;
+  guint head_watch_id;
+  guint64 head_first_seq;
+  gboolean head_fed;
+  Mp4Writer * writer;
+  gint clip_fd;
+  off_t send_offset;
+  off_t send_length;
+  guint send_watch_id;
+  gboolean snapshot;
+};
 
 typedef enum {
   WINDOW_BEFORE,
@@ -50,35 +273,439 @@ typedef enum {
   WINDOW_AFTER
 } WindowReturn;
 
+typedef enum {
+  MARK_PINNING,
+  MARK_PINNED,
+  MARK_EXPIRED,
+  MARK_MATERIALIZED
+} MarkState;
+
+// A named moment plus pre- and post-roll.  The mark takes its own reference
+// to every unit in the window (from memory, or mapped from the spill) as
+// soon as the ring has it, so eviction can't take the footage away and the
+// clip can be written out whenever it suits.
+typedef struct {
+  App * app;
+  gchar name[JOB_ID_SIZE];
+  Rendition * rendition;
+  GstClockTime clock_at;
+  GstClockTime clock_start;
+  GstClockTime clock_end;
+  MarkState state;
+  gboolean started;
+  guint64 cursor;
+  GstCaps * caps;
+  GArray * units;
+  guint64 bytes;
+  gchar * location;
+  gchar * destination;
+} Mark;
+
+// One still of a snapshot or thumbnails request, taken on the snapshot pool
+// while its request counts it as a child.  The stills of a thumbnail strip
+// share the strip array, and are answered together once the last is done.
+typedef struct {
+  Request * request;
+  GPtrArray * strip;
+  Rendition * rendition;
+  GstClockTime target;
+  gboolean exact;
+  const gchar * format;
+  gint width;
+  gchar * path;
+  // Filled in by the worker
+  GstBuffer * image;
+  GstClockTime pts;
+  guint status;
+  const gchar * reason;
+} Snapshot;
+
 
 // Set up debug output
-GST_DEBUG_CATEGORY_STATIC (camsrc);
+GST_DEBUG_CATEGORY (camsrc);
 #define GST_CAT_DEFAULT camsrc
 
-static gchar * get_buffer_status(gchar * buff, App * app)
+// Now on the stream timeline buffers are stamped with: the monotonic
+// system clock, or when simulating, the virtual clock (the newest capture
+// time every camera has reached).  Don't call with the metrics lock held.
+static GstClockTime get_stream_time (App * app)
+{
+  GstClockTime now = GST_CLOCK_TIME_NONE;
+  guint i;
+
+  if (!app->simulate)
+    return gst_clock_get_time (app->clock);
+
+  g_mutex_lock (&app->metrics_lock);
+  for (i = 0; i < app->cameras->len; i++) {
+    Camera * camera = g_ptr_array_index (app->cameras, i);
+
+    if (!GST_CLOCK_TIME_IS_VALID (camera->last_capture))
+      now = app->simulation_epoch;
+    else if (!GST_CLOCK_TIME_IS_VALID (now) || camera->last_capture < now)
+      now = camera->last_capture;
+  }
+  g_mutex_unlock (&app->metrics_lock);
+
+  return GST_CLOCK_TIME_IS_VALID (now) ? now : app->simulation_epoch;
+}
+
+// Note the wall clock against the stream clock, if their offset moved since
+// the last mapping (an NTP step or slew).  Returns TRUE to run as a timeout.
+static gboolean update_clock_mapping (gpointer data)
+{
+  App * app = data;
+  ClockMapping mapping = {
+    .wall = g_get_real_time () * GST_USECOND,
+    .stream = gst_clock_get_time (app->clock),
+  };
+
+  if (app->clock_mappings->len) {
+    ClockMapping * last = &g_array_index (app->clock_mappings, ClockMapping,
+        app->clock_mappings->len - 1);
+    GstClockTimeDiff drift = GST_CLOCK_DIFF (last->stream - last->wall,
+        mapping.stream - mapping.wall);
+
+    if (ABS (drift) < CLOCK_MAPPING_TOLERANCE)
+      return G_SOURCE_CONTINUE;
+
+    GST_INFO ("Wall clock moved %" G_GINT64_FORMAT "us against the stream clock",
+        drift / GST_USECOND);
+  }
+
+  if (app->clock_mappings->len == CLOCK_MAPPINGS_MAX)
+    g_array_remove_index (app->clock_mappings, 0);
+  g_array_append_val (app->clock_mappings, mapping);
+
+  return G_SOURCE_CONTINUE;
+}
+
+// Translate a requested wall-clock time using the mapping in effect then.
+static GstClockTime wall_to_stream_time (App * app, GstClockTime wall)
+{
+  ClockMapping * mapping = &g_array_index (app->clock_mappings, ClockMapping, 0);
+  guint i;
+
+  for (i = app->clock_mappings->len; i > 0; i--) {
+    ClockMapping * candidate = &g_array_index (app->clock_mappings, ClockMapping, i - 1);
+
+    if (candidate->wall <= wall) {
+      mapping = candidate;
+      break;
+    }
+  }
+
+  return wall + mapping->stream > mapping->wall ? wall + mapping->stream - mapping->wall : 0;
+}
+
+// And back, for telling clients what time it is.
+static GstClockTime stream_to_wall_time (App * app, GstClockTime stream)
+{
+  ClockMapping * mapping = &g_array_index (app->clock_mappings, ClockMapping, 0);
+  guint i;
+
+  for (i = app->clock_mappings->len; i > 0; i--) {
+    ClockMapping * candidate = &g_array_index (app->clock_mappings, ClockMapping, i - 1);
+
+    if (candidate->stream <= stream) {
+      mapping = candidate;
+      break;
+    }
+  }
+
+  return stream + mapping->wall - mapping->stream;
+}
+
+// Wall clock minus stream clock, for playlist date-times and the journal,
+// from any thread.  The clock mappings belong to the main loop, so read the
+// clocks here instead (a simulation's single mapping never changes, so that
+// one is safe).
+static GstClockTime get_wall_offset (App * app)
+{
+  ClockMapping * mapping = &g_array_index (app->clock_mappings, ClockMapping, 0);
+
+  if (app->simulate)
+    return mapping->wall - mapping->stream;
+  return g_get_real_time () * GST_USECOND - gst_clock_get_time (app->clock);
+}
+
+// Returns a newly allocated string, one line per camera plus a summary.
+static gchar * get_buffer_status (App * app)
+{
+  GString * status = g_string_new (NULL);
+  guint i;
+
+  for (i = 0; i < app->cameras->len; i++) {
+    Camera * camera = g_ptr_array_index (app->cameras, i);
+    guint j;
+
+    for (j = 0; j < camera->renditions->len; j++) {
+      Rendition * rendition = g_ptr_array_index (camera->renditions, j);
+      GstClockTime level_time_1;
+      GstClockTime level_time_2;
+      guint level_bytes_1, level_buffers_1;
+      guint level_buffers_2;
+      guint64 level_bytes_2;
+      guint64 level_memory_bytes;
+
+      g_object_get (rendition->queue,
+          "current-level-time", &level_time_1,
+          "current-level-bytes", &level_bytes_1,
+          "current-level-buffers", &level_buffers_1, NULL);
+
+      replay_ring_get_level (rendition->ring, &level_time_2, &level_buffers_2, &level_bytes_2);
+      level_memory_bytes = replay_ring_get_memory_bytes (rendition->ring);
+
+      g_string_append_printf (status,
+          "camera %u (device %d) %s: queue1 reports %lums, %u buffers, %u bytes "
+          "ring reports %lums, %u buffers, %lu bytes (%lu in memory)\n",
+          camera->index, camera->device_number, rendition->name,
+          GST_TIME_AS_MSECONDS(level_time_1), level_buffers_1, level_bytes_1,
+          GST_TIME_AS_MSECONDS(level_time_2), level_buffers_2, level_bytes_2, level_memory_bytes);
+    }
+  }
+
+  g_string_append_printf (status, "%u of %u replays active\n",
+      app->active_replays, app->max_replays);
+
+  return g_string_free (status, FALSE);
+}
+
+typedef enum {
+  METRIC_COUNTER,
+  METRIC_GAUGE,
+  METRIC_HISTOGRAM
+} MetricKind;
+
+static void append_metric_sample (GString * out, MetricKind kind, const gchar * name,
+    const gchar * labels, gconstpointer value)
+{
+  switch (kind) {
+    case METRIC_COUNTER:
+      metrics_append_value (out, name, labels, *(const guint64 *) value);
+      break;
+    case METRIC_GAUGE:
+      metrics_append_value (out, name, labels, *(const gdouble *) value);
+      break;
+    case METRIC_HISTOGRAM:
+      histogram_append_prometheus (value, out, name, labels);
+      break;
+  }
+}
+
+// One sample per camera (or per rendition) of the field at offset in
+// Camera (or Rendition).  Call with the metrics lock held.
+static void append_metric (GString * out, App * app, gboolean per_rendition,
+    MetricKind kind, const gchar * name, const gchar * help, glong offset)
+{
+  static const gchar * types[] = { "counter", "gauge", "histogram" };
+  gchar labels[128];
+  guint i, j;
+
+  metrics_append_header (out, name, types[kind], help);
+
+  for (i = 0; i < app->cameras->len; i++) {
+    Camera * camera = g_ptr_array_index (app->cameras, i);
+
+    if (!per_rendition) {
+      g_snprintf (labels, sizeof(labels), "camera=\"%u\"", camera->index);
+      append_metric_sample (out, kind, name, labels, G_STRUCT_MEMBER_P (camera, offset));
+      continue;
+    }
+
+    for (j = 0; j < camera->renditions->len; j++) {
+      Rendition * rendition = g_ptr_array_index (camera->renditions, j);
+
+      g_snprintf (labels, sizeof(labels), "camera=\"%u\",rendition=\"%s\"",
+          camera->index, rendition->name);
+      append_metric_sample (out, kind, name, labels, G_STRUCT_MEMBER_P (rendition, offset));
+    }
+  }
+}
+
+// Returns a newly allocated Prometheus text exposition of every metric.
+static gchar * get_metrics_text (App * app)
 {
-  GstClockTime level_time_1;
-  GstClockTime level_time_2;
-  guint level_bytes_1, level_buffers_1;
-  guint level_bytes_2, level_buffers_2;
+  GString * out = g_string_new (NULL);
+  gdouble active_replays = g_atomic_int_get (&app->active_replays);
+  gchar labels[128];
+  guint i, j;
+
+  // Queue levels come from the elements themselves, not under our lock
+  metrics_append_header (out, "camsrc_encoder_queue_ms", "gauge",
+      "Raw video waiting for the encoder; grows when it falls behind real time");
+  for (i = 0; i < app->cameras->len; i++) {
+    Camera * camera = g_ptr_array_index (app->cameras, i);
+
+    for (j = 0; j < camera->renditions->len; j++) {
+      Rendition * rendition = g_ptr_array_index (camera->renditions, j);
+      GstClockTime level_time;
+
+      g_object_get (rendition->queue, "current-level-time", &level_time, NULL);
+      g_snprintf (labels, sizeof(labels), "camera=\"%u\",rendition=\"%s\"",
+          camera->index, rendition->name);
+      metrics_append_value (out, "camsrc_encoder_queue_ms", labels,
+          GST_TIME_AS_MSECONDS (level_time));
+    }
+  }
+
+  g_mutex_lock (&app->metrics_lock);
+
+  append_metric (out, app, FALSE, METRIC_COUNTER, "camsrc_frames_captured_total",
+      "Frames delivered by the capture source", G_STRUCT_OFFSET (Camera, frames_captured));
+  append_metric (out, app, FALSE, METRIC_COUNTER, "camsrc_frames_dropped_total",
+      "Frames missing from gaps in the capture", G_STRUCT_OFFSET (Camera, frames_dropped));
+  append_metric (out, app, FALSE, METRIC_HISTOGRAM, "camsrc_capture_to_convert_ms",
+      "Latency from capture to the converted frame", G_STRUCT_OFFSET (Camera, convert_latency));
+  append_metric (out, app, FALSE, METRIC_COUNTER, "camsrc_raw_copy_bytes_total",
+      "Raw frame bytes converted or copied between the source and the encoders",
+      G_STRUCT_OFFSET (Camera, raw_bytes_copied));
+  append_metric (out, app, FALSE, METRIC_GAUGE, "camsrc_activity_score",
+      "How much the last frame changed from the one before, 0-255",
+      G_STRUCT_OFFSET (Camera, activity_score));
+  append_metric (out, app, TRUE, METRIC_COUNTER, "camsrc_frames_encoded_total",
+      "Frames out of the encoder", G_STRUCT_OFFSET (Rendition, frames_encoded));
+  append_metric (out, app, TRUE, METRIC_COUNTER, "camsrc_encoded_bytes_total",
+      "Bytes out of the encoder", G_STRUCT_OFFSET (Rendition, bytes_encoded));
+  append_metric (out, app, TRUE, METRIC_GAUGE, "camsrc_encoder_fps",
+      "Encoder output frame rate over the last second", G_STRUCT_OFFSET (Rendition, fps));
+  append_metric (out, app, TRUE, METRIC_GAUGE, "camsrc_encoder_bitrate_kbps",
+      "Bitrate the encoder is running at, lowered while it can't keep up",
+      G_STRUCT_OFFSET (Rendition, current_bitrate));
+  append_metric (out, app, TRUE, METRIC_COUNTER, "camsrc_encoder_bitrate_changes_total",
+      "Times encoder control has changed the bitrate", G_STRUCT_OFFSET (Rendition, bitrate_changes));
+  append_metric (out, app, TRUE, METRIC_HISTOGRAM, "camsrc_capture_to_encoded_ms",
+      "Latency from capture to the encoded frame", G_STRUCT_OFFSET (Rendition, encode_latency));
+  append_metric (out, app, TRUE, METRIC_HISTOGRAM, "camsrc_capture_to_ring_ms",
+      "Latency from capture to the frame landing in the replay ring",
+      G_STRUCT_OFFSET (Rendition, ring_latency));
+
+  metrics_append_header (out, "camsrc_replays_active", "gauge", "Replays being written");
+  metrics_append_value (out, "camsrc_replays_active", "", active_replays);
+  metrics_append_header (out, "camsrc_replays_completed_total", "counter", "Replays delivered");
+  metrics_append_value (out, "camsrc_replays_completed_total", "", app->replays_completed);
+  metrics_append_header (out, "camsrc_replays_failed_total", "counter", "Replays that failed after being accepted");
+  metrics_append_value (out, "camsrc_replays_failed_total", "", app->replays_failed);
+  metrics_append_header (out, "camsrc_capture_to_mux_ms", "histogram",
+      "Age of each frame when a replay hands it to its muxer");
+  histogram_append_prometheus (&app->mux_latency, out, "camsrc_capture_to_mux_ms", "");
+  metrics_append_header (out, "camsrc_request_first_byte_ms", "histogram",
+      "Time from a replay request to its first response bytes");
+  histogram_append_prometheus (&app->first_byte_latency, out, "camsrc_request_first_byte_ms", "");
+  metrics_append_header (out, "camsrc_request_latency_ms", "histogram",
+      "Time from a replay request until the clip is delivered");
+  histogram_append_prometheus (&app->request_latency, out, "camsrc_request_latency_ms", "");
+  metrics_append_header (out, "camsrc_hls_requests_total", "counter", "HLS requests served");
+  metrics_append_value (out, "camsrc_hls_requests_total", "", app->hls_requests);
+  metrics_append_header (out, "camsrc_hls_bytes_total", "counter", "HLS bytes served");
+  metrics_append_value (out, "camsrc_hls_bytes_total", "", app->hls_bytes);
+
+  g_mutex_unlock (&app->metrics_lock);
+
+  return g_string_free (out, FALSE);
+}
 
-  g_object_get (gst_bin_get_by_name (GST_BIN (app->pipeline), "upstream-queue"),
-      "current-level-time", &level_time_1,
-      "current-level-bytes", &level_bytes_1,
-      "current-level-buffers", &level_buffers_1, NULL);
+// Returns a newly allocated JSON line for the `stats` command.
+static gchar * get_stats_json (App * app)
+{
+  GString * out = g_string_new (NULL);
+  guint64 hits, misses, bytes;
+  guint i, j;
+
+  // The clock replays are parsed against (virtual when simulating)
+  g_string_append_printf (out, "{ \"clock-ms\": %lu, \"simulated\": %s, \"cameras\": [",
+      GST_TIME_AS_MSECONDS (stream_to_wall_time (app, get_stream_time (app))), app->simulate ? "true" : "false");
+
+  g_mutex_lock (&app->metrics_lock);
+
+  for (i = 0; i < app->cameras->len; i++) {
+    Camera * camera = g_ptr_array_index (app->cameras, i);
+    guint64 rate_dropped = 0, rate_duplicated = 0;
+
+    // Frames videorate threw away or repeated to hold the frame rate.  The
+    // source was checked for our rate at startup, so a repeat is a frame it
+    // failed to deliver, and it shows in the clips (stretched, in slow motion)
+    if (camera->videorate)
+      g_object_get (camera->videorate, "drop", &rate_dropped, "duplicate", &rate_duplicated, NULL);
+    if (rate_duplicated > camera->rate_duplicated)
+      GST_WARNING ("Camera %u's source is short of its frame rate: %" G_GUINT64_FORMAT
+          " frames repeated so far", camera->index, rate_duplicated);
+    camera->rate_duplicated = rate_duplicated;
+
+    g_string_append_printf (out, "%s { \"camera\": %u, \"device\": %d, "
+        "\"frames-captured\": %" G_GUINT64_FORMAT ", \"frames-dropped\": %" G_GUINT64_FORMAT ", "
+        "\"rate-dropped\": %" G_GUINT64_FORMAT ", \"rate-duplicated\": %" G_GUINT64_FORMAT ", "
+        "\"warning\": %s, "
+        "\"activity\": %.2f, \"activity-us\": %.1f, \"passthrough\": %s, "
+        "\"raw-copy-bytes\": %" G_GUINT64_FORMAT ", \"raw-copy-bytes-per-frame\": %.0f, "
+        "\"capture-to-convert-ms\": ",
+        i ? "," : "", camera->index, camera->device_number,
+        camera->frames_captured, camera->frames_dropped, rate_dropped, rate_duplicated,
+        rate_duplicated ? "\"frames repeated to make up the capture rate\"" : "null",
+        camera->activity_score, camera->activity_frames ?
+          (gdouble) camera->activity_time / camera->activity_frames / GST_USECOND : 0.0,
+        camera->passthrough ? "true" : "false", camera->raw_bytes_copied,
+        camera->frames_captured ? (gdouble) camera->raw_bytes_copied / camera->frames_captured : 0.0);
+    histogram_append_json (&camera->convert_latency, out);
+    g_string_append (out, ", \"renditions\": [");
+
+    for (j = 0; j < camera->renditions->len; j++) {
+      Rendition * rendition = g_ptr_array_index (camera->renditions, j);
+
+      g_string_append_printf (out, "%s { \"name\": \"%s\", "
+          "\"frames-encoded\": %" G_GUINT64_FORMAT ", \"bytes-encoded\": %" G_GUINT64_FORMAT ", "
+          "\"fps\": %.2f, \"bitrate\": %.0f, \"bitrate-changes\": %" G_GUINT64_FORMAT ", "
+          "\"capture-to-encoded-ms\": ",
+          j ? "," : "", rendition->name, rendition->frames_encoded,
+          rendition->bytes_encoded, rendition->fps, rendition->current_bitrate,
+          rendition->bitrate_changes);
+      histogram_append_json (&rendition->encode_latency, out);
+      g_string_append (out, ", \"capture-to-ring-ms\": ");
+      histogram_append_json (&rendition->ring_latency, out);
+      if (rendition->journal) {
+        guint64 records, journal_bytes, dropped;
+
+        journal_get_stats (rendition->journal, &records, &journal_bytes, &dropped);
+        g_string_append_printf (out, ", \"journal\": { \"records\": %" G_GUINT64_FORMAT
+            ", \"bytes\": %" G_GUINT64_FORMAT ", \"dropped\": %" G_GUINT64_FORMAT " }",
+            records, journal_bytes, dropped);
+      }
+      g_string_append (out, " }");
+    }
 
-  g_object_get (app->queue2,
-      "current-level-time", &level_time_2,
-      "current-level-bytes", &level_bytes_2,
-      "current-level-buffers", &level_buffers_2, NULL);
+    g_string_append (out, " ] }");
+  }
 
-  g_snprintf(buff, 1024,
-      "queue1 reports %lums, %u buffers, %u bytes "
-      "queue2 reports %lums, %u buffers, %u bytes\n",
-      GST_TIME_AS_MSECONDS(level_time_1), level_buffers_1, level_bytes_1,
-      GST_TIME_AS_MSECONDS(level_time_2), level_buffers_2, level_bytes_2);
+  g_string_append_printf (out, " ], \"replays\": { \"active\": %u, \"max\": %u, "
+      "\"completed\": %" G_GUINT64_FORMAT ", \"failed\": %" G_GUINT64_FORMAT ", "
+      "\"capture-to-mux-ms\": ",
+      app->active_replays, app->max_replays, app->replays_completed, app->replays_failed);
+  histogram_append_json (&app->mux_latency, out);
+  g_string_append (out, ", \"first-byte-ms\": ");
+  histogram_append_json (&app->first_byte_latency, out);
+  g_string_append (out, ", \"latency-ms\": ");
+  histogram_append_json (&app->request_latency, out);
+  g_string_append_printf (out, " }, \"marks\": { \"count\": %u, \"pinned-bytes\": %" G_GUINT64_FORMAT
+      ", \"materializing\": %u }",
+      g_hash_table_size (app->marks), app->pinned_bytes, app->materialize_queue->length);
+
+  snapshot_cache_get_stats (app->snapshot_cache, &hits, &misses, &bytes);
+  g_string_append_printf (out, ", \"snapshots\": { \"taken\": %" G_GUINT64_FORMAT
+      ", \"cache-hits\": %" G_GUINT64_FORMAT ", \"cache-misses\": %" G_GUINT64_FORMAT
+      ", \"cache-bytes\": %" G_GUINT64_FORMAT " }, \"hls\": { \"requests\": %" G_GUINT64_FORMAT
+      ", \"bytes\": %" G_GUINT64_FORMAT " } }\n",
+      app->snapshots_taken, hits, misses, bytes, app->hls_requests, app->hls_bytes);
+
+  g_mutex_unlock (&app->metrics_lock);
+
+  return g_string_free (out, FALSE);
+}
 
-  return buff;
+// Milliseconds from a buffer timestamp (stream time) until now, as from
+// get_stream_time ().
+static gdouble age_ms (GstClockTime pts, GstClockTime now)
+{
+  return GST_CLOCK_TIME_IS_VALID (pts) && now > pts ? (gdouble) (now - pts) / GST_MSECOND : 0;
 }
 
 
@@ -97,67 +724,174 @@ gboolean mkpath(gchar* file_path, mode_t mode) {
   return TRUE;
 }
 
-static GstElement * create_bin (App * app)
+static GstElement * create_bin (Request * request)
 {
-  GST_DEBUG ("Saving stream to %s...", app->file_location);
+  GST_DEBUG ("Saving stream to %s...", request->file_location);
 
-  GstElement *bin = gst_element_factory_make ("bin", NULL),
+  GstElement *bin = gst_pipeline_new ("replay"),
+             *src = gst_element_factory_make ("appsrc", "src"),
              *mux = gst_element_factory_make ("mp4mux", "mux"),
-             *sink = gst_element_factory_make ("filesink", "sink");
+             *sink = gst_element_factory_make (request->fragmented ? "fdsink" : "filesink", "sink");
+  GstCaps * caps;
 
   if (!bin) { GST_ERROR("Failed to create bin"); }
+  if (!src) { GST_ERROR("Failed to create src"); }
   if (!mux) { GST_ERROR("Failed to create mux"); }
   if (!sink) { GST_ERROR("Failed to create sink"); }
 
-  if (!bin || !mux || !sink) {
+  if (!bin || !src || !mux || !sink) {
     return NULL;
   }
 
-  if (!mkpath(app->file_location, 0766)) {
-    GST_ERROR ("mkpath of '%s' failed", app->file_location);
+  if (!request->in_memory && !request->fragmented && !mkpath(request->file_location, 0766)) {
+    GST_ERROR ("mkpath of '%s' failed", request->file_location);
+  }
+
+  // The ring holds the encoder's caps (including codec_data) for us; a slow
+  // motion clip only claims the rate it's played at
+  caps = replay_ring_get_caps (request->rendition->ring);
+  if (caps && request->slow_motion_fps) {
+    caps = gst_caps_make_writable (caps);
+    gst_caps_set_simple (caps, "framerate", GST_TYPE_FRACTION, request->slow_motion_fps, 1, NULL);
   }
+  g_object_set (src,
+      "caps", caps,
+      "format", GST_FORMAT_TIME,
+      "max-bytes", (guint64) 0,
+      NULL);
+  if (caps)
+    gst_caps_unref (caps);
 
   // g_object_set (mux, "faststart", TRUE, NULL);
-  g_object_set (sink, "location", app->file_location, NULL);
 
-  gst_bin_add_many (GST_BIN (bin), mux, sink, NULL);
-  gst_element_link (mux, sink);
-  gst_element_add_pad(bin, gst_ghost_pad_new ("sink", gst_element_get_request_pad (mux, "video_%u")));
+  if (request->fragmented) {
+    // moov up front, then a moof/mdat per GOP written straight to the client
+    // as soon as the GOP has left the ring
+    g_object_set (mux,
+        "fragment-duration", FRAGMENT_DURATION_MS,
+        "streamable", TRUE,
+        NULL);
+    g_object_set (sink,
+        "fd", request->clip_fd,
+        "sync", FALSE,
+        NULL);
+  } else {
+    g_object_set (sink, "location", request->file_location, NULL);
+  }
+
+  gst_bin_add_many (GST_BIN (bin), src, mux, sink, NULL);
+  gst_element_link_many (src, mux, sink, NULL);
 
   return bin;
 }
 
-static void drop_bin (App * app)
+static void drop_bin (Request * request)
+{
+  g_source_remove (request->bin_watch_id);
+  gst_element_set_state (request->bin, GST_STATE_NULL);
+  gst_object_unref (request->appsrc);
+  gst_object_unref (request->bin);
+  request->appsrc = NULL;
+  request->bin = NULL;
+  request->replay_active = FALSE;
+  g_atomic_int_add (&request->app->active_replays, -1);
+}
+
+static void drop_head (Request * request)
+{
+  g_source_remove (request->head_watch_id);
+  gst_element_set_state (request->head, GST_STATE_NULL);
+  gst_object_unref (request->head_src);
+  gst_object_unref (request->head);
+  request->head_src = NULL;
+  request->head = NULL;
+  request->head_fed = FALSE;
+}
+
+static void hangup (Request * request);
+static GstBusSyncReply pin_thread_cb (GstBus * bus, GstMessage * message, gpointer data);
+static void drop_queued_jobs (Request * session);
+static void schedule_pump (App * app);
+
+static void request_free (Request * request)
 {
-  gst_element_set_state (app->bin, GST_STATE_NULL);
-  gst_bin_remove (GST_BIN(app->pipeline), app->bin);
+  App * app = request->app;
+  Request * parent = request->parent;
+
+  GST_DEBUG ("Request %u done", request->id);
+  if (request->replay_active)
+    g_atomic_int_add (&app->active_replays, -1);
+  if (request->writer)
+    mp4_writer_free (request->writer);
+  if (request->clip_fd >= 0)
+    close (request->clip_fd);
+  app->requests = g_list_remove (app->requests, request);
+  if (parent && parent->session)
+    parent->jobs = g_list_remove (parent->jobs, request);
+  if (parent && parent->batch)
+    g_ptr_array_remove (parent->batch, request);
+  if (request->batch)
+    g_ptr_array_free (request->batch, TRUE);
+  g_free (request);
+
+  // The last clip of a multi-camera replay closes the connection; a session
+  // stays open for more jobs, unless its client has already gone
+  if (parent && !--parent->children && !(parent->session && parent->connection))
+    hangup (parent);
+
+  // A replay slot may have come free for a queued job
+  if (app->queue)
+    schedule_pump (app);
 }
 
-static void hangup (App * app)
+// Close the client connection.  The request itself lives on until its
+// output pipeline (if any) has been dropped too.
+static void hangup (Request * request)
 {
-  if (app->connection) {
-    g_source_remove (app->socket_watcher_id);
-    g_object_unref (app->connection);
-    app->connection = NULL;
+  if (request->send_watch_id) {
+    g_source_remove (request->send_watch_id);
+    request->send_watch_id = 0;
+  }
+
+  if (request->connection) {
+    g_source_remove (request->socket_watcher_id);
+    g_object_unref (request->connection);
+    request->connection = NULL;
   }
+
+  // Nobody is left to hear about jobs that haven't started; running ones finish
+  if (request->session)
+    drop_queued_jobs (request);
+
+  if (!request->bin && !request->head && !request->children)
+    request_free (request);
+}
+
+// Children answer over their parent's (or their session's) connection.
+static GSocketConnection * get_connection (Request * request)
+{
+  while (request->parent)
+    request = request->parent;
+  return request->connection;
 }
 
-static gint get_file_descriptor (App * app)
+static gint get_file_descriptor (Request * request)
 {
-  gint fd = app->connection ?
-    g_socket_get_fd (g_socket_connection_get_socket (app->connection)) :
+  GSocketConnection * connection = get_connection (request);
+  gint fd = connection ?
+    g_socket_get_fd (g_socket_connection_get_socket (connection)) :
     g_open ("/dev/null", O_WRONLY, 0);
   return fd;
 }
 
-static gboolean socket_send_string (gchar * str, App * app)
+static gboolean socket_send_string (gchar * str, Request * request)
 {
-  if (!app->connection || !str)
+  if (!get_connection (request) || !str)
     return FALSE;
 
   ssize_t sent;
   guint len = strlen(str);
-  gint dest = get_file_descriptor (app);
+  gint dest = get_file_descriptor (request);
 
   if ((sent = write (dest, str, len)) < len) {
     GST_ERROR ("entire response didn't get sent (only %zd bytes of %u).", sent, len);
@@ -166,329 +900,3480 @@ static gboolean socket_send_string (gchar * str, App * app)
   return TRUE;
 }
 
-static void send_result_to_socket (App * app)
+static gint64 request_latency_ms (Request * request)
+{
+  return (g_get_monotonic_time () - request->received_time) / 1000;
+}
+
+static void record_first_byte (Request * request)
+{
+  App * app = request->app;
+
+  g_mutex_lock (&app->metrics_lock);
+  histogram_observe (&app->first_byte_latency,
+      (g_get_monotonic_time () - request->received_time) / 1000.0);
+  g_mutex_unlock (&app->metrics_lock);
+}
+
+static void record_replay_done (Request * request, gboolean ok)
+{
+  App * app = request->app;
+
+  g_mutex_lock (&app->metrics_lock);
+  if (ok) {
+    app->replays_completed++;
+    histogram_observe (&app->request_latency,
+        (g_get_monotonic_time () - request->received_time) / 1000.0);
+  } else {
+    app->replays_failed++;
+  }
+  g_mutex_unlock (&app->metrics_lock);
+}
+
+// Lines for a job start with the client's id and what kind of event they are.
+static void job_fields (Request * request, const gchar * event, gchar * dest, gsize size)
+{
+  if (request->job_id[0])
+    g_snprintf (dest, size, "\"id\": \"%s\", \"event\": \"%s\", ", request->job_id, event);
+  else
+    dest[0] = '\0';
+}
+
+// extra is more members, each with a leading comma.
+static void send_job_event (Request * request, const gchar * event, const gchar * extra)
+{
+  gchar response[1024];
+
+  g_snprintf (response, sizeof(response), "{ \"id\": \"%s\", \"event\": \"%s\"%s }\n",
+      request->job_id, event, extra);
+  socket_send_string (response, request);
+}
+
+static void send_result_to_socket (Request * request)
 {
   gint src;
   struct stat stat_buf;
   gchar response[1024];
+  gchar job[128];
+  gint64 latency = request_latency_ms (request);
 
-  src = g_open (app->file_location, O_RDONLY);
+  src = g_open (request->file_location, O_RDONLY);
   fstat (src, &stat_buf);
   close (src);
 
+  GST_INFO ("Request %u completed in %ldms (%u replays active)",
+      request->id, latency, request->app->active_replays);
+
+  job_fields (request, "done", job, sizeof(job));
   g_snprintf (response, sizeof(response),
-      "{ \"status\": 200, \"content-type\": \"video/mp4\", \"content-length\": %ld, \"location\": \"%s\" }\n",
-      (glong)stat_buf.st_size, app->file_location);
+      "{ %s\"status\": 200, \"camera\": %u, \"rendition\": \"%s\", \"content-type\": \"video/mp4\", \"content-length\": %ld, \"location\": \"%s\", \"latency-ms\": %ld%s }\n",
+      job, request->camera->index, request->rendition->name, (glong)stat_buf.st_size,
+      request->in_memory ? "memory" : request->file_location, latency,
+      request->inline_delivery ? ", \"transfer\": \"inline\"" : "");
 
-  socket_send_string (response, app);
+  socket_send_string (response, request);
+  record_first_byte (request);
 }
 
-static void send_error_to_socket (guint status, gchar * reason, App *app)
+static void send_error_to_socket (guint status, const gchar * reason, Request * request)
 {
   gchar response[1024];
+  gchar job[128];
+
+  job_fields (request, "error", job, sizeof(job));
+  if (request->parent && request->parent->batch)
+    g_snprintf (response, sizeof(response),
+        "{ %s\"status\": %u, \"location\": \"%s\", \"reason\": \"%s\" }\n",
+        job, status, request->file_location, reason);
+  else if (request->parent && request->parent->camera_set)
+    g_snprintf (response, sizeof(response),
+        "{ %s\"status\": %u, \"camera\": %u, \"reason\": \"%s\" }\n",
+        job, status, request->camera->index, reason);
+  else
+    g_snprintf (response, sizeof(response),
+        "{ %s\"status\": %u, \"reason\": \"%s\" }\n", job, status, reason);
+
+  socket_send_string (response, request);
+}
 
-  g_snprintf (response, sizeof(response),
-      "{ \"status\": %u, \"reason\": \"%s\" }", status, reason);
+// Push the clip down the socket with sendfile() as fast as the client
+// will take it, without copying it through userspace.
+static gboolean send_clip_cb (gint fd, GIOCondition condition, gpointer data)
+{
+  Request * request = data;
+  ssize_t sent;
+
+  while (request->send_offset < request->send_length) {
+    sent = sendfile (fd, request->clip_fd, &request->send_offset,
+        request->send_length - request->send_offset);
+
+    if (sent < 0 && errno == EAGAIN)
+      return G_SOURCE_CONTINUE;
 
-  socket_send_string (response, app);
+    if (sent <= 0) {
+      GST_WARNING ("sendfile stopped after %ld of %ld bytes: %s",
+          (glong)request->send_offset, (glong)request->send_length,
+          sent < 0 ? g_strerror (errno) : "clip truncated");
+      break;
+    }
+  }
+
+  GST_INFO ("Request %u delivered %ld bytes inline in %ldms",
+      request->id, (glong)request->send_offset, request_latency_ms (request));
+  if (!request->snapshot)
+    record_replay_done (request, request->send_offset == request->send_length);
+
+  request->send_watch_id = 0;
+  hangup (request);
+  return G_SOURCE_REMOVE;
 }
 
-static GstPadProbeReturn
-blockpad_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+static void send_clip_to_socket (Request * request)
 {
-  App * app = user_data;
-  GstElement * mux = gst_bin_get_by_name (GST_BIN(app->bin), "mux");
+  struct stat stat_buf;
 
-  GstPad * mux_sink_pad = gst_element_get_static_pad (mux, "video_0");
-    gst_pad_send_event (mux_sink_pad, gst_event_new_eos());
-  g_object_unref (mux_sink_pad);
+  if (!request->connection) {
+    hangup (request);
+    return;
+  }
 
-  return GST_PAD_PROBE_OK;
+  if (request->clip_fd < 0)
+    request->clip_fd = g_open (request->file_location, O_RDONLY);
+
+  if (request->clip_fd < 0 || fstat (request->clip_fd, &stat_buf) < 0) {
+    GST_ERROR ("Couldn't open %s to send it", request->file_location);
+    send_error_to_socket (500, "couldn't read clip", request);
+    hangup (request);
+    return;
+  }
+
+  request->send_offset = 0;
+  request->send_length = stat_buf.st_size;
+
+  send_result_to_socket (request);
+
+  request->send_watch_id = g_unix_fd_add (get_file_descriptor (request),
+      G_IO_OUT, send_clip_cb, request);
+}
+
+// Hand a finished clip to the client: inline, or as a pointer to the file.
+static void deliver_clip (Request * request)
+{
+  if (request->inline_delivery) {
+    send_clip_to_socket (request);
+  } else {
+    send_result_to_socket (request);
+    record_replay_done (request, TRUE);
+    hangup (request);
+  }
 }
 
-static void block_pipeline(App *app)
+// Fragmented clips have no length up front; the body runs until we hang up.
+static void send_stream_header_to_socket (Request * request)
+{
+  socket_send_string ("{ \"status\": 200, \"content-type\": \"video/mp4\", \"transfer\": \"stream\" }\n",
+      request);
+}
+
+static GstPadProbeReturn
+first_bytes_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
 {
-  app->blockpad_probe_id = gst_pad_add_probe (app->blockpad,
-      GST_PAD_PROBE_TYPE_BLOCK | GST_PAD_PROBE_TYPE_BUFFER,
-      blockpad_probe_cb, app, NULL);
+  Request * request = data;
+
+  GST_INFO ("Request %u sent first bytes after %ldms", request->id, request_latency_ms (request));
+  record_first_byte (request);
+
+  return GST_PAD_PROBE_REMOVE;
 }
 
-static WindowReturn inside_window(GstPadProbeInfo * info, App * app)
+static WindowReturn inside_window(ReplayUnit * unit, Request * request)
 {
-  GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
-  GstBufferFlags flags = GST_BUFFER_FLAGS(GST_PAD_PROBE_INFO_BUFFER (info));
-  gboolean have_keyframe = (flags & GST_BUFFER_FLAG_DELTA_UNIT) != GST_BUFFER_FLAG_DELTA_UNIT;
+  GstClockTime pts = unit->pts;
+  gboolean have_keyframe = unit->keyframe;
 
-  WindowReturn ret = pts < app->clock_start ?
-    WINDOW_BEFORE : pts >= app->clock_end ?
+  WindowReturn ret = pts < request->clock_start ?
+    WINDOW_BEFORE : pts >= request->clock_end ?
     WINDOW_AFTER : have_keyframe ?
     WINDOW_INSIDE_KEYFRAME : WINDOW_INSIDE;
 
   if (have_keyframe)
     GST_LOG ("pts check : %lu%s %s [%lu, %lu]", GST_TIME_AS_MSECONDS(pts), have_keyframe ? "*" : "",
         ret == WINDOW_BEFORE ? "before" : ret == WINDOW_AFTER ? "after" : "inside",
-        GST_TIME_AS_MSECONDS(app->clock_start), GST_TIME_AS_MSECONDS(app->clock_end));
+        GST_TIME_AS_MSECONDS(request->clock_start), GST_TIME_AS_MSECONDS(request->clock_end));
 
   return ret;
 }
 
-static GstPadProbeReturn
-wait_for_end_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+// Tear down whatever output a replay has; this frees the request.
+static void abort_replay (Request * request)
 {
-  App * app = data;
-
+  if (request->bin)
+    drop_bin (request);
+  if (request->head)
+    drop_head (request);
+  if (request->writer) {
+    mp4_writer_free (request->writer);
+    request->writer = NULL;
+  }
+  hangup (request);
+}
 
-  switch (inside_window(info, app)) {
-    case WINDOW_BEFORE:
-      GST_ERROR ("Somehow we're before our window looking for end");
-      break;
+static void fail_replay (guint status, gchar * reason, Request * request)
+{
+  send_error_to_socket (status, reason, request);
+  record_replay_done (request, FALSE);
+  abort_replay (request);
+}
 
-    case WINDOW_INSIDE:
-    case WINDOW_INSIDE_KEYFRAME:
-      GST_LOG ("Passing along a frame that is in window");
-      return GST_PAD_PROBE_PASS;
+static gboolean
+replay_bus_call (GstBus *bus, GstMessage *msg, gpointer data);
+static gboolean
+head_bus_call (GstBus *bus, GstMessage *msg, gpointer data);
 
-    case WINDOW_AFTER:
-      break;
+// Give the head encoder whatever the live one is running with.
+static void copy_encoder_settings (GstElement * from, GstElement * to)
+{
+  GParamSpec ** pspecs;
+  guint n_pspecs, i;
+
+  pspecs = g_object_class_list_properties (G_OBJECT_GET_CLASS (from), &n_pspecs);
+  for (i = 0; i < n_pspecs; i++) {
+    GParamSpec * pspec = pspecs[i];
+    GValue value = G_VALUE_INIT;
+
+    if ((pspec->flags & G_PARAM_READWRITE) != G_PARAM_READWRITE ||
+        (pspec->flags & G_PARAM_CONSTRUCT_ONLY) ||
+        pspec->owner_type != G_OBJECT_TYPE (from))
+      continue;
+
+    g_value_init (&value, pspec->value_type);
+    g_object_get_property (G_OBJECT (from), pspec->name, &value);
+    g_object_set_property (G_OBJECT (to), pspec->name, &value);
+    g_value_unset (&value);
   }
+  g_free (pspecs);
+}
 
-  GST_LOG ("Capping flow");
+static GstPadProbeReturn
+drop_lead_in_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  Request * request = data;
 
-  gst_pad_remove_probe (pad, GST_PAD_PROBE_INFO_ID (info));
+  return GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info)) < request->clock_start ?
+    GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
 
-  block_pipeline(app);
+// Smart render: decode the first GOP and re-encode just the frames from
+// clock_start on, so the clip starts on a fresh keyframe exactly where it
+// was asked to.  Every later GOP is copied untouched.
+static gboolean start_head (Request * request)
+{
+  GstElement *bin = gst_pipeline_new ("smart-render"),
+             *src = gst_element_factory_make ("appsrc", "src"),
+             *decoder = gst_element_factory_make ("avdec_h264", "decoder"),
+             *encoder = gst_element_factory_make ("x264enc", "encoder"),
+             *sink = gst_element_factory_make ("appsink", "sink");
+  GstCaps * caps;
+  GstPad * pad;
+  GstBus * bus;
+
+  if (!bin || !src || !decoder || !encoder || !sink) {
+    GST_ERROR ("Failed to create smart render pipeline");
+    if (bin) gst_object_unref (bin);
+    if (src) gst_object_unref (src);
+    if (decoder) gst_object_unref (decoder);
+    if (encoder) gst_object_unref (encoder);
+    if (sink) gst_object_unref (sink);
+    return FALSE;
+  }
 
-  return GST_PAD_PROBE_PASS;
-}
+  caps = replay_ring_get_caps (request->rendition->ring);
+  g_object_set (src,
+      "caps", caps,
+      "format", GST_FORMAT_TIME,
+      "max-bytes", (guint64) 0,
+      NULL);
+  if (caps)
+    gst_caps_unref (caps);
 
+  copy_encoder_settings (request->rendition->encoder, encoder);
 
-static GstPadProbeReturn
-wait_for_start_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
-{
-  App * app = data;
+  caps = gst_caps_new_simple ("video/x-h264",
+      "stream-format", G_TYPE_STRING, "avc",
+      "alignment", G_TYPE_STRING, "au",
+      NULL);
+  g_object_set (sink,
+      "caps", caps,
+      "sync", FALSE,
+      NULL);
+  gst_caps_unref (caps);
 
-  switch (inside_window(info, app)) {
-    case WINDOW_BEFORE:
-      GST_LOG ("Dropping a frame that is too old");
-      return GST_PAD_PROBE_DROP;
+  gst_bin_add_many (GST_BIN (bin), src, decoder, encoder, sink, NULL);
+  gst_element_link_many (src, decoder, encoder, sink, NULL);
 
-    case WINDOW_INSIDE:
-      GST_LOG ("Dropping non-keyframe");
-      return GST_PAD_PROBE_DROP;
+  pad = gst_element_get_static_pad (encoder, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, drop_lead_in_cb, request, NULL);
+  gst_object_unref (pad);
 
-    case WINDOW_INSIDE_KEYFRAME:
-      GST_DEBUG ("Found a key frame that is in range");
-      app->clock_end = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info)) + app->clock_desired_duration;
-      gst_pad_remove_probe (pad, GST_PAD_PROBE_INFO_ID (info));
-      gst_pad_add_probe (app->blockpad, GST_PAD_PROBE_TYPE_BUFFER, wait_for_end_cb, app, NULL);
-      return GST_PAD_PROBE_PASS;
+  bus = gst_pipeline_get_bus (GST_PIPELINE (bin));
+  request->head_watch_id = gst_bus_add_watch (bus, head_bus_call, request);
+  if (request->rendition->camera->pinned)
+    gst_bus_set_sync_handler (bus, pin_thread_cb, request->rendition->camera, NULL);
+  gst_object_unref (bus);
 
-    case WINDOW_AFTER:
-      GST_WARNING ("Didn't find a keyframe in range!");
-      gst_pad_remove_probe (pad, GST_PAD_PROBE_INFO_ID (info));
-      block_pipeline(app);
-      return GST_PAD_PROBE_DROP;
+  request->head = bin;
+  request->head_src = gst_object_ref (src);
+  request->head_first_seq = request->replay_cursor;
+  request->head_fed = FALSE;
 
-    default:
-      return GST_PAD_PROBE_OK;  // should never reach here
-  }
+  gst_element_set_state (bin, GST_STATE_PLAYING);
+
+  return TRUE;
 }
 
+// All of the first GOP has gone in; the rest waits until it's re-encoded.
+static void end_head (Request * request)
+{
+  gst_app_src_end_of_stream (GST_APP_SRC (request->head_src));
+  request->head_fed = TRUE;
+}
 
-static GstPadProbeReturn
-drop_query_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+static void finish_head (Request * request)
 {
-  GstQuery * query = gst_pad_probe_info_get_query (info);
+  GstElement * sink = gst_bin_get_by_name (GST_BIN (request->head), "sink");
+  GError * error = NULL;
+  GstSample * sample;
+  GstCaps * caps;
+  guint frames = 0;
+  gboolean ok = TRUE;
+
+  while (ok && (sample = gst_app_sink_try_pull_sample (GST_APP_SINK (sink), 0))) {
+    GstBuffer * buffer = gst_sample_get_buffer (sample);
+    ReplayUnit unit = {
+      .buffer = buffer,
+      .pts = GST_BUFFER_PTS (buffer),
+      .dts = GST_BUFFER_DTS (buffer),
+      .size = gst_buffer_get_size (buffer),
+      .keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT),
+    };
+
+    // The re-encoded frames have parameter sets of their own
+    if (!frames++)
+      ok = mp4_writer_set_caps (request->writer, gst_sample_get_caps (sample), &error);
+    ok = ok && mp4_writer_add (request->writer, &unit, &error);
+    gst_sample_unref (sample);
+  }
+  gst_object_unref (sink);
+  drop_head (request);
+
+  caps = replay_ring_get_caps (request->rendition->ring);
+  ok = ok && mp4_writer_set_caps (request->writer, caps, &error);
+  if (caps)
+    gst_caps_unref (caps);
+
+  if (!ok) {
+    GST_ERROR ("Error writing %s: %s", request->file_location, error->message);
+    g_error_free (error);
+    fail_replay (500, "error writing clip", request);
+    return;
+  }
 
-  GST_DEBUG ("Received query of type '%s'", GST_QUERY_TYPE_NAME (query));
+  GST_DEBUG ("Re-encoded %u frames of the first GOP after %ldms", frames, request_latency_ms (request));
 
-  if (GST_QUERY_TYPE (query) == GST_QUERY_ALLOCATION) {
-    GST_DEBUG ("Dropping query");
-    return GST_PAD_PROBE_DROP;
+  schedule_pump (request->app);
+}
+
+// Slow motion for the mp4mux output (the native writer does its own): the
+// clip's timestamps, relative to its start, stretched from the rate it was
+// captured at to the one it's played at.
+static void set_stretch (Request * request)
+{
+  GstCaps * caps = replay_ring_get_caps (request->rendition->ring);
+  gint fps_n = 0, fps_d = 0;
+
+  request->stretch_n = request->stretch_d = 1;
+  if (caps && gst_structure_get_fraction (gst_caps_get_structure (caps, 0), "framerate",
+          &fps_n, &fps_d) && fps_n && fps_d) {
+    request->stretch_n = fps_n;
+    request->stretch_d = (guint64) fps_d * request->slow_motion_fps;
   } else {
-    GST_DEBUG ("Passing query");
-    return GST_PAD_PROBE_OK;
+    GST_WARNING ("No frame rate to slow down from; playing at the captured rate");
   }
 
+  if (caps)
+    gst_caps_unref (caps);
+}
+
+static GstClockTime stretch (Request * request, GstClockTime t)
+{
+  if (!request->slow_motion_fps)
+    return t;
+
+  return gst_util_uint64_scale (t, request->stretch_n, request->stretch_d);
 }
 
-static void unblock_pipeline(App *app)
+// Plain clips are written by the built-in muxer, straight from the ring:
+// no elements, no state changes.
+static gboolean start_native_replay (Request * request)
 {
-  // Need to prevent the source from sending an allocation query
-  // because it will hang the upstream pipeline.
-  // This gets added once (must happen after the initial caps
-  // negotiation) and left in place forever.
-  if (!app->srcpad_probe_id) {
-    GST_DEBUG ("Adding srcpad_probe");
-    app->srcpad_probe_id =  gst_pad_add_probe (app->srcpad,
-        GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM, drop_query_cb, app, NULL);
+  GError * error = NULL;
+  GstCaps * caps;
+
+  if (request->clip_fd < 0) {
+    if (!mkpath (request->file_location, 0766))
+      GST_ERROR ("mkpath of '%s' failed", request->file_location);
+
+    request->clip_fd = g_open (request->file_location, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (request->clip_fd < 0) {
+      GST_ERROR ("Couldn't create %s: %s", request->file_location, g_strerror (errno));
+      fail_replay (500, "couldn't create clip", request);
+      return FALSE;
+    }
   }
 
-  app->bin = create_bin (app);
-  gst_bin_add (GST_BIN(app->pipeline), app->bin);
-  gst_element_link (app->queue2, app->bin);
-  gst_element_set_state (app->bin, GST_STATE_PLAYING);
+  caps = replay_ring_get_caps (request->rendition->ring);
+  request->writer = mp4_writer_new (request->clip_fd, caps, &error);
+  if (caps)
+    gst_caps_unref (caps);
+
+  if (!request->writer) {
+    GST_ERROR ("Couldn't start writing %s: %s", request->file_location, error->message);
+    g_error_free (error);
+    fail_replay (500, "couldn't create clip", request);
+    return FALSE;
+  }
 
-  gst_pad_add_probe (app->blockpad,
-      GST_PAD_PROBE_TYPE_BUFFER,
-      wait_for_start_cb, app, NULL);
+  if (request->exact_start)
+    mp4_writer_set_start (request->writer, request->clock_start);
+  if (request->slow_motion_fps)
+    mp4_writer_set_playback_rate (request->writer, request->slow_motion_fps, 1);
 
-  if (app->blockpad_probe_id) {
-    GST_DEBUG ("Unblocking pipeline");
-    gst_pad_remove_probe (app->blockpad, app->blockpad_probe_id);
-    app->blockpad_probe_id = 0;
+  if (request->smart_render && !start_head (request)) {
+    fail_replay (500, "couldn't create smart render pipeline", request);
+    return FALSE;
   }
-}
 
-static GstClockTime get_current_time()
-{
-  GTimeVal current_time;
+  request->replay_started = TRUE;
 
-  g_get_current_time (&current_time);
-  return GST_TIMEVAL_TO_TIME (current_time);
+  return TRUE;
 }
 
-static GstPadProbeReturn
-source_set_timestamps (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+static void finish_native_replay (Request * request)
 {
-  GstClockTime now = get_current_time();
-  GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info)) = now;
-  GST_BUFFER_DTS(GST_PAD_PROBE_INFO_BUFFER(info)) = now;
+  GError * error = NULL;
+  gboolean ok = mp4_writer_finish (request->writer, &error);
 
-  return GST_PAD_PROBE_OK;
+  GST_DEBUG ("Wrote %u samples (%lums) to %s", mp4_writer_get_n_samples (request->writer),
+      GST_TIME_AS_MSECONDS (mp4_writer_get_duration (request->writer)), request->file_location);
+
+  mp4_writer_free (request->writer);
+  request->writer = NULL;
+  request->replay_active = FALSE;
+  g_atomic_int_add (&request->app->active_replays, -1);
+
+  if (!ok) {
+    GST_ERROR ("Error writing %s: %s", request->file_location, error->message);
+    g_error_free (error);
+    fail_replay (500, "error writing clip", request);
+    return;
+  }
+
+  deliver_clip (request);
 }
 
-gboolean io_callback(GIOChannel *source, GIOCondition condition, gpointer data)
+// Look up the first keyframe at or after clock_start in the ring's keyframe
+// index (or, for exact starts, the one clock_start's GOP begins with) and set
+// up the output.  Returns FALSE if the replay can't start (yet); if it never
+// will, the request has been failed and freed.
+static gboolean start_replay (Request * request)
 {
-  GError *error = NULL;
-  GString *buffer = g_string_new(NULL);
-  App * app = data;
+  ReplayRing * ring = request->rendition->ring;
+  ReplayUnit unit;
+  guint64 seq;
+  GstBus * bus;
 
-  switch (g_io_channel_read_line_string(source, buffer, NULL, &error)) {
-    case G_IO_STATUS_NORMAL:
-      g_strstrip(buffer->str);
-      if (!strcmp (buffer->str, ""))
-        break;
-      GST_DEBUG("received command %s", buffer->str);
-      if (!strcmp("shutdown", buffer->str)) {
-        g_main_loop_quit (app->loop);
-        hangup (app);
-        return FALSE;
-
-      } else if (!strcmp("query", buffer->str)) {
-        gsize bytes_written;
-        char buff[1024];
-
-        g_io_channel_write_chars (source, get_buffer_status (buff, app), -1, &bytes_written, &error);
-        g_io_channel_flush (source, &error);
-        hangup (app);
-        return FALSE;
-
-      } else if (g_str_has_prefix(buffer->str, "replay ")) {
-        glong start = 0;
-        glong duration = 0;
-        gchar * next = &buffer->str[7];
-        gchar * filepath;
-        gboolean valid = TRUE;
-
-        // Parse out params: start duration filepath
-        start = strtol(next, &next, 10);
-        if (!start && errno == EINVAL)
-          valid = FALSE;
-        duration = strtol(next, &next, 10);
-        if (duration <= 0)
-          valid = FALSE;
-        filepath = g_strstrip(next);
-        if (filepath[0] != '/')
-          valid = FALSE;
-
-        if (!valid) {
-          GST_WARNING ("command parameters invalid");
-          send_error_to_socket (400, "couldn't parse request", app);
-          hangup (app);
-          return FALSE;
-        }
+  if (request->exact_start) {
+    GstClockTime last_pts = replay_ring_get_last_pts (ring);
 
-        // Convert incoming times from msec to nsec
-        start = start * GST_MSECOND;
-        duration = duration * GST_MSECOND;
+    // Wait for the ring to reach clock_start so we know which GOP it's in
+    if (!GST_CLOCK_TIME_IS_VALID (last_pts) || last_pts < request->clock_start)
+      return FALSE;
 
-        // Start may be provided relative to current clock; convert to absolute
-        if (start < 0)
-          start += get_current_time();
+    // Older than anything we have left: start at the oldest keyframe instead
+    if (!replay_ring_find_keyframe_before (ring, request->clock_start, &seq))
+      request->exact_start = FALSE;
+  }
 
-        GST_INFO ("%20lu: get_current_time()",  GST_TIME_AS_MSECONDS(get_current_time()));
-        GST_INFO ("%20ld: start", GST_TIME_AS_MSECONDS(start));
+  if (!request->exact_start)
+    request->smart_render = FALSE;
 
-        app->clock_start = start;
-        app->clock_desired_duration = duration;
-        app->clock_end = start + duration;
-        strcpy(app->file_location, filepath);
+  if (!request->exact_start && !replay_ring_find_keyframe (ring, request->clock_start, &seq)) {
+    GstClockTime last_pts = replay_ring_get_last_pts (ring);
 
-        // May not request clips from the future, or clips longer than one minute
-        if (app->clock_start > get_current_time() || duration > 60 * GST_SECOND) {
-          GST_WARNING ("command parameters invalid");
-          send_error_to_socket (416, "invalid time range requested", app);
-          hangup (app);
-          return FALSE;
-        }
+    if (GST_CLOCK_TIME_IS_VALID (last_pts) && last_pts >= request->clock_end) {
+      GST_WARNING ("Didn't find a keyframe in range!");
+      fail_replay (416, "no keyframe in requested range", request);
+    }
+    return FALSE;
+  }
 
-        unblock_pipeline(app);
-      } else {
-        GST_INFO ("Unrecognized command");
+  if (replay_ring_get (ring, seq, &unit) != REPLAY_RING_OK)
+    return FALSE;
+
+  if (inside_window (&unit, request) == WINDOW_AFTER) {
+    GST_WARNING ("Didn't find a keyframe in range!");
+    replay_ring_unit_clear (&unit);
+    fail_replay (416, "no keyframe in requested range", request);
+    return FALSE;
+  }
+
+  if (request->exact_start) {
+    // The clip still ends at clock_start + duration; the lead-in is cut by
+    // the edit list (only the native writer has one; mp4mux shows it)
+    GST_DEBUG ("Starting %lums early at the preceding key frame",
+        GST_TIME_AS_MSECONDS (request->clock_start - unit.pts));
+    // Nothing to re-encode if clock_start is a keyframe
+    request->smart_render = request->smart_render && unit.pts < request->clock_start;
+  } else {
+    GST_DEBUG ("Found a key frame that is in range");
+    request->clock_end = unit.pts + request->clock_desired_duration;
+  }
+  request->replay_base = GST_CLOCK_TIME_IS_VALID (unit.dts) ? MIN (unit.pts, unit.dts) : unit.pts;
+  request->replay_cursor = seq;
+  replay_ring_unit_clear (&unit);
+
+  if (!request->fragmented && !request->gst_mux)
+    return start_native_replay (request);
+
+  if (request->slow_motion_fps)
+    set_stretch (request);
+
+  request->bin = create_bin (request);
+  if (!request->bin) {
+    fail_replay (500, "couldn't create output pipeline", request);
+    return FALSE;
+  }
+
+  request->appsrc = gst_bin_get_by_name (GST_BIN (request->bin), "src");
+
+  if (request->fragmented) {
+    GstElement * sink = gst_bin_get_by_name (GST_BIN (request->bin), "sink");
+    GstPad * sinkpad = gst_element_get_static_pad (sink, "sink");
+
+    gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER, first_bytes_cb, request, NULL);
+    gst_object_unref (sinkpad);
+    gst_object_unref (sink);
+
+    send_stream_header_to_socket (request);
+  }
+
+  bus = gst_pipeline_get_bus (GST_PIPELINE (request->bin));
+  request->bin_watch_id = gst_bus_add_watch (bus, replay_bus_call, request);
+  if (request->rendition->camera->pinned)
+    gst_bus_set_sync_handler (bus, pin_thread_cb, request->rendition->camera, NULL);
+  gst_object_unref (bus);
+
+  gst_element_set_state (request->bin, GST_STATE_PLAYING);
+  request->replay_started = TRUE;
+
+  return TRUE;
+}
+
+static void push_unit (Request * request, ReplayUnit * unit)
+{
+  // A shallow copy: new metadata, but the encoded data stays shared with the ring
+  GstBuffer * buffer = gst_buffer_copy (unit->buffer);
+
+  GST_BUFFER_PTS (buffer) = stretch (request, unit->pts - request->replay_base);
+  GST_BUFFER_DTS (buffer) = GST_CLOCK_TIME_IS_VALID (unit->dts) ?
+    stretch (request, unit->dts - request->replay_base) : GST_CLOCK_TIME_NONE;
+  if (GST_BUFFER_DURATION_IS_VALID (buffer))
+    GST_BUFFER_DURATION (buffer) = stretch (request, GST_BUFFER_DURATION (buffer));
+
+  gst_app_src_push_buffer (GST_APP_SRC (request->appsrc), buffer);
+}
+
+// Mux output: how old is each frame by the time a replay takes it?
+static void record_mux_latency (Request * request, ReplayUnit * unit)
+{
+  App * app = request->app;
+  GstClockTime now = get_stream_time (app);
+
+  g_mutex_lock (&app->metrics_lock);
+  histogram_observe (&app->mux_latency, age_ms (unit->pts, now));
+  g_mutex_unlock (&app->metrics_lock);
+}
+
+static gboolean write_unit (Request * request, ReplayUnit * unit)
+{
+  GError * error = NULL;
+
+  record_mux_latency (request, unit);
+  request->app->export_bytes += gst_buffer_get_size (unit->buffer);
+
+  if (!request->writer) {
+    push_unit (request, unit);
+    return TRUE;
+  }
+
+  if (request->head) {
+    gst_app_src_push_buffer (GST_APP_SRC (request->head_src), gst_buffer_ref (unit->buffer));
+    return TRUE;
+  }
+
+  if (!mp4_writer_add (request->writer, unit, &error)) {
+    GST_ERROR ("Error writing %s: %s", request->file_location, error->message);
+    g_error_free (error);
+    fail_replay (500, "error writing clip", request);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Note that this may deliver (and free) the request.
+static void end_replay (Request * request)
+{
+  if (request->writer) {
+    finish_native_replay (request);
+    return;
+  }
+
+  gst_app_src_end_of_stream (GST_APP_SRC (request->appsrc));
+  request->replay_active = FALSE;
+}
+
+// Jobs hear how far along they are, once a GOP.
+static void send_progress (Request * request, ReplayUnit * unit)
+{
+  GstClockTime span = request->clock_end - request->clock_start;
+  GstClockTime done = unit->pts > request->clock_start ? unit->pts - request->clock_start : 0;
+  gchar extra[128];
+
+  g_snprintf (extra, sizeof(extra), ", \"camera\": %u, \"ms\": %lu, \"percent\": %u",
+      request->camera->index, GST_TIME_AS_MSECONDS (done),
+      span ? (guint) MIN (done * 100 / span, 100) : 100);
+  send_job_event (request, "progress", extra);
+}
+
+// Lowest cursor of the clips still in a batch.
+static guint64 get_batch_cursor (Request * batch)
+{
+  guint64 cursor = G_MAXUINT64;
+  guint i;
+
+  for (i = 0; i < batch->batch->len; i++)
+    cursor = MIN (cursor, ((Request *) g_ptr_array_index (batch->batch, i))->replay_cursor);
+
+  return cursor;
+}
+
+// Feed every clip of a batch from one sweep over the ring: each unit is read
+// (from memory or spill) once and handed to every clip whose window holds it.
+// Clips remove themselves from the batch as they finish or fail, so loops
+// only step past a clip that is still there.
+static void pump_batch (Request * batch)
+{
+  ReplayRing * ring = batch->rendition->ring;
+  GPtrArray * clips = batch->batch;
+  ReplayUnit unit;
+  gboolean ready = TRUE;
+  guint i;
+
+  // The last clip out would otherwise take the batch with it, mid-loop
+  batch->children++;
+
+  // Every clip finds its first keyframe before the sweep starts at the earliest
+  if (!batch->replay_started) {
+    for (i = 0; i < clips->len; ) {
+      Request * clip = g_ptr_array_index (clips, i);
+
+      if (!clip->replay_active) {
+        clip->replay_active = TRUE;
+        g_atomic_int_inc (&batch->app->active_replays);
+      }
+      if (!clip->replay_started && !start_replay (clip))
+        ready = FALSE;
+      if (i < clips->len && g_ptr_array_index (clips, i) == clip)
+        i++;
+    }
+
+    if (!ready || !clips->len)
+      goto out;
+
+    batch->replay_started = TRUE;
+    batch->replay_cursor = get_batch_cursor (batch);
+  }
+
+  while (clips->len) {
+    switch (replay_ring_get (ring, batch->replay_cursor, &unit)) {
+      case REPLAY_RING_PENDING:
+        goto out;
+
+      case REPLAY_RING_EVICTED:
+        // Clips under way lose the rest; ones yet to begin may still make it
+        GST_WARNING ("Batch fell behind the ring; ending clips early");
+        for (i = 0; i < clips->len; ) {
+          Request * clip = g_ptr_array_index (clips, i);
+
+          if (clip->replay_cursor <= batch->replay_cursor)
+            end_replay (clip);
+          if (i < clips->len && g_ptr_array_index (clips, i) == clip)
+            i++;
+        }
+        if (clips->len)
+          batch->replay_cursor = get_batch_cursor (batch);
+        continue;
+
+      case REPLAY_RING_OK:
+        break;
+    }
+
+    for (i = 0; i < clips->len; ) {
+      Request * clip = g_ptr_array_index (clips, i);
+
+      // Clips whose window hasn't begun yet sit ahead of the sweep
+      if (clip->replay_cursor == batch->replay_cursor) {
+        if (inside_window (&unit, clip) == WINDOW_AFTER)
+          end_replay (clip);
+        else if (write_unit (clip, &unit))
+          clip->replay_cursor++;
+      }
+      if (i < clips->len && g_ptr_array_index (clips, i) == clip)
+        i++;
+    }
+
+    if (batch->job_id[0] && unit.keyframe) {
+      gchar extra[64];
+
+      g_snprintf (extra, sizeof(extra), ", \"clips-left\": %u", clips->len);
+      send_job_event (batch, "progress", extra);
+    }
+
+    replay_ring_unit_clear (&unit);
+    batch->replay_cursor++;
+  }
+
+out:
+  if (!--batch->children)
+    hangup (batch);
+}
+
+// Feed a replay everything the ring has between its cursor and clock_end.
+static void pump_request (Request * request)
+{
+  ReplayRing * ring = request->rendition->ring;
+  ReplayUnit unit;
+
+  if (request->batch) {
+    pump_batch (request);
+    return;
+  }
+
+  if (!request->replay_active || (!request->replay_started && !start_replay (request)))
+    return;
+
+  for (;;) {
+    // The rest of the clip waits for the re-encoded first GOP
+    if (request->head_fed)
+      return;
+
+    switch (replay_ring_get (ring, request->replay_cursor, &unit)) {
+      case REPLAY_RING_PENDING:
+        return;
+
+      case REPLAY_RING_EVICTED:
+        if (request->head) {
+          fail_replay (500, "clip start was evicted", request);
+          return;
+        }
+        GST_WARNING ("Replay fell behind the ring; ending clip early");
+        end_replay (request);
+        return;
+
+      case REPLAY_RING_OK:
+        break;
+    }
+
+    if (inside_window (&unit, request) == WINDOW_AFTER) {
+      GST_LOG ("Capping flow");
+      replay_ring_unit_clear (&unit);
+      if (request->head)
+        end_head (request);
+      else
+        end_replay (request);
+      return;
+    }
+
+    if (request->head && unit.keyframe && request->replay_cursor != request->head_first_seq) {
+      replay_ring_unit_clear (&unit);
+      end_head (request);
+      return;
+    }
+
+    GST_LOG ("Passing along a frame that is in window");
+    if (!write_unit (request, &unit)) {
+      replay_ring_unit_clear (&unit);
+      return;
+    }
+    if (request->job_id[0] && unit.keyframe)
+      send_progress (request, &unit);
+    replay_ring_unit_clear (&unit);
+    request->replay_cursor++;
+  }
+}
+
+static const gchar * mark_state_names[] = { "pinning", "pinned", "expired", "materialized" };
+
+static Mark * mark_new (App * app, const gchar * name, Rendition * rendition,
+    GstClockTime at, GstClockTime start, GstClockTime end)
+{
+  Mark * mark = g_new0 (Mark, 1);
+
+  mark->app = app;
+  g_strlcpy (mark->name, name, sizeof(mark->name));
+  mark->rendition = rendition;
+  mark->clock_at = at;
+  mark->clock_start = start;
+  mark->clock_end = end;
+  mark->state = MARK_PINNING;
+  mark->units = g_array_new (FALSE, FALSE, sizeof(ReplayUnit));
+  return mark;
+}
+
+// Let go of the footage; the ring may already have moved on without it.
+static void unpin_mark (Mark * mark)
+{
+  guint i;
+
+  for (i = 0; i < mark->units->len; i++)
+    replay_ring_unit_clear (&g_array_index (mark->units, ReplayUnit, i));
+  g_array_set_size (mark->units, 0);
+  mark->app->pinned_bytes -= mark->bytes;
+  mark->bytes = 0;
+}
+
+static void mark_free (Mark * mark)
+{
+  unpin_mark (mark);
+  g_array_free (mark->units, TRUE);
+  if (mark->caps)
+    gst_caps_unref (mark->caps);
+  g_free (mark->location);
+  g_free (mark->destination);
+  g_free (mark);
+}
+
+// Take a reference to each unit of the mark's window the ring has so far,
+// starting at the keyframe its pre-roll begins in.
+static void pump_mark (Mark * mark)
+{
+  ReplayRing * ring = mark->rendition->ring;
+  ReplayUnit unit;
+
+  if (!mark->started) {
+    // Pre-roll older than the ring still gets whatever is left of it
+    if (!replay_ring_find_keyframe_before (ring, mark->clock_start, &mark->cursor) &&
+        !replay_ring_find_keyframe (ring, mark->clock_start, &mark->cursor))
+      return;
+    mark->caps = replay_ring_get_caps (ring);
+    mark->started = TRUE;
+  }
+
+  for (;;) {
+    switch (replay_ring_get (ring, mark->cursor, &unit)) {
+      case REPLAY_RING_PENDING:
+        return;
+
+      case REPLAY_RING_EVICTED:
+        GST_WARNING ("Mark %s lost its footage before it was pinned", mark->name);
+        unpin_mark (mark);
+        mark->state = MARK_EXPIRED;
+        return;
+
+      case REPLAY_RING_OK:
+        break;
+    }
+
+    if (unit.pts >= mark->clock_end) {
+      replay_ring_unit_clear (&unit);
+      mark->state = mark->units->len ? MARK_PINNED : MARK_EXPIRED;
+      GST_DEBUG ("Mark %s %s with %u units, %" G_GUINT64_FORMAT " bytes", mark->name,
+          mark_state_names[mark->state], mark->units->len, mark->bytes);
+      return;
+    }
+
+    // Marks are held to --max-pinned as they pin, not just when made
+    if (mark->app->pinned_bytes + unit.size > mark->app->max_pinned_bytes) {
+      GST_WARNING ("Mark %s ran out of room to pin its footage", mark->name);
+      replay_ring_unit_clear (&unit);
+      unpin_mark (mark);
+      mark->state = MARK_EXPIRED;
+      return;
+    }
+
+    // A spilled unit would keep its whole segment (mapping and file) alive
+    // past recycling, so pin a copy of its own instead
+    if (unit.spilled) {
+      GstBuffer * copy = gst_buffer_copy_deep (unit.buffer);
+
+      gst_buffer_unref (unit.buffer);
+      unit.buffer = copy;
+    }
+
+    // The array takes over our reference
+    g_array_append_val (mark->units, unit);
+    mark->bytes += unit.size;
+    mark->app->pinned_bytes += unit.size;
+    mark->cursor++;
+  }
+}
+
+static void pump_marks (App * app)
+{
+  GList * l, * next;
+
+  for (l = app->pinning; l; l = next) {
+    Mark * mark = l->data;
+
+    next = l->next;
+    pump_mark (mark);
+    if (mark->state != MARK_PINNING)
+      app->pinning = g_list_delete_link (app->pinning, l);
+  }
+}
+
+// Called from the main loop whenever new units land in the ring (or a new
+// replay is accepted).
+static void schedule_jobs (App * app);
+
+static gboolean pump_replays (gpointer data)
+{
+  App * app = data;
+  GList * l, * next;
+
+  g_atomic_int_set (&app->pump_scheduled, FALSE);
+
+  // Admit queued jobs first, so they get a go this pass
+  schedule_jobs (app);
+
+  for (l = app->requests; l; l = next) {
+    next = l->next;
+    pump_request (l->data);
+  }
+
+  pump_marks (app);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void schedule_pump (App * app)
+{
+  if (g_atomic_int_compare_and_exchange (&app->pump_scheduled, FALSE, TRUE))
+    g_idle_add (pump_replays, app);
+}
+
+static GstFlowReturn
+ring_new_sample_cb (GstAppSink * sink, gpointer data)
+{
+  Rendition * rendition = data;
+  App * app = rendition->camera->app;
+  GstSample * sample = gst_app_sink_pull_sample (sink);
+  GstCaps * caps, * ring_caps;
+  GstBuffer * buffer;
+  GstClockTime now;
+
+  if (!sample)
+    return GST_FLOW_EOS;
+
+  caps = gst_sample_get_caps (sample);
+  ring_caps = replay_ring_get_caps (rendition->ring);
+  if (caps && (!ring_caps || !gst_caps_is_equal (caps, ring_caps))) {
+    // Only a restart's recovered footage can be under the ring's old caps
+    if (ring_caps)
+      GST_WARNING ("Rendition %s is encoded differently from the footage recovered for it; "
+          "replays reaching back before the restart may not decode", rendition->name);
+    replay_ring_set_caps (rendition->ring, caps);
+    if (rendition->journal)
+      journal_set_caps (rendition->journal, caps);
+  }
+  if (ring_caps)
+    gst_caps_unref (ring_caps);
+
+  buffer = gst_sample_get_buffer (sample);
+  now = get_stream_time (app);
+  g_mutex_lock (&app->metrics_lock);
+  histogram_observe (&rendition->ring_latency, age_ms (GST_BUFFER_PTS (buffer), now));
+  g_mutex_unlock (&app->metrics_lock);
+
+  replay_ring_push (rendition->ring, gst_buffer_ref (buffer));
+  if (rendition->hls)
+    hls_publisher_push (rendition->hls, replay_ring_get_end (rendition->ring) - 1, buffer);
+  if (rendition->journal)
+    journal_push (rendition->journal, buffer, get_wall_offset (app));
+  gst_sample_unref (sample);
+
+  schedule_pump (app);
+
+  return GST_FLOW_OK;
+}
+
+static GstPadProbeReturn
+source_set_timestamps (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  Camera * camera = data;
+  App * app = camera->app;
+  GstBuffer * buffer;
+  GstClockTime now;
+
+  // Only the metadata changes: a buffer somebody else holds gets a new
+  // header over the same memory, never a copy of the frame
+  buffer = GST_PAD_PROBE_INFO_DATA (info) =
+    gst_buffer_make_writable (GST_PAD_PROBE_INFO_BUFFER (info));
+
+  // Live sources stamp running time on the shared system clock, so base time
+  // plus PTS is the capture time on the stream clock, without asking for it.
+  // A simulated source runs flat out; its own timestamps become the virtual clock.
+  if (!GST_BUFFER_PTS_IS_VALID (buffer))
+    now = get_stream_time (app);
+  else if (app->simulate)
+    now = app->simulation_epoch + GST_BUFFER_PTS (buffer);
+  else
+    now = gst_element_get_base_time (camera->pipeline) + GST_BUFFER_PTS (buffer);
+
+  GST_BUFFER_PTS(buffer) = now;
+  GST_BUFFER_DTS(buffer) = now;
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Capture: count frames, and the ones missing from gaps between them.
+static GstPadProbeReturn
+capture_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  Camera * camera = data;
+  GstBuffer * buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime pts = GST_BUFFER_PTS (buffer), duration = GST_BUFFER_DURATION (buffer);
+
+  // Whatever reaches the tee in other memory got converted or copied on the way
+  camera->source_memory = gst_buffer_n_memory (buffer) ? gst_buffer_peek_memory (buffer, 0) : NULL;
+
+  g_mutex_lock (&camera->app->metrics_lock);
+  camera->frames_captured++;
+  if (GST_CLOCK_TIME_IS_VALID (camera->last_capture) && GST_CLOCK_TIME_IS_VALID (duration) &&
+      duration > 0 && pts > camera->last_capture + duration * 3 / 2)
+    camera->frames_dropped += (pts - camera->last_capture + duration / 2) / duration - 1;
+  camera->last_capture = pts;
+  g_mutex_unlock (&camera->app->metrics_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Post-convert: the raw frame as the tee hands it to every rendition.  The
+// source pushes it here on the same thread, so it's still the one the
+// capture probe saw.
+static GstPadProbeReturn
+convert_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  Camera * camera = data;
+  GstBuffer * buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime now = get_stream_time (camera->app);
+  gboolean copied = !gst_buffer_n_memory (buffer) ||
+    gst_buffer_peek_memory (buffer, 0) != camera->source_memory;
+
+  g_mutex_lock (&camera->app->metrics_lock);
+  histogram_observe (&camera->convert_latency, age_ms (GST_BUFFER_PTS (buffer), now));
+  if (copied)
+    camera->raw_bytes_copied += gst_buffer_get_size (buffer);
+  g_mutex_unlock (&camera->app->metrics_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Answer the capture side's allocation query (on its way back) with a pool
+// of frames big enough for every encoder queue to fill, unless something
+// downstream offered one.  The tee doesn't pass pools up from its branches,
+// so without this the source (or converter) sizes its own for nobody and
+// mallocs whatever else it needs a frame at a time.
+static GstPadProbeReturn
+allocation_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  Camera * camera = data;
+  GstQuery * query = GST_PAD_PROBE_INFO_QUERY (info);
+  GstVideoInfo video_info;
+  GstStructure * config;
+  GstCaps * caps;
+  guint min;
+
+  if (GST_QUERY_TYPE (query) != GST_QUERY_ALLOCATION)
+    return GST_PAD_PROBE_OK;
+
+  gst_query_parse_allocation (query, &caps, NULL);
+  if (!caps || !gst_video_info_from_caps (&video_info, caps) ||
+      gst_query_get_n_allocation_pools (query) > 0)
+    return GST_PAD_PROBE_OK;
+
+  min = (GST_VIDEO_INFO_FPS_D (&video_info) ? gst_util_uint64_scale_ceil (ENCODER_QUEUE_MS,
+          GST_VIDEO_INFO_FPS_N (&video_info), GST_VIDEO_INFO_FPS_D (&video_info) * 1000) : 0) +
+    FRAME_POOL_SLACK;
+
+  // A pool can't be reconfigured while in use, so new caps get a new one
+  if (camera->frame_pool)
+    gst_object_unref (camera->frame_pool);
+  camera->frame_pool = gst_video_buffer_pool_new ();
+  config = gst_buffer_pool_get_config (camera->frame_pool);
+  gst_buffer_pool_config_set_params (config, caps, GST_VIDEO_INFO_SIZE (&video_info), min, 0);
+  gst_buffer_pool_config_add_option (config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+  gst_buffer_pool_set_config (camera->frame_pool, config);
+
+  // No maximum: running out must never hold up capture
+  gst_query_add_allocation_pool (query, camera->frame_pool,
+      GST_VIDEO_INFO_SIZE (&video_info), min, 0);
+  gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+  GST_DEBUG ("Camera %u: offering a pool of %u+ frames of %zu bytes", camera->index, min,
+      GST_VIDEO_INFO_SIZE (&video_info));
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Post-convert too: score each frame's activity before any rendition sees it.
+static GstPadProbeReturn
+activity_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  Camera * camera = data;
+  GstBuffer * buffer;
+  GstVideoFrame frame;
+  GstClockTime begin;
+  gfloat score;
+
+  if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    GstEvent * event = GST_PAD_PROBE_INFO_EVENT (info);
+    GstCaps * caps;
+
+    if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+      gst_event_parse_caps (event, &caps);
+      camera->have_video_info = gst_video_info_from_caps (&camera->video_info, caps) &&
+          GST_VIDEO_INFO_IS_YUV (&camera->video_info);
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  if (!camera->have_video_info ||
+      !gst_video_frame_map (&frame, &camera->video_info, buffer, GST_MAP_READ))
+    return GST_PAD_PROBE_OK;
+
+  begin = gst_clock_get_time (camera->app->clock);
+  score = activity_meter_measure (camera->activity_meter, GST_VIDEO_FRAME_PLANE_DATA (&frame, 0),
+      GST_VIDEO_FRAME_COMP_WIDTH (&frame, 0), GST_VIDEO_FRAME_COMP_HEIGHT (&frame, 0),
+      GST_VIDEO_FRAME_PLANE_STRIDE (&frame, 0));
+  gst_video_frame_unmap (&frame);
+  activity_index_push (camera->activity, GST_BUFFER_PTS (buffer), score);
+
+  g_mutex_lock (&camera->app->metrics_lock);
+  camera->activity_score = score;
+  camera->activity_frames++;
+  camera->activity_time += gst_clock_get_time (camera->app->clock) - begin;
+  g_mutex_unlock (&camera->app->metrics_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Post-encode: latency through queue and x264, and the rate it keeps up.
+static GstPadProbeReturn
+encoded_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  Rendition * rendition = data;
+  GstBuffer * buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime now = get_stream_time (rendition->camera->app);
+
+  g_mutex_lock (&rendition->camera->app->metrics_lock);
+  rendition->frames_encoded++;
+  rendition->bytes_encoded += gst_buffer_get_size (buffer);
+  histogram_observe (&rendition->encode_latency, age_ms (GST_BUFFER_PTS (buffer), now));
+
+  rendition->fps_frames++;
+  if (!GST_CLOCK_TIME_IS_VALID (rendition->fps_window_start) || now < rendition->fps_window_start) {
+    rendition->fps_window_start = now;
+    rendition->fps_frames = 0;
+  } else if (now - rendition->fps_window_start >= GST_SECOND) {
+    rendition->fps = (gdouble) rendition->fps_frames * GST_SECOND / (now - rendition->fps_window_start);
+    rendition->fps_window_start = now;
+    rendition->fps_frames = 0;
+  }
+  g_mutex_unlock (&rendition->camera->app->metrics_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+// A camera index, ending the string or an item in a comma-separated list.
+static gboolean parse_camera_index (const gchar * str, App * app, guint * index)
+{
+  gchar * end;
+  guint64 value;
+
+  if (!g_ascii_isdigit (*str))
+    return FALSE;
+
+  value = g_ascii_strtoull (str, &end, 10);
+  if ((*end != '\0' && *end != ',') || value >= app->cameras->len)
+    return FALSE;
+
+  *index = value;
+  return TRUE;
+}
+
+// A comma-separated list of camera indexes, or "all".
+static gboolean parse_camera_set (const gchar * str, Request * request)
+{
+  App * app = request->app;
+  guint index;
+
+  if (!strcmp (str, "all")) {
+    request->camera_set = app->cameras->len == MAX_CAMERAS ?
+      G_MAXUINT64 : (G_GUINT64_CONSTANT (1) << app->cameras->len) - 1;
+    return TRUE;
+  }
+
+  request->camera_set = 0;
+  for (;;) {
+    if (!parse_camera_index (str, app, &index))
+      return FALSE;
+    request->camera_set |= G_GUINT64_CONSTANT (1) << index;
+    if (!(str = strchr (str, ',')))
+      return TRUE;
+    str++;
+  }
+}
+
+// Every camera has the same renditions, so they're looked up by index.
+static gboolean parse_rendition (const gchar * name, Request * request)
+{
+  GPtrArray * renditions = request->camera->renditions;
+  guint i;
+
+  for (i = 0; i < renditions->len; i++) {
+    if (!strcmp (((Rendition *) g_ptr_array_index (renditions, i))->name, name)) {
+      request->rendition_index = i;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static gboolean parse_replay_option (gchar * option, Request * request)
+{
+  guint index;
+
+  if (g_str_has_prefix (option, "--camera=")) {
+    if (!parse_camera_index (option + 9, request->app, &index))
+      return FALSE;
+    request->camera = g_ptr_array_index (request->app->cameras, index);
+  } else if (g_str_has_prefix (option, "--cameras=")) {
+    return parse_camera_set (option + 10, request);
+  } else if (g_str_has_prefix (option, "--rendition=")) {
+    return parse_rendition (option + 12, request);
+  } else if (!strcmp (option, "--inline")) {
+    request->inline_delivery = TRUE;
+  } else if (!strcmp (option, "--exact-start")) {
+    request->exact_start = TRUE;
+  } else if (!strcmp (option, "--smart-render")) {
+    request->exact_start = TRUE;
+    request->smart_render = TRUE;
+  } else if (!strcmp (option, "--gst-mux")) {
+    request->gst_mux = TRUE;
+  } else if (g_str_has_prefix (option, "--slow-motion=")) {
+    // The frame rate to play the clip at, e.g. 30 for footage taken at 120
+    gchar * end;
+    glong fps = strtol (option + 14, &end, 10);
+
+    if (*end || fps <= 0 || fps > CAPTURE_MAX_FPS)
+      return FALSE;
+    request->slow_motion_fps = fps;
+  } else if (!strcmp (option, "--fragmented")) {
+    request->inline_delivery = TRUE;
+    request->fragmented = TRUE;
+  } else {
+    GST_WARNING ("unknown replay option '%s'", option);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static guint count_cameras (guint64 camera_set)
+{
+  guint count = 0;
+
+  for (; camera_set; camera_set &= camera_set - 1)
+    count++;
+
+  return count;
+}
+
+// /clips/goal.mp4 becomes /clips/goal-cam2.mp4 for camera 2.
+static void camera_file_location (const gchar * location, guint index, gchar * dest, gsize size)
+{
+  const gchar * base = strrchr (location, '/');
+  const gchar * ext = strrchr (base ? base : location, '.');
+  gint stem = ext ? ext - location : (gint) strlen (location);
+
+  g_snprintf (dest, size, "%.*s-cam%u%s", stem, location, index, ext ? ext : "");
+}
+
+// Fan a multi-camera replay out into one child request per camera, all over
+// the same window.  The parent just keeps the connection; it leaves the pump
+// list so that its last child freeing it can't upset pump_replays ().
+static void start_camera_set (Request * request)
+{
+  App * app = request->app;
+  guint i;
+
+  app->requests = g_list_remove (app->requests, request);
+
+  for (i = 0; i < app->cameras->len; i++) {
+    Request * child;
+
+    if (!(request->camera_set & (G_GUINT64_CONSTANT (1) << i)))
+      continue;
+
+    child = g_new (Request, 1);
+    *child = *request;
+    child->id = app->next_request_id++;
+    child->camera = g_ptr_array_index (app->cameras, i);
+    child->rendition = g_ptr_array_index (child->camera->renditions, request->rendition_index);
+    child->parent = request;
+    child->children = 0;
+    child->connection = NULL;
+    child->socket_watcher_id = 0;
+    child->camera_set = 0;
+    camera_file_location (request->file_location, i,
+        child->file_location, sizeof(child->file_location));
+
+    GST_DEBUG ("Request %u: camera %u to %s", request->id, i, child->file_location);
+
+    g_atomic_int_inc (&app->active_replays);
+    child->replay_active = TRUE;
+    child->replay_started = FALSE;
+    app->requests = g_list_append (app->requests, child);
+    request->children++;
+  }
+
+  schedule_pump (app);
+}
+
+// A new request with nothing to do yet.
+static Request * request_new (App * app)
+{
+  Request * request = g_new0 (Request, 1);
+
+  request->app = app;
+  request->camera = g_ptr_array_index (app->cameras, 0);
+  request->rendition = g_ptr_array_index (request->camera->renditions, 0);
+  request->id = app->next_request_id++;
+  strcpy(request->file_location, "/dev/null");
+  request->clip_fd = -1;
+
+  return request;
+}
+
+// Requests give times in ms, relative to now if negative or on the wall clock
+// otherwise; either way they end up on the stream clock.
+static GstClockTime request_to_stream_time (App * app, glong ms, GstClockTime now)
+{
+  if (ms < 0)
+    return MAX (ms * GST_MSECOND + (glong) now, 0);
+  return wall_to_stream_time (app, ms * GST_MSECOND);
+}
+
+// Check a replay's options against each other and fill in its window
+// (start and duration in ms, start relative if negative) and destination.
+// Returns 0, or the status to fail the request with.
+static guint setup_replay (Request * request, glong start, glong duration,
+    const gchar * filepath, const gchar ** reason)
+{
+  App * app = request->app;
+  GstClockTime now;
+
+  *reason = "couldn't parse request";
+  request->rendition = g_ptr_array_index (request->camera->renditions,
+      request->rendition_index);
+
+  if (duration <= 0)
+    return 400;
+
+  // Smart render needs the built-in muxer for its second sample description
+  if (request->smart_render && (request->fragmented || request->gst_mux))
+    return 400;
+
+  // Multi-camera replays answer with one result line per camera, so
+  // the clips themselves have to go to files
+  if (request->camera_set && (request->inline_delivery || filepath[0] != '/'))
+    return 400;
+
+  // Inline clips don't need to be written anywhere in particular;
+  // fragmented ones go straight to a (dup of) the socket
+  if (request->fragmented) {
+    if (filepath[0] != '\0')
+      return 400;
+  } else if (filepath[0] == '\0' && request->inline_delivery) {
+    request->clip_fd = memfd_create ("camsrc-clip", 0);
+    request->in_memory = request->clip_fd >= 0;
+    if (!request->in_memory)
+      return 400;
+  } else if (filepath[0] != '/') {
+    return 400;
+  }
+
+  // Convert incoming times from msec to nsec
+  duration = duration * GST_MSECOND;
+
+  now = get_stream_time (app);
+  start = request_to_stream_time (app, start, now);
+
+  GST_INFO ("%20lu: stream time",  GST_TIME_AS_MSECONDS(now));
+  GST_INFO ("%20ld: start", GST_TIME_AS_MSECONDS(start));
+
+  request->clock_start = start;
+  request->clock_desired_duration = duration;
+  request->clock_end = start + duration;
+  if (request->fragmented) {
+    request->clip_fd = dup (get_file_descriptor (request));
+    strcpy (request->file_location, "(stream)");
+  } else if (request->in_memory) {
+    g_snprintf (request->file_location, sizeof(request->file_location),
+        "/proc/self/fd/%d", request->clip_fd);
+  } else {
+    g_strlcpy (request->file_location, filepath, sizeof(request->file_location));
+  }
+
+  // May not request clips from the future, or clips longer than one minute
+  if (request->clock_start > now || duration > 60 * GST_SECOND) {
+    *reason = "invalid time range requested";
+    return 416;
+  }
+
+  return 0;
+}
+
+// A job that never started has nothing to tear down.
+static void discard_job (Request * job)
+{
+  guint i;
+
+  if (job->batch) {
+    for (i = 0; i < job->batch->len; i++)
+      discard_job (g_ptr_array_index (job->batch, i));
+    g_ptr_array_free (job->batch, TRUE);
+  }
+  if (job->clip_fd >= 0)
+    close (job->clip_fd);
+  g_free (job);
+}
+
+// Only the built-in muxer can share one pass over the ring, and only over
+// one ring at that.
+static guint check_batch_options (Request * batch, const gchar ** reason)
+{
+  if (batch->camera_set || batch->inline_delivery || batch->fragmented || batch->gst_mux ||
+      batch->smart_render) {
+    *reason = "option not available for batches";
+    return 400;
+  }
+
+  batch->rendition = g_ptr_array_index (batch->camera->renditions, batch->rendition_index);
+  batch->batch = g_ptr_array_new ();
+  return 0;
+}
+
+// One clip of a batch, with the batch's options and its own window.
+static guint add_batch_clip (Request * batch, glong start, glong duration,
+    const gchar * filepath, const gchar ** reason)
+{
+  Request * clip;
+  guint status;
+
+  if (batch->batch->len == BATCH_CLIPS_MAX) {
+    *reason = "too many clips in batch";
+    return 400;
+  }
+
+  clip = g_new (Request, 1);
+  *clip = *batch;
+  clip->id = batch->app->next_request_id++;
+  clip->parent = batch;
+  clip->children = 0;
+  clip->connection = NULL;
+  clip->socket_watcher_id = 0;
+  clip->batch = NULL;
+  clip->clip_fd = -1;
+
+  if ((status = setup_replay (clip, start, duration, filepath, reason))) {
+    discard_job (clip);
+    return status;
+  }
+
+  g_ptr_array_add (batch->batch, clip);
+  batch->children++;
+  return 0;
+}
+
+// The clips of a batch command: START DURATION PATH[; START DURATION PATH...]
+static guint parse_batch_clips (Request * batch, gchar * str, const gchar ** reason)
+{
+  gchar ** items = g_strsplit (str, ";", -1);
+  guint status = 0, i;
+
+  for (i = 0; !status && items[i]; i++) {
+    gchar * next = items[i];
+    glong start, duration;
+
+    start = strtol (next, &next, 10);
+    duration = strtol (next, &next, 10);
+    status = add_batch_clip (batch, start, duration, g_strstrip (next), reason);
+  }
+
+  if (!status && !batch->batch->len) {
+    *reason = "empty batch";
+    status = 400;
+  }
+
+  g_strfreev (items);
+  return status;
+}
+
+// Drop the clips of a batch that was rejected before it started.
+static void clear_batch (Request * batch)
+{
+  guint i;
+
+  for (i = 0; i < batch->batch->len; i++)
+    discard_job (g_ptr_array_index (batch->batch, i));
+  g_ptr_array_free (batch->batch, TRUE);
+  batch->batch = NULL;
+  batch->children = 0;
+}
+
+// Start pumping a replay that's been set up (and admitted).
+static void begin_replay (Request * request)
+{
+  App * app = request->app;
+
+  if (request->camera_set) {
+    start_camera_set (request);
+    return;
+  }
+
+  // A batch takes one slot to get going; its clips count once they're open
+  if (request->batch) {
+    schedule_pump (app);
+    return;
+  }
+
+  g_atomic_int_inc (&app->active_replays);
+  request->replay_active = TRUE;
+  request->replay_started = FALSE;
+  schedule_pump (app);
+}
+
+// Bytes per second replays have been writing, sampled at most once a second.
+static gdouble get_export_rate (App * app)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (now - app->export_rate_time >= G_USEC_PER_SEC) {
+    app->export_rate = (app->export_bytes - app->export_bytes_sampled) *
+      (gdouble) G_USEC_PER_SEC / (now - app->export_rate_time);
+    app->export_bytes_sampled = app->export_bytes;
+    app->export_rate_time = now;
+  }
+
+  return app->export_rate;
+}
+
+// Step one encoder's bitrate by steps of ENCODER_BITRATE_STEP, between
+// app->min_bitrate percent and 100 percent of what it was configured with.
+static void step_bitrate (Rendition * rendition, gint steps, GstClockTime level)
+{
+  App * app = rendition->camera->app;
+  gint step = MAX (rendition->bitrate * ENCODER_BITRATE_STEP / 100, 1);
+  gint floor = MAX (rendition->bitrate * app->min_bitrate / 100, 1);
+  gint from, to;
+  gdouble fps;
+
+  g_mutex_lock (&app->metrics_lock);
+  from = rendition->current_bitrate;
+  to = CLAMP (from + steps * step, floor, rendition->bitrate);
+  fps = rendition->fps;
+  if (to != from) {
+    rendition->current_bitrate = to;
+    rendition->bitrate_changes++;
+  }
+  g_mutex_unlock (&app->metrics_lock);
+
+  if (to == from)
+    return;
+
+  // x264enc reconfigures its rate control in place, from the next frame
+  g_object_set (rendition->encoder, "bitrate", to, NULL);
+
+  if (to < from)
+    GST_WARNING ("Camera %u %s encoder falling behind (%lums queued, %.1f fps): "
+        "bitrate %d -> %d kbps", rendition->camera->index, rendition->name,
+        GST_TIME_AS_MSECONDS (level), fps, from, to);
+  else
+    GST_INFO ("Camera %u %s encoder caught up: bitrate %d -> %d kbps",
+        rendition->camera->index, rendition->name, from, to);
+}
+
+// Keep capture from blocking on a busy host: while an encoder's backlog
+// grows past ENCODER_PRESSURE_MS, ease its bitrate down a step at a time
+// (one step a tick, never while the backlog is already draining), and once
+// it has stayed near empty for a while, bring it back up a step.
+static gboolean control_encoders_cb (gpointer data)
+{
+  App * app = data;
+  guint i, j;
+
+  for (i = 0; i < app->cameras->len; i++) {
+    Camera * camera = g_ptr_array_index (app->cameras, i);
+
+    for (j = 0; j < camera->renditions->len; j++) {
+      Rendition * rendition = g_ptr_array_index (camera->renditions, j);
+      GstClockTime level;
+
+      g_object_get (rendition->queue, "current-level-time", &level, NULL);
+
+      if (level > ENCODER_PRESSURE_MS * GST_MSECOND && level >= rendition->last_queue_level) {
+        rendition->calm_ticks = 0;
+        step_bitrate (rendition, -1, level);
+      } else if (level < ENCODER_CALM_MS * GST_MSECOND) {
+        if (++rendition->calm_ticks >= ENCODER_CALM_TICKS) {
+          rendition->calm_ticks = 0;
+          step_bitrate (rendition, 1, level);
+        }
+      } else {
+        rendition->calm_ticks = 0;
+      }
+
+      rendition->last_queue_level = level;
+    }
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+// Why a job can't start right now, or NULL if it can.  Exports wait rather
+// than compete with capture: while any encoder has a backlog, or while
+// replays already write as fast as --max-export-rate allows.
+static const gchar * get_admission_hold (App * app, Request * job)
+{
+  guint i, j;
+
+  if (app->active_replays + MAX (count_cameras (job->camera_set), 1) > app->max_replays)
+    return "replays";
+
+  for (i = 0; i < app->cameras->len; i++) {
+    Camera * camera = g_ptr_array_index (app->cameras, i);
+
+    for (j = 0; j < camera->renditions->len; j++) {
+      Rendition * rendition = g_ptr_array_index (camera->renditions, j);
+      GstClockTime level_time;
+
+      g_object_get (rendition->queue, "current-level-time", &level_time, NULL);
+      if (level_time > ADMISSION_QUEUE_MS * GST_MSECOND)
+        return "encoder";
+    }
+  }
+
+  if (app->max_export_rate && get_export_rate (app) > app->max_export_rate)
+    return "disk";
+
+  return NULL;
+}
+
+static gboolean admission_retry_cb (gpointer data)
+{
+  App * app = data;
+
+  app->admission_timer_id = 0;
+  schedule_pump (app);
+
+  return G_SOURCE_REMOVE;
+}
+
+// Start queued jobs, best first, for as long as admission allows.
+static void schedule_jobs (App * app)
+{
+  while (app->queue) {
+    Request * job = app->queue->data;
+    const gchar * hold = get_admission_hold (app, job);
+
+    if (hold) {
+      if (hold != app->admission_hold)
+        GST_INFO ("Holding %u queued jobs (%s)", g_list_length (app->queue), hold);
+      app->admission_hold = hold;
+      // Backlogs drain without anything else happening, so look again soon
+      if (!app->admission_timer_id)
+        app->admission_timer_id = g_timeout_add (ADMISSION_RETRY_MS, admission_retry_cb, app);
+      return;
+    }
+
+    app->queue = g_list_delete_link (app->queue, app->queue);
+    job->queued = FALSE;
+    send_job_event (job, "started", "");
+    if (!job->camera_set)
+      app->requests = g_list_append (app->requests, job);
+    begin_replay (job);
+  }
+
+  app->admission_hold = NULL;
+}
+
+// Higher priorities first; first come, first served among equals.
+static gint compare_job_priority (gconstpointer a, gconstpointer b)
+{
+  return ((const Request *) a)->priority <= ((const Request *) b)->priority ? 1 : -1;
+}
+
+static guint get_queue_position (App * app, Request * job)
+{
+  return g_list_index (app->queue, job) + 1;
+}
+
+static Request * find_job (Request * session, const gchar * id)
+{
+  GList * l;
+
+  for (l = session->jobs; l; l = l->next) {
+    if (!strcmp (((Request *) l->data)->job_id, id))
+      return l->data;
+  }
+
+  return NULL;
+}
+
+static void drop_queued_jobs (Request * session)
+{
+  App * app = session->app;
+  GList * l, * next;
+
+  for (l = session->jobs; l; l = next) {
+    Request * job = l->data;
+
+    next = l->next;
+    if (!job->queued)
+      continue;
+
+    app->queue = g_list_remove (app->queue, job);
+    session->jobs = g_list_delete_link (session->jobs, l);
+    session->children--;
+    discard_job (job);
+  }
+}
+
+// For lines about the session rather than one of its jobs.
+static void send_session_error (Request * session, const gchar * id, guint status,
+    const gchar * reason)
+{
+  gchar response[1024];
+
+  if (id)
+    g_snprintf (response, sizeof(response),
+        "{ \"id\": \"%s\", \"event\": \"error\", \"status\": %u, \"reason\": \"%s\" }\n",
+        id, status, reason);
+  else
+    g_snprintf (response, sizeof(response),
+        "{ \"event\": \"error\", \"status\": %u, \"reason\": \"%s\" }\n", status, reason);
+
+  socket_send_string (response, session);
+}
+
+// A member of a job line, if it's there with the right type.
+static const gchar * get_string_member (JsonObject * object, const gchar * name)
+{
+  JsonNode * node = json_object_get_member (object, name);
+
+  return node && JSON_NODE_HOLDS_VALUE (node) && json_node_get_value_type (node) == G_TYPE_STRING ?
+    json_node_get_string (node) : NULL;
+}
+
+static gboolean get_int_member (JsonObject * object, const gchar * name, gint64 * value)
+{
+  JsonNode * node = json_object_get_member (object, name);
+
+  if (!node || !JSON_NODE_HOLDS_VALUE (node) || json_node_get_value_type (node) != G_TYPE_INT64)
+    return FALSE;
+
+  *value = json_node_get_int (node);
+  return TRUE;
+}
+
+// Ids are echoed into every event, so keep them to characters that need no escaping.
+static gboolean valid_job_id (const gchar * id)
+{
+  return id && id[0] && strlen (id) < JOB_ID_SIZE && id[strspn (id, JOB_ID_CHARS)] == '\0';
+}
+
+// { "op": "replay", "id": ID, "start": MS, "duration": MS, "path": PATH,
+//   "options": [ "--exact-start", ... ], "priority": N }
+// or { "op": "batch", "id": ID, "clips": [ { "start": MS, "duration": MS,
+//   "path": PATH }, ... ], "options": [ ... ], "priority": N }
+static void submit_job (Request * session, JsonObject * object, gboolean batch)
+{
+  App * app = session->app;
+  const gchar * id = get_string_member (object, "id");
+  const gchar * path = get_string_member (object, "path");
+  const gchar * reason = "couldn't parse request";
+  JsonNode * options = json_object_get_member (object, "options");
+  JsonNode * clips = json_object_get_member (object, "clips");
+  gint64 start = 0, duration = 0, priority = 0;
+  gboolean valid;
+  guint status, i;
+  Request * job;
+  gchar extra[64];
+
+  if (!valid_job_id (id)) {
+    send_session_error (session, NULL, 400, "missing or invalid job id");
+    return;
+  }
+
+  if (find_job (session, id)) {
+    send_session_error (session, id, 409, "job id already in use");
+    return;
+  }
+
+  job = request_new (app);
+  job->parent = session;
+  job->received_time = g_get_monotonic_time ();
+  g_strlcpy (job->job_id, id, sizeof(job->job_id));
+
+  valid = (batch ? clips && JSON_NODE_HOLDS_ARRAY (clips) :
+      path && get_int_member (object, "start", &start) &&
+      get_int_member (object, "duration", &duration)) &&
+    (!json_object_has_member (object, "priority") || get_int_member (object, "priority", &priority)) &&
+    (!options || JSON_NODE_HOLDS_ARRAY (options));
+
+  for (i = 0; valid && options && i < json_array_get_length (json_node_get_array (options)); i++) {
+    JsonNode * node = json_array_get_element (json_node_get_array (options), i);
+    gchar * option;
+
+    if (!JSON_NODE_HOLDS_VALUE (node) || json_node_get_value_type (node) != G_TYPE_STRING) {
+      valid = FALSE;
+      break;
+    }
+    option = g_strdup (json_node_get_string (node));
+    valid = parse_replay_option (option, job);
+    g_free (option);
+  }
+
+  // Clip bytes can't share the connection with other jobs' events
+  if (valid && job->inline_delivery) {
+    reason = "jobs can't deliver inline";
+    valid = FALSE;
+  }
+
+  if (!valid)
+    status = 400;
+  else if (!batch)
+    status = setup_replay (job, start, duration, path, &reason);
+  else if (!(status = check_batch_options (job, &reason))) {
+    JsonArray * array = json_node_get_array (clips);
+
+    for (i = 0; !status && i < json_array_get_length (array); i++) {
+      JsonNode * node = json_array_get_element (array, i);
+      JsonObject * clip = JSON_NODE_HOLDS_OBJECT (node) ? json_node_get_object (node) : NULL;
+
+      path = clip ? get_string_member (clip, "path") : NULL;
+      if (!path || !get_int_member (clip, "start", &start) ||
+          !get_int_member (clip, "duration", &duration))
+        status = 400;
+      else
+        status = add_batch_clip (job, start, duration, path, &reason);
+    }
+
+    if (!status && !job->batch->len) {
+      reason = "empty batch";
+      status = 400;
+    }
+  }
+
+  if (!status && MAX (count_cameras (job->camera_set), 1) > app->max_replays) {
+    status = 503;
+    reason = "more cameras than replay slots";
+  }
+
+  if (status) {
+    GST_WARNING ("rejecting job %s: %s", id, reason);
+    send_error_to_socket (status, reason, job);
+    discard_job (job);
+    return;
+  }
+
+  job->priority = CLAMP (priority, G_MININT, G_MAXINT);
+  job->queued = TRUE;
+  session->jobs = g_list_append (session->jobs, job);
+  session->children++;
+  app->queue = g_list_insert_sorted (app->queue, job, compare_job_priority);
+
+  g_snprintf (extra, sizeof(extra), ", \"position\": %u", get_queue_position (app, job));
+  send_job_event (job, "queued", extra);
+
+  schedule_pump (app);
+}
+
+static void cancel_job (Request * session, const gchar * id)
+{
+  App * app = session->app;
+  Request * job = valid_job_id (id) ? find_job (session, id) : NULL;
+  GList * children = NULL, * l;
+
+  if (!job) {
+    send_session_error (session, valid_job_id (id) ? id : NULL, 404, "no such job");
+    return;
+  }
+
+  send_job_event (job, "cancelled", "");
+
+  if (job->queued) {
+    app->queue = g_list_remove (app->queue, job);
+    session->jobs = g_list_remove (session->jobs, job);
+    session->children--;
+    discard_job (job);
+    return;
+  }
+
+  if (!job->camera_set && !job->batch) {
+    abort_replay (job);
+    return;
+  }
+
+  // The last child to go takes the job with it
+  if (job->batch) {
+    guint i;
+
+    for (i = 0; i < job->batch->len; i++)
+      children = g_list_prepend (children, g_ptr_array_index (job->batch, i));
+  }
+  for (l = app->requests; l; l = l->next) {
+    if (((Request *) l->data)->parent == job)
+      children = g_list_prepend (children, l->data);
+  }
+  for (l = children; l; l = l->next)
+    abort_replay (l->data);
+  g_list_free (children);
+}
+
+static void send_queue_status (Request * session)
+{
+  App * app = session->app;
+  GString * out = g_string_new (NULL);
+  GList * l;
+
+  g_string_append_printf (out, "{ \"event\": \"queue\", \"active\": %u, \"max\": %u, "
+      "\"queued\": %u, \"held\": ",
+      app->active_replays, app->max_replays, g_list_length (app->queue));
+  if (app->admission_hold)
+    g_string_append_printf (out, "\"%s\"", app->admission_hold);
+  else
+    g_string_append (out, "null");
+  g_string_append (out, ", \"jobs\": [");
+
+  for (l = session->jobs; l; l = l->next) {
+    Request * job = l->data;
+
+    g_string_append_printf (out, "%s { \"id\": \"%s\", \"state\": \"%s\", \"priority\": %d",
+        l == session->jobs ? "" : ",", job->job_id, job->queued ? "queued" : "active",
+        job->priority);
+    if (job->queued)
+      g_string_append_printf (out, ", \"position\": %u", get_queue_position (app, job));
+    g_string_append (out, " }");
+  }
+
+  g_string_append (out, " ] }\n");
+  socket_send_string (out->str, session);
+  g_string_free (out, TRUE);
+}
+
+// Keep the mark index (if there is one) up to date with a mark.
+static void save_mark (Mark * mark)
+{
+  GError * error = NULL;
+  MarkRecord record = {
+    .name = mark->name,
+    .camera = mark->rendition->camera->index,
+    .rendition = mark->rendition->name,
+    .at = mark->clock_at,
+    .start = mark->clock_start,
+    .end = mark->clock_end,
+    .location = mark->location,
+  };
+
+  if (mark->app->mark_index && !mark_index_put (mark->app->mark_index, &record, &error)) {
+    GST_WARNING ("Couldn't save mark %s: %s", mark->name, error->message);
+    g_error_free (error);
+  }
+}
+
+// Write a pinned mark out with the native writer; the edit list trims the
+// lead-in before the pre-roll, as for exact-start replays.
+static gboolean write_mark (Mark * mark, const gchar * path, GError ** error)
+{
+  gchar * dir_path = g_strdup (path);
+  Mp4Writer * writer;
+  gboolean ok = TRUE;
+  guint i;
+  gint fd;
+
+  if (!mkpath (dir_path, 0766))
+    GST_ERROR ("mkpath of '%s' failed", path);
+  g_free (dir_path);
+
+  fd = g_open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't create %s: %s", path, g_strerror (errno));
+    return FALSE;
+  }
+
+  writer = mp4_writer_new (fd, mark->caps, error);
+  if (!writer) {
+    close (fd);
+    return FALSE;
+  }
+
+  mp4_writer_set_start (writer, mark->clock_start);
+  for (i = 0; ok && i < mark->units->len; i++)
+    ok = mp4_writer_add (writer, &g_array_index (mark->units, ReplayUnit, i), error);
+  ok = ok && mp4_writer_finish (writer, error);
+
+  mp4_writer_free (writer);
+  close (fd);
+  return ok;
+}
+
+static gboolean materialize_cb (gpointer data);
+
+static void schedule_materialize (App * app, guint delay_ms)
+{
+  if (app->materialize_id || g_queue_is_empty (app->materialize_queue))
+    return;
+
+  app->materialize_id = delay_ms ?
+    g_timeout_add_full (G_PRIORITY_LOW, delay_ms, materialize_cb, app, NULL) :
+    g_idle_add_full (G_PRIORITY_LOW, materialize_cb, app, NULL);
+}
+
+// Write out one queued mark per idle pass, but only while no replays are
+// running or waiting: marks are there so this work can wait.
+static gboolean materialize_cb (gpointer data)
+{
+  App * app = data;
+  GError * error = NULL;
+  Mark * mark = NULL;
+  GList * l;
+
+  app->materialize_id = 0;
+
+  // Marks still waiting on their post-roll go when they're ready
+  for (l = app->materialize_queue->head; l && !mark; l = l->next) {
+    if (((Mark *) l->data)->state != MARK_PINNING)
+      mark = l->data;
+  }
+
+  if (!mark || app->active_replays || app->queue) {
+    schedule_materialize (app, MATERIALIZE_RETRY_MS);
+    return G_SOURCE_REMOVE;
+  }
+
+  g_queue_remove (app->materialize_queue, mark);
+
+  if (mark->state == MARK_PINNED && write_mark (mark, mark->destination, &error)) {
+    GST_INFO ("Materialized mark %s to %s", mark->name, mark->destination);
+    g_free (mark->location);
+    mark->location = g_steal_pointer (&mark->destination);
+    mark->state = MARK_MATERIALIZED;
+    unpin_mark (mark);
+    save_mark (mark);
+  } else {
+    // Still pinned if it was, so it can be tried again
+    GST_WARNING ("Couldn't materialize mark %s: %s", mark->name,
+        error ? error->message : "footage no longer available");
+    g_clear_error (&error);
+    g_clear_pointer (&mark->destination, g_free);
+  }
+
+  schedule_materialize (app, 0);
+  return G_SOURCE_REMOVE;
+}
+
+// Returns a newly allocated JSON object describing a mark.
+static gchar * get_mark_json (Mark * mark)
+{
+  App * app = mark->app;
+  GString * out = g_string_new (NULL);
+
+  g_string_append_printf (out, "{ \"name\": \"%s\", \"camera\": %u, \"rendition\": \"%s\", "
+      "\"time\": %lu, \"start\": %lu, \"duration\": %lu, \"state\": \"%s\", "
+      "\"pinned-bytes\": %" G_GUINT64_FORMAT ", \"location\": ",
+      mark->name, mark->rendition->camera->index, mark->rendition->name,
+      GST_TIME_AS_MSECONDS (stream_to_wall_time (app, mark->clock_at)),
+      GST_TIME_AS_MSECONDS (stream_to_wall_time (app, mark->clock_start)),
+      GST_TIME_AS_MSECONDS (mark->clock_end - mark->clock_start),
+      mark_state_names[mark->state], mark->bytes);
+  if (mark->location)
+    g_string_append_printf (out, "\"%s\"", mark->location);
+  else
+    g_string_append (out, "null");
+  g_string_append_printf (out, ", \"queued\": %s }", mark->destination ? "true" : "false");
+
+  return g_string_free (out, FALSE);
+}
+
+static gint compare_mark_time (gconstpointer a, gconstpointer b)
+{
+  const Mark * ma = a, * mb = b;
+
+  return ma->clock_at < mb->clock_at ? -1 : ma->clock_at > mb->clock_at;
+}
+
+// Every mark, oldest first; free the list with g_list_free ().
+static GList * get_marks (App * app)
+{
+  return g_list_sort (g_hash_table_get_values (app->marks), compare_mark_time);
+}
+
+// Returns a newly allocated JSON array of every mark.
+static gchar * get_marks_json (App * app)
+{
+  GString * out = g_string_new ("[");
+  GList * marks = get_marks (app), * l;
+
+  for (l = marks; l; l = l->next) {
+    gchar * mark = get_mark_json (l->data);
+
+    g_string_append_printf (out, "%s %s", l == marks ? "" : ",", mark);
+    g_free (mark);
+  }
+  g_string_append (out, " ]");
+
+  g_list_free (marks);
+  return g_string_free (out, FALSE);
+}
+
+// Mark a moment: now, or like a replay's start, relative to now (negative)
+// or on the wall clock.  Pinning starts with the next pump.
+static guint add_mark (App * app, const gchar * name, Rendition * rendition,
+    glong at, glong pre, glong post, const gchar ** reason, Mark ** result)
+{
+  GstClockTime now = get_stream_time (app), clock_at;
+  Mark * mark;
+
+  *reason = "couldn't parse request";
+  if (!valid_job_id (name) || pre < 0 || post < 0)
+    return 400;
+
+  if (g_hash_table_contains (app->marks, name)) {
+    *reason = "mark already exists";
+    return 409;
+  }
+
+  clock_at = at ? request_to_stream_time (app, at, now) : now;
+
+  // Same limits as a replay: nothing from the future, at most a minute
+  if (clock_at > now || pre + post > 60 * 1000) {
+    *reason = "invalid time range requested";
+    return 416;
+  }
+
+  if (g_hash_table_size (app->marks) >= MARKS_MAX || app->pinned_bytes >= app->max_pinned_bytes) {
+    *reason = "no room for more marks";
+    return 507;
+  }
+
+  mark = mark_new (app, name, rendition, clock_at,
+      clock_at > pre * GST_MSECOND ? clock_at - pre * GST_MSECOND : 0,
+      clock_at + post * GST_MSECOND);
+  g_hash_table_insert (app->marks, mark->name, mark);
+  app->pinning = g_list_append (app->pinning, mark);
+  save_mark (mark);
+  schedule_pump (app);
+
+  GST_INFO ("Marked %s on camera %u %s", name, rendition->camera->index, rendition->name);
+  *result = mark;
+  return 0;
+}
+
+static guint remove_mark (App * app, const gchar * name, const gchar ** reason)
+{
+  Mark * mark = name ? g_hash_table_lookup (app->marks, name) : NULL;
+  GError * error = NULL;
+
+  if (!mark) {
+    *reason = "no such mark";
+    return 404;
+  }
+
+  app->pinning = g_list_remove (app->pinning, mark);
+  g_queue_remove (app->materialize_queue, mark);
+  if (app->mark_index && !mark_index_remove (app->mark_index, name, &error)) {
+    GST_WARNING ("Couldn't remove mark %s from the index: %s", name, error->message);
+    g_error_free (error);
+  }
+  g_hash_table_remove (app->marks, name);
+
+  return 0;
+}
+
+// Queue one mark to be written to path, or with no name, every mark that
+// hasn't been yet, to NAME.mp4 in the directory path.
+static guint materialize_marks (App * app, const gchar * name, const gchar * path,
+    guint * queued, const gchar ** reason)
+{
+  GList * marks, * l;
+
+  *queued = 0;
+  *reason = "couldn't parse request";
+  if (!path || path[0] != '/')
+    return 400;
+
+  if (name) {
+    Mark * mark = g_hash_table_lookup (app->marks, name);
+
+    if (!mark) {
+      *reason = "no such mark";
+      return 404;
+    }
+    if (mark->state == MARK_EXPIRED) {
+      *reason = "footage no longer available";
+      return 410;
+    }
+    if (mark->state == MARK_MATERIALIZED || mark->destination) {
+      *reason = "mark already materialized";
+      return 409;
+    }
+
+    mark->destination = g_strdup (path);
+    g_queue_push_tail (app->materialize_queue, mark);
+    *queued = 1;
+  } else {
+    marks = get_marks (app);
+    for (l = marks; l; l = l->next) {
+      Mark * mark = l->data;
+
+      if (mark->state > MARK_PINNED || mark->destination)
+        continue;
+
+      mark->destination = g_strdup_printf ("%s/%s.mp4", path, mark->name);
+      g_queue_push_tail (app->materialize_queue, mark);
+      (*queued)++;
+    }
+    g_list_free (marks);
+  }
+
+  schedule_materialize (app, 0);
+  return 0;
+}
+
+// Marks left over from before a restart.  Their footage is gone unless the
+// ring has it again; either way the pump finds out.
+static void load_marks (App * app)
+{
+  GList * records = mark_index_get_records (app->mark_index), * l;
+
+  for (l = records; l; l = l->next) {
+    MarkRecord * record = l->data;
+    Camera * camera;
+    Rendition * rendition = NULL;
+    Mark * mark;
+    guint i;
+
+    if (record->camera < app->cameras->len) {
+      camera = g_ptr_array_index (app->cameras, record->camera);
+      for (i = 0; i < camera->renditions->len && !rendition; i++) {
+        if (!strcmp (((Rendition *) g_ptr_array_index (camera->renditions, i))->name,
+                record->rendition))
+          rendition = g_ptr_array_index (camera->renditions, i);
+      }
+    }
+
+    if (!rendition || !valid_job_id (record->name)) {
+      GST_WARNING ("Ignoring mark %s: no camera %u %s", record->name, record->camera,
+          record->rendition);
+      continue;
+    }
+
+    mark = mark_new (app, record->name, rendition, record->at, record->start, record->end);
+    if (record->location) {
+      mark->location = g_strdup (record->location);
+      mark->state = MARK_MATERIALIZED;
+    } else {
+      app->pinning = g_list_append (app->pinning, mark);
+    }
+    g_hash_table_insert (app->marks, mark->name, mark);
+  }
+
+  g_list_free (records);
+}
+
+// Options to the mark command: where to mark, and how much around it.
+static gboolean parse_mark_option (gchar * option, Request * options, glong * pre, glong * post)
+{
+  if (g_str_has_prefix (option, "--pre="))
+    *pre = strtol (option + 6, NULL, 10);
+  else if (g_str_has_prefix (option, "--post="))
+    *post = strtol (option + 7, NULL, 10);
+  else if (g_str_has_prefix (option, "--camera=") || g_str_has_prefix (option, "--rendition="))
+    return parse_replay_option (option, options);
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+// { "op": "mark", "name": NAME, "at": MS, "pre": MS, "post": MS,
+//   "camera": N, "rendition": NAME }
+static void mark_op (Request * session, JsonObject * object)
+{
+  App * app = session->app;
+  const gchar * id = get_string_member (object, "id");
+  const gchar * rendition_name = get_string_member (object, "rendition");
+  gint64 at = 0, pre = MARK_ROLL_DEFAULT_MS, post = MARK_ROLL_DEFAULT_MS, camera = 0;
+  Request options = { .app = app };
+  const gchar * reason = "couldn't parse request";
+  gboolean valid;
+  guint status;
+  Mark * mark;
+
+  id = valid_job_id (id) ? id : NULL;
+  get_int_member (object, "at", &at);
+  get_int_member (object, "pre", &pre);
+  get_int_member (object, "post", &post);
+  get_int_member (object, "camera", &camera);
+
+  valid = camera >= 0 && camera < app->cameras->len;
+  if (valid) {
+    options.camera = g_ptr_array_index (app->cameras, camera);
+    valid = !rendition_name || parse_rendition (rendition_name, &options);
+  }
+
+  status = valid ? add_mark (app, get_string_member (object, "name"),
+      g_ptr_array_index (options.camera->renditions, options.rendition_index),
+      at, pre, post, &reason, &mark) : 400;
+
+  if (status) {
+    send_session_error (session, id, status, reason);
+  } else {
+    gchar * json = get_mark_json (mark);
+    gchar * response = g_strdup_printf ("{ %s%s%s\"event\": \"marked\", \"mark\": %s }\n",
+        id ? "\"id\": \"" : "", id ? id : "", id ? "\", " : "", json);
+
+    socket_send_string (response, session);
+    g_free (response);
+    g_free (json);
+  }
+}
+
+// Returns 0 and a newly allocated JSON array of the busiest moments in a
+// window (start in ms as for a replay), or the status to fail with.
+static guint get_activity_peaks (App * app, Camera * camera, glong start, glong duration,
+    glong count, gchar ** json, const gchar ** reason)
+{
+  ActivitySample peaks[ACTIVITY_PEAKS_MAX];
+  GstClockTime clock_start;
+  GString * out;
+  guint n, i;
+
+  *reason = "couldn't parse request";
+  if (duration <= 0 || count <= 0 || count > ACTIVITY_PEAKS_MAX)
+    return 400;
+
+  clock_start = request_to_stream_time (app, start, get_stream_time (app));
+  n = activity_index_get_peaks (camera->activity, clock_start,
+      clock_start + duration * GST_MSECOND, count, ACTIVITY_PEAK_GAP, peaks);
+
+  out = g_string_new ("[");
+  for (i = 0; i < n; i++)
+    g_string_append_printf (out, "%s { \"time\": %lu, \"score\": %.2f }", i ? "," : "",
+        GST_TIME_AS_MSECONDS (stream_to_wall_time (app, peaks[i].pts)), peaks[i].score);
+  g_string_append (out, " ]");
+
+  *json = g_string_free (out, FALSE);
+  return 0;
+}
+
+static void snapshot_free (Snapshot * snapshot)
+{
+  if (snapshot->image)
+    gst_buffer_unref (snapshot->image);
+  g_free (snapshot->path);
+  g_free (snapshot);
+}
+
+static gboolean snapshot_done_cb (gpointer data);
+
+// On a pool thread: decode the frame, encode it, and write it out if the
+// still has a path.
+static void take_snapshot (gpointer data, gpointer user_data)
+{
+  Snapshot * snapshot = data;
+  App * app = user_data;
+  GError * error = NULL;
+  GstSample * frame;
+  GstMapInfo map;
+
+  frame = snapshot_take (app->snapshot_cache, snapshot->rendition->ring, snapshot->target,
+      snapshot->exact, &error);
+  if (frame) {
+    snapshot->pts = GST_BUFFER_PTS (gst_sample_get_buffer (frame));
+    snapshot->image = snapshot_encode (frame, snapshot->format, snapshot->width, &error);
+    gst_sample_unref (frame);
+  }
+
+  if (snapshot->image && snapshot->path) {
+    gst_buffer_map (snapshot->image, &map, GST_MAP_READ);
+    if (!mkpath (snapshot->path, 0766) ||
+        !g_file_set_contents (snapshot->path, (const gchar *) map.data, map.size, &error))
+      snapshot->reason = "couldn't write image";
+    gst_buffer_unmap (snapshot->image, &map);
+  }
+
+  if (error) {
+    GST_WARNING ("Snapshot for request %u failed: %s", snapshot->request->id, error->message);
+    if (g_error_matches (error, SNAPSHOT_ERROR, SNAPSHOT_ERROR_NO_FOOTAGE)) {
+      snapshot->status = 416;
+      snapshot->reason = "no footage at that time";
+    } else {
+      snapshot->status = 500;
+      if (!snapshot->reason)
+        snapshot->reason = g_error_matches (error, SNAPSHOT_ERROR, SNAPSHOT_ERROR_ENCODE) ?
+          "couldn't encode frame" : "couldn't decode frame";
+    }
+    g_error_free (error);
+  }
+
+  g_idle_add (snapshot_done_cb, snapshot);
+}
+
+// The request counts each still as a child until it's answered.
+static void queue_snapshot (Request * request, Snapshot * snapshot)
+{
+  request->children++;
+  g_thread_pool_push (request->app->snapshot_pool, snapshot, NULL);
+}
+
+// Answer a single snapshot: a pointer to the file, or the image itself
+// after the header, sent from a memfd like an inline clip.
+static void deliver_snapshot (Snapshot * snapshot)
+{
+  Request * request = snapshot->request;
+  App * app = request->app;
+  gchar response[1024];
+  GstMapInfo map;
+  gsize size;
+
+  if (snapshot->status) {
+    send_error_to_socket (snapshot->status, snapshot->reason, request);
+    hangup (request);
+    return;
+  }
+
+  if (!snapshot->path) {
+    if (!request->connection) {
+      hangup (request);
+      return;
+    }
+
+    request->clip_fd = memfd_create ("camsrc-snapshot", 0);
+    gst_buffer_map (snapshot->image, &map, GST_MAP_READ);
+    if (request->clip_fd < 0 || write (request->clip_fd, map.data, map.size) < (ssize_t) map.size) {
+      GST_ERROR ("Couldn't stage snapshot for request %u: %s", request->id, g_strerror (errno));
+      gst_buffer_unmap (snapshot->image, &map);
+      send_error_to_socket (500, "couldn't stage image", request);
+      hangup (request);
+      return;
+    }
+    gst_buffer_unmap (snapshot->image, &map);
+  }
+
+  size = gst_buffer_get_size (snapshot->image);
+  g_snprintf (response, sizeof(response),
+      "{ \"status\": 200, \"camera\": %u, \"rendition\": \"%s\", \"content-type\": \"image/%s\", \"content-length\": %lu, \"time\": %lu, \"%s\": \"%s\", \"latency-ms\": %ld }\n",
+      request->camera->index, snapshot->rendition->name, snapshot->format, (gulong) size,
+      GST_TIME_AS_MSECONDS (stream_to_wall_time (app, snapshot->pts)),
+      snapshot->path ? "location" : "transfer", snapshot->path ? snapshot->path : "inline",
+      request_latency_ms (request));
+  socket_send_string (response, request);
+  record_first_byte (request);
+
+  if (snapshot->path) {
+    hangup (request);
+    return;
+  }
+
+  request->snapshot = TRUE;
+  request->send_offset = 0;
+  request->send_length = size;
+  request->send_watch_id = g_unix_fd_add (get_file_descriptor (request),
+      G_IO_OUT, send_clip_cb, request);
+}
+
+// Answer a thumbnail strip with every still in order, failed ones included.
+static void deliver_thumbnails (Request * request, GPtrArray * strip)
+{
+  App * app = request->app;
+  Snapshot * first = g_ptr_array_index (strip, 0);
+  GString * out = g_string_new (NULL);
+  guint i;
+
+  g_string_append_printf (out, "{ \"status\": 200, \"camera\": %u, \"rendition\": \"%s\", "
+      "\"content-type\": \"image/%s\", \"latency-ms\": %ld, \"thumbnails\": [",
+      request->camera->index, first->rendition->name, first->format, request_latency_ms (request));
+
+  for (i = 0; i < strip->len; i++) {
+    Snapshot * snapshot = g_ptr_array_index (strip, i);
+
+    if (snapshot->status)
+      g_string_append_printf (out, "%s { \"time\": %lu, \"status\": %u, \"reason\": \"%s\" }",
+          i ? "," : "", GST_TIME_AS_MSECONDS (stream_to_wall_time (app, snapshot->target)),
+          snapshot->status, snapshot->reason);
+    else
+      g_string_append_printf (out, "%s { \"time\": %lu, \"location\": \"%s\" }",
+          i ? "," : "", GST_TIME_AS_MSECONDS (stream_to_wall_time (app, snapshot->pts)),
+          snapshot->path);
+  }
+  g_string_append (out, " ] }\n");
+
+  socket_send_string (out->str, request);
+  g_string_free (out, TRUE);
+  record_first_byte (request);
+}
+
+static gboolean snapshot_done_cb (gpointer data)
+{
+  Snapshot * snapshot = data;
+  Request * request = snapshot->request;
+  App * app = request->app;
+  GPtrArray * strip = snapshot->strip;
+
+  g_mutex_lock (&app->metrics_lock);
+  if (!snapshot->status)
+    app->snapshots_taken++;
+  g_mutex_unlock (&app->metrics_lock);
+
+  request->children--;
+  if (!strip) {
+    deliver_snapshot (snapshot);
+    snapshot_free (snapshot);
+  } else if (!request->children) {
+    GST_INFO ("Request %u took %u thumbnails in %ldms",
+        request->id, strip->len, request_latency_ms (request));
+    deliver_thumbnails (request, strip);
+    g_ptr_array_free (strip, TRUE);
+    hangup (request);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean parse_snapshot_option (gchar * option, Request * request, Snapshot * options)
+{
+  if (!strcmp (option, "--keyframe"))
+    options->exact = FALSE;
+  else if (!strcmp (option, "--exact"))
+    options->exact = TRUE;
+  else if (!strcmp (option, "--png"))
+    options->format = "png";
+  else if (g_str_has_prefix (option, "--width="))
+    options->width = strtol (option + 8, NULL, 10);
+  else if (g_str_has_prefix (option, "--camera=") || g_str_has_prefix (option, "--rendition="))
+    return parse_replay_option (option, request);
+  else
+    return FALSE;
+
+  return options->width >= 0;
+}
+
+// snapshot [--camera=N] [--rendition=NAME] [--keyframe] [--width=W] [--png] TIME [PATH]
+// Exact by default; with no path the image follows the header inline.
+static guint start_snapshot (Request * request, gchar ** args, const gchar ** reason)
+{
+  App * app = request->app;
+  Snapshot options = { .request = request, .exact = TRUE, .format = "jpeg" };
+  Snapshot * snapshot;
+  gchar * time = NULL, * path = NULL;
+  guint i;
+
+  *reason = "couldn't parse request";
+  for (i = 0; args[i]; i++) {
+    if (!args[i][0])
+      continue;
+    if (g_str_has_prefix (args[i], "--")) {
+      if (time || !parse_snapshot_option (args[i], request, &options))
+        return 400;
+    } else if (!time) {
+      time = args[i];
+    } else if (!path) {
+      path = args[i];
+    } else {
+      return 400;
+    }
+  }
+  if (!time)
+    return 400;
+
+  options.rendition = g_ptr_array_index (request->camera->renditions, request->rendition_index);
+  options.target = request_to_stream_time (app, strtol (time, NULL, 10), get_stream_time (app));
+  options.path = g_strdup (path);
+
+  snapshot = g_new (Snapshot, 1);
+  *snapshot = options;
+  queue_snapshot (request, snapshot);
+  return 0;
+}
+
+// thumbnails [--camera=N] [--rendition=NAME] [--exact] [--width=W] [--png]
+//     START DURATION COUNT DIR
+// One still from the middle of each of COUNT equal slices of the window,
+// snapped to keyframes unless --exact, decoded in parallel.
+static guint start_thumbnails (Request * request, gchar ** args, const gchar ** reason)
+{
+  App * app = request->app;
+  Snapshot options = { .request = request, .format = "jpeg", .width = THUMBNAIL_WIDTH_DEFAULT };
+  gchar * values[4] = { NULL };
+  glong duration, count;
+  GstClockTime clock_start, step;
+  GPtrArray * strip;
+  guint i, n = 0;
+
+  *reason = "couldn't parse request";
+  for (i = 0; args[i]; i++) {
+    if (!args[i][0])
+      continue;
+    if (g_str_has_prefix (args[i], "--")) {
+      if (n || !parse_snapshot_option (args[i], request, &options))
+        return 400;
+    } else if (n < G_N_ELEMENTS (values)) {
+      values[n++] = args[i];
+    } else {
+      return 400;
+    }
+  }
+  if (n < G_N_ELEMENTS (values))
+    return 400;
+
+  duration = strtol (values[1], NULL, 10);
+  count = strtol (values[2], NULL, 10);
+  if (duration <= 0 || count <= 0)
+    return 400;
+  if (count > THUMBNAILS_MAX) {
+    *reason = "too many thumbnails";
+    return 400;
+  }
+
+  options.rendition = g_ptr_array_index (request->camera->renditions, request->rendition_index);
+  clock_start = request_to_stream_time (app, strtol (values[0], NULL, 10), get_stream_time (app));
+  step = duration * GST_MSECOND / count;
+
+  strip = g_ptr_array_new_with_free_func ((GDestroyNotify) snapshot_free);
+  options.strip = strip;
+  for (i = 0; i < count; i++) {
+    Snapshot * snapshot = g_new (Snapshot, 1);
+
+    *snapshot = options;
+    snapshot->target = clock_start + i * step + step / 2;
+    snapshot->path = g_strdup_printf ("%s/thumb-%03u.%s", values[3], i,
+        !strcmp (options.format, "png") ? "png" : "jpg");
+    g_ptr_array_add (strip, snapshot);
+    queue_snapshot (request, snapshot);
+  }
+
+  return 0;
+}
+
+// One JSON line on a session connection.
+static void handle_session_line (Request * session, const gchar * line)
+{
+  App * app = session->app;
+  JsonParser * parser = json_parser_new ();
+  JsonObject * object;
+  const gchar * op;
+
+  if (!json_parser_load_from_data (parser, line, -1, NULL) ||
+      !JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser))) {
+    send_session_error (session, NULL, 400, "couldn't parse request");
+    g_object_unref (parser);
+    return;
+  }
+
+  object = json_node_get_object (json_parser_get_root (parser));
+  op = get_string_member (object, "op");
+
+  if (!op) {
+    send_session_error (session, NULL, 400, "missing op");
+  } else if (!strcmp (op, "replay")) {
+    submit_job (session, object, FALSE);
+  } else if (!strcmp (op, "batch")) {
+    submit_job (session, object, TRUE);
+  } else if (!strcmp (op, "cancel")) {
+    cancel_job (session, get_string_member (object, "id"));
+  } else if (!strcmp (op, "queue")) {
+    send_queue_status (session);
+  } else if (!strcmp (op, "stats")) {
+    gchar * stats = get_stats_json (app);
+    gchar * response = g_strdup_printf ("{ \"event\": \"stats\", \"stats\": %s }\n",
+        g_strchomp (stats));
+
+    socket_send_string (response, session);
+    g_free (response);
+    g_free (stats);
+  } else if (!strcmp (op, "mark")) {
+    mark_op (session, object);
+  } else if (!strcmp (op, "unmark") || !strcmp (op, "materialize")) {
+    const gchar * name = get_string_member (object, "name");
+    const gchar * reason;
+    gchar response[256];
+    guint status, queued = 0;
+
+    if (op[0] == 'u')
+      status = remove_mark (app, name, &reason);
+    else
+      status = materialize_marks (app, name, get_string_member (object,
+              name ? "path" : "dir"), &queued, &reason);
+
+    if (status) {
+      send_session_error (session, NULL, status, reason);
+    } else {
+      g_snprintf (response, sizeof(response), "{ \"event\": \"%s\", \"queued\": %u }\n",
+          op[0] == 'u' ? "unmarked" : "materializing", queued);
+      socket_send_string (response, session);
+    }
+  } else if (!strcmp (op, "activity")) {
+    gint64 start = 0, duration = 0, count = ACTIVITY_PEAKS_DEFAULT, camera = 0;
+    const gchar * reason = "couldn't parse request";
+    gchar * peaks, * response;
+    guint status = 400;
+
+    get_int_member (object, "camera", &camera);
+    get_int_member (object, "count", &count);
+    if (get_int_member (object, "start", &start) && get_int_member (object, "duration", &duration) &&
+        camera >= 0 && camera < app->cameras->len)
+      status = get_activity_peaks (app, g_ptr_array_index (app->cameras, camera), start, duration,
+          count, &peaks, &reason);
+
+    if (status) {
+      send_session_error (session, NULL, status, reason);
+    } else {
+      response = g_strdup_printf ("{ \"event\": \"activity\", \"camera\": %u, \"peaks\": %s }\n",
+          (guint) camera, peaks);
+      socket_send_string (response, session);
+      g_free (response);
+      g_free (peaks);
+    }
+  } else if (!strcmp (op, "marks")) {
+    gchar * marks = get_marks_json (app);
+    gchar * response = g_strdup_printf ("{ \"event\": \"marks\", \"marks\": %s }\n", marks);
+
+    socket_send_string (response, session);
+    g_free (response);
+    g_free (marks);
+  } else if (!strcmp (op, "shutdown")) {
+    g_main_loop_quit (app->loop);
+  } else {
+    send_session_error (session, NULL, 400, "unknown op");
+  }
+
+  g_object_unref (parser);
+}
+
+// Handle one command line.  Returns FALSE once the connection is done with.
+static gboolean handle_line (Request * request, GIOChannel * source, gchar * line)
+{
+  App * app = request->app;
+  GError *error = NULL;
+
+  // The first JSON line turns the connection into a session for good
+  if (line[0] == '{' || request->session) {
+    if (!request->session &&
+        (request->replay_active || request->bin || request->send_watch_id || request->children)) {
+      send_error_to_socket (409, "replay already in progress", request);
+      return TRUE;
+    }
+
+    if (!request->session) {
+      GST_DEBUG ("Request %u is now a session", request->id);
+      request->session = TRUE;
+      app->requests = g_list_remove (app->requests, request);
+    }
+
+    if (line[0] == '{')
+      handle_session_line (request, line);
+    else
+      send_session_error (request, NULL, 400, "sessions take JSON lines");
+    return TRUE;
+  }
+
+  if (!strcmp("shutdown", line)) {
+    g_main_loop_quit (app->loop);
+    hangup (request);
+    return FALSE;
+
+  } else if (!strcmp("query", line)) {
+    gsize bytes_written;
+    gchar * status = get_buffer_status (app);
+
+    g_io_channel_write_chars (source, status, -1, &bytes_written, &error);
+    g_io_channel_flush (source, &error);
+    g_free (status);
+    hangup (request);
+    return FALSE;
+
+  } else if (!strcmp("stats", line)) {
+    gchar * stats = get_stats_json (app);
+
+    socket_send_string (stats, request);
+    g_free (stats);
+    hangup (request);
+    return FALSE;
+
+  } else if (g_str_has_prefix(line, "mark ")) {
+    gchar ** args = g_strsplit_set (g_strstrip (&line[5]), " \t", -1);
+    glong pre = MARK_ROLL_DEFAULT_MS, post = MARK_ROLL_DEFAULT_MS, at = 0;
+    Request options = { .app = app, .camera = g_ptr_array_index (app->cameras, 0) };
+    const gchar * reason = "couldn't parse request";
+    gchar * name = NULL;
+    gboolean valid = TRUE;
+    guint status, i;
+    Mark * mark;
+
+    // mark [--camera=N] [--rendition=NAME] [--pre=MS] [--post=MS] NAME [AT]
+    for (i = 0; valid && args[i]; i++) {
+      if (!args[i][0])
+        continue;
+      if (g_str_has_prefix (args[i], "--"))
+        valid = !name && parse_mark_option (args[i], &options, &pre, &post);
+      else if (!name)
+        name = args[i];
+      else if (!at)
+        at = strtol (args[i], NULL, 10);
+      else
+        valid = FALSE;
+    }
+
+    status = valid ? add_mark (app, name, g_ptr_array_index (options.camera->renditions,
+            options.rendition_index), at, pre, post, &reason, &mark) : 400;
+
+    if (status) {
+      send_error_to_socket (status, reason, request);
+    } else {
+      gchar * json = get_mark_json (mark);
+      gchar * response = g_strdup_printf ("{ \"status\": 200, \"mark\": %s }\n", json);
+
+      socket_send_string (response, request);
+      g_free (response);
+      g_free (json);
+    }
+
+    g_strfreev (args);
+    hangup (request);
+    return FALSE;
+
+  } else if (g_str_has_prefix(line, "unmark ") || g_str_has_prefix(line, "materialize ")) {
+    gboolean unmark = line[0] == 'u';
+    gchar ** args = g_strsplit_set (g_strstrip (strchr (line, ' ')), " \t", -1);
+    const gchar * reason = "couldn't parse request";
+    gchar response[256];
+    guint status, queued = 0;
+
+    // unmark NAME, materialize NAME PATH or materialize --all DIR
+    if (unmark)
+      status = args[1] ? 400 : remove_mark (app, args[0], &reason);
+    else if (!args[1] || args[2])
+      status = 400;
+    else
+      status = materialize_marks (app, strcmp (args[0], "--all") ? args[0] : NULL,
+          args[1], &queued, &reason);
+
+    if (status) {
+      send_error_to_socket (status, reason, request);
+    } else {
+      g_snprintf (response, sizeof(response), "{ \"status\": %u, \"queued\": %u }\n",
+          unmark ? 200 : 202, queued);
+      socket_send_string (response, request);
+    }
+
+    g_strfreev (args);
+    hangup (request);
+    return FALSE;
+
+  } else if (g_str_has_prefix(line, "activity ")) {
+    Request options = { .app = app, .camera = g_ptr_array_index (app->cameras, 0) };
+    const gchar * reason = "couldn't parse request";
+    gchar * next = g_strstrip (&line[9]), * option, * peaks, * response;
+    glong start, duration, count;
+    gboolean valid = TRUE;
+    guint status;
+
+    // activity [--camera=N] START DURATION [COUNT]
+    while (valid && g_str_has_prefix (next, "--camera=")) {
+      option = next;
+      next = option + strcspn (option, " \t");
+      if (*next)
+        *next++ = '\0';
+      valid = parse_replay_option (option, &options);
+    }
+
+    start = strtol (next, &next, 10);
+    duration = strtol (next, &next, 10);
+    count = *g_strstrip (next) ? strtol (next, NULL, 10) : ACTIVITY_PEAKS_DEFAULT;
+
+    status = valid ? get_activity_peaks (app, options.camera, start, duration, count,
+        &peaks, &reason) : 400;
+
+    if (status) {
+      send_error_to_socket (status, reason, request);
+    } else {
+      response = g_strdup_printf ("{ \"status\": 200, \"camera\": %u, \"peaks\": %s }\n",
+          options.camera->index, peaks);
+      socket_send_string (response, request);
+      g_free (response);
+      g_free (peaks);
+    }
+
+    hangup (request);
+    return FALSE;
+
+  } else if (!strcmp("marks", line)) {
+    gchar * marks = get_marks_json (app);
+    gchar * response = g_strdup_printf ("{ \"status\": 200, \"marks\": %s }\n", marks);
+
+    socket_send_string (response, request);
+    g_free (response);
+    g_free (marks);
+    hangup (request);
+    return FALSE;
+
+  } else if (g_str_has_prefix(line, "snapshot ") || g_str_has_prefix(line, "thumbnails ")) {
+    gboolean thumbnails = line[0] == 't';
+    gchar ** args;
+    const gchar * reason;
+    guint status;
+
+    if (request->replay_active || request->bin || request->send_watch_id || request->children) {
+      GST_WARNING ("request %u already has a replay in progress", request->id);
+      send_error_to_socket (409, "replay already in progress", request);
+      return TRUE;
+    }
+
+    request->received_time = g_get_monotonic_time ();
+
+    args = g_strsplit_set (g_strstrip (strchr (line, ' ')), " \t", -1);
+    status = thumbnails ? start_thumbnails (request, args, &reason) :
+      start_snapshot (request, args, &reason);
+    g_strfreev (args);
+
+    // Otherwise the pool answers once the stills are done
+    if (status) {
+      GST_WARNING ("%s parameters invalid: %s", thumbnails ? "thumbnails" : "snapshot", reason);
+      send_error_to_socket (status, reason, request);
+      hangup (request);
+      return FALSE;
+    }
+
+  } else if (g_str_has_prefix(line, "batch ")) {
+    gchar * clips = g_strstrip (&line[6]);
+    const gchar * reason = "couldn't parse request";
+    gboolean valid = TRUE;
+    guint status;
+
+    if (request->replay_active || request->bin || request->send_watch_id || request->children) {
+      GST_WARNING ("request %u already has a replay in progress", request->id);
+      send_error_to_socket (409, "replay already in progress", request);
+      return TRUE;
+    }
+
+    request->received_time = g_get_monotonic_time ();
+
+    // Options for every clip come first
+    while (valid && g_str_has_prefix (clips, "--")) {
+      gchar * option = clips;
+
+      clips = option + strcspn (option, " \t");
+      if (*clips)
+        *clips++ = '\0';
+      clips = g_strchug (clips);
+      valid = parse_replay_option (option, request);
+    }
+
+    status = valid ? check_batch_options (request, &reason) : 400;
+    if (!status)
+      status = parse_batch_clips (request, clips, &reason);
+
+    if (status) {
+      GST_WARNING ("batch parameters invalid: %s", reason);
+      if (request->batch)
+        clear_batch (request);
+      send_error_to_socket (status, reason, request);
+      hangup (request);
+      return FALSE;
+    }
+
+    if (app->active_replays >= app->max_replays) {
+      GST_WARNING ("rejecting request %u: %u replays already active",
+          request->id, app->active_replays);
+      clear_batch (request);
+      send_error_to_socket (503, "too many concurrent replays", request);
+      hangup (request);
+      return FALSE;
+    }
+
+    GST_INFO ("Request %u exporting %u clips in one pass", request->id, request->batch->len);
+    begin_replay (request);
+
+  } else if (g_str_has_prefix(line, "replay ")) {
+    glong start = 0;
+    glong duration = 0;
+    gchar * next = &line[7];
+    gchar * filepath;
+    gboolean valid = TRUE;
+    const gchar * reason;
+    guint status;
+
+    if (request->replay_active || request->bin || request->send_watch_id || request->children) {
+      GST_WARNING ("request %u already has a replay in progress", request->id);
+      send_error_to_socket (409, "replay already in progress", request);
+      return TRUE;
+    }
+
+    request->received_time = g_get_monotonic_time ();
+
+    // Parse out params: start duration filepath
+    start = strtol(next, &next, 10);
+    if (!start && errno == EINVAL)
+      valid = FALSE;
+    duration = strtol(next, &next, 10);
+    filepath = g_strstrip(next);
+
+    // Options come before the filepath
+    while (valid && g_str_has_prefix (filepath, "--")) {
+      gchar * option = filepath;
+
+      filepath = option + strcspn (option, " \t");
+      if (*filepath)
+        *filepath++ = '\0';
+      filepath = g_strchug (filepath);
+      valid = parse_replay_option (option, request);
+    }
+
+    status = valid ? setup_replay (request, start, duration, filepath, &reason) : 400;
+    if (!valid)
+      reason = "couldn't parse request";
+
+    if (status) {
+      GST_WARNING ("command parameters invalid");
+      send_error_to_socket (status, reason, request);
+      hangup (request);
+      return FALSE;
+    }
+
+    if (app->active_replays + MAX (count_cameras (request->camera_set), 1) > app->max_replays) {
+      GST_WARNING ("rejecting request %u: %u replays already active",
+          request->id, app->active_replays);
+      send_error_to_socket (503, "too many concurrent replays", request);
+      hangup (request);
+      return FALSE;
+    }
+
+    begin_replay (request);
+  } else {
+    GST_INFO ("Unrecognized command");
+  }
+
+  return TRUE;
+}
+
+gboolean io_callback(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  GError *error = NULL;
+  GString *buffer = g_string_new(NULL);
+  Request * request = data;
+  gboolean keep = TRUE;
+
+  switch (g_io_channel_read_line_string(source, buffer, NULL, &error)) {
+    case G_IO_STATUS_NORMAL:
+      g_strstrip(buffer->str);
+      if (!strcmp (buffer->str, ""))
+        break;
+      GST_DEBUG("received command %s", buffer->str);
+      keep = handle_line (request, source, buffer->str);
+      break;
+    case G_IO_STATUS_ERROR:
+      GST_ERROR ("G_IO_STATUS_ERROR: %s", error->message);
+      g_error_free (error);
+      hangup (request);
+      keep = FALSE;
+      break;
+    case G_IO_STATUS_EOF:
+      GST_INFO ("Client disappeared");
+      hangup (request);
+      keep = FALSE;
+      break;
+    case G_IO_STATUS_AGAIN:
+      break;
+    default:
+      g_string_free (buffer, TRUE);
+      g_return_val_if_reached(FALSE);
+  }
+
+  g_string_free (buffer, TRUE);
+  return keep;
+}
+
+static gboolean
+incoming_callback  (GSocketService *service,
+                    GSocketConnection *connection,
+                    GObject *source_object,
+                    gpointer user_data)
+{
+  GError * error = NULL;
+  App * app = user_data;
+  Request * request = request_new (app);
+
+  app->requests = g_list_append (app->requests, request);
+
+  GST_DEBUG ("Received connection from client (request %u)", request->id);
+  g_object_ref (connection);
+  request->connection = connection;
+
+  GIOChannel *channel = g_io_channel_unix_new (get_file_descriptor (request));
+  request->socket_watcher_id = g_io_add_watch (channel, G_IO_IN, (GIOFunc) io_callback, request);
+  g_io_channel_set_encoding (channel, NULL, &error);
+  g_io_channel_set_close_on_unref (channel, TRUE);
+  return TRUE;
+}
+
+// Serve the Prometheus text for any GET on the metrics port.  This runs in
+// the threaded service's own thread, so a slow scraper can't stall replays.
+static gboolean
+metrics_callback (GThreadedSocketService *service,
+                  GSocketConnection *connection,
+                  GObject *source_object,
+                  gpointer user_data)
+{
+  App * app = user_data;
+  GInputStream * input = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  GOutputStream * output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  gchar request[4096];
+  gchar header[256];
+  gchar * body;
+  gssize received;
+
+  // One read gets the request line; anything past it is of no interest
+  received = g_input_stream_read (input, request, sizeof(request) - 1, NULL, NULL);
+  if (received <= 0)
+    return TRUE;
+  request[received] = '\0';
+
+  if (!g_str_has_prefix (request, "GET ")) {
+    const gchar * refusal = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n";
+
+    g_output_stream_write_all (output, refusal, strlen (refusal), NULL, NULL, NULL);
+    return TRUE;
+  }
+
+  body = get_metrics_text (app);
+  g_snprintf (header, sizeof(header),
+      "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+      strlen (body));
+  if (g_output_stream_write_all (output, header, strlen (header), NULL, NULL, NULL))
+    g_output_stream_write_all (output, body, strlen (body), NULL, NULL, NULL);
+  g_free (body);
+
+  return TRUE;
+}
+
+static const gchar * http_reason (guint status)
+{
+  switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+  }
+}
+
+static void send_http (GOutputStream * output, guint status, const gchar * content_type,
+    const gchar * cache_control, gconstpointer body, gsize size)
+{
+  gchar header[512];
+
+  g_snprintf (header, sizeof(header), "HTTP/1.1 %u %s\r\nContent-Type: %s\r\n"
+      "Content-Length: %zu\r\nCache-Control: %s\r\nAccess-Control-Allow-Origin: *\r\n"
+      "Connection: close\r\n\r\n", status, http_reason (status), content_type, size,
+      cache_control);
+  if (g_output_stream_write_all (output, header, strlen (header), NULL, NULL, NULL) && size)
+    g_output_stream_write_all (output, body, size, NULL, NULL, NULL);
+}
+
+static gchar * get_master_playlist (Camera * camera)
+{
+  GString * out = g_string_new ("#EXTM3U\n#EXT-X-VERSION:9\n#EXT-X-INDEPENDENT-SEGMENTS\n");
+  gchar codecs[32];
+  guint i;
+
+  for (i = 0; i < camera->renditions->len; i++) {
+    Rendition * rendition = g_ptr_array_index (camera->renditions, i);
+
+    if (!hls_publisher_get_codecs (rendition->hls, codecs, sizeof(codecs)))
+      continue;
+    g_string_append_printf (out, "#EXT-X-STREAM-INF:BANDWIDTH=%d,RESOLUTION=%dx%d,"
+        "CODECS=\"%s\"\n%s/playlist.m3u8\n", rendition->bitrate * 1000, rendition->width,
+        rendition->height, codecs, rendition->name);
+  }
+
+  return g_string_free (out, FALSE);
+}
+
+static guint get_hls_status (GError * error)
+{
+  if (error->domain != HLS_ERROR)
+    return 500;
+
+  switch (error->code) {
+    case HLS_ERROR_NOT_FOUND:
+    case HLS_ERROR_GONE:
+      return 404;
+    case HLS_ERROR_TIMEOUT:
+      return 503;
+    default:
+      return 400;
+  }
+}
+
+// One HLS resource by path: /camN/master.m3u8, or under /camN/RENDITION/
+// playlist.m3u8 (with _HLS_msn and _HLS_part to block for an update),
+// init.mp4, seg-MSN.m4s or part-MSN.PART.m4s.  Returns the HTTP status.
+static guint serve_hls (App * app, const gchar * path, const gchar * query,
+    const gchar ** content_type, GBytes ** body)
+{
+  gchar ** names = g_strsplit (path[0] == '/' ? path + 1 : path, "/", 4);
+  Camera * camera = NULL;
+  Rendition * rendition = NULL;
+  GError * error = NULL;
+  guint64 msn;
+  guint camera_index, i, part;
+  gint end = 0;
+  guint status = 200;
+
+  *body = NULL;
+
+  if (names[0] && g_str_has_prefix (names[0], "cam") &&
+      parse_camera_index (names[0] + 3, app, &camera_index))
+    camera = g_ptr_array_index (app->cameras, camera_index);
+
+  for (i = 0; camera && names[1] && names[2] && i < camera->renditions->len; i++) {
+    if (!strcmp (((Rendition *) g_ptr_array_index (camera->renditions, i))->name, names[1]))
+      rendition = g_ptr_array_index (camera->renditions, i);
+  }
+
+  if (camera && names[1] && !names[2] && !strcmp (names[1], "master.m3u8")) {
+    gchar * playlist = get_master_playlist (camera);
+
+    *content_type = "application/vnd.apple.mpegurl";
+    *body = g_bytes_new_take (playlist, strlen (playlist));
+  } else if (!rendition || names[3]) {
+    status = 404;
+  } else if (!strcmp (names[2], "playlist.m3u8")) {
+    gchar ** params = g_strsplit (query ? query : "", "&", -1);
+    gint64 block_msn = -1, block_part = -1;
+    gchar * playlist;
+
+    for (i = 0; params[i]; i++) {
+      if (g_str_has_prefix (params[i], "_HLS_msn="))
+        block_msn = g_ascii_strtoll (params[i] + 9, NULL, 10);
+      else if (g_str_has_prefix (params[i], "_HLS_part="))
+        block_part = g_ascii_strtoll (params[i] + 10, NULL, 10);
+    }
+    g_strfreev (params);
+
+    playlist = block_part >= 0 && block_msn < 0 ? NULL :
+      hls_publisher_get_playlist (rendition->hls, block_msn, block_part,
+          get_wall_offset (app), &error);
+    *content_type = "application/vnd.apple.mpegurl";
+    if (playlist)
+      *body = g_bytes_new_take (playlist, strlen (playlist));
+    else if (!error)
+      status = 400;
+  } else if (!strcmp (names[2], "init.mp4")) {
+    *content_type = "video/mp4";
+    *body = hls_publisher_get_init (rendition->hls, &error);
+  } else if (sscanf (names[2], "seg-%" G_GUINT64_FORMAT ".m4s%n", &msn, &end) == 1 &&
+      !names[2][end]) {
+    *content_type = "video/iso.segment";
+    *body = hls_publisher_get_segment (rendition->hls, msn, &error);
+  } else if (sscanf (names[2], "part-%" G_GUINT64_FORMAT ".%u.m4s%n", &msn, &part, &end) == 2 &&
+      !names[2][end]) {
+    *content_type = "video/iso.segment";
+    *body = hls_publisher_get_part (rendition->hls, msn, part, &error);
+  } else {
+    status = 404;
+  }
+
+  if (error) {
+    GST_DEBUG ("HLS request for %s failed: %s", path, error->message);
+    status = get_hls_status (error);
+    g_error_free (error);
+  }
+
+  g_strfreev (names);
+  return status;
+}
+
+// Serve live HLS to any number of viewers.  This runs on the threaded
+// service's own threads, which blocking playlist and part requests may hold
+// for a few seconds, so nothing here touches the main loop.
+static gboolean
+hls_callback (GThreadedSocketService *service,
+              GSocketConnection *connection,
+              GObject *source_object,
+              gpointer user_data)
+{
+  App * app = user_data;
+  GInputStream * input = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  GOutputStream * output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  const gchar * content_type = "text/plain";
+  gchar request[4096];
+  gchar * path, * query;
+  GBytes * body = NULL;
+  gconstpointer data = NULL;
+  gsize size = 0;
+  gssize received;
+  guint status;
+
+  received = g_input_stream_read (input, request, sizeof(request) - 1, NULL, NULL);
+  if (received <= 0)
+    return TRUE;
+  request[received] = '\0';
+
+  if (!g_str_has_prefix (request, "GET ")) {
+    send_http (output, 405, content_type, "no-cache", NULL, 0);
+    return TRUE;
+  }
+
+  path = request + 4;
+  path[strcspn (path, " \r\n")] = '\0';
+  if ((query = strchr (path, '?')))
+    *query++ = '\0';
+
+  status = serve_hls (app, path, query, &content_type, &body);
+  if (body)
+    data = g_bytes_get_data (body, &size);
+
+  // Playlists change every part; everything else never changes once it exists
+  send_http (output, status, status == 200 ? content_type : "text/plain",
+      status == 200 && !g_str_has_suffix (path, ".m3u8") ? "max-age=3600" : "no-cache",
+      data, size);
+
+  g_mutex_lock (&app->metrics_lock);
+  app->hls_requests++;
+  app->hls_bytes += size;
+  g_mutex_unlock (&app->metrics_lock);
+
+  if (body)
+    g_bytes_unref (body);
+  return TRUE;
+}
+
+static gboolean
+replay_bus_call (GstBus *bus, GstMessage *msg, gpointer data)
+{
+  Request * request = data;
+
+  switch (GST_MESSAGE_TYPE (msg)) {
+
+    case GST_MESSAGE_EOS:
+      GST_DEBUG ("Finished writing stream to %s", request->file_location);
+      drop_bin (request);
+      if (request->fragmented) {
+        GST_INFO ("Request %u finished streaming in %ldms", request->id, request_latency_ms (request));
+        record_replay_done (request, TRUE);
+        hangup (request);
+      } else {
+        deliver_clip (request);
       }
       break;
-    case G_IO_STATUS_ERROR:
-      GST_ERROR ("G_IO_STATUS_ERROR: %s", error->message);
-      g_error_free (error);
-      hangup (app);
-      return FALSE;
-    case G_IO_STATUS_EOF:
-      GST_INFO ("Client disappeared");
-      hangup (app);
-      return FALSE;
-    case G_IO_STATUS_AGAIN:
-      break;
+
+    case GST_MESSAGE_ERROR:
+      {
+        gchar  *debug;
+        GError *error;
+
+        gst_message_parse_error (msg, &error, &debug);
+
+        GST_ERROR ("Error writing %s: %s", request->file_location, error->message);
+        g_error_free (error);
+
+        GST_ERROR ("Debugging info: %s", (debug) ? debug : "none");
+        g_free (debug);
+
+        fail_replay (500, "error writing clip", request);
+        break;
+      }
     default:
-      g_return_val_if_reached(FALSE);
+      break;
   }
+
   return TRUE;
 }
 
 static gboolean
-incoming_callback  (GSocketService *service,
-                    GSocketConnection *connection,
-                    GObject *source_object,
-                    gpointer user_data)
+head_bus_call (GstBus *bus, GstMessage *msg, gpointer data)
 {
-  GError * error = NULL;
-  App * app = user_data;
+  Request * request = data;
 
-  GST_DEBUG ("Received connection from client");
-  g_object_ref (connection);
-  app->connection = connection;
+  switch (GST_MESSAGE_TYPE (msg)) {
+
+    case GST_MESSAGE_EOS:
+      finish_head (request);
+      break;
+
+    case GST_MESSAGE_ERROR:
+      {
+        gchar  *debug;
+        GError *error;
+
+        gst_message_parse_error (msg, &error, &debug);
+
+        GST_ERROR ("Error re-encoding start of %s: %s", request->file_location, error->message);
+        g_error_free (error);
+
+        GST_ERROR ("Debugging info: %s", (debug) ? debug : "none");
+        g_free (debug);
+
+        fail_replay (500, "error re-encoding clip start", request);
+        break;
+      }
+    default:
+      break;
+  }
 
-  GIOChannel *channel = g_io_channel_unix_new (get_file_descriptor (app));
-  app->socket_watcher_id = g_io_add_watch (channel, G_IO_IN, (GIOFunc) io_callback, app);
-  g_io_channel_set_encoding (channel, NULL, &error);
-  g_io_channel_set_close_on_unref (channel, TRUE);
   return TRUE;
 }
 
 static gboolean
 bus_call (GstBus *bus, GstMessage *msg, gpointer data)
 {
-  App * app = data;
-  gchar buffer[1024];
+  Camera * camera = data;
+  App * app = camera->app;
 
   switch (GST_MESSAGE_TYPE (msg)) {
 
     case GST_MESSAGE_EOS:
-      GST_DEBUG ("Finished writing stream to %s", app->file_location);
-      GST_DEBUG ("buffer status is now: %s", get_buffer_status (buffer, app));
-      send_result_to_socket (app);
-      drop_bin (app);
-      hangup (app);
+      GST_WARNING ("Capture pipeline of camera %u reached end of stream", camera->index);
+      g_main_loop_quit (app->loop);
       break;
 
     case GST_MESSAGE_ERROR:
@@ -498,7 +4383,7 @@ bus_call (GstBus *bus, GstMessage *msg, gpointer data)
 
         gst_message_parse_error (msg, &error, &debug);
 
-        GST_ERROR ("Error: %s", error->message);
+        GST_ERROR ("Error on camera %u: %s", camera->index, error->message);
         g_error_free (error);
 
         GST_ERROR ("Debugging info: %s", (debug) ? debug : "none");
@@ -514,119 +4399,443 @@ bus_call (GstBus *bus, GstMessage *msg, gpointer data)
   return TRUE;
 }
 
-int
-main (int argc, char *argv[])
+typedef struct {
+  gchar * name;
+  gint width;
+  gint height;
+  gint bitrate;
+} RenditionSpec;
+
+// Capture and retention settings shared by every camera.
+typedef struct {
+  GArray * renditions;
+  gint speed_preset;
+  gint retention_time;
+  gint retention_bytes;
+  gchar * spill_dir;
+  gint spill_size;
+  gint segment_size;
+  gint memory_time;
+  gint memory_bytes;
+  gint hls_part_ms;
+  gchar * journal_dir;
+  gint capture_width;
+  gint capture_height;
+  gint capture_fps;
+  gint encoder_threads;
+  gboolean sliced_threads;
+  gint lookahead;
+  GArray * cpu_sets;
+  gboolean verbose;
+} CameraSettings;
+
+// Parse NAME:WIDTHxHEIGHT:BITRATE[,...], e.g. full:1920x1080:5000,proxy:960x540:800
+static GArray * parse_rendition_specs (const gchar * str)
 {
-  GstBus *bus;
-  guint bus_watch_id;
-  App app_data;
-  App * app = &app_data;
-  GOptionContext * option_context;
+  GArray * specs = g_array_new (FALSE, FALSE, sizeof(RenditionSpec));
+  gchar ** items = g_strsplit (str, ",", -1);
+  guint i, j;
+
+  for (i = 0; items[i]; i++) {
+    gchar ** fields = g_strsplit (g_strstrip (items[i]), ":", 3);
+    RenditionSpec spec = { 0, };
+
+    // The name ends up in element names and spill paths
+    if (g_strv_length (fields) != 3 || !fields[0][0] ||
+        fields[0][strspn (fields[0], RENDITION_NAME_CHARS)] != '\0' ||
+        sscanf (fields[1], "%dx%d", &spec.width, &spec.height) != 2 ||
+        spec.width <= 0 || spec.height <= 0 || (spec.bitrate = atoi (fields[2])) <= 0) {
+      g_error ("invalid rendition '%s' (want NAME:WIDTHxHEIGHT:BITRATE)", items[i]);
+    }
+
+    for (j = 0; j < specs->len; j++) {
+      if (!strcmp (g_array_index (specs, RenditionSpec, j).name, fields[0]))
+        g_error ("rendition '%s' given twice", fields[0]);
+    }
+
+    spec.name = g_strdup (fields[0]);
+    g_array_append_val (specs, spec);
+    g_strfreev (fields);
+  }
+
+  g_strfreev (items);
+
+  return specs;
+}
+
+// Parse WIDTHxHEIGHT@FPS, e.g. 3840x2160@60
+static void parse_capture (const gchar * str, CameraSettings * settings)
+{
+  if (sscanf (str, "%dx%d@%d", &settings->capture_width, &settings->capture_height,
+          &settings->capture_fps) != 3 ||
+      settings->capture_width <= 0 || settings->capture_width > CAPTURE_MAX_WIDTH ||
+      settings->capture_height <= 0 || settings->capture_height > CAPTURE_MAX_HEIGHT ||
+      settings->capture_fps <= 0 || settings->capture_fps > CAPTURE_MAX_FPS ||
+      (gint64) settings->capture_width * settings->capture_height * settings->capture_fps >
+        CAPTURE_MAX_PIXEL_RATE) {
+    g_error ("invalid capture '%s' (want WIDTHxHEIGHT@FPS, up to %dx%d@60 or %d fps at 1080p)",
+        str, CAPTURE_MAX_WIDTH, CAPTURE_MAX_HEIGHT, CAPTURE_MAX_FPS);
+  }
+}
+
+// Parse CPUS[;CPUS...], one set per camera, each a list of CPUs and ranges
+// such as 0-3,8-11.  Cameras past the last set start over from the first.
+static GArray * parse_cpu_sets (const gchar * str)
+{
+  GArray * sets = g_array_new (FALSE, FALSE, sizeof(cpu_set_t));
+  gchar ** items = g_strsplit (str, ";", -1);
+  guint i, j;
+
+  for (i = 0; items[i]; i++) {
+    gchar ** ranges = g_strsplit (g_strstrip (items[i]), ",", -1);
+    cpu_set_t set;
+
+    CPU_ZERO (&set);
+    for (j = 0; ranges[j]; j++) {
+      gint first, last, cpu;
+      gint n = sscanf (ranges[j], "%d-%d", &first, &last);
+
+      if (n == 1)
+        last = first;
+      if (n < 1 || first < 0 || last < first || last >= CPU_SETSIZE)
+        g_error ("invalid CPU set '%s' (want a list like 0-3,8)", items[i]);
+      for (cpu = first; cpu <= last; cpu++)
+        CPU_SET (cpu, &set);
+    }
+
+    g_array_append_val (sets, set);
+    g_strfreev (ranges);
+  }
+
+  g_strfreev (items);
+
+  return sets;
+}
+
+static ReplayRing * create_ring (guint camera_index, const gchar * rendition_name,
+    CameraSettings * settings)
+{
+  ReplayRing * ring = replay_ring_new (settings->retention_time * GST_SECOND,
+      (guint64) settings->retention_bytes * MEGABYTE);
   GError * error = NULL;
-  gint port = -1,
-       device_number = DEVICE_NUMBER_TEST,
-       bitrate = BITRATE_DEFAULT,
-       speed_preset = X264_SPEED_PRESET_DEFAULT;
-  gboolean verbose = VERBOSE_DEFAULT;
 
-  GOptionEntry option_entries[] = {
-    { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port to listen on (default 2000)", "PORT" },
-    { "device-number", 'd', 0, G_OPTION_ARG_INT, &device_number, "Camera to use", "DEVICE_NUMBER" },
-    { "speed-preset", 's', 0, G_OPTION_ARG_INT, &speed_preset, "x264 speed preset" },
-    { "bitrate", 's', 0, G_OPTION_ARG_INT, &bitrate, "x264 bitrate" },
-    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Verbose (shows caps negotiation)" },
-    { NULL }
-  };
+  if (settings->spill_dir) {
+    gchar dir_name[16];
+    gchar * dir;
+    SegmentStore * store;
 
-  gst_init (&argc, &argv);
-  GST_DEBUG_CATEGORY_INIT (camsrc, "camsrc", 0, "camera source");
+    g_snprintf (dir_name, sizeof(dir_name), "cam%u", camera_index);
+    dir = g_build_filename (settings->spill_dir, dir_name, rendition_name, NULL);
+    store = segment_store_new (dir,
+        MAX (settings->spill_size / MAX (settings->segment_size, 1), 2),
+        (gsize) settings->segment_size * MEGABYTE, &error);
+    g_free (dir);
 
-  option_context = g_option_context_new ("- start queue-buffered video server");
-  g_option_context_add_main_entries (option_context, option_entries, NULL);
-  g_option_context_parse (option_context, &argc, &argv, &error);
-  g_option_context_free (option_context);
+    if (!store) {
+      g_error ("error setting up spill segments %s", error->message);
+    }
 
-  // If no port specified, we use PORT + device_number (unless we're also testing,
-  // in which case we just use PORT).
-  if (port < 0) {
-    port = device_number == DEVICE_NUMBER_TEST ? PORT : PORT + device_number;
+    replay_ring_set_spill (ring, store,
+        settings->memory_time * GST_SECOND, (guint64) settings->memory_bytes * MEGABYTE);
   }
 
-  /* set up socket */
-  GSocketService * service = g_socket_service_new ();
-  g_socket_listener_add_inet_port ((GSocketListener*)service, port, NULL, &error);
+  return ring;
+}
 
-  if (error) {
-    g_error ("error setting up socket %s", error->message);
+// Put what the rendition's journal kept from before a restart back in its
+// ring, report how that went, and journal from here on.
+static Journal * open_journal (Rendition * rendition, CameraSettings * settings)
+{
+  App * app = rendition->camera->app;
+  JournalRecovery recovery;
+  Journal * journal;
+  GError * error = NULL;
+  GstClockTime now = get_stream_time (app);
+  gchar dir_name[16];
+  gchar * dir;
+
+  g_snprintf (dir_name, sizeof(dir_name), "cam%u", rendition->camera->index);
+  dir = g_build_filename (settings->journal_dir, dir_name, rendition->name, NULL);
+  journal = journal_open (dir, settings->retention_time * GST_SECOND,
+      (guint64) settings->retention_bytes * MEGABYTE, &error);
+  g_free (dir);
+
+  if (!journal) {
+    g_error ("error opening journal %s", error->message);
   }
 
-  g_signal_connect (service, "incoming", G_CALLBACK (incoming_callback), app);
-  g_socket_service_start (service);
+  journal_recover (journal, get_wall_offset (app), now,
+      (JournalRecoverFunc) replay_ring_restore, rendition->ring, &recovery);
+  if (recovery.caps)
+    replay_ring_set_caps (rendition->ring, recovery.caps);
+
+  if (recovery.gops) {
+    g_printf ("cam%u/%s: recovered %.1fs of footage ending %.1fs ago (%u GOPs, %.1f MB from "
+        "%u files%s) in %.1f ms", rendition->camera->index, rendition->name,
+        (gdouble) (recovery.last_pts - recovery.first_pts) / GST_SECOND,
+        (gdouble) (now - recovery.last_pts) / GST_SECOND, recovery.gops,
+        (gdouble) recovery.bytes / MEGABYTE, recovery.files,
+        recovery.moved ? ", moved across a reboot" : "", recovery.elapsed / 1000.0);
+  } else {
+    g_printf ("cam%u/%s: no footage to recover (%.1f ms)", rendition->camera->index,
+        rendition->name, recovery.elapsed / 1000.0);
+  }
+  if (recovery.damaged)
+    g_printf ("; lost %u damaged records (%.1fs indexed)", recovery.damaged,
+        (gdouble) recovery.damaged_time / GST_SECOND);
+  g_printf ("\n");
 
-  app->loop = g_main_loop_new (NULL, FALSE);
-  app->blockpad_probe_id = 0;
-  app->srcpad_probe_id = 0;
-  app->connection = NULL;
-  strcpy(app->file_location, "/dev/null");
+  journal_recovery_clear (&recovery);
+  return journal;
+}
+
+// queue ! [videoscale ! capsfilter !] x264enc ! appsink, hanging off the tee.
+static Rendition * create_rendition (Camera * camera, GstElement * tee,
+    RenditionSpec * spec, gint capture_width, gint capture_height, CameraSettings * settings)
+{
+  Rendition * rendition = g_new0 (Rendition, 1);
+  gboolean scaled = spec->width != capture_width || spec->height != capture_height;
+  GstElement * scaler = NULL, * scale_filter = NULL, * ringsink;
+  gchar name[64];
+
+  rendition->camera = camera;
+  rendition->name = g_strdup (spec->name);
+  rendition->width = spec->width;
+  rendition->height = spec->height;
+  rendition->bitrate = spec->bitrate;
+  rendition->current_bitrate = spec->bitrate;
+  rendition->ring = create_ring (camera->index, spec->name, settings);
+  if (settings->journal_dir)
+    rendition->journal = open_journal (rendition, settings);
+  if (settings->hls_part_ms > 0)
+    rendition->hls = hls_publisher_new (rendition->ring, settings->hls_part_ms * GST_MSECOND);
+  rendition->fps_window_start = GST_CLOCK_TIME_NONE;
+
+  g_snprintf (name, sizeof(name), "upstream-queue-%s", spec->name);
+  rendition->queue = gst_element_factory_make ("queue", name);
+  g_snprintf (name, sizeof(name), "video-encoder-%s", spec->name);
+  rendition->encoder = gst_element_factory_make ("x264enc", name);
+  g_snprintf (name, sizeof(name), "ringbuffer-sink-%s", spec->name);
+  ringsink = gst_element_factory_make ("appsink", name);
+
+  if (scaled) {
+    g_snprintf (name, sizeof(name), "video-scale-%s", spec->name);
+    scaler = gst_element_factory_make ("videoscale", name);
+    g_snprintf (name, sizeof(name), "scale-filter-%s", spec->name);
+    scale_filter = gst_element_factory_make ("capsfilter", name);
+  }
+
+  if (!rendition->queue || !rendition->encoder || !ringsink ||
+      (scaled && (!scaler || !scale_filter))) {
+    GST_ERROR ("An element of rendition %s could not be created. Exiting.", spec->name);
+    exit (-1);
+  }
+
+  // A second of raw frames to ride out a busy moment, however big they are
+  // (the default byte limit holds barely three at 1080p)
+  g_object_set (rendition->queue,
+      "max-size-time", (guint64) ENCODER_QUEUE_MS * GST_MSECOND,
+      "max-size-bytes", 0,
+      "max-size-buffers", 0,
+      NULL);
+
+  // A GOP a second whatever the frame rate; HLS parts and eviction assume it
+  g_object_set (rendition->encoder,
+      "key-int-max", settings->capture_fps,
+      "speed-preset", settings->speed_preset,
+      "bitrate", spec->bitrate,
+      "threads", settings->encoder_threads,
+      "sliced-threads", settings->sliced_threads,
+      NULL);
+  if (settings->lookahead >= 0)
+    g_object_set (rendition->encoder, "rc-lookahead", settings->lookahead, NULL);
+
+  // Every encoded access unit goes into the replay ring; replays read it from there
+  GstCaps * h264_caps = gst_caps_new_simple ("video/x-h264",
+      "stream-format", G_TYPE_STRING, "avc",
+      "alignment", G_TYPE_STRING, "au",
+      NULL);
+  GstAppSinkCallbacks ring_callbacks = { .new_sample = ring_new_sample_cb };
+
+  g_object_set (ringsink,
+      "caps", h264_caps,
+      "sync", FALSE,
+      NULL);
+  gst_caps_unref (h264_caps);
+  gst_app_sink_set_callbacks (GST_APP_SINK (ringsink), &ring_callbacks, rendition, NULL);
+
+  gst_bin_add_many (GST_BIN (camera->pipeline), rendition->queue, rendition->encoder, ringsink, NULL);
+
+  if (scaled) {
+    GstCaps * caps = gst_caps_new_simple ("video/x-raw",
+        "width", G_TYPE_INT, spec->width,
+        "height", G_TYPE_INT, spec->height,
+        NULL);
+
+    g_object_set (scale_filter, "caps", caps, NULL);
+    gst_caps_unref (caps);
+
+    gst_bin_add_many (GST_BIN (camera->pipeline), scaler, scale_filter, NULL);
+    gst_element_link_many (tee, rendition->queue, scaler, scale_filter,
+        rendition->encoder, ringsink, NULL);
+  } else {
+    gst_element_link_many (tee, rendition->queue, rendition->encoder, ringsink, NULL);
+  }
+
+  GstPad * encoder_pad = gst_element_get_static_pad (rendition->encoder, "src");
+  gst_pad_add_probe (encoder_pad, GST_PAD_PROBE_TYPE_BUFFER, encoded_probe_cb, rendition, NULL);
+  gst_object_unref (encoder_pad);
+
+  return rendition;
+}
+
+static void free_rendition (Rendition * rendition)
+{
+  if (rendition->journal)
+    journal_free (rendition->journal);
+  if (rendition->hls)
+    hls_publisher_free (rendition->hls);
+  replay_ring_free (rendition->ring);
+  g_free (rendition->name);
+  g_free (rendition);
+}
+
+// Pin each streaming thread of a camera's pipelines (capture, encoders and
+// its replays') to the camera's CPUs as it starts; the message comes from
+// the new thread itself.  x264 starts its workers from the encoder's thread,
+// so they inherit the mask.
+static GstBusSyncReply
+pin_thread_cb (GstBus * bus, GstMessage * message, gpointer data)
+{
+  Camera * camera = data;
+  GstStreamStatusType type;
+  GstElement * owner;
+  gint err;
+
+  if (GST_MESSAGE_TYPE (message) != GST_MESSAGE_STREAM_STATUS)
+    return GST_BUS_PASS;
+
+  gst_message_parse_stream_status (message, &type, &owner);
+  if (type == GST_STREAM_STATUS_TYPE_ENTER &&
+      (err = pthread_setaffinity_np (pthread_self (), sizeof(cpu_set_t), &camera->cpus)) != 0)
+    GST_WARNING ("Couldn't pin a thread of camera %u: %s", camera->index, g_strerror (err));
+
+  return GST_BUS_PASS;
+}
+
+// What the source can deliver as configured.  Its template only says what
+// the element could ever produce, so open the device (READY) and ask it,
+// then close it again for the pipeline to start.  NULL if it won't open.
+static GstCaps * query_source_caps (GstElement * source, const gchar * pad_name)
+{
+  GstPad * pad;
+  GstCaps * source_caps;
+
+  if (gst_element_set_state (source, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE) {
+    gst_element_set_state (source, GST_STATE_NULL);
+    return NULL;
+  }
+
+  pad = gst_element_get_static_pad (source, pad_name);
+  source_caps = gst_pad_query_caps (pad, NULL);
+  gst_object_unref (pad);
+  gst_element_set_state (source, GST_STATE_NULL);
+
+  return source_caps;
+}
+
+// The card's own mode for our capture caps, e.g. 2160p60.  Modes fix the
+// whole frame and nothing between the card and the encoders scales, so
+// there has to be one matching size and rate exactly.
+static gint decklink_mode (GstElement * source, const CameraSettings * settings)
+{
+  // The frame width each mode's line count comes with
+  static const struct { gint width, height; } sizes[] = {
+    { 1280, 720 }, { 1920, 1080 }, { 2048, 1556 }, { 3840, 2160 }
+  };
+  GParamSpec * pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (source), "mode");
+  GEnumValue * value = NULL;
+  gchar nick[16];
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+    if (sizes[i].width == settings->capture_width && sizes[i].height == settings->capture_height) {
+      g_snprintf (nick, sizeof(nick), "%dp%d", settings->capture_height, settings->capture_fps);
+      value = g_enum_get_value_by_nick (G_PARAM_SPEC_ENUM (pspec)->enum_class, nick);
+      break;
+    }
+  }
+
+  if (!value)
+    g_error ("no DeckLink mode captures %dx%d@%d", settings->capture_width,
+        settings->capture_height, settings->capture_fps);
+
+  return value->value;
+}
+
+// Build (but don't start) the capture pipeline for one input.
+static Camera * create_camera (App * app, guint index, gint device_number,
+    CameraSettings * settings)
+{
+  Camera * camera = g_new0 (Camera, 1);
+  GstCaps * source_caps;
+  GstBus * bus;
+  gchar name[32];
+  guint i;
+
+  camera->app = app;
+  camera->index = index;
+  camera->device_number = device_number;
+  camera->last_capture = GST_CLOCK_TIME_NONE;
+  camera->renditions = g_ptr_array_new_with_free_func ((GDestroyNotify) free_rendition);
+  camera->activity_meter = activity_meter_new ();
+  camera->activity = activity_index_new (settings->retention_time * GST_SECOND);
 
   /* Create gstreamer elements */
-  app->pipeline          = gst_pipeline_new ("camsrc");
+  g_snprintf (name, sizeof(name), "camsrc-%u", index);
+  camera->pipeline       = gst_pipeline_new (name);
+
+  // Every camera runs on the same monotonic clock, so their stream times
+  // line up (a capture card would otherwise offer its own)
+  gst_pipeline_use_clock (GST_PIPELINE (camera->pipeline), app->clock);
 
   GstElement * source,
              * filter    = gst_element_factory_make ("capsfilter", "caps-filter"),
              * videorate = gst_element_factory_make ("videorate", "video-rate"),
              * converter = gst_element_factory_make ("videoconvert", "video-convert"),
-             * queue1    = gst_element_factory_make ("queue", "upstream-queue"),
-             * encoder   = gst_element_factory_make ("x264enc", "video-encoder");
-
-  app->queue2            = gst_element_factory_make ("queue", "ringbuffer-queue");
-  app->bin               = create_bin (app);
+             * tee       = gst_element_factory_make ("tee", "rendition-tee");
 
   if (device_number == DEVICE_NUMBER_TEST) {
     source = gst_element_factory_make ("videotestsrc", "video-source");
-    g_object_set (source, "is-live", TRUE, NULL);
+    // Simulated sources run as fast as the encoders keep up
+    g_object_set (source, "is-live", !app->simulate, NULL);
     /*g_object_set (source, "pattern", 18, NULL);*/
   } else {
     source = gst_element_factory_make ("decklinksrc", "video-source");
-    g_object_set (source,
-        "device-number", device_number,
-        "connection", 0,
-        "mode", DECKLINK_MODE_1080_30_P,
-        NULL);
+    if (source)
+      g_object_set (source,
+          "device-number", device_number,
+          "connection", 0,
+          "mode", decklink_mode (source, settings),
+          NULL);
   }
 
-  if (!app->pipeline) { GST_ERROR ("Failed to create pipeline"); }
+  if (!camera->pipeline) { GST_ERROR ("Failed to create pipeline"); }
   if (!source) { GST_ERROR("failed to create videotestsrc"); }
   if (!filter) { GST_ERROR ("Failed to create capsfilter"); }
   if (!videorate) { GST_ERROR("failed to create video-rate"); }
   if (!converter) { GST_ERROR("failed to create videoconvert"); }
-  if (!queue1) { GST_ERROR("failed to create upstream-queue"); }
-  if (!encoder) { GST_ERROR("failed to create encoder"); }
-  if (!app->queue2) { GST_ERROR("failed to create ringbuffer-queue"); }
+  if (!tee) { GST_ERROR("failed to create rendition-tee"); }
 
-  if (!app->pipeline || !source || !filter || !videorate || !converter ||
-      !queue1 || !encoder || !app->queue2 || !app->bin) {
+  if (!camera->pipeline || !source || !filter || !videorate || !converter || !tee) {
     GST_ERROR ("An element could not be created. Exiting.");
-    return -1;
+    exit (-1);
   }
 
-  g_object_set (encoder,
-      "key-int-max", 30,
-      "speed-preset", speed_preset,
-      "bitrate", bitrate,
-      NULL);
-
-  g_object_set (app->queue2,
-      "leaky", GST_QUEUE_LEAK_DOWNSTREAM,
-      "max-size-bytes", 0,
-      "max-size-buffers", 0,
-      "max-size-time", 5 * 60 * GST_SECOND,
-      NULL);
-
   GstCaps * caps = gst_caps_new_simple ("video/x-raw",
-      "width", G_TYPE_INT, 1920,
-      "height", G_TYPE_INT, 1080,
-      "framerate", GST_TYPE_FRACTION, 30, 1,
+      "width", G_TYPE_INT, settings->capture_width,
+      "height", G_TYPE_INT, settings->capture_height,
+      "framerate", GST_TYPE_FRACTION, settings->capture_fps, 1,
       "format", G_TYPE_STRING, "I420",
       "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
       "interlace-mode", G_TYPE_STRING, "progressive",
@@ -635,43 +4844,359 @@ main (int argc, char *argv[])
   g_object_set (filter, "caps", caps, NULL);
 
   /* Add a message handler */
-  bus = gst_pipeline_get_bus (GST_PIPELINE (app->pipeline));
-  bus_watch_id = gst_bus_add_watch (bus, bus_call, app);
+  bus = gst_pipeline_get_bus (GST_PIPELINE (camera->pipeline));
+  camera->bus_watch_id = gst_bus_add_watch (bus, bus_call, camera);
+  if (settings->cpu_sets) {
+    camera->cpus = g_array_index (settings->cpu_sets, cpu_set_t, index % settings->cpu_sets->len);
+    camera->pinned = TRUE;
+    gst_bus_set_sync_handler (bus, pin_thread_cb, camera, NULL);
+  }
   gst_object_unref (bus);
 
-  gst_bin_add_many (GST_BIN (app->pipeline),
-      source, /* videorate, */ converter, filter, queue1, encoder, app->queue2, app->bin, NULL);
-
-  gst_element_link_many (source, /* videorate, */ converter, filter, queue1, encoder, app->queue2, app->bin, NULL);
-
-  app->blockpad = gst_element_get_static_pad (app->queue2, "src");
-  app->srcpad   = gst_element_get_static_pad (encoder, "src");
+  // A source that delivers I420 at our size needs no converter at all, so
+  // its frames reach the encoders in the memory it filled.  One that won't
+  // open yet keeps the converter; the pipeline reports why when it starts.
+  source_caps = query_source_caps (source,
+      device_number == DEVICE_NUMBER_TEST ? "src" : "videosrc");
+  if (!source_caps)
+    GST_WARNING ("Couldn't open the source of camera %u to see what it delivers", index);
+  camera->passthrough = source_caps && gst_caps_can_intersect (source_caps, caps);
+
+  // Refuse a rate the source can't run at, rather than have videorate make
+  // up the difference with repeats of its frames
+  if (source_caps) {
+    GstCaps * rate = gst_caps_new_simple ("video/x-raw",
+        "framerate", GST_TYPE_FRACTION, settings->capture_fps, 1, NULL);
+
+    if (!gst_caps_can_intersect (source_caps, rate))
+      g_error ("the source of camera %u can't capture at %d fps", index, settings->capture_fps);
+    gst_caps_unref (rate);
+    gst_caps_unref (source_caps);
+  }
 
-  // Set timestamps on buffers coming out of source
-  gst_pad_add_probe (gst_element_get_static_pad (source, device_number == DEVICE_NUMBER_TEST ? "src" : "videosrc"),
-      GST_PAD_PROBE_TYPE_BUFFER, source_set_timestamps, app, NULL);
+  // A source that needs converting goes through videorate too, which
+  // evens out frames it mistimes or misses (dropping or repeating them).
+  // It starts from the first frame's timestamp, the stream clock, rather
+  // than filling in from zero.
+  if (camera->passthrough) {
+    gst_object_unref (videorate);
+    gst_object_unref (converter);
+    gst_bin_add_many (GST_BIN (camera->pipeline), source, filter, tee, NULL);
+    gst_element_link_many (source, filter, tee, NULL);
+  } else {
+    camera->videorate = videorate;
+    g_object_set (videorate, "skip-to-first", TRUE, NULL);
+    gst_bin_add_many (GST_BIN (camera->pipeline),
+        source, videorate, converter, filter, tee, NULL);
+    gst_element_link_many (source, videorate, converter, filter, tee, NULL);
+  }
 
-  block_pipeline(app);
+  gst_caps_unref (caps);
+
+  // One encoder and ring per rendition, all fed from the same capture
+  for (i = 0; i < settings->renditions->len; i++)
+    g_ptr_array_add (camera->renditions, create_rendition (camera, tee,
+        &g_array_index (settings->renditions, RenditionSpec, i),
+        settings->capture_width, settings->capture_height, settings));
+
+  // Set timestamps on buffers coming out of source, then count them
+  GstPad * source_pad = gst_element_get_static_pad (source,
+      device_number == DEVICE_NUMBER_TEST ? "src" : "videosrc");
+  gst_pad_add_probe (source_pad, GST_PAD_PROBE_TYPE_BUFFER, source_set_timestamps, camera, NULL);
+  gst_pad_add_probe (source_pad, GST_PAD_PROBE_TYPE_BUFFER, capture_probe_cb, camera, NULL);
+  gst_object_unref (source_pad);
+
+  GstPad * filter_pad = gst_element_get_static_pad (filter, "src");
+  gst_pad_add_probe (filter_pad, GST_PAD_PROBE_TYPE_BUFFER, convert_probe_cb, camera, NULL);
+  gst_pad_add_probe (filter_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      activity_probe_cb, camera, NULL);
+  gst_pad_add_probe (filter_pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM | GST_PAD_PROBE_TYPE_PULL,
+      allocation_probe_cb, camera, NULL);
+  gst_object_unref (filter_pad);
 
   /*Verbose*/
-  if (verbose) {
-    g_signal_connect (app->pipeline, "deep-notify",
+  if (settings->verbose) {
+    g_signal_connect (camera->pipeline, "deep-notify",
       G_CALLBACK (gst_object_default_deep_notify), NULL);
   }
 
-  /* Set the pipeline to "playing" state */
-  gst_element_set_state (app->pipeline, GST_STATE_PLAYING);
+  return camera;
+}
+
+static void free_camera (Camera * camera)
+{
+  gst_element_set_state (camera->pipeline, GST_STATE_NULL);
+  gst_object_unref (GST_OBJECT (camera->pipeline));
+  g_source_remove (camera->bus_watch_id);
+  g_ptr_array_free (camera->renditions, TRUE);
+  if (camera->frame_pool)
+    gst_object_unref (camera->frame_pool);
+  activity_meter_free (camera->activity_meter);
+  activity_index_free (camera->activity);
+  g_free (camera);
+}
+
+int
+main (int argc, char *argv[])
+{
+  App app_data;
+  App * app = &app_data;
+  GOptionContext * option_context;
+  GError * error = NULL;
+  CameraSettings settings = {
+    .speed_preset = X264_SPEED_PRESET_DEFAULT,
+    .retention_time = RETENTION_TIME_DEFAULT,
+    .retention_bytes = 0,
+    .spill_dir = NULL,
+    .spill_size = SPILL_SIZE_DEFAULT,
+    .segment_size = SEGMENT_SIZE_DEFAULT,
+    .memory_time = MEMORY_TIME_DEFAULT,
+    .memory_bytes = MEMORY_BYTES_DEFAULT,
+    .hls_part_ms = HLS_PART_MS_DEFAULT,
+    .journal_dir = NULL,
+    .encoder_threads = 0,
+    .sliced_threads = FALSE,
+    .lookahead = -1,
+    .cpu_sets = NULL,
+    .verbose = VERBOSE_DEFAULT,
+  };
+  gint port = -1,
+       metrics_port = 0,
+       hls_port = 0,
+       max_export_rate = 0,
+       device_number = DEVICE_NUMBER_TEST,
+       bitrate = BITRATE_DEFAULT,
+       max_replays = MAX_REPLAYS_DEFAULT,
+       max_pinned = MAX_PINNED_DEFAULT,
+       snapshot_threads = SNAPSHOT_THREADS_DEFAULT,
+       snapshot_cache = SNAPSHOT_CACHE_DEFAULT,
+       min_bitrate = MIN_BITRATE_DEFAULT;
+  gchar * devices = NULL;
+  gchar * capture = NULL;
+  gchar * cpu_sets = NULL;
+  gchar * mark_index = NULL;
+  gchar * renditions = NULL;
+  gchar ** device_list;
+  gboolean simulate = FALSE;
+  gint64 startup = g_get_monotonic_time ();
+  guint i;
+
+  GOptionEntry option_entries[] = {
+    { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port to listen on (default 2000)", "PORT" },
+    { "device-number", 'd', 0, G_OPTION_ARG_INT, &device_number, "Camera to use", "DEVICE_NUMBER" },
+    { "devices", 0, 0, G_OPTION_ARG_STRING, &devices, "Comma-separated cameras to capture, -1 for a test pattern (overrides --device-number)", "LIST" },
+    { "speed-preset", 's', 0, G_OPTION_ARG_INT, &settings.speed_preset, "x264 speed preset" },
+    { "bitrate", 's', 0, G_OPTION_ARG_INT, &bitrate, "x264 bitrate" },
+    { "capture", 0, 0, G_OPTION_ARG_STRING, &capture, "Capture size and rate, up to 3840x2160@60 or 1920x1080@120 (default 1920x1080@30)", "WIDTHxHEIGHT@FPS" },
+    { "renditions", 0, 0, G_OPTION_ARG_STRING, &renditions, "Encodings to keep, as NAME:WIDTHxHEIGHT:BITRATE[,...] (default full at the capture size and BITRATE)", "LIST" },
+    { "encoder-threads", 0, 0, G_OPTION_ARG_INT, &settings.encoder_threads, "Threads per x264 encoder (default 0, automatic)", "COUNT" },
+    { "sliced-threads", 0, 0, G_OPTION_ARG_NONE, &settings.sliced_threads, "Thread x264 by slices: lower latency, less efficient" },
+    { "lookahead", 0, 0, G_OPTION_ARG_INT, &settings.lookahead, "Frames x264 looks ahead for rate control (default x264's)", "FRAMES" },
+    { "cpu-sets", 0, 0, G_OPTION_ARG_STRING, &cpu_sets, "Pin each camera's capture, encoder and replay threads, as CPUS[;CPUS...] one per camera (e.g. 0-3;4-7)", "LIST" },
+    { "min-bitrate", 0, 0, G_OPTION_ARG_INT, &min_bitrate, "Lowest share of its bitrate an encoder may drop to while it falls behind (default 50, 100 for fixed)", "PERCENT" },
+    { "metrics-port", 0, 0, G_OPTION_ARG_INT, &metrics_port, "Serve Prometheus metrics over HTTP on this local port (default off)", "PORT" },
+    { "hls-port", 0, 0, G_OPTION_ARG_INT, &hls_port, "Publish every rendition as live LL-HLS over HTTP on this port (default off)", "PORT" },
+    { "hls-part-ms", 0, 0, G_OPTION_ARG_INT, &settings.hls_part_ms, "Longest LL-HLS part (default 334)", "MS" },
+    { "max-replays", 'm', 0, G_OPTION_ARG_INT, &max_replays, "Maximum concurrent replays (default 8)", "COUNT" },
+    { "max-export-rate", 0, 0, G_OPTION_ARG_INT, &max_export_rate, "Hold queued jobs while replays write faster than this (default unlimited)", "MB/S" },
+    { "retention-time", 0, 0, G_OPTION_ARG_INT, &settings.retention_time, "Seconds of footage to keep (default 300)", "SECONDS" },
+    { "retention-bytes", 0, 0, G_OPTION_ARG_INT, &settings.retention_bytes, "Megabytes of footage to keep per camera (default unlimited)", "MB" },
+    { "spill-dir", 0, 0, G_OPTION_ARG_FILENAME, &settings.spill_dir, "Spill older footage to segment files in this directory", "DIR" },
+    { "spill-size", 0, 0, G_OPTION_ARG_INT, &settings.spill_size, "Disk space to preallocate for spilled footage per camera (default 4096)", "MB" },
+    { "segment-size", 0, 0, G_OPTION_ARG_INT, &settings.segment_size, "Size of each spill segment file (default 64)", "MB" },
+    { "memory-time", 0, 0, G_OPTION_ARG_INT, &settings.memory_time, "Seconds of footage to keep in memory when spilling (default 30)", "SECONDS" },
+    { "memory-bytes", 0, 0, G_OPTION_ARG_INT, &settings.memory_bytes, "Megabytes of footage to keep in memory per camera when spilling (default 512)", "MB" },
+    { "journal-dir", 0, 0, G_OPTION_ARG_FILENAME, &settings.journal_dir, "Journal encoded footage to this directory and recover it after a restart", "DIR" },
+    { "mark-index", 0, 0, G_OPTION_ARG_FILENAME, &mark_index, "Keep marks in this file across restarts", "FILE" },
+    { "max-pinned", 0, 0, G_OPTION_ARG_INT, &max_pinned, "Megabytes of footage marks may hold onto (default 1024)", "MB" },
+    { "snapshot-threads", 0, 0, G_OPTION_ARG_INT, &snapshot_threads, "Decoders for snapshots and thumbnails (default 4)", "COUNT" },
+    { "snapshot-cache", 0, 0, G_OPTION_ARG_INT, &snapshot_cache, "Megabytes of decoded keyframes to keep for snapshots (default 256)", "MB" },
+    { "simulate", 0, 0, G_OPTION_ARG_NONE, &simulate, "Run test-pattern cameras faster than real time on a virtual clock" },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &settings.verbose, "Verbose (shows caps negotiation)" },
+    { NULL }
+  };
+
+  gst_init (&argc, &argv);
+
+  // Clients that hang up mid-clip must not take the server down with them
+  signal (SIGPIPE, SIG_IGN);
+  GST_DEBUG_CATEGORY_INIT (camsrc, "camsrc", 0, "camera source");
+
+  option_context = g_option_context_new ("- start queue-buffered video server");
+  g_option_context_add_main_entries (option_context, option_entries, NULL);
+  g_option_context_parse (option_context, &argc, &argv, &error);
+  g_option_context_free (option_context);
+
+  parse_capture (capture ? capture : CAPTURE_DEFAULT, &settings);
+  if (!renditions)
+    renditions = g_strdup_printf ("full:%dx%d:%d", settings.capture_width,
+        settings.capture_height, bitrate);
+  settings.renditions = parse_rendition_specs (renditions);
+  if (cpu_sets)
+    settings.cpu_sets = parse_cpu_sets (cpu_sets);
+
+  if (!devices)
+    devices = g_strdup_printf ("%d", device_number);
+  device_list = g_strsplit (devices, ",", MAX_CAMERAS);
+
+  // If no port specified, a single camera uses PORT + device_number (unless
+  // we're also testing, in which case we just use PORT); several share PORT.
+  if (port < 0) {
+    device_number = atoi (device_list[0]);
+    port = device_list[1] || device_number == DEVICE_NUMBER_TEST ? PORT : PORT + device_number;
+  }
+
+  /* set up socket */
+  GSocketService * service = g_socket_service_new ();
+  g_socket_listener_add_inet_port ((GSocketListener*)service, port, NULL, &error);
+
+  if (error) {
+    g_error ("error setting up socket %s", error->message);
+  }
+
+  g_signal_connect (service, "incoming", G_CALLBACK (incoming_callback), app);
+  g_socket_service_start (service);
+
+  app->loop = g_main_loop_new (NULL, FALSE);
+  app->cameras = g_ptr_array_new ();
+  app->pump_scheduled = FALSE;
+  app->requests = NULL;
+  app->active_replays = 0;
+  app->max_replays = MAX (max_replays, 1);
+  app->next_request_id = 1;
+  app->clock = gst_system_clock_obtain ();
+  app->clock_mappings = g_array_new (FALSE, FALSE, sizeof(ClockMapping));
+  app->simulate = simulate;
+  app->queue = NULL;
+  app->admission_hold = NULL;
+  app->admission_timer_id = 0;
+  app->max_export_rate = (guint64) MAX (max_export_rate, 0) * MEGABYTE;
+  app->export_bytes = 0;
+  app->export_bytes_sampled = 0;
+  app->export_rate_time = g_get_monotonic_time ();
+  app->export_rate = 0;
+  app->simulation_epoch = gst_clock_get_time (app->clock);
+  app->min_bitrate = CLAMP (min_bitrate, 1, 100);
+  app->marks = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) mark_free);
+  app->pinning = NULL;
+  app->materialize_queue = g_queue_new ();
+  app->materialize_id = 0;
+  app->mark_index = NULL;
+  app->pinned_bytes = 0;
+  app->max_pinned_bytes = (guint64) MAX (max_pinned, 0) * MEGABYTE;
+  app->snapshot_cache = snapshot_cache_new ((guint64) MAX (snapshot_cache, 0) * MEGABYTE);
+  app->snapshot_pool = g_thread_pool_new (take_snapshot, app, MAX (snapshot_threads, 1),
+      FALSE, NULL);
+  app->snapshots_taken = 0;
+
+  // Virtual clocks never get stepped, so one mapping does for a simulation
+  update_clock_mapping (app);
+  if (!simulate)
+    g_timeout_add_seconds (CLOCK_MAPPING_INTERVAL, update_clock_mapping, app);
+  g_mutex_init (&app->metrics_lock);
+  app->replays_completed = 0;
+  app->replays_failed = 0;
+  memset (&app->request_latency, 0, sizeof(Histogram));
+  memset (&app->first_byte_latency, 0, sizeof(Histogram));
+  memset (&app->mux_latency, 0, sizeof(Histogram));
+  app->hls_requests = 0;
+  app->hls_bytes = 0;
+
+  // Metrics are for local scrapers only
+  if (metrics_port > 0) {
+    GSocketService * metrics_service = g_threaded_socket_service_new (2);
+    GInetAddress * loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+    GSocketAddress * address = g_inet_socket_address_new (loopback, metrics_port);
+
+    g_socket_listener_add_address (G_SOCKET_LISTENER (metrics_service), address,
+        G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL, NULL, &error);
+    g_object_unref (address);
+    g_object_unref (loopback);
+
+    if (error) {
+      g_error ("error setting up metrics socket %s", error->message);
+    }
+
+    g_signal_connect (metrics_service, "run", G_CALLBACK (metrics_callback), app);
+    g_socket_service_start (metrics_service);
+  }
+
+  for (i = 0; device_list[i]; i++) {
+    if (simulate && atoi (g_strstrip (device_list[i])) != DEVICE_NUMBER_TEST)
+      g_error ("--simulate only works with test-pattern devices (-1)");
+  }
+
+  if (hls_port <= 0)
+    settings.hls_part_ms = 0;
+
+  for (i = 0; device_list[i]; i++)
+    g_ptr_array_add (app->cameras,
+        create_camera (app, i, atoi (g_strstrip (device_list[i])), &settings));
+
+  // Viewers are anywhere, unlike scrapers
+  if (hls_port > 0) {
+    GSocketService * hls_service = g_threaded_socket_service_new (HLS_THREADS);
+
+    g_socket_listener_add_inet_port (G_SOCKET_LISTENER (hls_service), hls_port, NULL, &error);
+    if (error) {
+      g_error ("error setting up HLS socket %s", error->message);
+    }
+
+    g_signal_connect (hls_service, "run", G_CALLBACK (hls_callback), app);
+    g_socket_service_start (hls_service);
+  }
+
+  if (mark_index) {
+    app->mark_index = mark_index_open (mark_index, &error);
+    if (!app->mark_index)
+      g_error ("error opening mark index %s", error->message);
+    load_marks (app);
+  }
+
+  // Simulated cameras wait for the encoders anyway, so only real ones need help
+  if (app->min_bitrate < 100 && !simulate)
+    g_timeout_add (ENCODER_CONTROL_MS, control_encoders_cb, app);
+
+  /* Set the pipelines to "playing" state */
+  for (i = 0; i < app->cameras->len; i++)
+    gst_element_set_state (((Camera *) g_ptr_array_index (app->cameras, i))->pipeline,
+        GST_STATE_PLAYING);
 
-  g_printf ("camsrc listening on port %d with device-number %d speed-preset %d bitrate %d...\n", 
-      port, device_number, speed_preset, bitrate);
+  g_printf ("camsrc listening on port %d with devices %s speed-preset %d renditions %s max-replays %u retention %ds%s%s%s%s%s activity kernels %s, started in %.1f ms...\n", 
+      port, devices, settings.speed_preset, renditions, app->max_replays, settings.retention_time,
+      settings.spill_dir ? " spilling to " : "", settings.spill_dir ? settings.spill_dir : "",
+      settings.journal_dir ? " journaling to " : "", settings.journal_dir ? settings.journal_dir : "",
+      simulate ? " (simulated)" : "", activity_get_kernel_name (),
+      (g_get_monotonic_time () - startup) / 1000.0);
 
   g_main_loop_run (app->loop);
 
   /* Out of the main loop, clean up nicely */
-  gst_element_set_state (app->pipeline, GST_STATE_NULL);
-  gst_object_unref (GST_OBJECT (app->pipeline));
-  g_source_remove (bus_watch_id);
+  g_thread_pool_free (app->snapshot_pool, TRUE, TRUE);
+  snapshot_cache_free (app->snapshot_cache);
+  for (i = 0; i < app->cameras->len; i++)
+    free_camera (g_ptr_array_index (app->cameras, i));
+  g_list_free (app->pinning);
+  g_queue_free (app->materialize_queue);
+  g_hash_table_unref (app->marks);
+  if (app->mark_index)
+    mark_index_free (app->mark_index);
+  g_free (mark_index);
+  g_ptr_array_free (app->cameras, TRUE);
   g_main_loop_unref (app->loop);
+  g_mutex_clear (&app->metrics_lock);
+  g_array_free (app->clock_mappings, TRUE);
+  gst_object_unref (app->clock);
+  g_strfreev (device_list);
+  g_free (devices);
+  g_free (capture);
+  g_free (cpu_sets);
+  if (settings.cpu_sets)
+    g_array_free (settings.cpu_sets, TRUE);
+  g_free (renditions);
+  for (i = 0; i < settings.renditions->len; i++)
+    g_free (g_array_index (settings.renditions, RenditionSpec, i).name);
+  g_array_free (settings.renditions, TRUE);
 
   return 0;
 }
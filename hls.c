@@ -0,0 +1,475 @@
+#include "hls.h"
+#include "mp4-writer.h"
+
+GST_DEBUG_CATEGORY_EXTERN (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define PART_SEGMENTS 3       // segments at the live edge whose parts are listed
+#define CACHED_SEGMENTS 4     // segments at the live edge whose part bytes are kept
+#define MAX_AHEAD 2           // how many segments ahead a blocking request may wait for
+
+// A run of units in one moof + mdat.  The open part's duration isn't known
+// until the unit after it arrives.
+typedef struct {
+  guint64 first_seq;
+  guint n_units;
+  GstClockTime start;
+  GstClockTime duration;
+  gboolean independent;
+  guint32 sequence;
+  GBytes * data;
+} HlsPart;
+
+typedef struct {
+  guint64 msn;
+  GstClockTime start;
+  GstClockTime duration;
+  GArray * parts;
+  gboolean complete;
+} HlsSegment;
+
+struct _HlsPublisher {
+  ReplayRing * ring;
+  GstClockTime part_target;
+  GMutex lock;
+  GCond changed;
+
+  // Oldest first; only the last can be incomplete.  The open part isn't in
+  // its segment's list until it's closed.
+  GPtrArray * segments;
+  guint64 next_msn;
+  guint32 next_sequence;
+  HlsPart open;
+  gboolean have_open;
+  GstClockTime last_dts;
+  GstClockTime max_duration;
+};
+
+G_DEFINE_QUARK (hls-error-quark, hls_error)
+
+static void part_clear (HlsPart * part)
+{
+  if (part->data) {
+    g_bytes_unref (part->data);
+    part->data = NULL;
+  }
+}
+
+static void segment_free (HlsSegment * segment)
+{
+  g_array_free (segment->parts, TRUE);
+  g_free (segment);
+}
+
+HlsPublisher * hls_publisher_new (ReplayRing * ring, GstClockTime part_target)
+{
+  HlsPublisher * publisher = g_new0 (HlsPublisher, 1);
+
+  publisher->ring = ring;
+  publisher->part_target = part_target;
+  g_mutex_init (&publisher->lock);
+  g_cond_init (&publisher->changed);
+  publisher->segments = g_ptr_array_new_with_free_func ((GDestroyNotify) segment_free);
+  publisher->last_dts = GST_CLOCK_TIME_NONE;
+
+  return publisher;
+}
+
+void hls_publisher_free (HlsPublisher * publisher)
+{
+  g_ptr_array_free (publisher->segments, TRUE);
+  g_cond_clear (&publisher->changed);
+  g_mutex_clear (&publisher->lock);
+  g_free (publisher);
+}
+
+#define SEGMENT(publisher, i) ((HlsSegment *) g_ptr_array_index ((publisher)->segments, (i)))
+#define LAST_SEGMENT(publisher) SEGMENT (publisher, (publisher)->segments->len - 1)
+#define PART(segment, i) (&g_array_index ((segment)->parts, HlsPart, (i)))
+
+static void close_part (HlsPublisher * publisher, GstClockTime end, gboolean ends_segment)
+{
+  HlsSegment * segment = LAST_SEGMENT (publisher);
+  guint i;
+
+  publisher->open.duration = end - publisher->open.start;
+  g_array_append_val (segment->parts, publisher->open);
+  publisher->have_open = FALSE;
+  segment->duration = end - segment->start;
+
+  if (ends_segment) {
+    segment->complete = TRUE;
+    publisher->max_duration = MAX (publisher->max_duration, segment->duration);
+
+    // Viewers have moved on from this one
+    if (publisher->segments->len > CACHED_SEGMENTS) {
+      segment = SEGMENT (publisher, publisher->segments->len - 1 - CACHED_SEGMENTS);
+      for (i = 0; i < segment->parts->len; i++)
+        part_clear (PART (segment, i));
+    }
+  }
+
+  g_cond_broadcast (&publisher->changed);
+}
+
+static void open_segment (HlsPublisher * publisher, GstClockTime start)
+{
+  HlsSegment * segment = g_new0 (HlsSegment, 1);
+
+  segment->msn = publisher->next_msn++;
+  segment->start = start;
+  segment->parts = g_array_new (FALSE, FALSE, sizeof(HlsPart));
+  g_array_set_clear_func (segment->parts, (GDestroyNotify) part_clear);
+  g_ptr_array_add (publisher->segments, segment);
+}
+
+// Called for every unit the ring takes, in order, right after it has.
+void hls_publisher_push (HlsPublisher * publisher, guint64 seq, GstBuffer * buffer)
+{
+  gboolean keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  GstClockTime dts = GST_BUFFER_DTS_IS_VALID (buffer) ? GST_BUFFER_DTS (buffer) :
+    GST_BUFFER_PTS (buffer);
+  guint64 ring_start = replay_ring_get_start (publisher->ring);
+
+  g_mutex_lock (&publisher->lock);
+
+  // Like the ring, start on a keyframe
+  if (!publisher->have_open && !keyframe) {
+    g_mutex_unlock (&publisher->lock);
+    return;
+  }
+
+  // A keyframe starts a segment; otherwise end the part before this unit
+  // would take it past the target
+  if (publisher->have_open && dts >= publisher->last_dts &&
+      (keyframe || (dts - publisher->open.start) + (dts - publisher->last_dts) >
+        publisher->part_target))
+    close_part (publisher, dts, keyframe);
+
+  if (!publisher->have_open) {
+    if (keyframe)
+      open_segment (publisher, dts);
+    publisher->open = (HlsPart) {
+      .first_seq = seq,
+      .start = dts,
+      .independent = keyframe,
+      .sequence = ++publisher->next_sequence,
+    };
+    publisher->have_open = TRUE;
+  }
+  publisher->open.n_units++;
+  publisher->last_dts = dts;
+
+  // Segments go once the ring has evicted the start of them
+  while (publisher->segments->len > 1 &&
+      PART (SEGMENT (publisher, 0), 0)->first_seq < ring_start)
+    g_ptr_array_remove_index (publisher->segments, 0);
+
+  g_mutex_unlock (&publisher->lock);
+}
+
+// Whether the playlist lists part of segment msn yet (or with part < 0,
+// the whole segment).  Call with the lock held.
+static gboolean is_published (HlsPublisher * publisher, guint64 msn, gint64 part)
+{
+  HlsSegment * last;
+
+  if (!publisher->segments->len)
+    return FALSE;
+
+  last = LAST_SEGMENT (publisher);
+  if (msn != last->msn)
+    return msn < last->msn;
+  return last->complete || (part >= 0 && part < last->parts->len);
+}
+
+static gboolean wait_published (HlsPublisher * publisher, guint64 msn, gint64 part,
+    GError ** error)
+{
+  gint64 deadline = g_get_monotonic_time () +
+    3 * MAX (publisher->max_duration, GST_SECOND) / GST_USECOND;
+
+  if (publisher->segments->len && msn > LAST_SEGMENT (publisher)->msn + MAX_AHEAD) {
+    g_set_error (error, HLS_ERROR, HLS_ERROR_INVALID, "segment %" G_GUINT64_FORMAT
+        " is too far ahead", msn);
+    return FALSE;
+  }
+
+  while (!is_published (publisher, msn, part)) {
+    if (!g_cond_wait_until (&publisher->changed, &publisher->lock, deadline)) {
+      g_set_error (error, HLS_ERROR, HLS_ERROR_TIMEOUT, "segment %" G_GUINT64_FORMAT
+          " didn't arrive in time", msn);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+// Call with the lock held.
+static HlsSegment * find_segment (HlsPublisher * publisher, guint64 msn, GError ** error)
+{
+  guint64 first;
+
+  if (!publisher->segments->len || msn > LAST_SEGMENT (publisher)->msn) {
+    g_set_error (error, HLS_ERROR, HLS_ERROR_NOT_FOUND, "no segment %" G_GUINT64_FORMAT, msn);
+    return NULL;
+  }
+
+  first = SEGMENT (publisher, 0)->msn;
+  if (msn < first) {
+    g_set_error (error, HLS_ERROR, HLS_ERROR_GONE, "segment %" G_GUINT64_FORMAT
+        " has left the buffer", msn);
+    return NULL;
+  }
+
+  return SEGMENT (publisher, msn - first);
+}
+
+static void append_date_time (GString * out, GstClockTime wall)
+{
+  GDateTime * date = g_date_time_new_from_unix_utc (wall / GST_SECOND);
+  gchar * text = g_date_time_format (date, "%Y-%m-%dT%H:%M:%S");
+
+  g_string_append_printf (out, "#EXT-X-PROGRAM-DATE-TIME:%s.%03luZ\n",
+      text, (gulong) (wall % GST_SECOND / GST_MSECOND));
+  g_free (text);
+  g_date_time_unref (date);
+}
+
+// The media playlist, once it lists segment msn (part part) if msn isn't
+// negative.  Stream time plus wall_offset is wall clock time.
+gchar * hls_publisher_get_playlist (HlsPublisher * publisher, gint64 msn, gint64 part,
+    GstClockTime wall_offset, GError ** error)
+{
+  GString * out;
+  HlsSegment * last;
+  guint target_duration, i, j;
+
+  g_mutex_lock (&publisher->lock);
+
+  if (msn >= 0 && !wait_published (publisher, msn, part, error)) {
+    g_mutex_unlock (&publisher->lock);
+    return NULL;
+  }
+
+  if (!publisher->segments->len || !SEGMENT (publisher, 0)->parts->len) {
+    g_mutex_unlock (&publisher->lock);
+    g_set_error (error, HLS_ERROR, HLS_ERROR_NOT_FOUND, "nothing published yet");
+    return NULL;
+  }
+
+  target_duration = MAX (1, (publisher->max_duration + GST_SECOND / 2) / GST_SECOND);
+
+  out = g_string_new ("#EXTM3U\n#EXT-X-VERSION:9\n");
+  g_string_append_printf (out, "#EXT-X-TARGETDURATION:%u\n", target_duration);
+  g_string_append_printf (out, "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n",
+      3 * (gdouble) publisher->part_target / GST_SECOND);
+  g_string_append_printf (out, "#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+      (gdouble) publisher->part_target / GST_SECOND);
+  g_string_append_printf (out, "#EXT-X-MEDIA-SEQUENCE:%" G_GUINT64_FORMAT "\n",
+      SEGMENT (publisher, 0)->msn);
+  g_string_append (out, "#EXT-X-MAP:URI=\"init.mp4\"\n");
+  append_date_time (out, SEGMENT (publisher, 0)->start + wall_offset);
+
+  for (i = 0; i < publisher->segments->len; i++) {
+    HlsSegment * segment = SEGMENT (publisher, i);
+
+    if (i + PART_SEGMENTS >= publisher->segments->len) {
+      for (j = 0; j < segment->parts->len; j++) {
+        HlsPart * p = PART (segment, j);
+
+        g_string_append_printf (out, "#EXT-X-PART:DURATION=%.5f,URI=\"part-%"
+            G_GUINT64_FORMAT ".%u.m4s\"%s\n", (gdouble) p->duration / GST_SECOND,
+            segment->msn, j, p->independent ? ",INDEPENDENT=YES" : "");
+      }
+    }
+
+    if (segment->complete)
+      g_string_append_printf (out, "#EXTINF:%.5f,\nseg-%" G_GUINT64_FORMAT ".m4s\n",
+          (gdouble) segment->duration / GST_SECOND, segment->msn);
+  }
+
+  last = LAST_SEGMENT (publisher);
+  if (!last->complete)
+    g_string_append_printf (out, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part-%"
+        G_GUINT64_FORMAT ".%u.m4s\"\n", last->msn, last->parts->len);
+
+  g_mutex_unlock (&publisher->lock);
+
+  return g_string_free (out, FALSE);
+}
+
+GBytes * hls_publisher_get_init (HlsPublisher * publisher, GError ** error)
+{
+  GstCaps * caps = replay_ring_get_caps (publisher->ring);
+  GBytes * data;
+
+  if (!caps) {
+    g_set_error (error, HLS_ERROR, HLS_ERROR_NOT_FOUND, "no stream yet");
+    return NULL;
+  }
+
+  data = mp4_init_segment_new (caps, error);
+  gst_caps_unref (caps);
+
+  return data;
+}
+
+// Read a part's units back from the ring and wrap them as a fragment.
+static GBytes * build_part (HlsPublisher * publisher, const HlsPart * part, GError ** error)
+{
+  ReplayUnit * units = g_new0 (ReplayUnit, part->n_units);
+  GBytes * data = NULL;
+  guint i;
+
+  for (i = 0; i < part->n_units; i++) {
+    if (replay_ring_get (publisher->ring, part->first_seq + i, &units[i]) != REPLAY_RING_OK) {
+      g_set_error (error, HLS_ERROR, HLS_ERROR_GONE, "part has left the buffer");
+      break;
+    }
+  }
+
+  if (i == part->n_units)
+    data = mp4_fragment_new (part->sequence, units, part->n_units,
+        part->start + part->duration, error);
+
+  for (i = 0; i < part->n_units; i++)
+    replay_ring_unit_clear (&units[i]);
+  g_free (units);
+
+  return data;
+}
+
+// Keep a part's bytes if it's still near the live edge.  Call with the lock held.
+static void cache_part (HlsPublisher * publisher, guint64 msn, guint index, GBytes * data)
+{
+  HlsSegment * segment = find_segment (publisher, msn, NULL);
+  HlsPart * part;
+
+  if (!segment || segment->msn + CACHED_SEGMENTS < LAST_SEGMENT (publisher)->msn ||
+      index >= segment->parts->len)
+    return;
+
+  part = PART (segment, index);
+  if (!part->data)
+    part->data = g_bytes_ref (data);
+}
+
+GBytes * hls_publisher_get_part (HlsPublisher * publisher, guint64 msn, guint index,
+    GError ** error)
+{
+  HlsSegment * segment;
+  HlsPart part;
+  GBytes * data;
+
+  g_mutex_lock (&publisher->lock);
+
+  if (!wait_published (publisher, msn, index, error) ||
+      !(segment = find_segment (publisher, msn, error))) {
+    g_mutex_unlock (&publisher->lock);
+    return NULL;
+  }
+
+  if (index >= segment->parts->len) {
+    g_mutex_unlock (&publisher->lock);
+    g_set_error (error, HLS_ERROR, HLS_ERROR_NOT_FOUND, "segment %" G_GUINT64_FORMAT
+        " has no part %u", msn, index);
+    return NULL;
+  }
+
+  part = *PART (segment, index);
+  if (part.data) {
+    data = g_bytes_ref (part.data);
+    g_mutex_unlock (&publisher->lock);
+    return data;
+  }
+
+  // Build without the lock: the ring may have to page it in from the spill
+  g_mutex_unlock (&publisher->lock);
+  data = build_part (publisher, &part, error);
+
+  if (data) {
+    g_mutex_lock (&publisher->lock);
+    cache_part (publisher, msn, index, data);
+    g_mutex_unlock (&publisher->lock);
+  }
+
+  return data;
+}
+
+// A whole segment is its parts back to back.
+GBytes * hls_publisher_get_segment (HlsPublisher * publisher, guint64 msn, GError ** error)
+{
+  HlsSegment * segment;
+  GArray * parts;
+  GByteArray * out;
+  guint i;
+
+  g_mutex_lock (&publisher->lock);
+
+  if (!wait_published (publisher, msn, -1, error) ||
+      !(segment = find_segment (publisher, msn, error))) {
+    g_mutex_unlock (&publisher->lock);
+    return NULL;
+  }
+
+  parts = g_array_sized_new (FALSE, FALSE, sizeof(HlsPart), segment->parts->len);
+  for (i = 0; i < segment->parts->len; i++) {
+    HlsPart part = *PART (segment, i);
+
+    if (part.data)
+      g_bytes_ref (part.data);
+    g_array_append_val (parts, part);
+  }
+
+  g_mutex_unlock (&publisher->lock);
+
+  out = g_byte_array_new ();
+  for (i = 0; i < parts->len && out; i++) {
+    HlsPart * part = &g_array_index (parts, HlsPart, i);
+    GBytes * data = part->data ? g_bytes_ref (part->data) : build_part (publisher, part, error);
+    gsize size;
+    gconstpointer bytes;
+
+    if (!data) {
+      g_byte_array_free (out, TRUE);
+      out = NULL;
+      break;
+    }
+
+    bytes = g_bytes_get_data (data, &size);
+    g_byte_array_append (out, bytes, size);
+    g_bytes_unref (data);
+  }
+
+  for (i = 0; i < parts->len; i++)
+    part_clear (&g_array_index (parts, HlsPart, i));
+  g_array_free (parts, TRUE);
+
+  return out ? g_byte_array_free_to_bytes (out) : NULL;
+}
+
+// The RFC 6381 codecs string, e.g. avc1.640028, from the stream's avcC.
+gboolean hls_publisher_get_codecs (HlsPublisher * publisher, gchar * dest, gsize size)
+{
+  GstCaps * caps = replay_ring_get_caps (publisher->ring);
+  const GValue * value;
+  GstMapInfo map;
+  gboolean ok = FALSE;
+
+  if (!caps)
+    return FALSE;
+
+  value = gst_structure_get_value (gst_caps_get_structure (caps, 0), "codec_data");
+  if (value && gst_buffer_map (gst_value_get_buffer (value), &map, GST_MAP_READ)) {
+    if (map.size >= 4) {
+      g_snprintf (dest, size, "avc1.%02x%02x%02x", map.data[1], map.data[2], map.data[3]);
+      ok = TRUE;
+    }
+    gst_buffer_unmap (gst_value_get_buffer (value), &map);
+  }
+
+  gst_caps_unref (caps);
+  return ok;
+}
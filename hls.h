@@ -0,0 +1,48 @@
+/*
+ * Live HLS publishing of a replay ring, as low-latency CMAF.
+ *
+ * The publisher hears about every unit the ring takes (its sequence number
+ * and timestamps, not its bytes) and keeps the timeline: a segment per GOP,
+ * cut into parts no longer than the part target.  Playlists, the init
+ * segment, segments and parts are all built on request from the ring, so
+ * they cover exactly the footage it retains; the bytes of parts near the
+ * live edge are kept once built, since every viewer there asks for the
+ * same ones.
+ *
+ * A playlist or part asked for before it exists is waited for (LL-HLS
+ * blocking playlist reload and preload hints), for up to three target
+ * durations.  All functions are safe to call from any thread.
+ */
+
+#ifndef __HLS_H__
+#define __HLS_H__
+
+#include <gst/gst.h>
+
+#include "replay-ring.h"
+
+typedef enum {
+  HLS_ERROR_NOT_FOUND,
+  HLS_ERROR_GONE,
+  HLS_ERROR_TIMEOUT,
+  HLS_ERROR_INVALID
+} HlsError;
+
+#define HLS_ERROR (hls_error_quark ())
+GQuark hls_error_quark (void);
+
+typedef struct _HlsPublisher HlsPublisher;
+
+HlsPublisher * hls_publisher_new (ReplayRing * ring, GstClockTime part_target);
+void hls_publisher_free (HlsPublisher * publisher);
+void hls_publisher_push (HlsPublisher * publisher, guint64 seq, GstBuffer * buffer);
+
+gchar * hls_publisher_get_playlist (HlsPublisher * publisher, gint64 msn, gint64 part,
+    GstClockTime wall_offset, GError ** error);
+GBytes * hls_publisher_get_init (HlsPublisher * publisher, GError ** error);
+GBytes * hls_publisher_get_segment (HlsPublisher * publisher, guint64 msn, GError ** error);
+GBytes * hls_publisher_get_part (HlsPublisher * publisher, guint64 msn, guint part,
+    GError ** error);
+gboolean hls_publisher_get_codecs (HlsPublisher * publisher, gchar * dest, gsize size);
+
+#endif /* __HLS_H__ */
@@ -0,0 +1,840 @@
+#include "journal.h"
+
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+GST_DEBUG_CATEGORY_EXTERN (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define FILE_SIZE (64 * 1024 * 1024)    // start a new file past this
+#define MAX_PENDING 64                  // GOPs waiting for the writer before we drop some
+#define MOVE_THRESHOLD GST_SECOND       // wall offsets further apart mean a reboot
+
+// Record: header, unit table, unit bytes.  All integers little-endian.
+#define RECORD_MAGIC 0x524a5343         // "CSJR"
+#define RECORD_VERSION 1
+#define HEADER_SIZE 32                  // magic, units, size, data crc, wall offset, version, header crc
+#define UNIT_SIZE 24                    // pts, dts, size, flags
+#define UNIT_FLAG_KEYFRAME 1
+#define INDEX_SIZE 40                   // offset, first pts, last pts, wall offset, size, crc
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct {
+  GPtrArray * units;
+  GstCaps * caps;
+  GstClockTime wall_offset;
+} Gop;
+
+typedef struct {
+  guint number;
+  guint64 size;
+  GstClockTime last_pts;
+} JournalFile;
+
+// A recovered file, mapped for as long as any unit from it is alive.
+typedef struct {
+  gint refcount;
+  guint8 * data;
+  gsize size;
+} Mapping;
+
+typedef struct {
+  guint64 offset;
+  GstClockTime first_pts;
+  GstClockTime last_pts;
+  GstClockTime wall_offset;
+  guint32 size;
+} IndexEntry;
+
+struct _Journal {
+  gchar * dir;
+  GstClockTime max_time;
+  guint64 max_bytes;
+
+  // The streaming thread's
+  Gop * gop;
+  GstCaps * caps;
+
+  // The writer's (and recovery's, before the writer has anything to do)
+  GThread * thread;
+  GAsyncQueue * queue;
+  guint next_file;
+  gint data_fd;
+  gint index_fd;
+  GstCaps * file_caps;
+  GQueue files;
+  guint64 bytes;
+
+  GMutex stats_lock;
+  guint64 records_written;
+  guint64 bytes_written;
+  guint64 gops_dropped;
+};
+
+static void gop_free (Gop * gop)
+{
+  g_ptr_array_unref (gop->units);
+  if (gop->caps)
+    gst_caps_unref (gop->caps);
+  g_free (gop);
+}
+
+static gchar * file_path (Journal * journal, guint number, const gchar * extension)
+{
+  gchar name[32];
+
+  g_snprintf (name, sizeof(name), "gops-%08u.%s", number, extension);
+  return g_build_filename (journal->dir, name, NULL);
+}
+
+static void delete_file (Journal * journal, guint number)
+{
+  static const gchar * extensions[] = { "dat", "idx", "caps" };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (extensions); i++) {
+    gchar * path = file_path (journal, number, extensions[i]);
+
+    g_unlink (path);
+    g_free (path);
+  }
+}
+
+// Write every vector in full, however the kernel splits it up.
+static gboolean write_vectors (gint fd, struct iovec * iov, guint n)
+{
+  while (n) {
+    ssize_t written = writev (fd, iov, MIN (n, IOV_MAX));
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+
+    while (n && (gsize) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n) {
+      iov->iov_base = (guint8 *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return TRUE;
+}
+
+static void close_file (Journal * journal)
+{
+  if (journal->data_fd < 0)
+    return;
+
+  close (journal->data_fd);
+  close (journal->index_fd);
+  journal->data_fd = journal->index_fd = -1;
+  if (journal->file_caps) {
+    gst_caps_unref (journal->file_caps);
+    journal->file_caps = NULL;
+  }
+}
+
+static gboolean open_file (Journal * journal, GstCaps * caps)
+{
+  guint number = journal->next_file++;
+  gchar * data_path = file_path (journal, number, "dat");
+  gchar * index_path = file_path (journal, number, "idx");
+  JournalFile * file;
+
+  journal->data_fd = g_open (data_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+  journal->index_fd = journal->data_fd < 0 ? -1 :
+    g_open (index_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+
+  if (journal->index_fd < 0) {
+    GST_ERROR ("Couldn't create journal file %s: %s", data_path, g_strerror (errno));
+    if (journal->data_fd >= 0)
+      close (journal->data_fd);
+    journal->data_fd = -1;
+    g_free (data_path);
+    g_free (index_path);
+    return FALSE;
+  }
+
+  if (caps) {
+    gchar * caps_path = file_path (journal, number, "caps");
+    gchar * str = gst_caps_to_string (caps);
+
+    if (!g_file_set_contents (caps_path, str, -1, NULL))
+      GST_WARNING ("Couldn't write %s", caps_path);
+    journal->file_caps = gst_caps_ref (caps);
+    g_free (str);
+    g_free (caps_path);
+  }
+
+  file = g_new0 (JournalFile, 1);
+  file->number = number;
+  file->last_pts = GST_CLOCK_TIME_NONE;
+  g_queue_push_tail (&journal->files, file);
+
+  GST_DEBUG ("Journaling to %s", data_path);
+  g_free (data_path);
+  g_free (index_path);
+  return TRUE;
+}
+
+// Delete whole files, oldest first, while the rest still cover retention.
+static void prune (Journal * journal)
+{
+  JournalFile * newest = g_queue_peek_tail (&journal->files);
+
+  while (journal->files.length > 1) {
+    JournalFile * oldest = g_queue_peek_head (&journal->files);
+    gboolean too_old = journal->max_time && GST_CLOCK_TIME_IS_VALID (newest->last_pts) &&
+      (!GST_CLOCK_TIME_IS_VALID (oldest->last_pts) ||
+       oldest->last_pts + journal->max_time < newest->last_pts);
+    gboolean too_big = journal->max_bytes && journal->bytes - oldest->size > journal->max_bytes;
+
+    if (!too_old && !too_big)
+      break;
+
+    GST_DEBUG ("Deleting journal file %u", oldest->number);
+    delete_file (journal, oldest->number);
+    journal->bytes -= oldest->size;
+    g_free (g_queue_pop_head (&journal->files));
+  }
+}
+
+static void write_gop (Journal * journal, Gop * gop)
+{
+  guint n = gop->units->len, i;
+  guint8 header[HEADER_SIZE], index[INDEX_SIZE];
+  guint8 * table = g_malloc (n * UNIT_SIZE);
+  struct iovec * iov = g_new (struct iovec, n + 2);
+  GstMapInfo * maps = g_new (GstMapInfo, n);
+  GstClockTime first_pts = GST_CLOCK_TIME_NONE, last_pts = GST_CLOCK_TIME_NONE;
+  JournalFile * file;
+  guint64 size = HEADER_SIZE + n * UNIT_SIZE;
+  gulong crc = crc32 (0, NULL, 0);
+  guint mapped = 0;
+
+  // A file only ever holds footage of one set of caps
+  if (journal->data_fd >= 0 && gop->caps && (!journal->file_caps ||
+          !gst_caps_is_equal (gop->caps, journal->file_caps)))
+    close_file (journal);
+
+  file = g_queue_peek_tail (&journal->files);
+  if (journal->data_fd >= 0 && file->size >= FILE_SIZE)
+    close_file (journal);
+
+  if (journal->data_fd < 0 && !open_file (journal, gop->caps))
+    goto dropped;
+  file = g_queue_peek_tail (&journal->files);
+
+  for (i = 0; i < n; i++) {
+    GstBuffer * buffer = g_ptr_array_index (gop->units, i);
+    guint8 * entry = table + i * UNIT_SIZE;
+
+    if (!gst_buffer_map (buffer, &maps[i], GST_MAP_READ))
+      goto dropped;
+    mapped++;
+
+    GST_WRITE_UINT64_LE (entry, GST_BUFFER_PTS (buffer));
+    GST_WRITE_UINT64_LE (entry + 8, GST_BUFFER_DTS (buffer));
+    GST_WRITE_UINT32_LE (entry + 16, maps[i].size);
+    GST_WRITE_UINT32_LE (entry + 20,
+        GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) ? 0 : UNIT_FLAG_KEYFRAME);
+    size += maps[i].size;
+
+    if (GST_BUFFER_PTS_IS_VALID (buffer)) {
+      if (!GST_CLOCK_TIME_IS_VALID (first_pts) || GST_BUFFER_PTS (buffer) < first_pts)
+        first_pts = GST_BUFFER_PTS (buffer);
+      if (!GST_CLOCK_TIME_IS_VALID (last_pts) || GST_BUFFER_PTS (buffer) > last_pts)
+        last_pts = GST_BUFFER_PTS (buffer);
+    }
+  }
+
+  if (size > G_MAXUINT32)
+    goto dropped;
+
+  crc = crc32 (crc, table, n * UNIT_SIZE);
+  for (i = 0; i < n; i++)
+    crc = crc32 (crc, maps[i].data, maps[i].size);
+
+  GST_WRITE_UINT32_LE (header, RECORD_MAGIC);
+  GST_WRITE_UINT32_LE (header + 4, n);
+  GST_WRITE_UINT32_LE (header + 8, size);
+  GST_WRITE_UINT32_LE (header + 12, crc);
+  GST_WRITE_UINT64_LE (header + 16, gop->wall_offset);
+  GST_WRITE_UINT32_LE (header + 24, RECORD_VERSION);
+  GST_WRITE_UINT32_LE (header + 28, crc32 (0, header, 28));
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = HEADER_SIZE;
+  iov[1].iov_base = table;
+  iov[1].iov_len = n * UNIT_SIZE;
+  for (i = 0; i < n; i++) {
+    iov[i + 2].iov_base = maps[i].data;
+    iov[i + 2].iov_len = maps[i].size;
+  }
+
+  GST_WRITE_UINT64_LE (index, file->size);
+  GST_WRITE_UINT64_LE (index + 8, first_pts);
+  GST_WRITE_UINT64_LE (index + 16, last_pts);
+  GST_WRITE_UINT64_LE (index + 24, gop->wall_offset);
+  GST_WRITE_UINT32_LE (index + 32, size);
+  GST_WRITE_UINT32_LE (index + 36, crc32 (0, index, 36));
+
+  // The record goes down before its index entry; a record cut short leaves
+  // the file unusable from there on, so carry on in a new one
+  if (!write_vectors (journal->data_fd, iov, n + 2) || fdatasync (journal->data_fd) < 0 ||
+      write (journal->index_fd, index, INDEX_SIZE) != INDEX_SIZE) {
+    GST_ERROR ("Couldn't write to journal in %s: %s", journal->dir, g_strerror (errno));
+    close_file (journal);
+    goto dropped;
+  }
+
+  file->size += size;
+  if (GST_CLOCK_TIME_IS_VALID (last_pts))
+    file->last_pts = last_pts;
+  journal->bytes += size;
+  prune (journal);
+
+  g_mutex_lock (&journal->stats_lock);
+  journal->records_written++;
+  journal->bytes_written += size;
+  g_mutex_unlock (&journal->stats_lock);
+  goto done;
+
+dropped:
+  g_mutex_lock (&journal->stats_lock);
+  journal->gops_dropped++;
+  g_mutex_unlock (&journal->stats_lock);
+
+done:
+  for (i = 0; i < mapped; i++)
+    gst_buffer_unmap (g_ptr_array_index (gop->units, i), &maps[i]);
+  g_free (maps);
+  g_free (iov);
+  g_free (table);
+}
+
+// A GOP with no units is the signal to stop.
+static gpointer writer_thread (gpointer data)
+{
+  Journal * journal = data;
+  Gop * gop;
+
+  while ((gop = g_async_queue_pop (journal->queue))->units->len) {
+    write_gop (journal, gop);
+    gop_free (gop);
+  }
+  gop_free (gop);
+
+  return NULL;
+}
+
+static gint compare_numbers (gconstpointer a, gconstpointer b)
+{
+  guint na = *(const guint *) a, nb = *(const guint *) b;
+
+  return na < nb ? -1 : na > nb;
+}
+
+// The numbers of the journal files in dir, oldest first.
+static GArray * list_files (const gchar * dir)
+{
+  GArray * numbers = g_array_new (FALSE, FALSE, sizeof(guint));
+  GDir * handle = g_dir_open (dir, 0, NULL);
+  const gchar * name;
+
+  if (!handle)
+    return numbers;
+
+  while ((name = g_dir_read_name (handle))) {
+    guint number;
+    gchar extension[4];
+
+    if (sscanf (name, "gops-%8u.%3s", &number, extension) == 2 && !strcmp (extension, "dat"))
+      g_array_append_val (numbers, number);
+  }
+  g_dir_close (handle);
+
+  g_array_sort (numbers, compare_numbers);
+  return numbers;
+}
+
+Journal * journal_open (const gchar * dir, GstClockTime max_time, guint64 max_bytes,
+    GError ** error)
+{
+  Journal * journal;
+  GArray * numbers;
+
+  if (g_mkdir_with_parents (dir, 0755) < 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't create %s: %s", dir, g_strerror (errno));
+    return NULL;
+  }
+
+  journal = g_new0 (Journal, 1);
+  journal->dir = g_strdup (dir);
+  journal->max_time = max_time;
+  journal->max_bytes = max_bytes;
+  journal->data_fd = journal->index_fd = -1;
+  g_queue_init (&journal->files);
+  g_mutex_init (&journal->stats_lock);
+
+  // Never append to a file from before: its tail may be torn
+  numbers = list_files (dir);
+  journal->next_file = numbers->len ? g_array_index (numbers, guint, numbers->len - 1) + 1 : 0;
+  g_array_free (numbers, TRUE);
+
+  journal->queue = g_async_queue_new ();
+  journal->thread = g_thread_new ("journal", writer_thread, journal);
+
+  return journal;
+}
+
+// Write out the GOP in progress (so a clean shutdown loses nothing), then
+// everything still queued.
+void journal_free (Journal * journal)
+{
+  Gop * stop = g_new0 (Gop, 1);
+
+  if (journal->gop)
+    g_async_queue_push (journal->queue, journal->gop);
+  stop->units = g_ptr_array_new ();
+  g_async_queue_push (journal->queue, stop);
+  g_thread_join (journal->thread);
+  g_async_queue_unref (journal->queue);
+
+  close_file (journal);
+  if (journal->caps)
+    gst_caps_unref (journal->caps);
+  g_queue_clear_full (&journal->files, g_free);
+  g_mutex_clear (&journal->stats_lock);
+  g_free (journal->dir);
+  g_free (journal);
+}
+
+void journal_set_caps (Journal * journal, GstCaps * caps)
+{
+  gst_caps_replace (&journal->caps, caps);
+}
+
+// Collect units into GOPs; each complete one goes off to the writer.
+void journal_push (Journal * journal, GstBuffer * buffer, GstClockTime wall_offset)
+{
+  gboolean keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  if (keyframe && journal->gop) {
+    if (g_async_queue_length (journal->queue) < MAX_PENDING) {
+      g_async_queue_push (journal->queue, journal->gop);
+    } else {
+      GST_WARNING ("Journal in %s is falling behind; dropping a GOP", journal->dir);
+      gop_free (journal->gop);
+      g_mutex_lock (&journal->stats_lock);
+      journal->gops_dropped++;
+      g_mutex_unlock (&journal->stats_lock);
+    }
+    journal->gop = NULL;
+  }
+
+  if (!journal->gop) {
+    if (!keyframe)
+      return;
+    journal->gop = g_new0 (Gop, 1);
+    journal->gop->units = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+    journal->gop->caps = journal->caps ? gst_caps_ref (journal->caps) : NULL;
+    journal->gop->wall_offset = wall_offset;
+  }
+
+  g_ptr_array_add (journal->gop->units, gst_buffer_ref (buffer));
+}
+
+void journal_get_stats (Journal * journal, guint64 * records, guint64 * bytes,
+    guint64 * dropped)
+{
+  g_mutex_lock (&journal->stats_lock);
+  *records = journal->records_written;
+  *bytes = journal->bytes_written;
+  *dropped = journal->gops_dropped;
+  g_mutex_unlock (&journal->stats_lock);
+}
+
+static Mapping * mapping_ref (Mapping * mapping)
+{
+  g_atomic_int_inc (&mapping->refcount);
+  return mapping;
+}
+
+static void mapping_unref (Mapping * mapping)
+{
+  if (!g_atomic_int_dec_and_test (&mapping->refcount))
+    return;
+
+  munmap (mapping->data, mapping->size);
+  g_free (mapping);
+}
+
+static Mapping * map_file (const gchar * path)
+{
+  Mapping * mapping;
+  struct stat st;
+  guint8 * data;
+  gint fd = g_open (path, O_RDONLY, 0);
+
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) < 0 || st.st_size < HEADER_SIZE ||
+      (data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close (fd);
+    return NULL;
+  }
+  close (fd);
+
+  // Recovery checksums every page straight away
+  madvise (data, st.st_size, MADV_WILLNEED);
+
+  mapping = g_new0 (Mapping, 1);
+  mapping->refcount = 1;
+  mapping->data = data;
+  mapping->size = st.st_size;
+  return mapping;
+}
+
+// The entries of an index file up to the first that fails its checksum.
+static GArray * read_index (const gchar * path)
+{
+  GArray * entries = g_array_new (FALSE, FALSE, sizeof(IndexEntry));
+  gchar * contents;
+  gsize length, offset;
+
+  if (!g_file_get_contents (path, &contents, &length, NULL))
+    return entries;
+
+  for (offset = 0; offset + INDEX_SIZE <= length; offset += INDEX_SIZE) {
+    const guint8 * data = (const guint8 *) contents + offset;
+    IndexEntry entry;
+
+    if (GST_READ_UINT32_LE (data + 36) != crc32 (0, data, 36))
+      break;
+
+    entry.offset = GST_READ_UINT64_LE (data);
+    entry.first_pts = GST_READ_UINT64_LE (data + 8);
+    entry.last_pts = GST_READ_UINT64_LE (data + 16);
+    entry.wall_offset = GST_READ_UINT64_LE (data + 24);
+    entry.size = GST_READ_UINT32_LE (data + 32);
+    g_array_append_val (entries, entry);
+  }
+
+  g_free (contents);
+  return entries;
+}
+
+// Check the record at offset completely: header, bounds, unit table, bytes.
+static gboolean check_record (Mapping * mapping, gsize offset, guint32 * n_units,
+    guint32 * size, GstClockTime * wall_offset)
+{
+  const guint8 * header = mapping->data + offset, * table;
+  guint64 payload = 0;
+  guint32 i;
+
+  if (offset + HEADER_SIZE > mapping->size ||
+      GST_READ_UINT32_LE (header) != RECORD_MAGIC ||
+      GST_READ_UINT32_LE (header + 28) != crc32 (0, header, 28))
+    return FALSE;
+
+  *n_units = GST_READ_UINT32_LE (header + 4);
+  *size = GST_READ_UINT32_LE (header + 8);
+  *wall_offset = GST_READ_UINT64_LE (header + 16);
+
+  if (!*n_units || *size < HEADER_SIZE || *size > mapping->size - offset ||
+      (guint64) *n_units * UNIT_SIZE > *size - HEADER_SIZE)
+    return FALSE;
+
+  table = header + HEADER_SIZE;
+  for (i = 0; i < *n_units; i++)
+    payload += GST_READ_UINT32_LE (table + i * UNIT_SIZE + 16);
+  if (HEADER_SIZE + (guint64) *n_units * UNIT_SIZE + payload != *size)
+    return FALSE;
+
+  return GST_READ_UINT32_LE (header + 12) ==
+    crc32 (crc32 (0, NULL, 0), table, *size - HEADER_SIZE);
+}
+
+// How far footage written under one wall clock offset has to move to sit on
+// today's stream clock.  Within one boot both clocks carry on together (give
+// or take NTP slewing the wall clock), so times stay exactly as they were,
+// as marks expect.
+static gint64 get_shift (GstClockTime now_offset, GstClockTime then_offset)
+{
+  gint64 shift = (gint64) (now_offset - then_offset);
+
+  return ABS (shift) < MOVE_THRESHOLD ? 0 : shift;
+}
+
+// Move a stream time by shift, or fail if it lands before the stream clock
+// began.
+static gboolean move_time (GstClockTime time, gint64 shift, GstClockTime * moved)
+{
+  if (!GST_CLOCK_TIME_IS_VALID (time)) {
+    *moved = time;
+    return TRUE;
+  }
+  if (shift < 0 && time < (GstClockTime) -shift)
+    return FALSE;
+
+  *moved = time + shift;
+  return TRUE;
+}
+
+typedef struct {
+  GstClockTime wall_offset;
+  GstClockTime now;
+  JournalRecoverFunc func;
+  gpointer user_data;
+  JournalRecovery * recovery;
+} RecoverState;
+
+// Hand the units of a good record over, unless they're from the future or
+// would go back in time (the wall clock was stepped between records).
+static void recover_record (RecoverState * state, Mapping * mapping, gsize offset,
+    guint32 n_units, guint32 size, GstClockTime wall_offset, GstClockTime * file_last_pts)
+{
+  JournalRecovery * recovery = state->recovery;
+  const guint8 * table = mapping->data + offset + HEADER_SIZE;
+  gsize data = offset + HEADER_SIZE + (gsize) n_units * UNIT_SIZE;
+  gint64 shift = get_shift (state->wall_offset, wall_offset);
+  GstBuffer ** buffers = g_new (GstBuffer *, n_units);
+  GstClockTime first_pts = GST_CLOCK_TIME_NONE, last_pts = GST_CLOCK_TIME_NONE;
+  gboolean ok = TRUE;
+  guint32 i, made = 0;
+
+  if (shift)
+    recovery->moved = TRUE;
+
+  for (i = 0; i < n_units && ok; i++) {
+    const guint8 * entry = table + i * UNIT_SIZE;
+    guint32 unit_size = GST_READ_UINT32_LE (entry + 16);
+    GstBuffer * buffer;
+    GstClockTime pts, dts;
+
+    ok = move_time (GST_READ_UINT64_LE (entry), shift, &pts) &&
+      move_time (GST_READ_UINT64_LE (entry + 8), shift, &dts) &&
+      (!GST_CLOCK_TIME_IS_VALID (pts) || pts < state->now);
+    if (!ok)
+      break;
+
+    buffer = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, mapping->data,
+        mapping->size, data, unit_size, mapping_ref (mapping), (GDestroyNotify) mapping_unref);
+    GST_BUFFER_PTS (buffer) = pts;
+    GST_BUFFER_DTS (buffer) = dts;
+    if (!(GST_READ_UINT32_LE (entry + 20) & UNIT_FLAG_KEYFRAME))
+      GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    buffers[made++] = buffer;
+    data += unit_size;
+
+    if (GST_CLOCK_TIME_IS_VALID (pts)) {
+      if (!GST_CLOCK_TIME_IS_VALID (first_pts) || pts < first_pts)
+        first_pts = pts;
+      if (!GST_CLOCK_TIME_IS_VALID (last_pts) || pts > last_pts)
+        last_pts = pts;
+    }
+  }
+
+  if (ok && GST_CLOCK_TIME_IS_VALID (recovery->last_pts) &&
+      (!GST_CLOCK_TIME_IS_VALID (first_pts) || first_pts <= recovery->last_pts))
+    ok = FALSE;
+
+  if (!ok) {
+    GST_DEBUG ("Skipping journal record at %lu; its times don't fit", offset);
+    for (i = 0; i < made; i++)
+      gst_buffer_unref (buffers[i]);
+    g_free (buffers);
+    return;
+  }
+
+  for (i = 0; i < made; i++)
+    state->func (state->user_data, buffers[i]);
+  g_free (buffers);
+
+  if (!GST_CLOCK_TIME_IS_VALID (recovery->first_pts))
+    recovery->first_pts = first_pts;
+  recovery->last_pts = last_pts;
+  recovery->gops++;
+  recovery->units += n_units;
+  recovery->bytes += size;
+  *file_last_pts = last_pts;
+}
+
+// The caps a file's footage was encoded with, or NULL.
+static GstCaps * read_caps (Journal * journal, guint number)
+{
+  gchar * path = file_path (journal, number, "caps");
+  gchar * str;
+  GstCaps * caps = NULL;
+
+  if (g_file_get_contents (path, &str, NULL, NULL)) {
+    caps = gst_caps_from_string (str);
+    g_free (str);
+  }
+
+  g_free (path);
+  return caps;
+}
+
+// Whether a file's index says all it holds is older than cutoff.
+static gboolean out_of_retention (RecoverState * state, const gchar * path, GArray * entries,
+    GstClockTime cutoff)
+{
+  IndexEntry * last;
+  GstClockTime last_pts;
+  struct stat st;
+
+  if (!entries->len)
+    return FALSE;
+
+  // Records past the end of the index could be newer than it says
+  last = &g_array_index (entries, IndexEntry, entries->len - 1);
+  if (g_stat (path, &st) < 0 || (guint64) st.st_size != last->offset + last->size)
+    return FALSE;
+
+  return move_time (last->last_pts, get_shift (state->wall_offset, last->wall_offset),
+      &last_pts) && GST_CLOCK_TIME_IS_VALID (last_pts) && last_pts < cutoff;
+}
+
+// Recover one file: follow its index while the records it points at check
+// out, then carry on past the end of it (the index entry of the last record
+// may not have made it), stopping at the first record that doesn't.  Files
+// out of retention, or whose footage can't share the ring with the newest,
+// are deleted instead.
+static void recover_file (Journal * journal, RecoverState * state, guint number,
+    GstClockTime cutoff, GstCaps * caps)
+{
+  JournalRecovery * recovery = state->recovery;
+  gchar * path = file_path (journal, number, "dat");
+  gchar * index_path = file_path (journal, number, "idx");
+  GArray * entries = read_index (index_path);
+  GstCaps * file_caps = read_caps (journal, number);
+  JournalFile * file;
+  Mapping * mapping;
+  gsize offset = 0;
+  guint next = 0;
+
+  if (caps && (!file_caps || !gst_caps_is_equal (caps, file_caps))) {
+    GST_WARNING ("Journal file %u was encoded differently from the newest; dropping it", number);
+    delete_file (journal, number);
+    goto done;
+  }
+
+  // Don't even map it
+  if (out_of_retention (state, path, entries, cutoff)) {
+    GST_DEBUG ("Journal file %u is out of retention", number);
+    delete_file (journal, number);
+    goto done;
+  }
+
+  if (!(mapping = map_file (path))) {
+    delete_file (journal, number);
+    goto done;
+  }
+
+  file = g_new0 (JournalFile, 1);
+  file->number = number;
+  file->size = mapping->size;
+  file->last_pts = GST_CLOCK_TIME_NONE;
+
+  while (offset < mapping->size) {
+    gboolean indexed = next < entries->len &&
+      g_array_index (entries, IndexEntry, next).offset == offset;
+    guint32 n_units, size;
+    GstClockTime wall_offset;
+
+    if (!check_record (mapping, offset, &n_units, &size, &wall_offset)) {
+      // A record cut short by a crash, and anything the index lists past it
+      if (!indexed)
+        recovery->damaged++;
+      for (; next < entries->len; next++) {
+        IndexEntry * lost = &g_array_index (entries, IndexEntry, next);
+
+        recovery->damaged++;
+        if (GST_CLOCK_TIME_IS_VALID (lost->first_pts) && lost->last_pts >= lost->first_pts)
+          recovery->damaged_time += lost->last_pts - lost->first_pts;
+      }
+      GST_WARNING ("Journal file %u is damaged at %lu; recovered what came before it",
+          number, offset);
+      break;
+    }
+
+    if (indexed)
+      next++;
+    else
+      GST_DEBUG ("Journal file %u: record at %lu wasn't indexed", number, offset);
+
+    recover_record (state, mapping, offset, n_units, size, wall_offset, &file->last_pts);
+    offset += size;
+  }
+
+  journal->bytes += file->size;
+  g_queue_push_tail (&journal->files, file);
+  recovery->files++;
+  mapping_unref (mapping);
+
+done:
+  if (file_caps)
+    gst_caps_unref (file_caps);
+  g_array_free (entries, TRUE);
+  g_free (index_path);
+  g_free (path);
+}
+
+// Hand every unit the journal holds from before back to func, oldest first.
+// wall_offset and now say where the stream clock stands today.
+void journal_recover (Journal * journal, GstClockTime wall_offset, GstClockTime now,
+    JournalRecoverFunc func, gpointer user_data, JournalRecovery * recovery)
+{
+  RecoverState state = { wall_offset, now, func, user_data, recovery };
+  gint64 start = g_get_monotonic_time ();
+  GArray * numbers = list_files (journal->dir);
+  GstClockTime cutoff = journal->max_time && now > journal->max_time ? now - journal->max_time : 0;
+  guint i;
+
+  memset (recovery, 0, sizeof(*recovery));
+  recovery->first_pts = recovery->last_pts = GST_CLOCK_TIME_NONE;
+
+  // The ring holds one set of caps, so only footage encoded like the newest
+  // can come back
+  if (numbers->len)
+    recovery->caps = read_caps (journal, g_array_index (numbers, guint, numbers->len - 1));
+
+  for (i = 0; i < numbers->len; i++)
+    recover_file (journal, &state, g_array_index (numbers, guint, i), cutoff, recovery->caps);
+  g_array_free (numbers, TRUE);
+
+  recovery->elapsed = g_get_monotonic_time () - start;
+
+  GST_INFO ("Recovered %u GOPs (%u units, %" G_GUINT64_FORMAT " bytes) from %u files in %s "
+      "in %" G_GINT64_FORMAT " us; %u damaged records", recovery->gops, recovery->units,
+      recovery->bytes, recovery->files, journal->dir, recovery->elapsed, recovery->damaged);
+}
+
+void journal_recovery_clear (JournalRecovery * recovery)
+{
+  if (recovery->caps) {
+    gst_caps_unref (recovery->caps);
+    recovery->caps = NULL;
+  }
+}
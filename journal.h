@@ -0,0 +1,64 @@
+/*
+ * Journal: the encoded stream of a replay ring, kept on disk so that a
+ * restarted process can pick up the footage it had.
+ *
+ * Each complete GOP is appended to the current journal file as one record:
+ * a header, a table of its units (timestamps, size, keyframe flag) and their
+ * bytes, all covered by CRC-32s.  Every record also gets an entry in the
+ * file's index, itself checksummed, so recovery can tell what a file holds
+ * (and skip files that are too old) without reading it.  Files are started
+ * afresh every so often and whole files are deleted once they fall out of
+ * retention; a file's caps are written next to it.
+ *
+ * Writing happens on a thread of the journal's own, which syncs each record
+ * as it goes, so the streaming thread only ever hands over references.
+ *
+ * Recovery maps each file and re-checks every record, stopping a file at the
+ * first one that doesn't add up (a record cut short by a crash); the units
+ * it hands back wrap the mapping directly.  Times are on the stream clock
+ * (the monotonic system clock), which carries on across restarts of the
+ * process; after a restart of the machine each record's wall clock offset
+ * moves its footage onto the new stream clock.
+ *
+ * journal_set_caps and journal_push are for the streaming thread only, and
+ * journal_recover must come before the first journal_push.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <gst/gst.h>
+
+typedef struct {
+  GstCaps * caps;               // of the newest footage recovered, or NULL
+  guint files;
+  guint gops;
+  guint units;
+  guint64 bytes;
+  guint damaged;                // records that failed their checks
+  GstClockTime damaged_time;    // footage those held, as far as the index says
+  GstClockTime first_pts;
+  GstClockTime last_pts;
+  gboolean moved;               // the machine restarted since it was written
+  gint64 elapsed;               // microseconds spent recovering
+} JournalRecovery;
+
+typedef void (*JournalRecoverFunc) (gpointer user_data, GstBuffer * buffer);
+
+typedef struct _Journal Journal;
+
+Journal * journal_open (const gchar * dir, GstClockTime max_time, guint64 max_bytes,
+    GError ** error);
+void journal_free (Journal * journal);
+
+void journal_recover (Journal * journal, GstClockTime wall_offset, GstClockTime now,
+    JournalRecoverFunc func, gpointer user_data, JournalRecovery * recovery);
+void journal_recovery_clear (JournalRecovery * recovery);
+
+void journal_set_caps (Journal * journal, GstCaps * caps);
+void journal_push (Journal * journal, GstBuffer * buffer, GstClockTime wall_offset);
+
+void journal_get_stats (Journal * journal, guint64 * records, guint64 * bytes,
+    guint64 * dropped);
+
+#endif /* __JOURNAL_H__ */
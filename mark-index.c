@@ -0,0 +1,281 @@
+#include "mark-index.h"
+
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <json-glib/json-glib.h>
+
+GST_DEBUG_CATEGORY_EXTERN (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+struct _MarkIndex {
+  gchar * path;
+  gint fd;
+  GHashTable * records;
+};
+
+static void record_free (MarkRecord * record)
+{
+  g_free (record->name);
+  g_free (record->rendition);
+  g_free (record->location);
+  g_free (record);
+}
+
+static MarkRecord * record_copy (const MarkRecord * record)
+{
+  MarkRecord * copy = g_new (MarkRecord, 1);
+
+  *copy = *record;
+  copy->name = g_strdup (record->name);
+  copy->rendition = g_strdup (record->rendition);
+  copy->location = g_strdup (record->location);
+  return copy;
+}
+
+// One line of the log, newline included.  Paths can hold anything, so the
+// generator does the escaping.
+static gchar * record_to_line (const gchar * op, const MarkRecord * record, const gchar * name)
+{
+  JsonBuilder * builder = json_builder_new ();
+  JsonGenerator * generator = json_generator_new ();
+  JsonNode * root;
+  gchar * json, * line;
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "op");
+  json_builder_add_string_value (builder, op);
+  json_builder_set_member_name (builder, "name");
+  json_builder_add_string_value (builder, record ? record->name : name);
+  if (record) {
+    json_builder_set_member_name (builder, "camera");
+    json_builder_add_int_value (builder, record->camera);
+    json_builder_set_member_name (builder, "rendition");
+    json_builder_add_string_value (builder, record->rendition);
+    json_builder_set_member_name (builder, "at");
+    json_builder_add_int_value (builder, record->at);
+    json_builder_set_member_name (builder, "start");
+    json_builder_add_int_value (builder, record->start);
+    json_builder_set_member_name (builder, "end");
+    json_builder_add_int_value (builder, record->end);
+    if (record->location) {
+      json_builder_set_member_name (builder, "location");
+      json_builder_add_string_value (builder, record->location);
+    }
+  }
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  json_generator_set_root (generator, root);
+  json = json_generator_to_data (generator, NULL);
+  line = g_strconcat (json, "\n", NULL);
+
+  g_free (json);
+  json_node_unref (root);
+  g_object_unref (generator);
+  g_object_unref (builder);
+  return line;
+}
+
+static gboolean write_line (gint fd, const gchar * line, const gchar * path, GError ** error)
+{
+  gsize len = strlen (line);
+  gssize written = write (fd, line, len);
+
+  if (written < 0 || (gsize) written < len) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't write to %s: %s", path, written < 0 ? g_strerror (errno) : "short write");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Apply one line of the log.  Returns FALSE if it isn't one we understand.
+static gboolean apply_line (MarkIndex * index, const gchar * line)
+{
+  JsonParser * parser = json_parser_new ();
+  JsonObject * object;
+  const gchar * op, * name;
+  gboolean ok = FALSE;
+
+  if (!json_parser_load_from_data (parser, line, -1, NULL) ||
+      !JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser)))
+    goto done;
+
+  object = json_node_get_object (json_parser_get_root (parser));
+  op = json_object_get_string_member_with_default (object, "op", NULL);
+  name = json_object_get_string_member_with_default (object, "name", NULL);
+  if (!op || !name)
+    goto done;
+
+  if (!strcmp (op, "remove")) {
+    g_hash_table_remove (index->records, name);
+    ok = TRUE;
+  } else if (!strcmp (op, "put") && json_object_has_member (object, "rendition")) {
+    MarkRecord * record = g_new0 (MarkRecord, 1);
+
+    record->name = g_strdup (name);
+    record->camera = json_object_get_int_member_with_default (object, "camera", 0);
+    record->rendition = g_strdup (json_object_get_string_member_with_default (object,
+            "rendition", ""));
+    record->at = json_object_get_int_member_with_default (object, "at", 0);
+    record->start = json_object_get_int_member_with_default (object, "start", 0);
+    record->end = json_object_get_int_member_with_default (object, "end", 0);
+    record->location = g_strdup (json_object_get_string_member_with_default (object,
+            "location", NULL));
+    g_hash_table_replace (index->records, record->name, record);
+    ok = TRUE;
+  }
+
+done:
+  g_object_unref (parser);
+  return ok;
+}
+
+// Write the live marks to a new file and swap it in, so a crash mid-way
+// leaves the old log in place.
+static gboolean compact (MarkIndex * index, GError ** error)
+{
+  gchar * tmp_path = g_strconcat (index->path, ".tmp", NULL);
+  GHashTableIter iter;
+  gpointer value;
+  gboolean ok = TRUE;
+  gint fd;
+
+  fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't create %s: %s", tmp_path, g_strerror (errno));
+    g_free (tmp_path);
+    return FALSE;
+  }
+
+  g_hash_table_iter_init (&iter, index->records);
+  while (ok && g_hash_table_iter_next (&iter, NULL, &value)) {
+    gchar * line = record_to_line ("put", value, NULL);
+
+    ok = write_line (fd, line, tmp_path, error);
+    g_free (line);
+  }
+
+  if (ok && fsync (fd) < 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't sync %s: %s", tmp_path, g_strerror (errno));
+    ok = FALSE;
+  }
+  close (fd);
+
+  if (ok && g_rename (tmp_path, index->path) < 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't replace %s: %s", index->path, g_strerror (errno));
+    ok = FALSE;
+  }
+
+  if (!ok)
+    g_unlink (tmp_path);
+  g_free (tmp_path);
+  return ok;
+}
+
+// Load the marks in path (if it exists yet), compact it and open it for
+// appending.
+MarkIndex * mark_index_open (const gchar * path, GError ** error)
+{
+  MarkIndex * index = g_new0 (MarkIndex, 1);
+  gchar * contents = NULL, ** lines;
+  guint i, skipped = 0;
+
+  index->path = g_strdup (path);
+  index->fd = -1;
+  index->records = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) record_free);
+
+  if (g_file_get_contents (path, &contents, NULL, NULL)) {
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+      if (lines[i][0] && !apply_line (index, lines[i]))
+        skipped++;
+    }
+    g_strfreev (lines);
+    g_free (contents);
+  }
+
+  if (skipped)
+    GST_WARNING ("Skipped %u unreadable lines in %s", skipped, path);
+
+  if (!compact (index, error)) {
+    mark_index_free (index);
+    return NULL;
+  }
+
+  index->fd = g_open (path, O_WRONLY | O_APPEND, 0644);
+  if (index->fd < 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't open %s: %s", path, g_strerror (errno));
+    mark_index_free (index);
+    return NULL;
+  }
+
+  GST_INFO ("Loaded %u marks from %s", g_hash_table_size (index->records), path);
+  return index;
+}
+
+void mark_index_free (MarkIndex * index)
+{
+  if (index->fd >= 0)
+    close (index->fd);
+  g_hash_table_unref (index->records);
+  g_free (index->path);
+  g_free (index);
+}
+
+static gint compare_records (gconstpointer a, gconstpointer b)
+{
+  const MarkRecord * ra = a, * rb = b;
+
+  return ra->at < rb->at ? -1 : ra->at > rb->at;
+}
+
+// Every mark, oldest first.  Free the list (but not the records, which stay
+// the index's) with g_list_free ().
+GList * mark_index_get_records (MarkIndex * index)
+{
+  return g_list_sort (g_hash_table_get_values (index->records), compare_records);
+}
+
+// Add a mark, or replace the one with the same name.  Appends are left to the
+// page cache: they survive the process dying, if not the machine.
+gboolean mark_index_put (MarkIndex * index, const MarkRecord * record, GError ** error)
+{
+  gchar * line = record_to_line ("put", record, NULL);
+  gboolean ok = write_line (index->fd, line, index->path, error);
+  MarkRecord * copy;
+
+  g_free (line);
+  if (!ok)
+    return FALSE;
+
+  copy = record_copy (record);
+  g_hash_table_replace (index->records, copy->name, copy);
+  return TRUE;
+}
+
+gboolean mark_index_remove (MarkIndex * index, const gchar * name, GError ** error)
+{
+  gchar * line;
+  gboolean ok;
+
+  if (!g_hash_table_contains (index->records, name))
+    return TRUE;
+
+  line = record_to_line ("remove", NULL, name);
+  ok = write_line (index->fd, line, index->path, error);
+  g_free (line);
+
+  if (ok)
+    g_hash_table_remove (index->records, name);
+  return ok;
+}
@@ -0,0 +1,42 @@
+/*
+ * Mark index: the set of named marks, kept in a file so that it outlives
+ * the process.
+ *
+ * The file is a log of JSON lines, one per change (a mark added or updated,
+ * or removed), appended as changes happen.  Opening the index replays the
+ * log, skipping anything unreadable (such as a line cut short by a crash),
+ * then rewrites the file with just the live marks so it doesn't grow
+ * without bound.
+ *
+ * Times are on the stream clock (the monotonic system clock), which carries
+ * on across restarts of the process but not of the machine.
+ *
+ * Not thread-safe; the owner serialises access.
+ */
+
+#ifndef __MARK_INDEX_H__
+#define __MARK_INDEX_H__
+
+#include <gst/gst.h>
+
+typedef struct {
+  gchar * name;
+  guint camera;
+  gchar * rendition;
+  GstClockTime at;
+  GstClockTime start;
+  GstClockTime end;
+  gchar * location;     // the materialized clip, or NULL
+} MarkRecord;
+
+typedef struct _MarkIndex MarkIndex;
+
+MarkIndex * mark_index_open (const gchar * path, GError ** error);
+void mark_index_free (MarkIndex * index);
+
+GList * mark_index_get_records (MarkIndex * index);
+
+gboolean mark_index_put (MarkIndex * index, const MarkRecord * record, GError ** error);
+gboolean mark_index_remove (MarkIndex * index, const gchar * name, GError ** error);
+
+#endif /* __MARK_INDEX_H__ */
@@ -0,0 +1,79 @@
+#include "metrics.h"
+
+// Upper bounds in ms; roughly logarithmic from a frame's worth of time to
+// a minute, which covers everything from probe-to-probe hops to long clips.
+static const gdouble bucket_bounds[HISTOGRAM_BUCKETS] = {
+  1, 2, 5, 10, 20, 33, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000, 60000
+};
+
+void histogram_observe (Histogram * histogram, gdouble ms)
+{
+  guint i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS && ms > bucket_bounds[i]; i++)
+    ;
+
+  histogram->counts[i]++;
+  histogram->count++;
+  histogram->sum += ms;
+}
+
+// Estimate a quantile by interpolating linearly within its bucket.
+gdouble histogram_quantile (const Histogram * histogram, gdouble q)
+{
+  gdouble rank = q * histogram->count, lower = 0, seen = 0;
+  guint i;
+
+  if (!histogram->count)
+    return 0;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (seen + histogram->counts[i] >= rank && histogram->counts[i])
+      return lower + (bucket_bounds[i] - lower) * (rank - seen) / histogram->counts[i];
+    seen += histogram->counts[i];
+    lower = bucket_bounds[i];
+  }
+
+  // In the +Inf bucket; the best we can say is "more than the last bound"
+  return bucket_bounds[HISTOGRAM_BUCKETS - 1];
+}
+
+void metrics_append_header (GString * out, const gchar * name, const gchar * type,
+    const gchar * help)
+{
+  g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_append_value (GString * out, const gchar * name, const gchar * labels,
+    gdouble value)
+{
+  g_string_append_printf (out, "%s{%s} %.17g\n", name, labels, value);
+}
+
+void histogram_append_prometheus (const Histogram * histogram, GString * out,
+    const gchar * name, const gchar * labels)
+{
+  const gchar * sep = labels[0] ? "," : "";
+  guint64 cumulative = 0;
+  guint i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    cumulative += histogram->counts[i];
+    g_string_append_printf (out, "%s_bucket{%s%sle=\"%g\"} %" G_GUINT64_FORMAT "\n",
+        name, labels, sep, bucket_bounds[i], cumulative);
+  }
+  g_string_append_printf (out, "%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+      name, labels, sep, histogram->count);
+  g_string_append_printf (out, "%s_sum{%s} %.3f\n", name, labels, histogram->sum);
+  g_string_append_printf (out, "%s_count{%s} %" G_GUINT64_FORMAT "\n",
+      name, labels, histogram->count);
+}
+
+void histogram_append_json (const Histogram * histogram, GString * out)
+{
+  g_string_append_printf (out,
+      "{ \"count\": %" G_GUINT64_FORMAT ", \"mean\": %.2f, \"p50\": %.2f, \"p95\": %.2f, \"p99\": %.2f }",
+      histogram->count, histogram->count ? histogram->sum / histogram->count : 0.0,
+      histogram_quantile (histogram, 0.50), histogram_quantile (histogram, 0.95),
+      histogram_quantile (histogram, 0.99));
+}
@@ -0,0 +1,34 @@
+/*
+ * Latency histograms and helpers for rendering metrics, either as
+ * Prometheus text exposition format or as JSON for the `stats` command.
+ *
+ * Histograms have fixed millisecond buckets and no locking of their own;
+ * callers hold whatever lock protects the histogram while observing or
+ * rendering it.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <glib.h>
+
+#define HISTOGRAM_BUCKETS 16
+
+typedef struct {
+  guint64 counts[HISTOGRAM_BUCKETS + 1];    // the last one is +Inf
+  guint64 count;
+  gdouble sum;
+} Histogram;
+
+void histogram_observe (Histogram * histogram, gdouble ms);
+gdouble histogram_quantile (const Histogram * histogram, gdouble q);
+
+void metrics_append_header (GString * out, const gchar * name, const gchar * type,
+    const gchar * help);
+void metrics_append_value (GString * out, const gchar * name, const gchar * labels,
+    gdouble value);
+void histogram_append_prometheus (const Histogram * histogram, GString * out,
+    const gchar * name, const gchar * labels);
+void histogram_append_json (const Histogram * histogram, GString * out);
+
+#endif /* __METRICS_H__ */
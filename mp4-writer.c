@@ -0,0 +1,868 @@
+#include "mp4-writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+GST_DEBUG_CATEGORY_EXTERN (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define MEDIA_TIMESCALE 90000
+#define MOVIE_TIMESCALE 1000
+#define MDAT_HEADER_SIZE 16
+
+typedef struct {
+  guint32 size;
+  guint64 offset;
+  GstClockTime dts;
+  GstClockTime pts;
+  gboolean keyframe;
+  guint description;
+} Mp4Sample;
+
+// One stsd entry: samples coded with different SPS/PPS need their own avcC.
+typedef struct {
+  GstBuffer * codec_data;
+  gint width;
+  gint height;
+} Mp4Description;
+
+struct _Mp4Writer {
+  gint fd;
+  guint64 position;
+  guint64 mdat_start;
+  GArray * samples;
+  GArray * descriptions;
+  guint description;
+  GstClockTime base;
+  GstClockTime start;
+  gint fps_n;
+  gint fps_d;
+  // Clip time is stretched by stretch_n / stretch_d for slow motion
+  guint64 stretch_n;
+  guint64 stretch_d;
+};
+
+/* Box building */
+
+static void put_u8 (GByteArray * b, guint8 v)
+{
+  g_byte_array_append (b, &v, 1);
+}
+
+static void put_u16 (GByteArray * b, guint16 v)
+{
+  guint8 d[2] = { v >> 8, v };
+  g_byte_array_append (b, d, sizeof(d));
+}
+
+static void put_u32 (GByteArray * b, guint32 v)
+{
+  guint8 d[4] = { v >> 24, v >> 16, v >> 8, v };
+  g_byte_array_append (b, d, sizeof(d));
+}
+
+static void put_u64 (GByteArray * b, guint64 v)
+{
+  put_u32 (b, v >> 32);
+  put_u32 (b, v);
+}
+
+static void put_zeroes (GByteArray * b, guint n)
+{
+  while (n--)
+    put_u8 (b, 0);
+}
+
+static void put_fourcc (GByteArray * b, const gchar * fourcc)
+{
+  g_byte_array_append (b, (const guint8 *) fourcc, 4);
+}
+
+static void put_matrix (GByteArray * b)
+{
+  put_u32 (b, 0x00010000); put_u32 (b, 0); put_u32 (b, 0);
+  put_u32 (b, 0); put_u32 (b, 0x00010000); put_u32 (b, 0);
+  put_u32 (b, 0); put_u32 (b, 0); put_u32 (b, 0x40000000);
+}
+
+static guint begin_box (GByteArray * b, const gchar * type)
+{
+  guint offset = b->len;
+
+  put_u32 (b, 0);
+  put_fourcc (b, type);
+  return offset;
+}
+
+static guint begin_full_box (GByteArray * b, const gchar * type, guint8 version, guint32 flags)
+{
+  guint offset = begin_box (b, type);
+
+  put_u32 (b, (version << 24) | flags);
+  return offset;
+}
+
+static void set_u32 (GByteArray * b, guint offset, guint32 v)
+{
+  b->data[offset] = v >> 24;
+  b->data[offset + 1] = v >> 16;
+  b->data[offset + 2] = v >> 8;
+  b->data[offset + 3] = v;
+}
+
+static void end_box (GByteArray * b, guint offset)
+{
+  set_u32 (b, offset, b->len - offset);
+}
+
+/* File output */
+
+static gboolean write_at (Mp4Writer * writer, guint64 offset,
+    const guint8 * data, gsize size, GError ** error)
+{
+  while (size) {
+    ssize_t written = pwrite (writer->fd, data, size, offset);
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+          "write failed: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+    data += written;
+    size -= written;
+    offset += written;
+  }
+
+  return TRUE;
+}
+
+static gboolean append (Mp4Writer * writer, const guint8 * data, gsize size, GError ** error)
+{
+  if (!write_at (writer, writer->position, data, size, error))
+    return FALSE;
+
+  writer->position += size;
+  return TRUE;
+}
+
+static guint32 to_media_time (GstClockTime t)
+{
+  return gst_util_uint64_scale_round (t, MEDIA_TIMESCALE, GST_SECOND);
+}
+
+// Fragments are stamped with the stream clock itself, which outgrows 32 bits.
+static guint64 to_media_time64 (GstClockTime t)
+{
+  return gst_util_uint64_scale_round (t, MEDIA_TIMESCALE, GST_SECOND);
+}
+
+#define DESCRIPTION(writer, i) (&g_array_index ((writer)->descriptions, Mp4Description, (i)))
+
+static gboolean parse_caps (GstCaps * caps, Mp4Description * description, GError ** error)
+{
+  GstStructure * s;
+  const GValue * codec_data;
+
+  if (!caps || !(s = gst_caps_get_structure (caps, 0)) ||
+      !(codec_data = gst_structure_get_value (s, "codec_data"))) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+        "stream has no avc codec_data");
+    return FALSE;
+  }
+
+  description->codec_data = gst_value_get_buffer (codec_data);
+  description->width = 0;
+  description->height = 0;
+  gst_structure_get_int (s, "width", &description->width);
+  gst_structure_get_int (s, "height", &description->height);
+
+  return TRUE;
+}
+
+static gboolean same_description (Mp4Description * a, Mp4Description * b)
+{
+  GstMapInfo map;
+  gboolean same;
+
+  if (a->width != b->width || a->height != b->height ||
+      gst_buffer_get_size (a->codec_data) != gst_buffer_get_size (b->codec_data))
+    return FALSE;
+
+  gst_buffer_map (b->codec_data, &map, GST_MAP_READ);
+  same = !gst_buffer_memcmp (a->codec_data, 0, map.data, map.size);
+  gst_buffer_unmap (b->codec_data, &map);
+
+  return same;
+}
+
+// Use caps for the samples added from now on, adding a sample description
+// unless an identical one already exists.
+gboolean mp4_writer_set_caps (Mp4Writer * writer, GstCaps * caps, GError ** error)
+{
+  Mp4Description description;
+  guint i;
+
+  if (!parse_caps (caps, &description, error))
+    return FALSE;
+
+  for (i = 0; i < writer->descriptions->len; i++) {
+    if (same_description (DESCRIPTION (writer, i), &description))
+      break;
+  }
+
+  if (i == writer->descriptions->len) {
+    gst_buffer_ref (description.codec_data);
+    g_array_append_val (writer->descriptions, description);
+  }
+
+  writer->description = i;
+
+  return TRUE;
+}
+
+Mp4Writer * mp4_writer_new (gint fd, GstCaps * caps, GError ** error)
+{
+  GstStructure * s;
+  Mp4Writer * writer;
+  GByteArray * b;
+  guint ftyp;
+  gboolean ok;
+
+  writer = g_new0 (Mp4Writer, 1);
+  writer->fd = fd;
+  writer->samples = g_array_new (FALSE, FALSE, sizeof(Mp4Sample));
+  writer->descriptions = g_array_new (FALSE, FALSE, sizeof(Mp4Description));
+  writer->base = GST_CLOCK_TIME_NONE;
+  writer->start = GST_CLOCK_TIME_NONE;
+  writer->stretch_n = 1;
+  writer->stretch_d = 1;
+
+  if (!mp4_writer_set_caps (writer, caps, error)) {
+    mp4_writer_free (writer);
+    return NULL;
+  }
+
+  s = gst_caps_get_structure (caps, 0);
+  if (!gst_structure_get_fraction (s, "framerate", &writer->fps_n, &writer->fps_d) ||
+      !writer->fps_n || !writer->fps_d) {
+    writer->fps_n = 30;
+    writer->fps_d = 1;
+  }
+
+  b = g_byte_array_new ();
+
+  ftyp = begin_box (b, "ftyp");
+  put_fourcc (b, "isom");
+  put_u32 (b, 0x200);
+  put_fourcc (b, "isom");
+  put_fourcc (b, "iso2");
+  put_fourcc (b, "avc1");
+  put_fourcc (b, "mp41");
+  end_box (b, ftyp);
+
+  // 64-bit mdat header; the size gets patched in once we know it
+  writer->mdat_start = b->len;
+  put_u32 (b, 1);
+  put_fourcc (b, "mdat");
+  put_u64 (b, 0);
+
+  ok = append (writer, b->data, b->len, error);
+  g_byte_array_free (b, TRUE);
+
+  if (!ok) {
+    mp4_writer_free (writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+void mp4_writer_free (Mp4Writer * writer)
+{
+  guint i;
+
+  for (i = 0; i < writer->descriptions->len; i++)
+    gst_buffer_unref (DESCRIPTION (writer, i)->codec_data);
+  g_array_free (writer->descriptions, TRUE);
+  g_array_free (writer->samples, TRUE);
+  g_free (writer);
+}
+
+// Present the clip from start onwards: anything decoded before it (the rest
+// of the GOP start falls in) is hidden by an edit list.  start is on the
+// same timeline as the units' PTS.
+void mp4_writer_set_start (Mp4Writer * writer, GstClockTime start)
+{
+  writer->start = start;
+}
+
+// Play the clip at fps_n/fps_d rather than the rate it was captured at, by
+// stretching every timestamp: 120 fps footage played at 30 fps runs four
+// times as long.  Only the sample tables change; the frames are written as
+// they are.  Must come before the first sample.
+void mp4_writer_set_playback_rate (Mp4Writer * writer, gint fps_n, gint fps_d)
+{
+  writer->stretch_n = (guint64) writer->fps_n * fps_d;
+  writer->stretch_d = (guint64) writer->fps_d * fps_n;
+  writer->fps_n = fps_n;
+  writer->fps_d = fps_d;
+}
+
+static GstClockTime stretch (Mp4Writer * writer, GstClockTime t)
+{
+  return gst_util_uint64_scale (t, writer->stretch_n, writer->stretch_d);
+}
+
+gboolean mp4_writer_add (Mp4Writer * writer, const ReplayUnit * unit, GError ** error)
+{
+  GstClockTime dts = GST_CLOCK_TIME_IS_VALID (unit->dts) ? unit->dts : unit->pts;
+  Mp4Sample sample;
+  GstMapInfo map;
+  gboolean ok;
+
+  if (!GST_CLOCK_TIME_IS_VALID (writer->base))
+    writer->base = MIN (unit->pts, dts);
+
+  if (!gst_buffer_map (unit->buffer, &map, GST_MAP_READ)) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "couldn't map sample");
+    return FALSE;
+  }
+
+  sample.size = map.size;
+  sample.offset = writer->position;
+  sample.dts = stretch (writer, dts - writer->base);
+  sample.pts = stretch (writer, unit->pts - writer->base);
+  sample.keyframe = unit->keyframe;
+  sample.description = writer->description;
+
+  ok = append (writer, map.data, map.size, error);
+  gst_buffer_unmap (unit->buffer, &map);
+
+  if (ok)
+    g_array_append_val (writer->samples, sample);
+
+  return ok;
+}
+
+#define SAMPLE(writer, i) (&g_array_index ((writer)->samples, Mp4Sample, (i)))
+
+static guint32 sample_duration (Mp4Writer * writer, guint i)
+{
+  guint n = writer->samples->len;
+
+  if (i + 1 < n)
+    return to_media_time (SAMPLE (writer, i + 1)->dts) - to_media_time (SAMPLE (writer, i)->dts);
+
+  // Last sample: assume it lasts as long as a frame
+  return gst_util_uint64_scale_int (MEDIA_TIMESCALE, writer->fps_d, writer->fps_n);
+}
+
+static guint64 media_duration (Mp4Writer * writer)
+{
+  guint n = writer->samples->len;
+
+  if (!n)
+    return 0;
+
+  return to_media_time (SAMPLE (writer, n - 1)->dts) + sample_duration (writer, n - 1);
+}
+
+static void put_avc1 (Mp4Description * description, GByteArray * b)
+{
+  GstMapInfo map;
+  guint avc1, avcc;
+
+  avc1 = begin_box (b, "avc1");
+  put_zeroes (b, 6);
+  put_u16 (b, 1);                 // data_reference_index
+  put_zeroes (b, 16);
+  put_u16 (b, description->width);
+  put_u16 (b, description->height);
+  put_u32 (b, 0x00480000);        // 72 dpi
+  put_u32 (b, 0x00480000);
+  put_u32 (b, 0);
+  put_u16 (b, 1);                 // frame_count
+  put_zeroes (b, 32);             // compressorname
+  put_u16 (b, 0x0018);
+  put_u16 (b, 0xffff);
+
+  avcc = begin_box (b, "avcC");
+  gst_buffer_map (description->codec_data, &map, GST_MAP_READ);
+  g_byte_array_append (b, map.data, map.size);
+  gst_buffer_unmap (description->codec_data, &map);
+  end_box (b, avcc);
+
+  end_box (b, avc1);
+}
+
+static gboolean starts_chunk (Mp4Writer * writer, guint i)
+{
+  return !i || SAMPLE (writer, i)->keyframe ||
+    SAMPLE (writer, i)->description != SAMPLE (writer, i - 1)->description;
+}
+
+static void put_stbl (Mp4Writer * writer, GByteArray * b)
+{
+  guint n = writer->samples->len, i, entries, entries_at;
+  guint stbl, box;
+  gboolean need_ctts = FALSE, all_keyframes = TRUE, need_co64 = FALSE;
+  guint32 run_value = 0, run_length = 0, chunks = 0, prev_per_chunk = 0, per_chunk = 0;
+  guint prev_description = G_MAXUINT;
+
+  stbl = begin_box (b, "stbl");
+
+  box = begin_full_box (b, "stsd", 0, 0);
+  put_u32 (b, writer->descriptions->len);
+  for (i = 0; i < writer->descriptions->len; i++)
+    put_avc1 (DESCRIPTION (writer, i), b);
+  end_box (b, box);
+
+  // stts: run-length encoded sample durations
+  box = begin_full_box (b, "stts", 0, 0);
+  entries_at = b->len;
+  put_u32 (b, 0);
+  for (i = 0, entries = 0; i < n; i++) {
+    guint32 duration = sample_duration (writer, i);
+
+    if (run_length && duration == run_value) {
+      run_length++;
+      continue;
+    }
+    if (run_length) {
+      put_u32 (b, run_length);
+      put_u32 (b, run_value);
+      entries++;
+    }
+    run_value = duration;
+    run_length = 1;
+  }
+  if (run_length) {
+    put_u32 (b, run_length);
+    put_u32 (b, run_value);
+    entries++;
+  }
+  set_u32 (b, entries_at, entries);
+  end_box (b, box);
+
+  for (i = 0; i < n; i++) {
+    if (SAMPLE (writer, i)->pts != SAMPLE (writer, i)->dts)
+      need_ctts = TRUE;
+    if (!SAMPLE (writer, i)->keyframe)
+      all_keyframes = FALSE;
+  }
+
+  // ctts: composition offsets, only when frames are reordered
+  if (need_ctts) {
+    box = begin_full_box (b, "ctts", 0, 0);
+    entries_at = b->len;
+    put_u32 (b, 0);
+    run_length = 0;
+    for (i = 0, entries = 0; i < n; i++) {
+      Mp4Sample * sample = SAMPLE (writer, i);
+      guint32 offset = sample->pts > sample->dts ?
+        to_media_time (sample->pts) - to_media_time (sample->dts) : 0;
+
+      if (run_length && offset == run_value) {
+        run_length++;
+        continue;
+      }
+      if (run_length) {
+        put_u32 (b, run_length);
+        put_u32 (b, run_value);
+        entries++;
+      }
+      run_value = offset;
+      run_length = 1;
+    }
+    if (run_length) {
+      put_u32 (b, run_length);
+      put_u32 (b, run_value);
+      entries++;
+    }
+    set_u32 (b, entries_at, entries);
+    end_box (b, box);
+  }
+
+  // stss: sync samples; absent means every sample is one
+  if (!all_keyframes) {
+    box = begin_full_box (b, "stss", 0, 0);
+    entries_at = b->len;
+    put_u32 (b, 0);
+    for (i = 0, entries = 0; i < n; i++) {
+      if (SAMPLE (writer, i)->keyframe) {
+        put_u32 (b, i + 1);
+        entries++;
+      }
+    }
+    set_u32 (b, entries_at, entries);
+    end_box (b, box);
+  }
+
+  box = begin_full_box (b, "stsz", 0, 0);
+  put_u32 (b, 0);
+  put_u32 (b, n);
+  for (i = 0; i < n; i++)
+    put_u32 (b, SAMPLE (writer, i)->size);
+  end_box (b, box);
+
+  // One chunk per GOP: samples are contiguous in mdat, so a chunk starts at
+  // every keyframe (or change of sample description).  stsc only needs an
+  // entry when the chunk size or description changes.
+  box = begin_full_box (b, "stsc", 0, 0);
+  entries_at = b->len;
+  put_u32 (b, 0);
+  for (i = 0, entries = 0; i <= n; i++) {
+    if (i < n && !starts_chunk (writer, i)) {
+      per_chunk++;
+      continue;
+    }
+    if (i && (per_chunk != prev_per_chunk || SAMPLE (writer, i - 1)->description != prev_description)) {
+      put_u32 (b, chunks);
+      put_u32 (b, per_chunk);
+      put_u32 (b, SAMPLE (writer, i - 1)->description + 1);
+      entries++;
+      prev_per_chunk = per_chunk;
+      prev_description = SAMPLE (writer, i - 1)->description;
+    }
+    chunks++;
+    per_chunk = 1;
+  }
+  chunks--;
+  set_u32 (b, entries_at, entries);
+  end_box (b, box);
+
+  if (n && SAMPLE (writer, n - 1)->offset > G_MAXUINT32)
+    need_co64 = TRUE;
+
+  box = begin_full_box (b, need_co64 ? "co64" : "stco", 0, 0);
+  put_u32 (b, chunks);
+  for (i = 0; i < n; i++) {
+    if (!starts_chunk (writer, i))
+      continue;
+    if (need_co64)
+      put_u64 (b, SAMPLE (writer, i)->offset);
+    else
+      put_u32 (b, SAMPLE (writer, i)->offset);
+  }
+  end_box (b, box);
+
+  end_box (b, stbl);
+}
+
+static void put_mvhd (GByteArray * b, guint32 movie_duration)
+{
+  guint box = begin_full_box (b, "mvhd", 0, 0);
+
+  put_u32 (b, 0);                 // creation_time
+  put_u32 (b, 0);                 // modification_time
+  put_u32 (b, MOVIE_TIMESCALE);
+  put_u32 (b, movie_duration);
+  put_u32 (b, 0x00010000);        // rate 1.0
+  put_u16 (b, 0x0100);            // volume 1.0
+  put_zeroes (b, 10);
+  put_matrix (b);
+  put_zeroes (b, 24);
+  put_u32 (b, 2);                 // next_track_ID
+  end_box (b, box);
+}
+
+static void put_tkhd (GByteArray * b, guint32 movie_duration, Mp4Description * description)
+{
+  guint box = begin_full_box (b, "tkhd", 0, 0x000003);
+
+  put_u32 (b, 0);
+  put_u32 (b, 0);
+  put_u32 (b, 1);                 // track_ID
+  put_u32 (b, 0);
+  put_u32 (b, movie_duration);
+  put_zeroes (b, 8);
+  put_u16 (b, 0);                 // layer
+  put_u16 (b, 0);                 // alternate_group
+  put_u16 (b, 0);                 // volume
+  put_u16 (b, 0);
+  put_matrix (b);
+  put_u32 (b, description->width << 16);
+  put_u32 (b, description->height << 16);
+  end_box (b, box);
+}
+
+// mdhd and hdlr, which start an mdia.
+static void put_media_header (GByteArray * b, guint32 duration)
+{
+  guint box = begin_full_box (b, "mdhd", 0, 0);
+
+  put_u32 (b, 0);
+  put_u32 (b, 0);
+  put_u32 (b, MEDIA_TIMESCALE);
+  put_u32 (b, duration);
+  put_u16 (b, 0x55c4);            // 'und'
+  put_u16 (b, 0);
+  end_box (b, box);
+
+  box = begin_full_box (b, "hdlr", 0, 0);
+  put_u32 (b, 0);
+  put_fourcc (b, "vide");
+  put_zeroes (b, 12);
+  g_byte_array_append (b, (const guint8 *) "VideoHandler", 13);
+  end_box (b, box);
+}
+
+// vmhd and dinf, which start a minf.
+static void put_media_info_header (GByteArray * b)
+{
+  guint dinf, box;
+
+  box = begin_full_box (b, "vmhd", 0, 1);
+  put_zeroes (b, 8);
+  end_box (b, box);
+
+  dinf = begin_box (b, "dinf");
+  box = begin_full_box (b, "dref", 0, 0);
+  put_u32 (b, 1);
+  end_box (b, begin_full_box (b, "url ", 0, 1));
+  end_box (b, box);
+  end_box (b, dinf);
+}
+
+static void put_moov (Mp4Writer * writer, GByteArray * b)
+{
+  guint64 duration = media_duration (writer);
+  guint32 media_start = 0, movie_duration;
+  guint moov, trak, edts, mdia, minf, box;
+
+  if (GST_CLOCK_TIME_IS_VALID (writer->start) && writer->start > writer->base)
+    media_start = MIN (to_media_time (stretch (writer, writer->start - writer->base)), duration);
+  movie_duration = gst_util_uint64_scale (duration - media_start, MOVIE_TIMESCALE, MEDIA_TIMESCALE);
+
+  moov = begin_box (b, "moov");
+  put_mvhd (b, movie_duration);
+
+  trak = begin_box (b, "trak");
+  put_tkhd (b, movie_duration, DESCRIPTION (writer, 0));
+
+  // A single edit skipping the lead-in frames
+  if (media_start) {
+    edts = begin_box (b, "edts");
+    box = begin_full_box (b, "elst", 0, 0);
+    put_u32 (b, 1);
+    put_u32 (b, movie_duration);
+    put_u32 (b, media_start);
+    put_u16 (b, 1);               // media_rate 1.0
+    put_u16 (b, 0);
+    end_box (b, box);
+    end_box (b, edts);
+  }
+
+  mdia = begin_box (b, "mdia");
+  put_media_header (b, duration);
+
+  minf = begin_box (b, "minf");
+  put_media_info_header (b);
+  put_stbl (writer, b);
+
+  end_box (b, minf);
+  end_box (b, mdia);
+  end_box (b, trak);
+  end_box (b, moov);
+}
+
+gboolean mp4_writer_finish (Mp4Writer * writer, GError ** error)
+{
+  GByteArray * b;
+  guint8 mdat_size[8];
+  guint64 size = writer->position - writer->mdat_start;
+  gboolean ok;
+  guint i;
+
+  if (!writer->samples->len) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "no samples to write");
+    return FALSE;
+  }
+
+  b = g_byte_array_new ();
+  for (i = 0; i < 8; i++)
+    mdat_size[i] = size >> (56 - 8 * i);
+
+  put_moov (writer, b);
+
+  ok = write_at (writer, writer->mdat_start + 8, mdat_size, sizeof(mdat_size), error) &&
+    append (writer, b->data, b->len, error) &&
+    ftruncate (writer->fd, writer->position) == 0;
+
+  g_byte_array_free (b, TRUE);
+
+  return ok;
+}
+
+guint mp4_writer_get_n_samples (Mp4Writer * writer)
+{
+  return writer->samples->len;
+}
+
+GstClockTime mp4_writer_get_duration (Mp4Writer * writer)
+{
+  return gst_util_uint64_scale (media_duration (writer), GST_SECOND, MEDIA_TIMESCALE);
+}
+
+/* Fragmented output */
+
+// An empty sample table, for a moov whose samples all come in fragments.
+static void put_empty_stbl (Mp4Description * description, GByteArray * b)
+{
+  guint stbl, box;
+
+  stbl = begin_box (b, "stbl");
+
+  box = begin_full_box (b, "stsd", 0, 0);
+  put_u32 (b, 1);
+  put_avc1 (description, b);
+  end_box (b, box);
+
+  box = begin_full_box (b, "stts", 0, 0);
+  put_u32 (b, 0);
+  end_box (b, box);
+  box = begin_full_box (b, "stsc", 0, 0);
+  put_u32 (b, 0);
+  end_box (b, box);
+  box = begin_full_box (b, "stsz", 0, 0);
+  put_u32 (b, 0);
+  put_u32 (b, 0);
+  end_box (b, box);
+  box = begin_full_box (b, "stco", 0, 0);
+  put_u32 (b, 0);
+  end_box (b, box);
+
+  end_box (b, stbl);
+}
+
+// The CMAF header for a track of caps: ftyp plus a moov with no samples
+// and an mvex announcing that fragments follow.
+GBytes * mp4_init_segment_new (GstCaps * caps, GError ** error)
+{
+  Mp4Description description;
+  GByteArray * b;
+  guint ftyp, moov, trak, mdia, minf, mvex, box;
+
+  if (!parse_caps (caps, &description, error))
+    return NULL;
+
+  b = g_byte_array_new ();
+
+  ftyp = begin_box (b, "ftyp");
+  put_fourcc (b, "iso6");
+  put_u32 (b, 0);
+  put_fourcc (b, "iso6");
+  put_fourcc (b, "cmfc");
+  put_fourcc (b, "avc1");
+  end_box (b, ftyp);
+
+  moov = begin_box (b, "moov");
+  put_mvhd (b, 0);
+
+  trak = begin_box (b, "trak");
+  put_tkhd (b, 0, &description);
+  mdia = begin_box (b, "mdia");
+  put_media_header (b, 0);
+  minf = begin_box (b, "minf");
+  put_media_info_header (b);
+  put_empty_stbl (&description, b);
+  end_box (b, minf);
+  end_box (b, mdia);
+  end_box (b, trak);
+
+  mvex = begin_box (b, "mvex");
+  box = begin_full_box (b, "trex", 0, 0);
+  put_u32 (b, 1);                 // track_ID
+  put_u32 (b, 1);                 // default_sample_description_index
+  put_u32 (b, 0);
+  put_u32 (b, 0);
+  put_u32 (b, 0);
+  end_box (b, box);
+  end_box (b, mvex);
+
+  end_box (b, moov);
+
+  return g_byte_array_free_to_bytes (b);
+}
+
+#define TRUN_FLAGS 0x000f01       // data offset, then per sample duration, size, flags, cts
+#define SAMPLE_FLAGS_SYNC 0x02000000
+#define SAMPLE_FLAGS_NON_SYNC 0x01010000
+
+static GstClockTime unit_dts (const ReplayUnit * unit)
+{
+  return GST_CLOCK_TIME_IS_VALID (unit->dts) ? unit->dts : unit->pts;
+}
+
+// One moof + mdat holding units in decode order.  Timestamps stay on the
+// stream clock, so consecutive fragments line up without any state here;
+// end_dts (the next unit's DTS) gives the last sample its duration.
+GBytes * mp4_fragment_new (guint32 sequence, const ReplayUnit * units, guint n_units,
+    GstClockTime end_dts, GError ** error)
+{
+  GByteArray * b;
+  GstMapInfo map;
+  guint moof, traf, box, data_offset, mdat, i;
+
+  if (!n_units) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "no samples to write");
+    return NULL;
+  }
+
+  b = g_byte_array_new ();
+
+  moof = begin_box (b, "moof");
+
+  box = begin_full_box (b, "mfhd", 0, 0);
+  put_u32 (b, sequence);
+  end_box (b, box);
+
+  traf = begin_box (b, "traf");
+
+  box = begin_full_box (b, "tfhd", 0, 0x020000);    // default-base-is-moof
+  put_u32 (b, 1);
+  end_box (b, box);
+
+  box = begin_full_box (b, "tfdt", 1, 0);
+  put_u64 (b, to_media_time64 (unit_dts (&units[0])));
+  end_box (b, box);
+
+  box = begin_full_box (b, "trun", 1, TRUN_FLAGS);
+  put_u32 (b, n_units);
+  data_offset = b->len;
+  put_u32 (b, 0);
+  for (i = 0; i < n_units; i++) {
+    GstClockTime dts = unit_dts (&units[i]);
+    GstClockTime next = i + 1 < n_units ? unit_dts (&units[i + 1]) : end_dts;
+
+    put_u32 (b, to_media_time64 (MAX (next, dts)) - to_media_time64 (dts));
+    put_u32 (b, units[i].size);
+    put_u32 (b, units[i].keyframe ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NON_SYNC);
+    put_u32 (b, (guint32) (gint32) (to_media_time64 (units[i].pts) - to_media_time64 (dts)));
+  }
+  end_box (b, box);
+
+  end_box (b, traf);
+  end_box (b, moof);
+
+  // Samples start right after the mdat header
+  set_u32 (b, data_offset, b->len - moof + 8);
+
+  mdat = begin_box (b, "mdat");
+  for (i = 0; i < n_units; i++) {
+    if (!gst_buffer_map (units[i].buffer, &map, GST_MAP_READ)) {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "couldn't map sample");
+      g_byte_array_free (b, TRUE);
+      return NULL;
+    }
+    g_byte_array_append (b, map.data, map.size);
+    gst_buffer_unmap (units[i].buffer, &map);
+  }
+  end_box (b, mdat);
+
+  return g_byte_array_free_to_bytes (b);
+}
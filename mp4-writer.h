@@ -0,0 +1,45 @@
+/*
+ * Native MP4 writer for already-encoded H.264 access units.
+ *
+ * Turns a run of ReplayUnits straight into an MP4 file (ftyp, mdat, then a
+ * moov with avcC and stts/ctts/stss/stsz/stsc/stco tables, plus an edit list
+ * when the clip starts mid-GOP) with no GStreamer elements involved, so a
+ * replay costs a handful of pwrite()s rather than a pipeline build, state
+ * change and teardown.
+ *
+ * Samples are written to the file as they're added; only the sample tables
+ * are kept in memory until mp4_writer_finish () writes the moov.  The writer
+ * never closes the fd it was given.  A clip can be played back slower than
+ * it was captured (slow motion) by stretching its timestamps alone.
+ *
+ * The same boxes also come as fragmented MP4 (CMAF) in memory, for live
+ * publishing: an init segment per set of caps, then any number of
+ * moof + mdat fragments, each built from a run of units on its own.
+ */
+
+#ifndef __MP4_WRITER_H__
+#define __MP4_WRITER_H__
+
+#include <gst/gst.h>
+
+#include "replay-ring.h"
+
+typedef struct _Mp4Writer Mp4Writer;
+
+Mp4Writer * mp4_writer_new (gint fd, GstCaps * caps, GError ** error);
+void mp4_writer_free (Mp4Writer * writer);
+void mp4_writer_set_start (Mp4Writer * writer, GstClockTime start);
+void mp4_writer_set_playback_rate (Mp4Writer * writer, gint fps_n, gint fps_d);
+gboolean mp4_writer_set_caps (Mp4Writer * writer, GstCaps * caps, GError ** error);
+
+gboolean mp4_writer_add (Mp4Writer * writer, const ReplayUnit * unit, GError ** error);
+gboolean mp4_writer_finish (Mp4Writer * writer, GError ** error);
+
+guint mp4_writer_get_n_samples (Mp4Writer * writer);
+GstClockTime mp4_writer_get_duration (Mp4Writer * writer);
+
+GBytes * mp4_init_segment_new (GstCaps * caps, GError ** error);
+GBytes * mp4_fragment_new (guint32 sequence, const ReplayUnit * units, guint n_units,
+    GstClockTime end_dts, GError ** error);
+
+#endif /* __MP4_WRITER_H__ */
@@ -0,0 +1,558 @@
+#include "replay-ring.h"
+
+GST_DEBUG_CATEGORY_EXTERN (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define INITIAL_UNIT_CAPACITY 1024
+#define INITIAL_KEYFRAME_CAPACITY 64
+
+// A unit either holds its buffer in memory, or (once spilled) just remembers
+// where it lives in the segment store.
+typedef struct {
+  ReplayUnit unit;
+  SegmentLocation location;
+} Slot;
+
+struct _ReplayRing {
+  GMutex lock;
+  GstCaps * caps;
+  GstClockTime max_time;
+  guint64 max_bytes;
+
+  // Circular array of slots; slots[head] has sequence number first_seq.
+  Slot * slots;
+  guint capacity;
+  guint head;
+  guint length;
+  guint64 first_seq;
+  guint64 bytes;
+  GstClockTime last_pts;
+
+  // Circular array of the sequence numbers of every retained keyframe,
+  // in increasing order (and therefore in increasing PTS order).
+  guint64 * keyframes;
+  guint kf_capacity;
+  guint kf_head;
+  guint kf_length;
+
+  // Spilling: everything before mem_first_seq has been written to the store.
+  SegmentStore * store;
+  GstClockTime mem_max_time;
+  guint64 mem_max_bytes;
+  guint64 mem_first_seq;
+  guint64 mem_bytes;
+};
+
+#define SLOT_AT(ring, seq) \
+  (&(ring)->slots[((ring)->head + (guint)((seq) - (ring)->first_seq)) % (ring)->capacity])
+#define UNIT_AT(ring, seq) (&SLOT_AT (ring, seq)->unit)
+#define KEYFRAME_AT(ring, i) \
+  ((ring)->keyframes[((ring)->kf_head + (i)) % (ring)->kf_capacity])
+
+ReplayRing * replay_ring_new (GstClockTime max_time, guint64 max_bytes)
+{
+  ReplayRing * ring = g_new0 (ReplayRing, 1);
+
+  g_mutex_init (&ring->lock);
+  ring->max_time = max_time;
+  ring->max_bytes = max_bytes;
+  ring->last_pts = GST_CLOCK_TIME_NONE;
+
+  ring->capacity = INITIAL_UNIT_CAPACITY;
+  ring->slots = g_new0 (Slot, ring->capacity);
+
+  ring->kf_capacity = INITIAL_KEYFRAME_CAPACITY;
+  ring->keyframes = g_new0 (guint64, ring->kf_capacity);
+
+  return ring;
+}
+
+void replay_ring_free (ReplayRing * ring)
+{
+  guint i;
+
+  for (i = 0; i < ring->length; i++)
+    replay_ring_unit_clear (&ring->slots[(ring->head + i) % ring->capacity].unit);
+
+  if (ring->caps)
+    gst_caps_unref (ring->caps);
+
+  if (ring->store)
+    segment_store_free (ring->store);
+
+  g_free (ring->slots);
+  g_free (ring->keyframes);
+  g_mutex_clear (&ring->lock);
+  g_free (ring);
+}
+
+// Keep only the newest mem_max_time/mem_max_bytes in memory and spill older
+// GOPs to the store.  The ring takes ownership of the store.
+void replay_ring_set_spill (ReplayRing * ring, SegmentStore * store,
+    GstClockTime mem_max_time, guint64 mem_max_bytes)
+{
+  g_mutex_lock (&ring->lock);
+  ring->store = store;
+  ring->mem_max_time = mem_max_time;
+  ring->mem_max_bytes = mem_max_bytes;
+  g_mutex_unlock (&ring->lock);
+}
+
+void replay_ring_set_caps (ReplayRing * ring, GstCaps * caps)
+{
+  g_mutex_lock (&ring->lock);
+  if (ring->caps)
+    gst_caps_unref (ring->caps);
+  ring->caps = caps ? gst_caps_ref (caps) : NULL;
+  g_mutex_unlock (&ring->lock);
+}
+
+GstCaps * replay_ring_get_caps (ReplayRing * ring)
+{
+  GstCaps * caps;
+
+  g_mutex_lock (&ring->lock);
+  caps = ring->caps ? gst_caps_ref (ring->caps) : NULL;
+  g_mutex_unlock (&ring->lock);
+
+  return caps;
+}
+
+static void grow_slots (ReplayRing * ring)
+{
+  guint i, capacity = ring->capacity * 2;
+  Slot * slots = g_new0 (Slot, capacity);
+
+  for (i = 0; i < ring->length; i++)
+    slots[i] = ring->slots[(ring->head + i) % ring->capacity];
+
+  g_free (ring->slots);
+  ring->slots = slots;
+  ring->capacity = capacity;
+  ring->head = 0;
+}
+
+static void grow_keyframes (ReplayRing * ring)
+{
+  guint i, capacity = ring->kf_capacity * 2;
+  guint64 * keyframes = g_new0 (guint64, capacity);
+
+  for (i = 0; i < ring->kf_length; i++)
+    keyframes[i] = KEYFRAME_AT (ring, i);
+
+  g_free (ring->keyframes);
+  ring->keyframes = keyframes;
+  ring->kf_capacity = capacity;
+  ring->kf_head = 0;
+}
+
+static gboolean over_limit (ReplayRing * ring)
+{
+  GstClockTime oldest = ring->slots[ring->head].unit.pts;
+
+  if (ring->max_time && GST_CLOCK_TIME_IS_VALID (oldest) &&
+      GST_CLOCK_TIME_IS_VALID (ring->last_pts) &&
+      ring->last_pts > oldest && ring->last_pts - oldest > ring->max_time)
+    return TRUE;
+
+  if (ring->max_bytes && ring->bytes > ring->max_bytes)
+    return TRUE;
+
+  return FALSE;
+}
+
+// Drop the oldest GOP entirely.
+static void drop_front_gop (ReplayRing * ring)
+{
+  guint64 next_gop = ring->kf_length > 1 ? KEYFRAME_AT (ring, 1) : ring->first_seq + ring->length;
+
+  while (ring->first_seq < next_gop) {
+    ReplayUnit * unit = &ring->slots[ring->head].unit;
+
+    ring->bytes -= unit->size;
+    if (unit->buffer && ring->first_seq >= ring->mem_first_seq)
+      ring->mem_bytes -= unit->size;
+    replay_ring_unit_clear (unit);
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->length--;
+    ring->first_seq++;
+  }
+
+  ring->kf_head = (ring->kf_head + 1) % ring->kf_capacity;
+  ring->kf_length--;
+
+  if (ring->mem_first_seq < ring->first_seq)
+    ring->mem_first_seq = ring->first_seq;
+}
+
+// Drop whole GOPs from the front until we're back within our limits.  The
+// newest GOP is never dropped, even if it alone exceeds the limits.
+static void evict (ReplayRing * ring)
+{
+  while (ring->kf_length > 1 && over_limit (ring))
+    drop_front_gop (ring);
+}
+
+// A segment was overwritten: forget every GOP that had data in it.  Segments
+// are filled in order, so those are the oldest spilled GOPs.  Restored units
+// (from before a restart) sit in front of them and are older still, so if
+// any GOP is lost they go first: the ring never keeps footage from before a
+// hole, where a replay or mark could run into it.
+static void drop_recycled (ReplayRing * ring, guint segment, guint64 generation)
+{
+  guint64 seq;
+  Slot * slot;
+
+  for (seq = ring->first_seq; seq < ring->mem_first_seq; seq++) {
+    if (!SLOT_AT (ring, seq)->unit.buffer)
+      break;
+  }
+
+  // Nothing of the segment left in the ring
+  if (seq == ring->mem_first_seq)
+    return;
+  slot = SLOT_AT (ring, seq);
+  if (slot->location.segment != segment || slot->location.generation != generation)
+    return;
+
+  while (ring->kf_length && ring->first_seq < ring->mem_first_seq) {
+    slot = &ring->slots[ring->head];
+
+    if (!slot->unit.buffer && (slot->location.segment != segment ||
+            slot->location.generation != generation))
+      break;
+
+    drop_front_gop (ring);
+  }
+}
+
+static gboolean memory_over_limit (ReplayRing * ring)
+{
+  GstClockTime oldest = UNIT_AT (ring, ring->mem_first_seq)->pts;
+
+  if (ring->mem_max_time && GST_CLOCK_TIME_IS_VALID (oldest) &&
+      GST_CLOCK_TIME_IS_VALID (ring->last_pts) &&
+      ring->last_pts > oldest && ring->last_pts - oldest > ring->mem_max_time)
+    return TRUE;
+
+  if (ring->mem_max_bytes && ring->mem_bytes > ring->mem_max_bytes)
+    return TRUE;
+
+  return FALSE;
+}
+
+// Find the keyframe that starts the GOP following seq, if we have one.
+static gboolean next_keyframe (ReplayRing * ring, guint64 seq, guint64 * next)
+{
+  guint lo = 0, hi = ring->kf_length, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (KEYFRAME_AT (ring, mid) <= seq)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == ring->kf_length)
+    return FALSE;
+
+  *next = KEYFRAME_AT (ring, lo);
+  return TRUE;
+}
+
+// Move whole GOPs from memory to the segment store, oldest first, while the
+// memory tier is over its limits.  The newest GOP always stays in memory.
+// If the store won't take a unit, spilling stops there for now: everything
+// from mem_first_seq on is still in memory and counted in mem_bytes.
+static void spill (ReplayRing * ring)
+{
+  guint64 gop_end;
+
+  if (!ring->store)
+    return;
+
+  while (ring->mem_first_seq < ring->first_seq + ring->length &&
+      memory_over_limit (ring) &&
+      next_keyframe (ring, ring->mem_first_seq, &gop_end)) {
+
+    while (ring->mem_first_seq < gop_end) {
+      Slot * slot = SLOT_AT (ring, ring->mem_first_seq);
+      gint recycled;
+      guint64 recycled_generation;
+
+      if (!segment_store_append (ring->store, slot->unit.buffer, &slot->location,
+              &recycled, &recycled_generation))
+        return;
+
+      ring->mem_bytes -= slot->unit.size;
+      replay_ring_unit_clear (&slot->unit);
+      ring->mem_first_seq++;
+
+      if (recycled != SEGMENT_STORE_NO_RECYCLE)
+        drop_recycled (ring, recycled, recycled_generation);
+    }
+  }
+}
+
+// Append a unit.  One that's restored already lives on disk elsewhere, so
+// it doesn't count against the memory tier and never gets spilled.
+static void push_unit (ReplayRing * ring, GstBuffer * buffer, gboolean restored)
+{
+  gboolean keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  ReplayUnit * unit;
+
+  g_mutex_lock (&ring->lock);
+
+  // A ring always starts on a keyframe, otherwise the first GOP is undecodable
+  if (!ring->length && !keyframe) {
+    g_mutex_unlock (&ring->lock);
+    GST_LOG ("Dropping delta unit; no keyframe in ring yet");
+    gst_buffer_unref (buffer);
+    return;
+  }
+
+  if (ring->length == ring->capacity)
+    grow_slots (ring);
+
+  unit = &ring->slots[(ring->head + ring->length) % ring->capacity].unit;
+  unit->buffer = buffer;
+  unit->pts = GST_BUFFER_PTS (buffer);
+  unit->dts = GST_BUFFER_DTS (buffer);
+  unit->size = gst_buffer_get_size (buffer);
+  unit->keyframe = keyframe;
+
+  if (keyframe) {
+    if (ring->kf_length == ring->kf_capacity)
+      grow_keyframes (ring);
+    KEYFRAME_AT (ring, ring->kf_length) = ring->first_seq + ring->length;
+    ring->kf_length++;
+  }
+
+  ring->length++;
+  ring->bytes += unit->size;
+  if (restored)
+    ring->mem_first_seq = ring->first_seq + ring->length;
+  else
+    ring->mem_bytes += unit->size;
+
+  if (GST_CLOCK_TIME_IS_VALID (unit->pts) &&
+      (!GST_CLOCK_TIME_IS_VALID (ring->last_pts) || unit->pts > ring->last_pts))
+    ring->last_pts = unit->pts;
+
+  evict (ring);
+  if (!restored)
+    spill (ring);
+
+  g_mutex_unlock (&ring->lock);
+}
+
+void replay_ring_push (ReplayRing * ring, GstBuffer * buffer)
+{
+  push_unit (ring, buffer, FALSE);
+}
+
+// Put back a unit kept from before a restart, whose buffer wraps a file of
+// its own.  Restored units go in before the first replay_ring_push.
+void replay_ring_restore (ReplayRing * ring, GstBuffer * buffer)
+{
+  push_unit (ring, buffer, TRUE);
+}
+
+ReplayRingReturn replay_ring_get (ReplayRing * ring, guint64 seq, ReplayUnit * unit)
+{
+  ReplayRingReturn ret;
+  Slot * slot;
+
+  g_mutex_lock (&ring->lock);
+
+  if (seq < ring->first_seq) {
+    ret = REPLAY_RING_EVICTED;
+  } else if (seq >= ring->first_seq + ring->length) {
+    ret = REPLAY_RING_PENDING;
+  } else {
+    slot = SLOT_AT (ring, seq);
+    *unit = slot->unit;
+    unit->spilled = !unit->buffer;
+    if (unit->buffer) {
+      gst_buffer_ref (unit->buffer);
+      ret = REPLAY_RING_OK;
+    } else {
+      // Spilled: wrap the mapped segment, no copy, and stamp it as it was
+      unit->buffer = segment_store_read (ring->store, &slot->location);
+      ret = unit->buffer ? REPLAY_RING_OK : REPLAY_RING_EVICTED;
+      if (unit->buffer) {
+        GST_BUFFER_PTS (unit->buffer) = unit->pts;
+        GST_BUFFER_DTS (unit->buffer) = unit->dts;
+        if (unit->keyframe)
+          GST_BUFFER_FLAG_UNSET (unit->buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+        else
+          GST_BUFFER_FLAG_SET (unit->buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+      }
+    }
+  }
+
+  g_mutex_unlock (&ring->lock);
+
+  return ret;
+}
+
+void replay_ring_unit_clear (ReplayUnit * unit)
+{
+  if (unit->buffer) {
+    gst_buffer_unref (unit->buffer);
+    unit->buffer = NULL;
+  }
+}
+
+#define KEYFRAME_PTS(ring, i) (UNIT_AT (ring, KEYFRAME_AT (ring, i))->pts)
+
+static gboolean keyframe_before (ReplayRing * ring, guint i, GstClockTime ts, gboolean inclusive)
+{
+  GstClockTime pts = KEYFRAME_PTS (ring, i);
+
+  return inclusive ? pts <= ts : pts < ts;
+}
+
+// Count the keyframes whose PTS is before ts (or at it, if inclusive).
+// GOPs are close to regular, so interpolating between the oldest and newest
+// keyframe lands on (or right next to) the answer; galloping out from the
+// guess brackets it in O(1) steps then, and O(log n) however uneven they are.
+static guint count_keyframes_before (ReplayRing * ring, GstClockTime ts, gboolean inclusive)
+{
+  guint n = ring->kf_length, guess, lo, hi, step, mid;
+  GstClockTime first, last;
+
+  if (!n || !keyframe_before (ring, 0, ts, inclusive))
+    return 0;
+  if (keyframe_before (ring, n - 1, ts, inclusive))
+    return n;
+
+  // From here on keyframe 0 is before ts and keyframe n - 1 isn't
+  first = KEYFRAME_PTS (ring, 0);
+  last = KEYFRAME_PTS (ring, n - 1);
+  guess = last > first ? gst_util_uint64_scale (ts - first, n - 1, last - first) : 0;
+  guess = MIN (guess, n - 2);
+
+  if (keyframe_before (ring, guess, ts, inclusive)) {
+    lo = guess;
+    for (step = 1;; step *= 2) {
+      hi = MIN (lo + step, n - 1);
+      if (!keyframe_before (ring, hi, ts, inclusive))
+        break;
+      lo = hi;
+    }
+  } else {
+    hi = guess;
+    for (step = 1;; step *= 2) {
+      lo = hi > step ? hi - step : 0;
+      if (keyframe_before (ring, lo, ts, inclusive))
+        break;
+      hi = lo;
+    }
+  }
+
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (keyframe_before (ring, mid, ts, inclusive))
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return hi;
+}
+
+// Find the first keyframe whose PTS is at or after ts.
+gboolean replay_ring_find_keyframe (ReplayRing * ring, GstClockTime ts, guint64 * seq)
+{
+  guint i;
+  gboolean found;
+
+  g_mutex_lock (&ring->lock);
+
+  i = count_keyframes_before (ring, ts, FALSE);
+  found = i < ring->kf_length;
+  if (found)
+    *seq = KEYFRAME_AT (ring, i);
+
+  g_mutex_unlock (&ring->lock);
+
+  return found;
+}
+
+// Find the last keyframe whose PTS is at or before ts, i.e. the start of the
+// GOP that ts falls in.
+gboolean replay_ring_find_keyframe_before (ReplayRing * ring, GstClockTime ts, guint64 * seq)
+{
+  guint i;
+  gboolean found;
+
+  g_mutex_lock (&ring->lock);
+
+  i = count_keyframes_before (ring, ts, TRUE);
+  found = i > 0;
+  if (found)
+    *seq = KEYFRAME_AT (ring, i - 1);
+
+  g_mutex_unlock (&ring->lock);
+
+  return found;
+}
+
+// The oldest sequence number still retained.
+guint64 replay_ring_get_start (ReplayRing * ring)
+{
+  guint64 start;
+
+  g_mutex_lock (&ring->lock);
+  start = ring->first_seq;
+  g_mutex_unlock (&ring->lock);
+
+  return start;
+}
+
+guint64 replay_ring_get_end (ReplayRing * ring)
+{
+  guint64 end;
+
+  g_mutex_lock (&ring->lock);
+  end = ring->first_seq + ring->length;
+  g_mutex_unlock (&ring->lock);
+
+  return end;
+}
+
+GstClockTime replay_ring_get_last_pts (ReplayRing * ring)
+{
+  GstClockTime last_pts;
+
+  g_mutex_lock (&ring->lock);
+  last_pts = ring->last_pts;
+  g_mutex_unlock (&ring->lock);
+
+  return last_pts;
+}
+
+void replay_ring_get_level (ReplayRing * ring, GstClockTime * level_time,
+    guint * level_units, guint64 * level_bytes)
+{
+  g_mutex_lock (&ring->lock);
+
+  *level_time = ring->length ? ring->last_pts - ring->slots[ring->head].unit.pts : 0;
+  *level_units = ring->length;
+  *level_bytes = ring->bytes;
+
+  g_mutex_unlock (&ring->lock);
+}
+
+guint64 replay_ring_get_memory_bytes (ReplayRing * ring)
+{
+  guint64 mem_bytes;
+
+  g_mutex_lock (&ring->lock);
+  mem_bytes = ring->mem_bytes;
+  g_mutex_unlock (&ring->lock);
+
+  return mem_bytes;
+}
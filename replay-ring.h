@@ -0,0 +1,73 @@
+/*
+ * Replay ring: a retention store of encoded access units.
+ *
+ * The ring keeps ref-counted GstBuffers (plus their PTS, DTS, size and
+ * keyframe flag) for a bounded window of time and/or bytes, and a sorted
+ * index of the keyframes it holds.  Reading never consumes anything, so any
+ * number of replays can walk the same footage.  Eviction always drops whole
+ * GOPs from the front, so the oldest retained unit is always a keyframe.
+ *
+ * Units are addressed by a monotonically increasing sequence number that
+ * survives eviction: a reader holding a cursor can tell whether the unit it
+ * wants has already been evicted, is available, or hasn't arrived yet.
+ *
+ * Optionally the ring is tiered: only the newest GOPs stay in memory, older
+ * ones are spilled to a SegmentStore on disk and read back from its mapping
+ * on demand.  Readers can't tell the difference.
+ *
+ * Footage kept from before a restart can be restored into a new ring ahead
+ * of the live stream; it stays where it is on disk, outside either tier,
+ * until it's evicted or the spill tier has to drop footage newer than it.
+ *
+ * All functions are safe to call from any thread.
+ */
+
+#ifndef __REPLAY_RING_H__
+#define __REPLAY_RING_H__
+
+#include <gst/gst.h>
+
+#include "segment-store.h"
+
+typedef struct {
+  GstBuffer * buffer;
+  GstClockTime pts;
+  GstClockTime dts;
+  gsize size;
+  gboolean keyframe;
+  gboolean spilled;             // buffer wraps the segment store's mapping
+} ReplayUnit;
+
+typedef enum {
+  REPLAY_RING_OK,
+  REPLAY_RING_EVICTED,
+  REPLAY_RING_PENDING
+} ReplayRingReturn;
+
+typedef struct _ReplayRing ReplayRing;
+
+ReplayRing * replay_ring_new (GstClockTime max_time, guint64 max_bytes);
+void replay_ring_free (ReplayRing * ring);
+void replay_ring_set_spill (ReplayRing * ring, SegmentStore * store,
+    GstClockTime mem_max_time, guint64 mem_max_bytes);
+
+void replay_ring_set_caps (ReplayRing * ring, GstCaps * caps);
+GstCaps * replay_ring_get_caps (ReplayRing * ring);
+
+void replay_ring_push (ReplayRing * ring, GstBuffer * buffer);
+void replay_ring_restore (ReplayRing * ring, GstBuffer * buffer);
+
+ReplayRingReturn replay_ring_get (ReplayRing * ring, guint64 seq, ReplayUnit * unit);
+void replay_ring_unit_clear (ReplayUnit * unit);
+
+gboolean replay_ring_find_keyframe (ReplayRing * ring, GstClockTime ts, guint64 * seq);
+gboolean replay_ring_find_keyframe_before (ReplayRing * ring, GstClockTime ts, guint64 * seq);
+guint64 replay_ring_get_start (ReplayRing * ring);
+guint64 replay_ring_get_end (ReplayRing * ring);
+GstClockTime replay_ring_get_last_pts (ReplayRing * ring);
+
+void replay_ring_get_level (ReplayRing * ring, GstClockTime * level_time,
+    guint * level_units, guint64 * level_bytes);
+guint64 replay_ring_get_memory_bytes (ReplayRing * ring);
+
+#endif /* __REPLAY_RING_H__ */
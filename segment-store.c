@@ -0,0 +1,231 @@
+#include "segment-store.h"
+
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+GST_DEBUG_CATEGORY_EXTERN (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+typedef struct {
+  gint refcount;
+  gint fd;
+  guint8 * data;
+  gsize size;
+} Segment;
+
+struct _SegmentStore {
+  gchar * dir;
+  gsize segment_size;
+  guint n_segments;
+  Segment ** segments;
+  guint64 * generations;
+  guint current;
+  gsize offset;
+};
+
+static Segment * segment_ref (Segment * segment)
+{
+  g_atomic_int_inc (&segment->refcount);
+  return segment;
+}
+
+static void segment_unref (Segment * segment)
+{
+  if (!g_atomic_int_dec_and_test (&segment->refcount))
+    return;
+
+  munmap (segment->data, segment->size);
+  close (segment->fd);
+  g_free (segment);
+}
+
+static gchar * segment_path (SegmentStore * store, guint index)
+{
+  gchar name[32];
+
+  g_snprintf (name, sizeof(name), "segment-%03u.dat", index);
+  return g_build_filename (store->dir, name, NULL);
+}
+
+// Create (or replace) a segment file, preallocate it and map it.
+static Segment * segment_open (SegmentStore * store, guint index, GError ** error)
+{
+  gchar * path = segment_path (store, index);
+  Segment * segment = NULL;
+  gint fd, err;
+  guint8 * data;
+
+  // Unlink first so anybody still mapping the old file keeps its contents
+  g_unlink (path);
+
+  fd = g_open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't create %s: %s", path, g_strerror (errno));
+    goto done;
+  }
+
+  if ((err = posix_fallocate (fd, 0, store->segment_size)) != 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (err),
+        "couldn't preallocate %s: %s", path, g_strerror (err));
+    close (fd);
+    goto done;
+  }
+
+  data = mmap (NULL, store->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't map %s: %s", path, g_strerror (errno));
+    close (fd);
+    goto done;
+  }
+
+  segment = g_new0 (Segment, 1);
+  segment->refcount = 1;
+  segment->fd = fd;
+  segment->data = data;
+  segment->size = store->segment_size;
+
+done:
+  g_free (path);
+  return segment;
+}
+
+SegmentStore * segment_store_new (const gchar * dir, guint n_segments,
+    gsize segment_size, GError ** error)
+{
+  SegmentStore * store;
+  guint i;
+
+  // Recycling the segment we're still writing would lose data
+  if (n_segments < 2) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+        "need at least two segments, got %u", n_segments);
+    return NULL;
+  }
+
+  if (g_mkdir_with_parents (dir, 0755) < 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "couldn't create %s: %s", dir, g_strerror (errno));
+    return NULL;
+  }
+
+  store = g_new0 (SegmentStore, 1);
+  store->dir = g_strdup (dir);
+  store->segment_size = segment_size;
+  store->n_segments = n_segments;
+  store->segments = g_new0 (Segment *, n_segments);
+  store->generations = g_new0 (guint64, n_segments);
+
+  for (i = 0; i < n_segments; i++) {
+    if (!(store->segments[i] = segment_open (store, i, error))) {
+      segment_store_free (store);
+      return NULL;
+    }
+  }
+
+  GST_INFO ("Spilling to %u segments of %lu bytes in %s", n_segments, segment_size, dir);
+
+  return store;
+}
+
+void segment_store_free (SegmentStore * store)
+{
+  guint i;
+
+  for (i = 0; i < store->n_segments; i++) {
+    if (store->segments[i])
+      segment_unref (store->segments[i]);
+  }
+
+  g_free (store->segments);
+  g_free (store->generations);
+  g_free (store->dir);
+  g_free (store);
+}
+
+// Move on to the next segment, invalidating everything it held.
+static gboolean recycle_next (SegmentStore * store)
+{
+  guint next = (store->current + 1) % store->n_segments;
+  Segment * segment = store->segments[next];
+
+  if (g_atomic_int_get (&segment->refcount) > 1) {
+    GError * error = NULL;
+    Segment * fresh = segment_open (store, next, &error);
+
+    if (!fresh) {
+      GST_ERROR ("Couldn't replace segment %u: %s", next, error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+    GST_DEBUG ("Segment %u still has readers; replaced its file", next);
+    segment_unref (segment);
+    store->segments[next] = fresh;
+  }
+
+  store->generations[next]++;
+  store->current = next;
+  store->offset = 0;
+
+  return TRUE;
+}
+
+gboolean segment_store_append (SegmentStore * store, GstBuffer * buffer,
+    SegmentLocation * location, gint * recycled, guint64 * recycled_generation)
+{
+  gsize size = gst_buffer_get_size (buffer);
+  Segment * segment;
+
+  *recycled = SEGMENT_STORE_NO_RECYCLE;
+
+  if (size > store->segment_size) {
+    GST_WARNING ("Unit of %lu bytes doesn't fit in a %lu byte segment", size, store->segment_size);
+    return FALSE;
+  }
+
+  if (store->offset + size > store->segment_size) {
+    guint next = (store->current + 1) % store->n_segments;
+    guint64 generation = store->generations[next];
+
+    if (!recycle_next (store))
+      return FALSE;
+
+    *recycled = next;
+    *recycled_generation = generation;
+  }
+
+  segment = store->segments[store->current];
+  gst_buffer_extract (buffer, 0, segment->data + store->offset, size);
+
+  location->segment = store->current;
+  location->generation = store->generations[store->current];
+  location->offset = store->offset;
+  location->size = size;
+
+  store->offset += size;
+
+  return TRUE;
+}
+
+GstBuffer * segment_store_read (SegmentStore * store, const SegmentLocation * location)
+{
+  Segment * segment = store->segments[location->segment];
+
+  if (store->generations[location->segment] != location->generation)
+    return NULL;
+
+  return gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+      segment->data, segment->size, location->offset, location->size,
+      segment_ref (segment), (GDestroyNotify) segment_unref);
+}
+
+guint64 segment_store_get_capacity (SegmentStore * store)
+{
+  return (guint64) store->n_segments * store->segment_size;
+}
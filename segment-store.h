@@ -0,0 +1,45 @@
+/*
+ * Segment store: circular, preallocated, memory-mapped segment files on
+ * local disk.
+ *
+ * Data is appended to the current segment; when it fills up, the store moves
+ * on to the next one, overwriting whatever it held before (the caller is told
+ * which segment was recycled so it can forget what lived there).  Every time
+ * a segment is recycled its generation is bumped, so a stale location can
+ * never be mistaken for a live one.
+ *
+ * Reads hand back GstBuffers that wrap the mapping directly, with no copy.
+ * Those buffers keep their segment mapped; if a segment is recycled while a
+ * reader still holds one, the store swaps in a fresh file and the old
+ * mapping lives on until the last buffer referencing it is freed.
+ *
+ * Not thread-safe; the owner serialises access.
+ */
+
+#ifndef __SEGMENT_STORE_H__
+#define __SEGMENT_STORE_H__
+
+#include <gst/gst.h>
+
+typedef struct {
+  guint segment;
+  guint64 generation;
+  gsize offset;
+  gsize size;
+} SegmentLocation;
+
+typedef struct _SegmentStore SegmentStore;
+
+#define SEGMENT_STORE_NO_RECYCLE -1
+
+SegmentStore * segment_store_new (const gchar * dir, guint n_segments,
+    gsize segment_size, GError ** error);
+void segment_store_free (SegmentStore * store);
+
+gboolean segment_store_append (SegmentStore * store, GstBuffer * buffer,
+    SegmentLocation * location, gint * recycled, guint64 * recycled_generation);
+GstBuffer * segment_store_read (SegmentStore * store, const SegmentLocation * location);
+
+guint64 segment_store_get_capacity (SegmentStore * store);
+
+#endif /* __SEGMENT_STORE_H__ */
@@ -0,0 +1,310 @@
+#include "snapshot.h"
+
+#include <string.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+
+GST_DEBUG_CATEGORY_EXTERN (camsrc);
+#define GST_CAT_DEFAULT camsrc
+
+#define DECODE_TIMEOUT (5 * GST_SECOND)
+
+// A decoded keyframe, by ring and sequence number.
+typedef struct {
+  ReplayRing * ring;
+  guint64 seq;
+  GstSample * frame;
+  gsize size;
+} CacheEntry;
+
+struct _SnapshotCache {
+  GMutex lock;
+  guint64 max_bytes;
+  guint64 bytes;
+  guint64 hits;
+  guint64 misses;
+  // Most recently used first; the table points into the queue
+  GQueue lru;
+  GHashTable * entries;
+};
+
+G_DEFINE_QUARK (snapshot-error-quark, snapshot_error)
+
+static guint entry_hash (gconstpointer key)
+{
+  const CacheEntry * entry = key;
+
+  return g_direct_hash (entry->ring) ^ g_int64_hash (&entry->seq);
+}
+
+static gboolean entry_equal (gconstpointer a, gconstpointer b)
+{
+  const CacheEntry * ea = a, * eb = b;
+
+  return ea->ring == eb->ring && ea->seq == eb->seq;
+}
+
+static void entry_free (CacheEntry * entry)
+{
+  gst_sample_unref (entry->frame);
+  g_free (entry);
+}
+
+SnapshotCache * snapshot_cache_new (guint64 max_bytes)
+{
+  SnapshotCache * cache = g_new0 (SnapshotCache, 1);
+
+  g_mutex_init (&cache->lock);
+  cache->max_bytes = max_bytes;
+  g_queue_init (&cache->lru);
+  cache->entries = g_hash_table_new (entry_hash, entry_equal);
+
+  return cache;
+}
+
+void snapshot_cache_free (SnapshotCache * cache)
+{
+  g_hash_table_unref (cache->entries);
+  g_queue_clear_full (&cache->lru, (GDestroyNotify) entry_free);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+void snapshot_cache_get_stats (SnapshotCache * cache, guint64 * hits, guint64 * misses,
+    guint64 * bytes)
+{
+  g_mutex_lock (&cache->lock);
+  *hits = cache->hits;
+  *misses = cache->misses;
+  *bytes = cache->bytes;
+  g_mutex_unlock (&cache->lock);
+}
+
+static GstSample * cache_lookup (SnapshotCache * cache, ReplayRing * ring, guint64 seq)
+{
+  CacheEntry key = { .ring = ring, .seq = seq };
+  GList * link;
+  GstSample * frame = NULL;
+
+  g_mutex_lock (&cache->lock);
+  link = g_hash_table_lookup (cache->entries, &key);
+  if (link) {
+    g_queue_unlink (&cache->lru, link);
+    g_queue_push_head_link (&cache->lru, link);
+    frame = gst_sample_ref (((CacheEntry *) link->data)->frame);
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  g_mutex_unlock (&cache->lock);
+
+  return frame;
+}
+
+static void cache_insert (SnapshotCache * cache, ReplayRing * ring, guint64 seq, GstSample * frame)
+{
+  CacheEntry * entry = g_new0 (CacheEntry, 1);
+
+  entry->ring = ring;
+  entry->seq = seq;
+  entry->frame = gst_sample_ref (frame);
+  entry->size = gst_buffer_get_size (gst_sample_get_buffer (frame));
+
+  g_mutex_lock (&cache->lock);
+
+  // Another thread may have decoded the same keyframe meanwhile
+  if (g_hash_table_contains (cache->entries, entry)) {
+    g_mutex_unlock (&cache->lock);
+    entry_free (entry);
+    return;
+  }
+
+  g_queue_push_head (&cache->lru, entry);
+  g_hash_table_insert (cache->entries, entry, cache->lru.head);
+  cache->bytes += entry->size;
+
+  while (cache->bytes > cache->max_bytes && cache->lru.length > 1) {
+    CacheEntry * oldest = g_queue_pop_tail (&cache->lru);
+
+    g_hash_table_remove (cache->entries, oldest);
+    cache->bytes -= oldest->size;
+    entry_free (oldest);
+  }
+
+  g_mutex_unlock (&cache->lock);
+}
+
+// The keyframe closest to target, on either side.
+static gboolean find_nearest_keyframe (ReplayRing * ring, GstClockTime target, guint64 * seq)
+{
+  guint64 before, after;
+  gboolean have_before = replay_ring_find_keyframe_before (ring, target, &before);
+  gboolean have_after = replay_ring_find_keyframe (ring, target, &after);
+  ReplayUnit unit;
+  GstClockTime before_pts = 0, after_pts = 0;
+
+  if (have_before && replay_ring_get (ring, before, &unit) == REPLAY_RING_OK) {
+    before_pts = unit.pts;
+    replay_ring_unit_clear (&unit);
+  } else {
+    have_before = FALSE;
+  }
+
+  if (have_after && replay_ring_get (ring, after, &unit) == REPLAY_RING_OK) {
+    after_pts = unit.pts;
+    replay_ring_unit_clear (&unit);
+  } else {
+    have_after = FALSE;
+  }
+
+  if (!have_before && !have_after)
+    return FALSE;
+
+  *seq = have_before && (!have_after || target - before_pts <= after_pts - target) ?
+    before : after;
+  return TRUE;
+}
+
+// Decode from the keyframe at seq through every unit decoded before the frame
+// at target, and return the last frame at or before target (or with exact
+// unset, just the keyframe).  The keyframe itself goes into the cache.
+static GstSample * decode_gop (SnapshotCache * cache, ReplayRing * ring, guint64 seq,
+    GstClockTime target, gboolean exact, GError ** error)
+{
+  GstElement * pipeline, * src, * sink;
+  GstSample * sample, * best = NULL;
+  GstCaps * caps;
+  ReplayUnit unit;
+  GError * parse_error = NULL;
+  guint64 keyframe = seq;
+
+  pipeline = gst_parse_launch ("appsrc name=src format=time ! avdec_h264 max-threads=1 ! "
+      "appsink name=sink sync=false", &parse_error);
+  if (!pipeline) {
+    g_set_error (error, SNAPSHOT_ERROR, SNAPSHOT_ERROR_DECODE,
+        "couldn't build decoder: %s", parse_error->message);
+    g_error_free (parse_error);
+    return NULL;
+  }
+
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  caps = replay_ring_get_caps (ring);
+  g_object_set (src, "caps", caps, NULL);
+  if (caps)
+    gst_caps_unref (caps);
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  // Decode order is DTS order, so once DTS passes target nothing later can
+  // show at or before it
+  for (;; seq++) {
+    if (replay_ring_get (ring, seq, &unit) != REPLAY_RING_OK)
+      break;
+    if (seq > keyframe && (!exact || unit.keyframe ||
+          (GST_CLOCK_TIME_IS_VALID (unit.dts) ? unit.dts : unit.pts) > target)) {
+      replay_ring_unit_clear (&unit);
+      break;
+    }
+
+    gst_app_src_push_buffer (GST_APP_SRC (src), gst_buffer_ref (unit.buffer));
+    replay_ring_unit_clear (&unit);
+  }
+  gst_app_src_end_of_stream (GST_APP_SRC (src));
+
+  while ((sample = gst_app_sink_try_pull_sample (GST_APP_SINK (sink), DECODE_TIMEOUT))) {
+    GstClockTime pts = GST_BUFFER_PTS (gst_sample_get_buffer (sample));
+
+    if (!best)
+      cache_insert (cache, ring, keyframe, sample);
+
+    if (!best || (pts <= target &&
+          pts > GST_BUFFER_PTS (gst_sample_get_buffer (best)))) {
+      if (best)
+        gst_sample_unref (best);
+      best = sample;
+    } else {
+      gst_sample_unref (sample);
+    }
+
+    if (!exact)
+      break;
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (src);
+  gst_object_unref (sink);
+  gst_object_unref (pipeline);
+
+  if (!best)
+    g_set_error (error, SNAPSHOT_ERROR, SNAPSHOT_ERROR_DECODE, "decoder produced no frame");
+  return best;
+}
+
+// The frame shown at target, or with exact unset the keyframe nearest it, as
+// a raw sample (decoded PTS included).
+GstSample * snapshot_take (SnapshotCache * cache, ReplayRing * ring, GstClockTime target,
+    gboolean exact, GError ** error)
+{
+  GstClockTime last_pts = replay_ring_get_last_pts (ring);
+  GstSample * frame;
+  guint64 seq;
+  gboolean found;
+
+  if (!GST_CLOCK_TIME_IS_VALID (last_pts) || (exact && target > last_pts)) {
+    g_set_error (error, SNAPSHOT_ERROR, SNAPSHOT_ERROR_NO_FOOTAGE, "no footage at that time");
+    return NULL;
+  }
+
+  found = exact ? replay_ring_find_keyframe_before (ring, target, &seq) :
+    find_nearest_keyframe (ring, target, &seq);
+  if (!found) {
+    g_set_error (error, SNAPSHOT_ERROR, SNAPSHOT_ERROR_NO_FOOTAGE, "no footage at that time");
+    return NULL;
+  }
+
+  // Only keyframes are cached; anything after one needs the GOP decoded again
+  if (!exact && (frame = cache_lookup (cache, ring, seq)))
+    return frame;
+
+  return decode_gop (cache, ring, seq, target, exact, error);
+}
+
+// Scale a decoded frame to width (keeping its aspect ratio; 0 keeps its
+// size) and encode it as "jpeg" or "png".
+GstBuffer * snapshot_encode (GstSample * frame, const gchar * format, gint width,
+    GError ** error)
+{
+  GstVideoInfo info;
+  GstCaps * caps;
+  GstSample * image;
+  GstBuffer * buffer;
+  GError * convert_error = NULL;
+
+  if (!gst_video_info_from_caps (&info, gst_sample_get_caps (frame))) {
+    g_set_error (error, SNAPSHOT_ERROR, SNAPSHOT_ERROR_ENCODE, "decoded frame has no video caps");
+    return NULL;
+  }
+
+  caps = gst_caps_new_empty_simple (!strcmp (format, "png") ? "image/png" : "image/jpeg");
+  if (width > 0 && width != GST_VIDEO_INFO_WIDTH (&info))
+    gst_caps_set_simple (caps,
+        "width", G_TYPE_INT, width,
+        "height", G_TYPE_INT, MAX (2, (gint) gst_util_uint64_scale_round (width,
+                GST_VIDEO_INFO_HEIGHT (&info), GST_VIDEO_INFO_WIDTH (&info)) & ~1),
+        NULL);
+
+  image = gst_video_convert_sample (frame, caps, DECODE_TIMEOUT, &convert_error);
+  gst_caps_unref (caps);
+
+  if (!image) {
+    g_set_error (error, SNAPSHOT_ERROR, SNAPSHOT_ERROR_ENCODE, "couldn't encode frame: %s",
+        convert_error ? convert_error->message : "unknown error");
+    g_clear_error (&convert_error);
+    return NULL;
+  }
+
+  buffer = gst_buffer_ref (gst_sample_get_buffer (image));
+  gst_sample_unref (image);
+  return buffer;
+}
@@ -0,0 +1,43 @@
+/*
+ * Snapshots: single decoded frames from a replay ring, as stills.
+ *
+ * Taking a snapshot decodes only the GOP the requested time falls in, and
+ * only up to the requested frame; snapping to the nearest keyframe decodes
+ * just that keyframe.  Decoded keyframes are kept in an LRU cache bounded by
+ * bytes, so scrubbing back and forth across the buffer decodes each GOP
+ * once.  Frames are scaled and encoded as JPEG or PNG separately, so one
+ * decoded frame can serve several sizes.
+ *
+ * All functions block (decoding builds a short-lived pipeline) and are safe
+ * to call from any thread; callers run them on worker threads.
+ */
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <gst/gst.h>
+
+#include "replay-ring.h"
+
+typedef enum {
+  SNAPSHOT_ERROR_NO_FOOTAGE,
+  SNAPSHOT_ERROR_DECODE,
+  SNAPSHOT_ERROR_ENCODE
+} SnapshotError;
+
+#define SNAPSHOT_ERROR (snapshot_error_quark ())
+GQuark snapshot_error_quark (void);
+
+typedef struct _SnapshotCache SnapshotCache;
+
+SnapshotCache * snapshot_cache_new (guint64 max_bytes);
+void snapshot_cache_free (SnapshotCache * cache);
+void snapshot_cache_get_stats (SnapshotCache * cache, guint64 * hits, guint64 * misses,
+    guint64 * bytes);
+
+GstSample * snapshot_take (SnapshotCache * cache, ReplayRing * ring, GstClockTime target,
+    gboolean exact, GError ** error);
+GstBuffer * snapshot_encode (GstSample * frame, const gchar * format, gint width,
+    GError ** error);
+
+#endif /* __SNAPSHOT_H__ */